@@ -0,0 +1,434 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+
+#include "symbols.h"
+#include "simulator.h"
+
+using namespace std;
+
+
+/* Instruction classes of the ROM words, filled in by find_code */
+#define WORD_DATA			0			// never reached from reset
+#define WORD_CODE			1			// starts an instruction
+#define WORD_ADDRESS		2			// second word of a 4 byte instruction
+
+#define CODE_ENTRIES		(MEM_SIZE / 2)
+
+
+/* Follows every path from reset, marking instructions and block leaders */
+void find_code(const machine& m);
+/* Writes the translated program as one C++ function, returns FAIL if the file cannot be written */
+int write_program(const machine& m, const char * file_name);
+/* Writes the C++ statements for one non control flow instruction */
+void write_instruction(ofstream& out, int op, int rd, int rs, unsigned short word, unsigned short address);
+
+
+static machine cpu;
+static symbols program_symbols;			// optional, labels and source lines become comments in the output
+
+static unsigned char kind[CODE_ENTRIES];
+static bool leader[CODE_ENTRIES];			// first instruction of a basic block
+static bool entry[CODE_ENTRIES];			// reachable through ret, needs a case in the dispatch switch
+
+
+int main(int argc, char * argv[]) {
+
+	const char * in_name = argc > 1 ? argv[1] : "machine_code.bin";
+	const char * out_name = argc > 2 ? argv[2] : "program_aot.cpp";
+
+	if (load_program(cpu, in_name) == FAIL)
+		return FAIL;
+
+	symbols_open(program_symbols, symbols_file_for(in_name).c_str());
+
+	find_code(cpu);
+
+	if (write_program(cpu, out_name) == FAIL)
+		return FAIL;
+
+	int blocks = 0, instructions = 0;
+
+	for (int i = 0; i < CODE_ENTRIES; i++) {
+
+		blocks += leader[i];
+		instructions += kind[i] == WORD_CODE;
+	}
+
+	cout << instructions << " instructions in " << blocks << " blocks written to " << out_name << endl;
+
+	return 0;
+}
+
+
+static int size_of(int op) {
+
+	return (op >= opcodes::ldr && op <= opcodes::strb) || op == opcodes::call || op == opcodes::jmp ? 4 : 2;
+}
+
+
+void find_code(const machine& m) {
+
+	vector <unsigned short> work;
+
+	memset(kind, WORD_DATA, sizeof(kind));
+	memset(leader, 0, sizeof(leader));
+	memset(entry, 0, sizeof(entry));
+
+	leader[0] = entry[0] = true;			// reset
+	work.push_back(0);
+
+	while (!work.empty()) {
+
+		unsigned short pc = work.back();
+
+		work.pop_back();
+
+		while (kind[pc >> 1] != WORD_CODE) {
+
+			unsigned short word = rom_read_word(m, pc);
+			int op = word >> 11;
+			unsigned short fall = pc + size_of(op);
+
+			kind[pc >> 1] = WORD_CODE;
+
+			if (size_of(op) == 4)
+				kind[((pc + 2) & 0xffff) >> 1] = WORD_ADDRESS;
+
+			if ((op >= opcodes::bra && op <= opcodes::bvc) || op == opcodes::call || op == opcodes::jmp) {
+
+				unsigned short target = op <= opcodes::bvc ? fall + sext8(word) : rom_read_word(m, pc + 2);
+
+				leader[target >> 1] = true;
+				work.push_back(target & ~1);
+			}
+
+			if (op == opcodes::call)
+				entry[fall >> 1] = true;			// the matching ret comes back here
+
+			if (op == opcodes::bra || op == opcodes::ret || op == opcodes::jmp)
+				break;
+
+			if (op >= opcodes::bne && op <= opcodes::bvc)
+				leader[fall >> 1] = true;
+
+			pc = fall;
+		}
+	}
+
+	for (int i = 0; i < CODE_ENTRIES; i++)
+		if (entry[i])
+			leader[i] = true;
+}
+
+
+/* Runtime support copied into every translated program, so the output compiles on its own */
+static const char * prologue =
+"/* Generated by aot.cpp, do not edit */\n"
+"\n"
+"#include <iostream>\n"
+"#include <iomanip>\n"
+"\n"
+"#define RUN_HALT\t\t0\n"
+"#define RUN_LIMIT\t\t1\n"
+"#define RUN_LOST\t\t2\t\t\t// ret to an address that was not found when translating\n"
+"\n"
+"\n"
+"struct hbcp_state {\n"
+"\n"
+"\tunsigned short regs[8];\n"
+"\tunsigned short pc;\n"
+"\tunsigned char sp;\n"
+"\tbool n, z, c, v;\n"
+"\tunsigned long long retired;\n"
+"\tunsigned char ram[65536];\n"
+"};\n"
+"\n"
+"\n"
+"static inline unsigned short alu_add(unsigned short a, unsigned short b, unsigned int cin, bool& n, bool& z, bool& c, bool& v) {\n"
+"\n"
+"\tunsigned int sum = (unsigned int) a + b + cin;\n"
+"\tunsigned short e = (unsigned short) sum;\n"
+"\n"
+"\tn = e >> 15;\n"
+"\tz = e == 0;\n"
+"\tc = (sum >> 16) & 1;\n"
+"\tv = (~(a ^ b) & (a ^ e)) >> 15;\n"
+"\n"
+"\treturn e;\n"
+"}\n"
+"\n"
+"static inline unsigned short alu_logic(unsigned short e, bool& n, bool& z) {\n"
+"\n"
+"\tn = e >> 15;\n"
+"\tz = e == 0;\n"
+"\n"
+"\treturn e;\n"
+"}\n"
+"\n"
+"#define RAM_WORD(a)\t\t\t((unsigned short) ((s.ram[(a) & ~1] << 8) | s.ram[(a) | 1]))\n"
+"#define RAM_SET_WORD(a, d)\tdo { unsigned short x = (d); s.ram[(a) & ~1] = x >> 8; s.ram[(a) | 1] = (unsigned char) x; } while (0)\n"
+"\n"
+"\n"
+"/* Runs from s.pc until a branch to itself or until the next block would take more than max_instructions */\n"
+"int hbcp_run(hbcp_state& s, unsigned long long max_instructions) {\n"
+"\n"
+"\tunsigned short r0 = s.regs[0], r1 = s.regs[1], r2 = s.regs[2], r3 = s.regs[3];\n"
+"\tunsigned short r4 = s.regs[4], r5 = s.regs[5], r6 = s.regs[6], r7 = s.regs[7];\n"
+"\tbool n = s.n, z = s.z, c = s.c, v = s.v;\n"
+"\tunsigned char sp = s.sp;\n"
+"\tunsigned short pc = s.pc;\n"
+"\tunsigned long long budget = max_instructions;\n"
+"\tint result;\n"
+"\n"
+"\tgoto dispatch;\n"
+"\n";
+
+static const char * epilogue =
+"\n"
+"halt:\n"
+"\tresult = RUN_HALT;\n"
+"\tgoto done;\n"
+"\n"
+"limit:\n"
+"\tresult = RUN_LIMIT;\n"
+"\tgoto done;\n"
+"\n"
+"lost:\n"
+"\tresult = RUN_LOST;\n"
+"\n"
+"done:\n"
+"\ts.regs[0] = r0; s.regs[1] = r1; s.regs[2] = r2; s.regs[3] = r3;\n"
+"\ts.regs[4] = r4; s.regs[5] = r5; s.regs[6] = r6; s.regs[7] = r7;\n"
+"\ts.n = n; s.z = z; s.c = c; s.v = v;\n"
+"\ts.sp = sp;\n"
+"\ts.pc = pc;\n"
+"\ts.retired += max_instructions - budget;\n"
+"\n"
+"\treturn result;\n"
+"}\n"
+"\n"
+"\n"
+"#ifndef HBCP_NO_MAIN\n"
+"\n"
+"static hbcp_state state;\n"
+"\n"
+"int main() {\n"
+"\n"
+"\tint result = hbcp_run(state, ~0ULL);\n"
+"\n"
+"\tfor (int i = 0; i < 8; i++)\n"
+"\t\tstd::cout << \"r\" << i << \" = 0x\" << std::hex << std::setw(4) << std::setfill('0') << state.regs[i] << std::dec << \" (\" << state.regs[i] << \")\" << std::endl;\n"
+"\n"
+"\tstd::cout << \"pc = 0x\" << std::hex << std::setw(4) << state.pc << \"  sp = 0x\" << std::setw(2) << (int) state.sp << std::dec << std::endl;\n"
+"\tstd::cout << \"N = \" << state.n << \"  Z = \" << state.z << \"  C = \" << state.c << \"  V = \" << state.v << std::endl;\n"
+"\tstd::cout << \"instructions = \" << state.retired << std::endl;\n"
+"\n"
+"\treturn result;\n"
+"}\n"
+"\n"
+"#endif\n";
+
+
+static const char * branch_condition[] = {"", "!z", "z", "c", "!c", "z || n == v", "n != v", "v", "!v"};			// bne..bvc, the urom takes bge on Z as well
+
+
+int write_program(const machine& m, const char * file_name) {
+
+	ofstream out;
+
+	out.open(file_name, ios::out | ios::trunc);
+
+	if (!out.is_open()) {
+
+		cout << "\nUnable to open write file [" << file_name << "]" << endl;
+		return FAIL;
+	}
+
+	out << prologue << hex << setfill('0');
+
+	for (int i = 0; i < CODE_ENTRIES; i++) {
+
+		if (!leader[i] || kind[i] != WORD_CODE)
+			continue;
+
+		/* Collect the block so its instruction count can be charged up front */
+		vector <unsigned short> block;
+		unsigned short pc = i << 1;
+
+		for (;;) {
+
+			int op = rom_read_word(m, pc) >> 11;
+
+			block.push_back(pc);
+			pc += size_of(op);
+
+			if ((op >= opcodes::bra && op <= opcodes::bvc) || op >= opcodes::call || leader[pc >> 1] || kind[pc >> 1] != WORD_CODE || pc == 0)
+				break;
+		}
+
+		unsigned short start = i << 1;
+
+		const symbols_symbol * label = symbols_find_symbol(program_symbols, start);
+
+		out << "L_" << setw(4) << start << ":";
+
+		if (label && label->address == start)
+			out << "\t\t\t// ." << symbols_string(program_symbols, label->name);
+
+		out << "\n";
+		out << "\tif (budget < " << dec << block.size() << ") { pc = 0x" << hex << setw(4) << start << "; goto limit; }\n";
+		out << "\tbudget -= " << dec << block.size() << hex << ";\n";
+
+		for (unsigned short at : block) {
+
+			unsigned short word = rom_read_word(m, at);
+			unsigned short address = rom_read_word(m, at + 2);
+			int op = word >> 11;
+			unsigned short fall = at + size_of(op);
+			unsigned short target = op <= opcodes::bvc ? fall + sext8(word) : address;
+			const symbols_line * line = symbols_find_line(program_symbols, at);
+
+			if (line)
+				out << "\t// " << dec << line->line << ": " << symbols_string(program_symbols, line->source) << hex << "\n";
+
+			if (op >= opcodes::bra && op <= opcodes::bvc) {
+
+				out << "\t";
+
+				if (op != opcodes::bra)
+					out << "if (" << branch_condition[op - opcodes::bra] << ") ";
+
+				if (target == at)
+					out << "{ pc = 0x" << setw(4) << at << "; goto halt; }\n";
+				else
+					out << "goto L_" << setw(4) << (target & ~1) << ";\n";
+
+			} else if (op == opcodes::jmp) {
+
+				if (target == at)
+					out << "\tpc = 0x" << setw(4) << at << ";\n\tgoto halt;\n";
+				else
+					out << "\tgoto L_" << setw(4) << (target & ~1) << ";\n";
+
+			} else if (op == opcodes::call) {
+
+				out << "\tRAM_SET_WORD(sp, 0x" << setw(4) << fall << ");\n";
+				out << "\tsp += 2;\n";
+				out << "\tgoto L_" << setw(4) << (target & ~1) << ";\n";
+
+			} else if (op == opcodes::ret) {
+
+				out << "\tsp -= 2;\n";
+				out << "\tpc = RAM_WORD(sp) & ~1;\n";
+				out << "\tgoto dispatch;\n";
+
+			} else
+				write_instruction(out, op, (word >> 8) & 7, word & 7, word, address);
+		}
+
+		int last = rom_read_word(m, block.back()) >> 11;
+
+		if (last != opcodes::bra && last != opcodes::jmp && last != opcodes::call && last != opcodes::ret) {
+
+			unsigned short fall = block.back() + size_of(last);
+
+			if (kind[fall >> 1] == WORD_CODE)
+				out << "\tgoto L_" << setw(4) << fall << ";\n";
+			else
+				out << "\tpc = 0x" << setw(4) << fall << ";\n\tgoto lost;\n";
+		}
+
+		out << "\n";
+	}
+
+	/* Entry from reset, from the caller and from ret */
+	out << "dispatch:\n\tswitch (pc) {\n";
+
+	for (int i = 0; i < CODE_ENTRIES; i++)
+		if (leader[i] && kind[i] == WORD_CODE)
+			out << "\t\tcase 0x" << setw(4) << (i << 1) << ": goto L_" << setw(4) << (i << 1) << ";\n";
+
+	out << "\t\tdefault: goto lost;\n\t}\n";
+	out << epilogue;
+
+	out.close();
+
+	return SUCCESS;
+}
+
+
+void write_instruction(ofstream& out, int op, int rd, int rs, unsigned short word, unsigned short address) {
+
+	unsigned short imm = sext8(word);
+
+	out << "\t";
+
+	switch (op) {
+
+		case opcodes::nop:
+			out << ";";
+			break;
+		case opcodes::mvi:
+			out << "r" << rd << " = alu_logic(0x" << setw(4) << (word & 0xff) << ", n, z);";
+			break;
+		case opcodes::addi:
+			out << "r" << rd << " = alu_add(r" << rd << ", 0x" << setw(4) << imm << ", 0, n, z, c, v);";
+			break;
+		case opcodes::subi:
+			out << "r" << rd << " = alu_add(r" << rd << ", 0x" << setw(4) << (unsigned short) ~imm << ", 1, n, z, c, v);";
+			break;
+		case opcodes::andi:
+			out << "r" << rd << " = alu_logic(r" << rd << " & 0x" << setw(4) << imm << ", n, z);";
+			break;
+		case opcodes::ori:
+			out << "r" << rd << " = alu_logic(r" << rd << " | 0x" << setw(4) << imm << ", n, z);";
+			break;
+		case opcodes::cmpi:
+			out << "alu_add(r" << rd << ", 0x" << setw(4) << (unsigned short) ~imm << ", 1, n, z, c, v);";
+			break;
+		case opcodes::mvr:
+			out << "r" << rd << " = alu_logic(r" << rs << " & 0xff, n, z);";
+			break;
+		case opcodes::addr:
+			out << "r" << rd << " = alu_add(r" << rd << ", r" << rs << ", 0, n, z, c, v);";
+			break;
+		case opcodes::subr:
+			out << "r" << rd << " = alu_add(r" << rd << ", (unsigned short) ~r" << rs << ", 1, n, z, c, v);";
+			break;
+		case opcodes::andr:
+			out << "r" << rd << " = alu_logic(r" << rd << " & r" << rs << ", n, z);";
+			break;
+		case opcodes::orr:
+			out << "r" << rd << " = alu_logic(r" << rd << " | r" << rs << ", n, z);";
+			break;
+		case opcodes::notr:
+			out << "r" << rd << " = alu_logic((unsigned short) ~r" << rs << ", n, z);";
+			break;
+		case opcodes::cmp:
+			out << "alu_add(r" << rd << ", (unsigned short) ~r" << rs << ", 1, n, z, c, v);";
+			break;
+		case opcodes::ldr:
+			out << "r" << rd << " = RAM_WORD(0x" << setw(4) << address << ");";
+			break;
+		case opcodes::ldrb:
+			out << "r" << rd << " = s.ram[0x" << setw(4) << address << "];";
+			break;
+		case opcodes::str:
+			out << "RAM_SET_WORD(0x" << setw(4) << address << ", r" << rd << ");";
+			break;
+		case opcodes::strb:
+			out << "s.ram[0x" << setw(4) << address << "] = (unsigned char) r" << rd << ";";
+			break;
+		case opcodes::push:
+			out << "RAM_SET_WORD(sp, r" << rd << "); sp += 2;";
+			break;
+		case opcodes::pop:
+			out << "sp -= 2; r" << rd << " = RAM_WORD(sp);";
+			break;
+	}
+
+	out << "\n";
+}
@@ -0,0 +1,145 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <chrono>
+
+#include "simulator.h"
+
+using namespace std;
+
+
+/*
+ * Checks a program translated by aot.cpp against the interpreter and reports the speedup. Build with the generated file:
+ *	g++ -O2 -DHBCP_NO_MAIN -o aot_check aot_check.cpp program_aot.cpp interpreter.cpp jit.cpp machine.cpp
+ */
+
+
+#define BENCH_INSTRUCTIONS		100000000ULL
+#define BENCH_SECONDS			1.0			// wall time per engine, resets included: a short program reruns from reset far too often to reach BENCH_INSTRUCTIONS
+#define RUN_LOST				2			// returned by hbcp_run for a ret into untranslated code
+
+
+/* Layout written by aot.cpp */
+struct hbcp_state {
+
+	unsigned short regs[8];
+	unsigned short pc;
+	unsigned char sp;
+	bool n, z, c, v;
+	unsigned long long retired;
+	unsigned char ram[65536];
+};
+
+int hbcp_run(hbcp_state& s, unsigned long long max_instructions);
+
+
+/* Clears the translated program's state to reset */
+void aot_reset(hbcp_state& s);
+/* Times one engine, rerunning from reset until BENCH_INSTRUCTIONS have executed or BENCH_SECONDS have gone by, returns MIPS of the runs alone */
+double bench_interp(int (*run)(machine&, unsigned long long));
+double bench_aot();
+
+
+static machine cpu;
+static hbcp_state state;
+
+
+int main(int argc, char * argv[]) {
+
+	const char * file_name = argc > 1 ? argv[1] : "machine_code.bin";
+
+	if (load_program(cpu, file_name) == FAIL)
+		return FAIL;
+
+	machine_reset(cpu);
+	interp_predecode(cpu);
+	aot_reset(state);
+
+	int expected = interp_run(cpu, ~0ULL);
+	int result = hbcp_run(state, ~0ULL);
+
+	bool match = expected == result && !memcmp(cpu.regs, state.regs, sizeof(state.regs)) && cpu.pc == state.pc && cpu.sp == state.sp;
+
+	match = match && cpu.n == state.n && cpu.z == state.z && cpu.c == state.c && cpu.v == state.v;
+	match = match && cpu.retired == state.retired && !memcmp(cpu.ram, state.ram, MEM_SIZE);
+
+	if (!match) {
+
+		cout << "translated program does not match the interpreter";
+
+		if (result == RUN_LOST)
+			cout << " (ret to untranslated address 0x" << hex << setw(4) << setfill('0') << state.pc << dec << ")";
+
+		cout << endl;
+		return FAIL;
+	}
+
+	cout << "translated program matches the interpreter, " << state.retired << " instructions" << endl;
+
+	jit_init(cpu);
+
+	double interp = bench_interp(interp_run);
+	double jit = bench_interp(jit_run);
+	double aot = bench_aot();
+
+	cout << fixed << setprecision(1);
+	cout << "interpreter " << setw(10) << interp << " MIPS" << endl;
+	cout << "jit         " << setw(10) << jit << " MIPS  " << setprecision(2) << jit / interp << "x" << setprecision(1) << endl;
+	cout << "aot         " << setw(10) << aot << " MIPS  " << setprecision(2) << aot / interp << "x" << endl;
+
+	return 0;
+}
+
+
+void aot_reset(hbcp_state& s) {
+
+	memset(&s, 0, sizeof(hbcp_state));
+}
+
+
+double bench_interp(int (*run)(machine&, unsigned long long)) {
+
+	unsigned long long total = 0;
+	double seconds = 0;
+	auto begin = chrono::steady_clock::now();
+
+	while (total < BENCH_INSTRUCTIONS && chrono::duration<double>(chrono::steady_clock::now() - begin).count() < BENCH_SECONDS) {
+
+		machine_reset(cpu);
+
+		auto start = chrono::steady_clock::now();
+
+		run(cpu, BENCH_INSTRUCTIONS - total);
+
+		seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		total += cpu.retired;
+	}
+
+	return total / seconds / 1e6;
+}
+
+
+double bench_aot() {
+
+	unsigned long long total = 0;
+	double seconds = 0;
+	auto begin = chrono::steady_clock::now();
+
+	while (total < BENCH_INSTRUCTIONS && chrono::duration<double>(chrono::steady_clock::now() - begin).count() < BENCH_SECONDS) {
+
+		aot_reset(state);
+
+		auto start = chrono::steady_clock::now();
+
+		hbcp_run(state, BENCH_INSTRUCTIONS - total);
+
+		seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if (!state.retired)			// next block does not fit in what is left
+			break;
+
+		total += state.retired;
+	}
+
+	return total / seconds / 1e6;
+}
@@ -2,16 +2,37 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
 #include <algorithm>
+#include <deque>
 #include <cctype>
 #include <cstring>
 #include <bitset>
 #include <math.h>
 
+#include "assembler.h"
+#include "assembly.h"
+#include "symbols.h"
+#include "object.h"
+#include "urom.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define SOURCE_MMAP			1
+#endif
+
 #define SUCCESS				1
 #define FAIL				-1
+#define GROWN				0			// a pass grew a branch that could not reach its label, the file has to be read again
 
 
 #define NUM_REGS			8
@@ -28,6 +49,30 @@
 #define JUMP				8
 #define DIRECTIVE			9
 
+/* Flags an instruction writes, for the scheduler */
+#define FLAGS_NZ			1
+#define FLAGS_CV			2
+
+#define STACK_TOP			0x100			// push and pop stay below this, the stack pointer is 8 bits
+
+/* Long forms of a branch that cannot reach its label (bytes) */
+#define LONG_BRA			6			// jmp label, then the word the short bra ran for its delay slot
+#define LONG_BRANCH			8			// inverted branch over jmp label and nop
+#define LONG_BGE			10			// beq to the jmp, blt over it
+#define LONG_BLT			14			// blt to the jmp, bra over it
+
+#define PEEPHOLE_HOPS		8			// branches a jump is threaded through at most
+
+#define LAYOUT_LABEL		"layout "			// labels the block layout adds; the space keeps them apart from source labels and out of the symbol file
+#define LAYOUT_END			-2			// a block falling off the end of its #org region
+
+#define INLINE_LABEL		"inline "			// labels of the inlined copies, followed by the copy and the label copied
+#define INLINE_BYTES		12			// largest body inlined, the ret left out: six one word instructions
+
+/* Mnemonic lookup: the mnemonic packed into an int, multiplied and the top bits kept, indexes a table with no two mnemonics in the same slot */
+#define OPCODE_HASH_BITS		6
+#define OPCODE_HASH_MULTIPLIER	0x34f6fbu			// found by search, checked by the static_assert below
+
 #define BYTE_ADDRESSABLE	1
 //#define WORD_ADDRESSABLE	1
 
@@ -39,91 +84,243 @@
 
 /* Labels, instructions, and registers are not case-sensitive */
 /* Branch instructions either have a label or number */
+/* Tokens are views into the program file, which stays mapped until the binary and symbol file are written */
 
 using namespace std;
 
-enum opcodes {
-
-	nop = 0,
-	mvi,
-	addi,
-	subi,
-	andi,
-	ori,
-	cmpi,
-	bra,
-	bne,
-	beq,
-    	bhs,
-	blo,
-	bge,
-	blt,
-	bvs,
-	bvc,
-	mvr,
-	addr,
-	subr,
-	andr,
-	orr,
-	notr,
-	cmp,
-	ldr,
-	ldrb,
-	str,
-	strb,
-	push,
-	pop,
-	call,
-	ret,
-	jmp
+
+thread_local ostream * diagnostics = &cout;			// where parse errors go; assemble() points it at its output, threads of the parallel parse buffer theirs
+
+
+/* Mnemonics in opcode order */
+constexpr const char * opcode_names[32] = {"nop", "mvi", "addi", "subi", "andi", "ori", "cmpi", "bra", "bne", "beq", "bhs", "blo", "bge", "blt", "bvs", "bvc",
+											"mvr", "addr", "subr", "andr", "orr", "notr", "cmp", "ldr", "ldrb", "str", "strb", "push", "pop", "call", "ret", "jmp"};
+
+/* Characters lowercased and packed little endian, 0 if there are none or more than 4 (no mnemonic) */
+constexpr unsigned int mnemonic_key(const char * str, size_t length) {
+
+	unsigned int key = 0;
+
+	if (length > 4)
+		return 0;
+
+	for (size_t i = 0; i < length; i++) {
+
+		unsigned char c = str[i];
+
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+
+		key |= (unsigned int) c << (8 * i);
+	}
+
+	return key;
+}
+
+constexpr size_t mnemonic_length(const char * str) {
+
+	size_t length = 0;
+
+	while (str[length])
+		length++;
+
+	return length;
+}
+
+constexpr unsigned int mnemonic_slot(unsigned int key) {
+
+	return (key * OPCODE_HASH_MULTIPLIER) >> (32 - OPCODE_HASH_BITS);
+}
+
+/* Slot -> key and opcode, key 0 and opcode -1 where no mnemonic lands; collides is set if two mnemonics share a slot */
+struct opcode_table {
+
+	unsigned int key[1 << OPCODE_HASH_BITS];
+	signed char opcode[1 << OPCODE_HASH_BITS];
+	bool collides;
 };
 
-string valid_registers[] = {"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7"};
+constexpr opcode_table build_opcode_table() {
 
-vector <string> label_names;			// names of labels
-vector <int> label_addresses;			// addresses of labels
-vector <string> tokens;					// tokenizer
+	opcode_table table = {};
 
-/* Receives string and returns corresponding opcode for instruction */
-int string_to_opcode(string str);
-/* Receives string and returns decoded register # */
-int string_to_register(string str);
+	for (int slot = 0; slot < (1 << OPCODE_HASH_BITS); slot++)
+		table.opcode[slot] = -1;
+
+	for (int opcode = 0; opcode < 32; opcode++) {
+
+		unsigned int key = mnemonic_key(opcode_names[opcode], mnemonic_length(opcode_names[opcode]));
+		unsigned int slot = mnemonic_slot(key);
+
+		table.collides = table.collides || table.opcode[slot] >= 0;
+		table.key[slot] = key;
+		table.opcode[slot] = (signed char) opcode;
+	}
+
+	return table;
+}
+
+constexpr opcode_table opcode_lookup = build_opcode_table();
+
+static_assert(!opcode_lookup.collides, "OPCODE_HASH_MULTIPLIER puts two mnemonics in the same slot");
+
+
+
+
+
+/* Basic block as the layout pass places it */
+struct layout_block {
+
+	int first, end;				// instructions, end excluded
+	int branch;					// conditional branch ending it, -1 if none
+	int taken;					// block the branch jumps to, -1 if none in the region or the label is inside a block
+	int fall;					// block it falls into, LAYOUT_END past its region, -1 if it never falls through
+	unsigned long long taken_count, fall_count;			// from the branch profile
+	int next, previous;			// chain of blocks placed one after the other, -1 at its ends
+};
+
+/* Peephole rule: rewrites the program at instruction k and returns true, or leaves it as it is */
+struct peephole_rule {
+
+	const char * name;
+	bool (assembly::*apply)(peephole_program& p, int k);
+};
+
+/* Receives string and returns corresponding opcode for instruction, -1 if it is none */
+int string_to_opcode(string_view str);
+/* Receives string and returns decoded register #, -1 if it is none */
+int string_to_register(string_view str);
 /* Takes in binary, hex, or decimal string and returns integer representation */
-int string_to_imm(string str);
+int string_to_imm(string_view str);
+/* Reads the digits of a number in base (decimal ones may start with '-'), false if there are none, others, or too many */
+bool parse_number(string_view digits, int base, int& value);
 /* Takes in decimal, binary, hex number in string form and returns raw number */
-bool is_valid_immediate(string str, int max_size);
+bool is_valid_immediate(string_view str, int max_size);
 /* Takes in a string, checks if it is a valid label name */
-bool is_valid_label(string label);
-/* Takes in a label (valid or invalid) and returns its absolute address or -1 if invalid */
-int get_label_address(string label);
+bool is_valid_label(string_view label);
 /* Receives instruction and returns its type (NOP, IMMEDIATE, BRANCH, REGISTER) */
 int get_instruction_type(int opcode);
 
-/* Opens program file and reads each line, checking for syntax and valid label names, registers, instructions, and immediate values */
-int parse_file(ifstream& prog_file);
-/* Receives one line from program line and checks for syntax, updating the program counter for every line; adds each token to a vector */
-int parse_instruction(char * line, int line_num, int& pc);
+/* Line starting at position with the comment and surrounding whitespace removed, empty if nothing is left; position moves past the line */
+string_view read_line(const char * data, size_t size, size_t& position);
+/* Next token of rest the way strtok finds it: leading delimiters skipped, the token ends at the next delimiter, which is consumed; empty if there is none */
+string_view next_token(string_view& rest, const char * delimiters);
 /* Check to see if there is a missing operand in instruction */
 bool parse_instruction_early_exit(int instruction_type, int iteration, int line_num);
-/* Checks to see if label has a valid name and notes its name and location in memory using the program counter */
-int parse_label(string label, int line_num, int& pc);
-/* Checks to see if org or dcx directive, otherwise, exit */
-int parse_directive(string dir, int line_num, int& pc);
 /* Break the parsed file into separate tokens on each line */
 int tokenize_file(fstream &parser_file, fstream &token_file);
-/* Convert each token to binary and write to new bin file */
-int assemble_file(ofstream &bin);
-/* Add token to token vector */
-void add_token(string tok);
+/* True if a branch at pc reaches label_address with its displacement byte */
+bool reaches(int pc, int label_address);
+/* Source file name with the extension replaced by extension */
+string output_file_for(const char * file_name, const char * extension);
+/* Cycles an instruction costs in the pipeline: one, plus its STALL bubble, plus its FLUSH bubbles (conditional branches not taken) */
+int instruction_cycles(int opcode);
+/* True if b has to stay behind a in the same block */
+bool depends(const instruction_effects& a, const instruction_effects& b);
+/* True if e, right behind the push behind, reads a register other than its own through the push's register selects */
+bool misreads(const instruction_effects& behind, const instruction_effects& e);
+/* Next and previous instruction left, -1 if there is none */
+int peephole_next(const peephole_program& p, int k);
+int peephole_previous(const peephole_program& p, int k);
+/* True if instruction k can go without changing what the delay slots and push hazards around it run */
+bool peephole_removable(const peephole_program& p, int k);
+/* Instruction that always runs right after k, -1 if another path leads there or k is guarded or ends a block */
+int peephole_follower(const peephole_program& p, int k);
+/* Removes instruction k, its labels move to the next one */
+void peephole_remove(peephole_program& p, int k);
+/* Opcode of the branch taken exactly when opcode is not, -1 if there is none */
+int inverse_branch(int opcode);
+/* Number of tokens, opcode included, of an instruction type */
+int token_count(int instruction_type);
+/* Bytes of an instruction type */
+int instruction_size(int instruction_type);
+/* Append the low bytes of value, little endian */
+void write_little_endian(string &buffer, unsigned int value, int bytes);
+
+
+const peephole_rule peephole_rules[] = {
+
+	{"padding nops removed", &assembly::remove_nop},
+	{"mvi folded into the next immediate", &assembly::fold_immediate},
+	{"mvr r, r on a byte removed", &assembly::remove_byte_move},
+	{"cmpi r, 0 after the flags were set removed", &assembly::remove_compare},
+	{"branches threaded past a jump", &assembly::thread_jump},
+	{"push and pop pairs removed", &assembly::remove_push_pop}
+};
 
 
-int main() {
+#ifndef HBCP_NO_MAIN
+int main(int argc, char * argv[]) {
 
 	ofstream bin;		
-	ifstream prog;
+	ofstream sym;
+	source_file prog;
+	assembler_options options = {};
+	const char * branch_profile = nullptr;			// lay the blocks out for the branch outcomes simulator -e wrote
+	string profile;
+	const char * program = "function.txt";
+
+	options.threads = 1;
+
+	for (int i = 1; i < argc; i++) {
+
+		if (!strcmp(argv[i], "-s"))
+			options.schedule = true;
+		else if (!strcmp(argv[i], "-O"))
+			options.optimize = true;
+		else if (!strcmp(argv[i], "-v"))
+			options.verify = true;
+		else if (!strcmp(argv[i], "-i"))
+			options.inline_calls = true;
+		else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+			branch_profile = argv[++i];
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			options.threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-c"))
+			options.relocatable = true;
+		else if (argv[i][0] != '-' && i + 1 == argc)
+			program = argv[i];
+		else {
+
+			cout << "\nUsage: assembler [-s] [-i] [-O [-v]] [-p branches.txt] [-j threads] [-c] [program.txt]" << endl;
+			return FAIL;
+		}
+	}
+
+	if (branch_profile && options.relocatable) {
+
+		cout << "\nThe block layout needs the whole program, -p cannot be combined with -c" << endl;
+		return FAIL;
+	}
+
+	if (options.inline_calls && options.relocatable) {
+
+		cout << "\nThe labels of inlined copies would go to the linker, -i cannot be combined with -c" << endl;
+		return FAIL;
+	}
+
+	if (branch_profile) {
+
+		ifstream file(branch_profile, ios::in | ios::binary);
+
+		if (!file.is_open()) {
+
+			cout << "\nUnable to read branch profile [" << branch_profile << "]" << endl;
+			return FAIL;
+		}
+
+		profile.assign(istreambuf_iterator <char> (file), istreambuf_iterator <char> ());
+		options.layout = true;
+		options.branch_profile = profile;
+	}
+
+	if (options.relocatable)
+		bin.open(output_file_for(program, ".o"), ios::out | ios::trunc | ios::binary);			// object file for the linker, next to the module
+	else {
 
-	bin.open("machine_code.bin", ios::out | ios::trunc | ios::binary);			// open new write file, replace old file with new file
-	prog.open("function.txt", ios::in);			// open program file for read-only mode
+		bin.open("machine_code.bin", ios::out | ios::trunc | ios::binary);			// open new write file, replace old file with new file
+		sym.open("machine_code.sym", ios::out | ios::trunc | ios::binary);			// symbols and line table next to the binary
+	}
 
 	
 	if (!bin.is_open()) {
@@ -131,154 +328,213 @@ int main() {
 		return FAIL;
 	}
 
-	if (!prog.is_open()) {
+	if (open_source_file(prog, program) == FAIL) {			// mapped read-only
 		cout << "\nUnable to open program file";
 		return FAIL;
 	}
 
+	if (!sym.is_open() && !options.relocatable) {
+		cout << "\nUnable to open symbol file";
+		return FAIL;
+	}
+
+
+	assembler_output output = assemble(string_view(prog.data, prog.size), options);
+
+	cout << output.diagnostics;
+
+	if (!output.unoptimized.empty()) {			// for peephole_check, even if a later pass failed
+
+		ofstream unoptimized("machine_code_unoptimized.bin", ios::out | ios::trunc | ios::binary);
+
+		if (!unoptimized.write((const char *) output.unoptimized.data(), output.unoptimized.size()))
+			cout << "\nUnable to write machine_code_unoptimized.bin";
+	}
+
+	if (output.result == SUCCESS) {
+
+		bin.write((const char *) output.code.data(), output.code.size());
+		sym.write(output.symbols.data(), output.symbols.size());
+
+		if (bin.good() && (options.relocatable || sym.good()))
+			cout << "success";
+	}
+
+	bin.close();
+	sym.close();
+	close_source_file(prog);
+
+	return 0;
+}
+#endif
+
+
+assembler_output assemble(string_view source, const assembler_options& options) {
 
-	if (parse_file(prog) == FAIL)
+	assembly program;
+	assembler_output output = {};
+	ostringstream messages;
+	ostringstream out;
+	ostream * caller_diagnostics = diagnostics;
+	const source_file prog = {source.data(), source.size(), false};			// a view, never closed
+	int threads = options.threads > 0 ? options.threads : (int) thread::hardware_concurrency();
+
+	diagnostics = &messages;			// this thread's, the parse threads have their own
+	program.relocatable = options.relocatable;
+	program.keep_tokens = options.schedule || options.inline_calls || options.optimize || options.layout;
+	output.result = FAIL;
+
+	if (options.layout && (options.relocatable || program.read_branch_profile(options.branch_profile) == FAIL))
 		goto exit;
-	if (assemble_file(bin) == FAIL)
+
+	if (threads > 1 && !program.keep_tokens ? program.parse_file_parallel(prog, threads) == FAIL : program.parse_file(prog) == FAIL)			// the passes that rewrite the tokens need them, which only the serial parse keeps
 		goto exit;
 
-	cout << "success";
+	if ((options.optimize || options.inline_calls) && options.verify && !options.relocatable)
+		output.unoptimized = program.code;
+
+	while (program.keep_tokens) {			// every rewrite moves branches away from their labels, those grow and the file is rewritten again
+
+		int result = options.inline_calls ? program.inline_program() : SUCCESS;
+
+		if (result != FAIL && options.optimize)
+			result = program.optimize_program();
+
+		if (result != FAIL && options.layout)
+			result = program.layout_program();
+		if (result != FAIL && options.schedule)
+			result = program.schedule_program();
+		if (result != FAIL)
+			result = program.assemble_tokens();
+		if (result == FAIL)
+			goto exit;
+		if (result == SUCCESS)
+			break;
+
+		messages << "Branches out of reach after " << (options.schedule ? "scheduling" : options.layout ? "the block layout" : options.optimize ? "the peephole rules" : "inlining")
+			<< ", starting again with " << program.long_branches.size() << " long branches" << endl;
+
+		if (program.parse_file_relaxed(prog, 0) == FAIL)
+			goto exit;
+	}
+
+	if (!program.long_branches.empty())
+		messages << program.long_branches.size() << " branches out of reach rewritten to their long form" << endl;
+
+	if (options.relocatable) {
+
+		if (program.write_object_file(out) == FAIL)
+			goto exit;
+
+		string object = out.str();
+
+		output.code.assign(object.begin(), object.end());
+	} else {
+
+		if (program.write_symbol_file(out) == FAIL)
+			goto exit;
+
+		output.code = move(program.code);
+		output.symbols = out.str();
+	}
+
+	output.result = SUCCESS;
 
 
 exit:
 
-	bin.close();
-	prog.close();
+	diagnostics = caller_diagnostics;
+	output.diagnostics = messages.str();
 
-	return 0;
+	return output;
 }
 
 
-int string_to_opcode(string str) {
-
-	if (!str.compare("nop"))
-		return opcodes::nop;
-	else if (!str.compare("mvi"))
-		return opcodes::mvi;
-	else if (!str.compare("addi"))
-		return opcodes::addi;
-	else if (!str.compare("subi"))
-		return opcodes::subi;
-	else if (!str.compare("andi"))
-		return opcodes::andi;
-	else if (!str.compare("ori"))
-		return opcodes::ori;
-	else if (!str.compare("cmpi"))
-		return opcodes::cmpi;
-	else if (!str.compare("bra"))
-		return opcodes::bra;
-	else if (!str.compare("bne"))
-		return opcodes::bne;
-	else if (!str.compare("beq"))
-		return opcodes::beq;
-	else if (!str.compare("bhs"))
-		return opcodes::bhs;
-	else if (!str.compare("blo"))
-		return opcodes::blo;
-	else if (!str.compare("bge"))
-		return opcodes::bge;
-	else if (!str.compare("blt"))
-		return opcodes::blt;
-	else if (!str.compare("bvs"))
-		return opcodes::bvs;
-	else if (!str.compare("bvc"))
-		return opcodes::bvc;
-	else if (!str.compare("mvr"))
-		return opcodes::mvr;
-	else if (!str.compare("addr"))
-		return opcodes::addr;
-	else if (!str.compare("subr"))
-		return opcodes::subr;
-	else if (!str.compare("andr"))
-		return opcodes::andr;
-	else if (!str.compare("orr"))
-		return opcodes::orr;
-	else if (!str.compare("notr"))
-		return opcodes::notr;
-	else if (!str.compare("cmp"))
-		return opcodes::cmp;
-	else if (!str.compare("ldr"))
-		return opcodes::ldr;
-	else if (!str.compare("ldrb"))
-		return opcodes::ldrb;
-	else if (!str.compare("str"))
-		return opcodes::str;
-	else if (!str.compare("strb"))
-		return opcodes::strb;
-	else if (!str.compare("push"))
-		return opcodes::push;
-	else if (!str.compare("pop"))
-		return opcodes::pop;
-	else if (!str.compare("call"))
-		return opcodes::call;
-	else if (!str.compare("ret"))
-		return opcodes::ret;
-	else if (!str.compare("jmp"))
-		return opcodes::jmp;
-	else	
+int string_to_opcode(string_view str) {
+
+	unsigned int key = mnemonic_key(str.data(), str.size());
+	unsigned int slot = mnemonic_slot(key);
+
+	if (key == 0 || opcode_lookup.key[slot] != key)
 		return -1;
+
+	return opcode_lookup.opcode[slot];
 }
 
 
-int string_to_register(string str) {
+int string_to_register(string_view str) {
+
+	if (str.size() == 2 && (str[0] == 'r' || str[0] == 'R') && str[1] >= '0' && str[1] < '0' + NUM_REGS)			// r0-r7
+		return str[1] - '0';
 
-	for (int i = 0; i < NUM_REGS; i++)
-		if (!str.compare(valid_registers[i]))		// if there is a match...
-			return stoi(str.substr(1), nullptr, 10);		// remove the 'r' and return string as integer
-		
 	return -1;			// return -1 if invalid register
 }
 
 
-int string_to_imm(string imm) {
+int string_to_imm(string_view imm) {
 
-	int immediate;
+	int immediate = 0;
 
-	if (imm.find("0b") != string::npos && imm.find("0b") == 0)		
-		immediate = stoi(imm.substr(2), nullptr, 2);		// binary
-	else if (imm.find("0x") != string::npos)
-		immediate = stoi(imm.substr(2), nullptr, 16);		// hex
+	if (imm.size() > 2 && imm[0] == '0' && (imm[1] == 'b' || imm[1] == 'B'))
+		parse_number(imm.substr(2), 2, immediate);		// binary
+	else if (imm.size() > 2 && imm[0] == '0' && (imm[1] == 'x' || imm[1] == 'X'))
+		parse_number(imm.substr(2), 16, immediate);		// hex
 	else 
-		immediate = stoi(imm, nullptr, 10);		// decimal
+		parse_number(imm, 10, immediate);		// decimal
 
 	return immediate;
 }
 
 
-bool is_valid_immediate(string imm, int max_size) {
+bool parse_number(string_view digits, int base, int& value) {
 
-	int immediate;
+	bool negative = base == 10 && !digits.empty() && digits[0] == '-';
+	long long number = 0;
+
+	if (negative)
+		digits.remove_prefix(1);
+
+	if (digits.empty())
+		return false;
+
+	for (char c : digits) {
 
-	if (imm.find("0b") != string::npos && imm.find("0b") == 0) {		// binary number...
+		int digit = base;			// not a digit
 
-		string bin_substring = imm.substr(2);		// remove "0b" from string
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
 
-		if (bin_substring.find_first_not_of("01") != string::npos)		// contains numbers other than 0 and 1... fail
+		if (digit >= base)
+			return false;
+
+		number = number * base + digit;
+
+		if (number > 0x7fffffff)			// would not fit an int
 			return false;
-		
-		immediate = stoi(bin_substring, nullptr, 2);		// get bin # (base 2) in decimal
-		
 	}
-	else if (imm.find("0x") != string::npos && imm.find("0x") == 0) {			// hex number...
 
-		string hex_substring = imm.substr(2);			// remove "0x" from string
+	value = negative ? -number : number;
 
-		if (hex_substring.find_first_not_of("0123456789abcdef") != string::npos)		// contains non hex characters... fail
-			return false; 
-		
+	return true;
+}
 
-		immediate = stoi(hex_substring, nullptr, 16);		// get hex # (base 16) in decimal
-	}
-	else if (imm.find_first_not_of("0123456789-") != string::npos)			// not hex, not bin, and there is a non-number character or blank space... fail
+
+bool is_valid_immediate(string_view imm, int max_size) {
+
+	int immediate;
+	int base = 10;
+
+	if (imm.size() >= 2 && imm[0] == '0' && (imm[1] == 'b' || imm[1] == 'B'))		// binary number...
+		base = 2;
+	else if (imm.size() >= 2 && imm[0] == '0' && (imm[1] == 'x' || imm[1] == 'X'))			// hex number...
+		base = 16;
+
+	if (!parse_number(base == 10 ? imm : imm.substr(2), base, immediate))			// digits other than those of the base, or none... fail
 		return false;
-	else			// decimal number...
-		immediate = stoi(imm, nullptr, 10);		// get # representation of string
-		
 
 	if (immediate > ((int) pow(2, max_size) - 1) || immediate < (-1 * (int) pow(2, max_size - 1)))			// if # does not fit into max_size bits (signed and unsigned)
 		return false;
@@ -288,9 +544,9 @@ bool is_valid_immediate(string imm, int max_size) {
 }
 
 
-bool is_valid_label(string label) {
+bool is_valid_label(string_view label) {
 
-	int first_char = label.find_first_of("abcdefghijklmopqrstuvwxyz_");
+	int first_char = label.find_first_of("abcdefghijklmopqrstuvwxyzABCDEFGHIJKLMOPQRSTUVWXYZ_");
 	int first_num = label.find_first_of("012345679");
 
 	if (first_char != string::npos && first_num != string::npos) {		// if the operand has both letters and number
@@ -309,17 +565,38 @@ bool is_valid_label(string label) {
 }
 
 
-int get_label_address(string label) {
+int assembly::get_label_address(string_view label) {
 
-	for (int i = 0; i != label_names.size(); i++)		// search through list of label names...
-		if (!label_names.at(i).compare(label))		// if there is a match
-			return label_addresses.at(i);
-	
+	auto found = label_index.find(label);
 
-	// if label not found...
-	cout << "\nLine []: Error... Label not found\n";
-	return -1;
-	
+	if (found == label_index.end())
+		return -1;
+
+	return label_addresses.at(found->second);
+}
+
+
+size_t label_hash::operator()(string_view name) const {
+
+	size_t hash = 14695981039346656037ULL;			// FNV-1a
+
+	for (char c : name)
+		hash = (hash ^ (unsigned char) tolower((unsigned char) c)) * 1099511628211ULL;
+
+	return hash;
+}
+
+
+bool label_equal::operator()(string_view a, string_view b) const {
+
+	if (a.size() != b.size())
+		return false;
+
+	for (size_t i = 0; i < a.size(); i++)
+		if (tolower((unsigned char) a[i]) != tolower((unsigned char) b[i]))
+			return false;
+
+	return true;
 }
 
 
@@ -348,240 +625,660 @@ int get_instruction_type(int opcode) {
 }
 
 
-int parse_file(ifstream& prog_file) {
+/* Reads the whole file into memory, for hosts without mmap and for files that cannot be mapped */
+static int read_source_file(source_file& source, const char * file_name) {
+
+	ifstream file(file_name, ios::in | ios::binary | ios::ate);
 
-	if (!prog_file.is_open())
+	if (!file.is_open())
 		return FAIL;
 
+	size_t size = (size_t) file.tellg();
+	char * data = new char[size ? size : 1];
 
-	string line;
-	int line_count = 0;
-	int pc = 0;
+	file.seekg(0);
+	file.read(data, size);
 
-	while (getline(prog_file, line)) {
+	if ((size_t) file.gcount() != size) {
 
-		line_count++;
+		delete[] data;
+		return FAIL;
+	}
 
-		if (line.find(';') != -1)				// delete comments
-			line.erase(line.find(';'));
-		
-		if (line.empty() || line.find_first_not_of(" \t\n") == string::npos)				// empty line, ignore
-			continue;
+	source.data = data;
+	source.size = size;
+	source.mapped = false;
+
+	return SUCCESS;
+}
 
 
-		int found = line.find_first_not_of(" \t");			// ignore whitespace
+int open_source_file(source_file& source, const char * file_name) {
 
+	source = {};
 
-		if (found != string::npos) {			// if the line has text...
+#ifdef SOURCE_MMAP
+	int fd = open(file_name, O_RDONLY);
+	struct stat info;
 
+	if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
 
-			line = line.substr(found);			// remove leading whitespace...
+		void * memory = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-			if (line.find_last_not_of(" \t\n") != string::npos)
-				line = line.substr(0, line.find_last_not_of(" \t\n") + 1);			// remove trailing whitespace from line
+		if (memory != MAP_FAILED) {
 
-			transform(line.begin(), line.end(), line.begin(), ::tolower);				// convert to all lowercase for comparison
+			madvise(memory, (size_t) info.st_size, MADV_SEQUENTIAL);			// read once, front to back
 
+			source.data = (const char *) memory;
+			source.size = (size_t) info.st_size;
+			source.mapped = true;
+		}
+	}
 
-			string cpy = line;		// create copy of line
+	if (fd >= 0)
+		close(fd);
 
-			if (line.at(0) == '.') {				// if first non-whitespace character is a '.', it is a label
+	if (source.mapped)
+		return SUCCESS;
+#endif
 
-				cpy = cpy.substr(1);		// remove '.'
+	return read_source_file(source, file_name);
+}
 
-				if ((parse_label(cpy, line_count, pc)) == FAIL)
-					return FAIL;
 
-				continue;			// don't write label to parser file
+void close_source_file(source_file& source) {
 
-			} else if (line.at(0) == '#') {			// if first character is '#', it is a directive
-				
-				if (parse_directive(cpy, line_count, pc) == FAIL)
-					return FAIL;	
+#ifdef SOURCE_MMAP
+	if (source.data && source.mapped)
+		munmap((void *) source.data, source.size);
+#endif
 
-			} else {				// else, it is an instruction...
+	if (source.data && !source.mapped)
+		delete[] source.data;
 
-				if (parse_instruction(cpy.data(), line_count, pc) == FAIL)		// this method modifies the string
-					return FAIL;
+	source = {};
+}
 
-			}
 
-		}
+int assembly::parse_file(const source_file& source) {
 
-	}
+	long_branches.clear();
 
-	return SUCCESS;
+	return parse_file_relaxed(source, 0);
 }
 
 
-int parse_label(string label, int line_num, int& pc) {
+int assembly::parse_file_parallel(const source_file& source, int threads) {
 
-	
-	int first_char = label.find_first_of("abcdefghijklmopqrstuvwxyz_");
-	int first_num = label.find_first_of("012345679");
+	long_branches.clear();
 
-	bool invalid = false;
+	return parse_file_relaxed(source, threads);
+}
 
-	if (first_char == string::npos)		// if no characters in string...
-		invalid = true;
 
-	if (first_char != string::npos && first_num != string::npos)		// if the operand has both letters and numbers
-		if (first_num < first_char)			// if label starts with a number
-			invalid = true;
+int assembly::parse_file_relaxed(const source_file& source, int threads) {
 
-	if (label.find_first_not_of("abcdefghijklmnopqrstuvwxyz_0123456789") != string::npos)		// if label name contains special characters
-		invalid = true;
+	int result;
 
-	if (string_to_opcode(label) != -1 || string_to_register(label) != -1)		// if label has name of instruction or register name (reserved name/keyword)
-		invalid = true;
-		
-	if (invalid) {
+	do			/* branches only grow, so this stops: at the latest when every branch is long */
+		result = threads > 0 ? parse_pass_parallel(source, threads) : parse_pass(source);
+	while (result == GROWN);
 
-		cout << "\nLine " << line_num << ": Error... Invalid label name [" << label << "]" << endl;
-		return FAIL;
-	}
+	return result;
+}
 
-	// if label name is valid and label is not already taken
-	if (find(label_names.begin(), label_names.end(), label) != label_names.end()) {
 
-		cout << "\nLine " << line_num << ": Error... Cannot have multiple labels of same name" << endl;
+int assembly::parse_pass(const source_file& source) {
+
+	if (!source.data)
 		return FAIL;
-	}
 
-	label_names.push_back(label);			// save label name
-	label_addresses.push_back(pc);				// save label address
 
-	return SUCCESS;
-}
+	size_t position = 0;
+	int line_count = 0;
+	int pc = 0;
 
+	clear_program();
 
-int parse_instruction(char * line, int line_num, int& pc) {
+	size_t lines = min(count(source.data, source.data + source.size, '\n') + 1, (ptrdiff_t) 0x10000 / 2);			// at most one instruction each and one per word, so the line table never regrows
 
-	char * token = strtok(line, " ");			// get instruction
+	line_addresses.reserve(lines);
+	line_numbers.reserve(lines);
+	line_sources.reserve(lines);
 
-	int operand_count = 0;			// 0 = instruction, 1 = register/immediate, 2 = register/immediate, 3+ = illegal
-	int opcode;
+	region_addresses.push_back(0);
+	region_lines.push_back(0);
 
-	int instruction_type = 0;		// will be updated on first iteration of loop
+	while (position < source.size) {
 
-	while (token != NULL) {
+		string_view line = read_line(source.data, source.size, position);
 
-		if (operand_count == 0) {			// if instruction is expected...
-			
-			opcode = string_to_opcode(token);			// get instruction opcode
-			instruction_type = get_instruction_type(opcode);		// get type of instruction
+		line_count++;
 
-			/* Increment program counter based on instruction type (16 bit program counter, 16 bit words) */			
-			if (instruction_type == NOP)
-				pc += 2;								// 1 byte for opcode, 1 empty byte (1 word)
-			else if (instruction_type == IMMEDIATE)
-				pc += 2;								// 1 byte for opcode + register, 1 byte for immediate (1 word)
-			else if (instruction_type == BRANCH) 
-				pc += 2;								// 1 byte for opcode, 1 byte for relative displacement (1 word)
-			else if (instruction_type == REGISTER)
-				pc += 2;								// 1 byte for opcode + register, 1 byte for register (1 word)
-			else if (instruction_type == RAM)
-				pc += 4;								// 1 byte for opcode, 1 empty, 2 bytes for RAM address (1 word)
-			else if (instruction_type == STACK)
-				pc += 2;								// 1 byte for opcode + register, 1 empty byte
-			else if (instruction_type == CALL)
-				pc += 4;								// 1 byte for opcode, 1 empty, 2 bytes for address
-			else if (instruction_type == RET)
-				pc += 2;								// 1 byte for opcode, 1 empty byte
-			else if (instruction_type == JUMP)
-				pc += 4;								// 1 byte opcode, 1 empty byte, 2 bytes absolute address
-			else if (opcode == -1) {			// if not an instruction...
+		if (line.empty())				// empty line, ignore
+			continue;
 
-				cout << "\nLine " << line_num << ": Error... Invalid instruction" << endl;
-				return FAIL;
-			} 
-			else {
+		if (line.at(0) == '.') {				// if first non-whitespace character is a '.', it is a label
 
-				cout << "\nThis tests for unsupported instructions...";
+			if ((parse_label(line.substr(1), line_count, pc)) == FAIL)		// remove '.'
 				return FAIL;
-			}
 
+		} else if (line.at(0) == '#') {			// if first character is '#', it is a directive
 			
-			add_token(token);
-			token = strtok(NULL, ",");		// get next operand (if no "," found, gives the rest of line)
-		}
+			if (parse_directive(line, line_count, pc) == FAIL)
+				return FAIL;	
 
+		} else {				// else, it is an instruction...
 
-		if (operand_count == 1) {
+			int address = pc;
 
-			string token_string(token);
+			if (parse_instruction(line, line_count, pc, fixups) == FAIL)
+				return FAIL;
 
-			if (instruction_type == NOP || instruction_type == RET) {			// nop and ret should have nothing after (if it did, it would have returned after end of first loop)
+			line_addresses.push_back(address);
+			line_numbers.push_back(line_count);
+			line_sources.push_back(line);
+		}
+	}
 
-				cout << "\nLine " << line_num << ": Error... Unexpected [] after instruction" << endl;
-				return FAIL;
+	region_ends.push_back(pc);
 
-			} else if (instruction_type == IMMEDIATE || instruction_type == REGISTER || instruction_type == RAM || instruction_type == STACK) {		// immediate, register, load instructions both take registers for first operand
-					
-				if (string_to_register(token) == -1) {		// if register doesn't match r0-r3
+	return resolve_fixups();
+}
 
-					cout << "\nLine " << line_num << ": Error... Invalid register" << endl;
+
+void assembly::clear_program() {
+
+	label_names.clear();			// start over, the tables may hold an earlier file
+	label_addresses.clear();
+	label_positions.clear();
+	label_regions.clear();
+	label_index.clear();
+	tokens.clear();
+	code.clear();
+	fixups.clear();
+	relocations.clear();
+	line_addresses.clear();
+	line_numbers.clear();
+	line_sources.clear();
+	region_addresses.clear();
+	region_ends.clear();
+	region_lines.clear();
+}
+
+
+string_view read_line(const char * data, size_t size, size_t& position) {
+
+	const char * start = data + position;
+	const char * end = (const char *) memchr(start, '\n', size - position);
+	string_view line(start, end ? end - start : size - position);
+
+	position += line.size() + 1;
+
+	line = line.substr(0, line.find(';'));				// delete comments
+
+	size_t found = line.find_first_not_of(" \t\r");			// ignore whitespace, \r of files with Windows line endings included
+
+	if (found == string_view::npos)
+		return string_view();
+
+	return line.substr(found, line.find_last_not_of(" \t\r") + 1 - found);			// remove leading and trailing whitespace, as written for the line table
+}
+
+
+#define CHUNK_BYTES			(1 << 16)			// smallest chunk worth a thread
+#define CHUNKS_PER_THREAD	8					// for load balance
+
+
+int assembly::parse_pass_parallel(const source_file& source, int threads) {
+
+	if (!source.data)
+		return FAIL;
+
+	clear_program();
+
+	/* Split at line boundaries */
+	size_t count = max((size_t) 1, min(source.size / CHUNK_BYTES, (size_t) threads * CHUNKS_PER_THREAD));
+	size_t begin = 0;
+
+	chunks = vector <source_chunk> (count);
+	chunk_source = &source;
+
+	for (size_t i = 0; i < count; i++) {
+
+		size_t end = i + 1 == count ? source.size : max(begin, source.size * (i + 1) / count);
+		const char * newline = (const char *) memchr(source.data + end, '\n', source.size - end);
+
+		if (i + 1 < count)
+			end = newline ? newline - source.data + 1 : source.size;
+
+		chunks[i].begin = begin;
+		chunks[i].end = end;
+		chunks[i].first_line = -1;
+		begin = end;
+	}
+
+	parallel(threads, count, &assembly::measure_chunk);
+
+	/* Labels and regions in source order, then every instruction at its final address */
+	ostringstream merge_errors;
+	ostream * out = diagnostics;
+
+	diagnostics = &merge_errors;
+	chunk_stop_line = merge_chunks();
+	diagnostics = out;
+
+	parallel(threads, count, &assembly::encode_chunk);
+
+	/* The first error in the file, as the serial parse would stop at it */
+	int error_line = chunk_stop_line;
+	string error = merge_errors.str();
+
+	for (source_chunk& c : chunks) {
+
+		if (c.error_line && (!error_line || c.error_line < error_line)) {
+
+			error_line = c.error_line;
+			error = c.errors.str();
+		}
+	}
+
+	if (error_line) {
+
+		*diagnostics << error;
+		return FAIL;
+	}
+
+	for (source_chunk& c : chunks)
+		fixups.insert(fixups.end(), c.fixups.begin(), c.fixups.end());
+
+	chunks.clear();
+
+	return resolve_fixups();
+}
+
+
+void assembly::parallel(int threads, unsigned long long count, void (assembly::*work)(unsigned long long item)) {
+
+	atomic <unsigned long long> next(0);
+	vector <thread> pool;
+
+	for (int t = 0; t < threads; t++) {
+
+		pool.emplace_back([this, &next, count, work]() {
+
+			for (unsigned long long item; (item = next++) < count; )
+				(this->*work)(item);
+		});
+	}
+
+	for (thread& t : pool)
+		t.join();
+}
+
+
+void assembly::measure_chunk(unsigned long long item) {
+
+	source_chunk& c = chunks[item];
+	size_t position = c.begin;
+	bool measuring = true;
+
+	c.lines = c.instructions = c.pc = 0;
+	c.absolute = false;
+
+	while (position < c.end) {
+
+		string_view line = read_line(chunk_source->data, c.end, position);
+
+		c.lines++;
+
+		if (line.empty() || !measuring)
+			continue;
+
+		if (line.at(0) == '.') {
+
+			c.events.push_back({true, line.substr(1), c.lines, c.pc, c.absolute, c.instructions});
+
+		} else if (line.at(0) == '#') {
+
+			c.events.push_back({false, line, c.lines, c.pc, c.absolute, c.instructions});
+
+			string_view rest = line;
+			next_token(rest, " ");
+			string_view address = next_token(rest, " ");
+
+			if (!is_valid_immediate(address, 16)) {			// parse_directive reports it when merging
+
+				measuring = false;
+				continue;
+			}
+
+			c.pc = string_to_imm(address);
+			c.absolute = true;
+
+		} else {
+
+			string_view rest = line;
+			string_view mnemonic = next_token(rest, " ");
+			int opcode = string_to_opcode(mnemonic);
+
+			if (opcode == -1) {			// parse_instruction reports it when encoding
+
+				measuring = false;
+				continue;
+			}
+
+			c.pc += encoded_size(opcode, mnemonic.data());
+			c.instructions++;
+		}
+	}
+}
+
+
+int assembly::merge_chunks() {
+
+	int pc = 0, lines = 0, instructions = 0;
+
+	region_addresses.push_back(0);
+	region_lines.push_back(0);
+
+	for (source_chunk& c : chunks) {
+
+		c.first_line = lines;
+		c.first_instruction = instructions;
+		c.base = pc;
+
+		for (const chunk_event& e : c.events) {
+
+			int event_pc = e.absolute ? e.pc : c.base + e.pc;
+			int line = c.first_line + e.line;
+			bool merged;
+
+			if (e.label) {
+
+				merged = parse_label(e.text, line, event_pc) != FAIL;
+
+				if (merged)
+					label_positions.back() = c.first_instruction + e.instructions;			// parse_label counts the instructions seen so far, none here
+			} else
+				merged = parse_directive(e.text, line, event_pc) != FAIL;
+
+			if (!merged) {			// room for the instructions in front of it, which are still encoded in case one of them fails first
+
+				code.resize(event_pc);
+				line_addresses.resize(c.first_instruction + e.instructions);
+				line_numbers.resize(c.first_instruction + e.instructions);
+				line_sources.resize(c.first_instruction + e.instructions);
+
+				return line;
+			}
+		}
+
+		pc = c.absolute ? c.pc : c.base + c.pc;
+		lines += c.lines;
+		instructions += c.instructions;
+
+		if (pc > 0x10000)			// the code runs over the top of program memory in this chunk, encoding it reports the line
+			break;
+	}
+
+	region_ends.push_back(pc);
+
+	code.resize(pc);
+	line_addresses.resize(instructions);
+	line_numbers.resize(instructions);
+	line_sources.resize(instructions);
+
+	return 0;
+}
+
+
+void assembly::encode_chunk(unsigned long long item) {
+
+	source_chunk& c = chunks[item];
+	size_t position = c.begin;
+	int line_count = c.first_line;
+	int pc = c.base;
+	int instruction = c.first_instruction;
+
+	c.error_line = 0;
+
+	if (c.first_line < 0)			// not merged
+		return;
+
+	diagnostics = &c.errors;
+	c.fixups.clear();
+
+	while (position < c.end) {
+
+		string_view line = read_line(chunk_source->data, c.end, position);
+
+		line_count++;
+
+		if (chunk_stop_line && line_count >= chunk_stop_line)
+			break;
+
+		if (line.empty() || line.at(0) == '.')				// labels are defined by now
+			continue;
+
+		if (line.at(0) == '#') {			// checked when merging
+
+			string_view rest = line;
+			next_token(rest, " ");
+			pc = string_to_imm(next_token(rest, " "));
+			continue;
+		}
+
+		int address = pc;
+
+		if (parse_instruction(line, line_count, pc, c.fixups) == FAIL) {
+
+			c.error_line = line_count;
+			break;
+		}
+
+		line_addresses[instruction] = address;
+		line_numbers[instruction] = line_count;
+		line_sources[instruction] = line;
+		instruction++;
+	}
+
+	diagnostics = &cout;
+}
+
+
+string_view next_token(string_view& rest, const char * delimiters) {
+
+	size_t start = rest.find_first_not_of(delimiters);
+
+	if (start == string_view::npos) {
+
+		rest = string_view();
+		return string_view();
+	}
+
+	size_t end = rest.find_first_of(delimiters, start);
+	string_view token = rest.substr(start, end == string_view::npos ? end : end - start);
+
+	rest = end == string_view::npos ? string_view() : rest.substr(end + 1);
+
+	return token;
+}
+
+
+int assembly::parse_label(string_view label, int line_num, int& pc) {
+
+	
+	int first_char = label.find_first_of("abcdefghijklmopqrstuvwxyzABCDEFGHIJKLMOPQRSTUVWXYZ_");
+	int first_num = label.find_first_of("012345679");
+
+	bool invalid = false;
+
+	if (first_char == string::npos)		// if no characters in string...
+		invalid = true;
+
+	if (first_char != string::npos && first_num != string::npos)		// if the operand has both letters and numbers
+		if (first_num < first_char)			// if label starts with a number
+			invalid = true;
+
+	if (label.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789") != string::npos)		// if label name contains special characters
+		invalid = true;
+
+	if (string_to_opcode(label) != -1 || string_to_register(label) != -1)		// if label has name of instruction or register name (reserved name/keyword)
+		invalid = true;
+		
+	if (invalid) {
+
+		*diagnostics << "\nLine " << line_num << ": Error... Invalid label name [" << label << "]" << endl;
+		return FAIL;
+	}
+
+	// if label name is valid and label is not already taken
+	if (!label_index.emplace(label, label_names.size()).second) {
+
+		*diagnostics << "\nLine " << line_num << ": Error... Cannot have multiple labels of same name" << endl;
+		return FAIL;
+	}
+
+	label_names.emplace_back(label);			// save label name
+	transform(label_names.back().begin(), label_names.back().end(), label_names.back().begin(), ::tolower);
+	label_addresses.push_back(pc);				// save label address
+	label_positions.push_back(line_addresses.size());			// the next instruction, if it is not behind an #org
+	label_regions.push_back(region_addresses.size() - 1);
+
+	return SUCCESS;
+}
+
+
+int assembly::parse_instruction(string_view line, int line_num, int& pc, vector <label_fixup>& pending) {
+
+	string_view token = next_token(line, " ");			// get instruction
+
+	int address = pc;
+	int operand_count = 0;			// 0 = instruction, 1 = register/immediate, 2 = register/immediate, 3+ = illegal
+	int opcode;
+
+	int instruction_type = 0;		// will be updated on first iteration of loop
+
+	string_view operands[3];			// opcode first, for emit_instruction
+
+	while (!token.empty()) {
+
+		if (operand_count == 0) {			// if instruction is expected...
+			
+			opcode = string_to_opcode(token);			// get instruction opcode
+			instruction_type = get_instruction_type(opcode);		// get type of instruction
+
+			/* Increment program counter based on instruction type (16 bit program counter, 16 bit words) */			
+			if (instruction_type == NOP)
+				pc += 2;								// 1 byte for opcode, 1 empty byte (1 word)
+			else if (instruction_type == IMMEDIATE)
+				pc += 2;								// 1 byte for opcode + register, 1 byte for immediate (1 word)
+			else if (instruction_type == BRANCH) 
+				pc += encoded_size(opcode, token.data());		// 1 byte for opcode, 1 byte for relative displacement (1 word), more if it had to grow
+			else if (instruction_type == REGISTER)
+				pc += 2;								// 1 byte for opcode + register, 1 byte for register (1 word)
+			else if (instruction_type == RAM)
+				pc += 4;								// 1 byte for opcode, 1 empty, 2 bytes for RAM address (1 word)
+			else if (instruction_type == STACK)
+				pc += 2;								// 1 byte for opcode + register, 1 empty byte
+			else if (instruction_type == CALL)
+				pc += 4;								// 1 byte for opcode, 1 empty, 2 bytes for address
+			else if (instruction_type == RET)
+				pc += 2;								// 1 byte for opcode, 1 empty byte
+			else if (instruction_type == JUMP)
+				pc += 4;								// 1 byte opcode, 1 empty byte, 2 bytes absolute address
+			else if (opcode == -1) {			// if not an instruction...
+
+				*diagnostics << "\nLine " << line_num << ": Error... Invalid instruction" << endl;
+				return FAIL;
+			} 
+			else {
+
+				*diagnostics << "\nThis tests for unsupported instructions...";
+				return FAIL;
+			}
+
+			
+			operands[operand_count] = token;
+			add_token(token);
+			token = next_token(line, ",");		// get next operand (if no "," found, gives the rest of line)
+		}
+
+
+		if (operand_count == 1) {
+
+			if (instruction_type == NOP || instruction_type == RET) {			// nop and ret should have nothing after (if it did, it would have returned after end of first loop)
+
+				*diagnostics << "\nLine " << line_num << ": Error... Unexpected [] after instruction" << endl;
+				return FAIL;
+
+			} else if (instruction_type == IMMEDIATE || instruction_type == REGISTER || instruction_type == RAM || instruction_type == STACK) {		// immediate, register, load instructions both take registers for first operand
+					
+				if (string_to_register(token) == -1) {		// if register doesn't match r0-r3
+
+					*diagnostics << "\nLine " << line_num << ": Error... Invalid register" << endl;
 					return FAIL;
 				}
 				
 			} else if (instruction_type == BRANCH || instruction_type == CALL || instruction_type == JUMP) {		// branch, call, and jump should just have an address after in the form of a label...
 
-				if (!is_valid_label(token_string)) {
+				if (!is_valid_label(token)) {
 
-					cout << "\nLine " << line_num << ": Error... Expected label after branch instruction" << endl;
+					*diagnostics << "\nLine " << line_num << ": Error... Expected label after branch instruction" << endl;
 					return FAIL;
 				}
 			}
 
+			operands[operand_count] = token;
 			add_token(token);
-			token = strtok(NULL, " ");			// next operand should have a space delimiter
+			token = next_token(line, " ");			// next operand should have a space delimiter
 		}
 
 		else if (operand_count == 2) {
 
-			string token_string(token);
-
 			 if (instruction_type == IMMEDIATE) {		// immediate instruction should have a number for second operand
 
-				if (!is_valid_immediate(token_string, 8)) {			// if immediate is not a valid number... fail
-					cout << "\nLine " << line_num << ": Error... Expected # (0b..., 0x..., dec)" << endl;
+				if (!is_valid_immediate(token, 8)) {			// if immediate is not a valid number... fail
+					*diagnostics << "\nLine " << line_num << ": Error... Expected # (0b..., 0x..., dec)" << endl;
 					return FAIL;
 				}
 				
 			} else if (instruction_type == BRANCH || instruction_type == CALL || instruction_type == JUMP) {			// there should not be a second operand for branch instructions
 
-				cout << "\nLine " << line_num << ": Error... Unexpected [] after branch" << endl;
+				*diagnostics << "\nLine " << line_num << ": Error... Unexpected [] after branch" << endl;
 				return FAIL;
 
 			} else if (instruction_type == REGISTER) {		// register instructions expect another register for second operand
 
 				if (string_to_register(token) == -1) {		// if register doesn't match r0-r3
 
-					cout << "\nLine " << line_num << ": Error... Invalid register" << endl;
+					*diagnostics << "\nLine " << line_num << ": Error... Invalid register" << endl;
 					return FAIL;
 				}
 
 			} else if (instruction_type == RAM) {		// RAM instruction should have 16-bit address for second operand
 
-				if (!is_valid_immediate(token_string, 16)) {
+				if (!is_valid_immediate(token, 16)) {
 
-					cout << "\nLine " << line_num << ": Error... Expected # (0b..., 0x..., dec)" << endl;
+					*diagnostics << "\nLine " << line_num << ": Error... Expected # (0b..., 0x..., dec)" << endl;
 					return FAIL;
 				}
 				
 			} else if (instruction_type == STACK) {
 
-				cout << "\nLine " << line_num << ": Error... Unexpected [] after nop" << endl;
+				*diagnostics << "\nLine " << line_num << ": Error... Unexpected [] after nop" << endl;
 				return FAIL;
 			}
 
+			operands[operand_count] = token;
 			add_token(token);
-			token = strtok(NULL, " ");			// get next token, should be NULL if instruction has correct syntax
+			token = next_token(line, " ");			// get next token, should be empty if instruction has correct syntax
 		}
 
 		else if (operand_count == 3) {				// this will only be reached by instructions with incorrect syntax
 
-			cout << "\nLine " << line_num << ": Error... Unexpected [] after last operand" << endl;
+			*diagnostics << "\nLine " << line_num << ": Error... Unexpected [] after last operand" << endl;
 			return FAIL;
 			
 		}
@@ -594,7 +1291,13 @@ int parse_instruction(char * line, int line_num, int& pc) {
 	if (parse_instruction_early_exit(instruction_type, operand_count, line_num))
 		return FAIL;
 
-	return SUCCESS;
+	if (pc > 0x10000) {			// ran over the top of program memory, where the tables would keep growing for nothing
+
+		*diagnostics << "\nLine " << line_num << ": Error... Code does not fit in program memory" << endl;
+		return FAIL;
+	}
+
+	return emit_instruction(operands, line_num, address, pending);
 
 }
 
@@ -604,7 +1307,7 @@ bool parse_instruction_early_exit(int instruction_type, int iteration, int line_
 	if (instruction_type == IMMEDIATE || instruction_type == REGISTER || instruction_type == RAM) {
 		if (iteration == 2) {
 
-			cout << "\nLine " << line_num << ": Error... Missing intermediate value" << endl;
+			*diagnostics << "\nLine " << line_num << ": Error... Missing intermediate value" << endl;
 			return true;
 		}
 	}
@@ -612,7 +1315,7 @@ bool parse_instruction_early_exit(int instruction_type, int iteration, int line_
 	if (instruction_type == BRANCH || instruction_type == STACK || instruction_type == CALL || instruction_type == JUMP) {
 		if (iteration == 1) {
 
-			cout << "\nLine " << line_num << ": Error... Missing operand" << endl;
+			*diagnostics << "\nLine " << line_num << ": Error... Missing operand" << endl;
 			return true;
 		}
 	}
@@ -621,54 +1324,57 @@ bool parse_instruction_early_exit(int instruction_type, int iteration, int line_
 }
 
 
-int parse_directive(string dir, int line_num, int&pc) {
+int assembly::parse_directive(string_view dir, int line_num, int&pc) {
 
-	char * line = dir.data();			// get C string
-	char * token = strtok(line, " ");		// break up line into individual tokens separated by spaces
+	string_view token = next_token(dir, " ");		// break up line into individual tokens separated by spaces
 
 	int itr = 0;
 
-	while (token != NULL) {
-
-		string token_string(token);
+	while (!token.empty()) {
 
 		if (itr == 0) {			// should be expecting a "#org" or "#dcw" directive
 
-			if (token_string.compare("#org")) {			// for now, if not "#org", fail
+			if (!label_equal()(token, "#org")) {			// for now, if not "#org" (in any case), fail
 
-				cout << "\nLine " << line_num << ": Error... Expected directive" << endl;
+				*diagnostics << "\nLine " << line_num << ": Error... Expected directive" << endl;
 				return FAIL;
 			}
 
-			token = strtok(NULL, " ");			// get next address
+			token = next_token(dir, " ");			// get next address
 		}
 		else if (itr == 1) {			// check for valid immediate address
 
-			if (!is_valid_immediate(token_string, 16)) {
+			if (!is_valid_immediate(token, 16)) {
 
-				cout << "\nLine " << line_num << ": Error... Expected 16 bit address" << endl;
+				*diagnostics << "\nLine " << line_num << ": Error... Expected 16 bit address" << endl;
 				return FAIL;
 			}
 
-			int new_pc = string_to_imm(token_string);			// get memory address of directive
+			int new_pc = string_to_imm(token);			// get memory address of directive
 			int range = (new_pc - pc) / 2;			// get # of 16 bit words between current PC and new PC
 
 			if (range < 0) {			// overwriting memory...
 
-				cout << "\nLine " << line_num << ": Error... Org directive overwriting memory" << endl;
+				*diagnostics << "\nLine " << line_num << ": Error... Org directive overwriting memory" << endl;
 				return FAIL;
 			}
 
-			for (int i = 0; i < range; i++)
+			for (int i = 0; i < range && keep_tokens; i++)
 				tokens.push_back("nop");
 
+			code.resize(new_pc, 0);			// nop is all zeros
+
+			region_ends.push_back(pc);			// close the region before the gap, the next one starts at the new address
+			region_addresses.push_back(new_pc);
+			region_lines.push_back(line_num);
+
 			pc = new_pc;		// update program counter
 
-			token = strtok(NULL, " ");			// should be NULL after this
+			token = next_token(dir, " ");			// should be empty after this
 		}
 		else {		// #org should not have more arguments
 
-			cout << "\nLine " << line_num << ": Error... Unexpected [] after address" << endl;
+			*diagnostics << "\nLine " << line_num << ": Error... Unexpected [] after address" << endl;
 			return FAIL;
 		}
 
@@ -677,176 +1383,2126 @@ int parse_directive(string dir, int line_num, int&pc) {
 
 	if (itr == 1) {		// early exit
 
-		cout << "\nLine " << line_num << ": Error... Expected address" << endl;
+		*diagnostics << "\nLine " << line_num << ": Error... Expected address" << endl;
 		return FAIL;
 	}
 	return SUCCESS;
 }
 
 
-void add_token(string tok) {
+void assembly::add_token(string_view tok) {
 
-	tokens.push_back(tok);
+	if (keep_tokens)
+		tokens.push_back(tok);
 }
 
 
-int assemble_file(ofstream &bin) {
+int assembly::emit_instruction(const string_view operands[], int line_num, int pc, vector <label_fixup>& pending) {
 
-	
-	string line;
-	int pc = 0;
-	
-	auto token_num = tokens.begin();
+	int opcode = string_to_opcode(operands[0]);
+	int instruction_type = get_instruction_type(opcode);
+	int size = encoded_size(opcode, operands[0].data());
+	unsigned char high_byte = opcode << 3;			// 5 bits for opcode, 3 bits for register
 
-	while (token_num != tokens.end()) {
+	if (code.size() < (size_t) (pc + size))			// the parallel parse sizes code up front
+		code.resize(pc + size);
 
-		int opcode = string_to_opcode(*(token_num++));
-		int instruction_type = get_instruction_type(opcode);
-		__int8 high_byte = (__int8) opcode << 3;			// 5 bits for opcode, 3 bits for register
+	unsigned char * out = &code[pc];
 
-		if (instruction_type == NOP) {
-			
-			pc += 2;
+	if (instruction_type == NOP || instruction_type == RET) {
 
-			bin << high_byte;
-			bin << (__int8) 0;
-		}
-		else if (instruction_type == IMMEDIATE) {
+		out[0] = high_byte;
+		out[1] = 0;
+	}
+	else if (instruction_type == IMMEDIATE) {
 
-			pc += 2;
+		out[0] = high_byte | string_to_register(operands[1]);		// combine register and opcode into final opcode
+		out[1] = string_to_imm(operands[2]);
+	}
+	else if (instruction_type == REGISTER) {
 
-			__int8 r_dest = (__int8) string_to_register(*(token_num++));		// get destination register
+		out[0] = high_byte | string_to_register(operands[1]);		// first register
+		out[1] = string_to_register(operands[2]);		// second register
+	}
+	else if (instruction_type == STACK) {
 
-			bin << (__int8)  (high_byte | r_dest);		// combine register and opcode into final opcode
-			bin << (__int8) string_to_imm(*(token_num++));		// write to file
+		out[0] = high_byte | string_to_register(operands[1]);		// register to push/pop memory into/out
+		out[1] = 0;
+	}
+	else if (instruction_type == RAM) {
 
-		}
-		else if (instruction_type == BRANCH) {
+		int immediate = string_to_imm(operands[2]);		// address checked by parse_instruction
 
-			pc += 2;
+		if ((opcode == opcodes::str || opcode == opcodes::ldr) && immediate % 2 == 1) {			// don't allow misaligned writes or reads when using str and ldr
 
-			bin << high_byte;		// write branch instruction
+			*diagnostics << "\nLine " << line_num << ": Error... Misaligned writes and reads not allowed" << endl;
+			return FAIL;
+		}
 
-			int label_address = get_label_address(*(token_num++));		// get label address
+		out[0] = high_byte | string_to_register(operands[1]);		// register to load memory into
+		out[1] = 0;
+		out[2] = immediate >> 8;			// high byte of address
+		out[3] = immediate;				// low byte of address
+	}
+	else if (instruction_type == BRANCH && size > 2)
+		return emit_long_branch(opcode, operands[1], line_num, pc, pending);
+	else if (instruction_type == BRANCH || instruction_type == CALL || instruction_type == JUMP) {
 
-			if (label_address == -1) {
+		out[0] = high_byte;
+		out[1] = 0;			// displacement of a branch, filled in by patch_label
 
-				cout << "\nLine []: Error... Invalid reference to label [" << line << "]" << endl;
-				return FAIL;
-			}
-			
-			int offset = (label_address - pc) / WORD_SIZE_BYTES;		// get relative displacement of branch, then divide by # of individually accessible bytes
-			
-			if (offset > 127 || offset < -128) {
+		if (instruction_type != BRANCH) {
 
-				cout << "\nError... Offset out of range" << endl;
-				return FAIL;
+			out[2] = 0;			// absolute address of call and jmp
+			out[3] = 0;
+		}
+
+		int label_address = get_label_address(operands[1]);
+		const char * branch = instruction_type == BRANCH ? operands[0].data() : nullptr;
+
+		/* Forward reference, patched at the end of the file (the parallel parse knows every label already); a branch out of reach grows there */
+		if (relocatable || label_address == -1 || label_address > pc || (branch && !reaches(pc, label_address))) {
+
+			pending.push_back({pc, line_num, operands[1], branch});
+			return SUCCESS;
+		}
+
+		return patch_label(pc, label_address, line_num);
+	}
+	else {
+
+		*diagnostics << "\nHow did you even get here?" << endl;
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+
+int assembly::emit_long_branch(int opcode, string_view label, int line_num, int pc, vector <label_fixup>& pending) {
+
+	unsigned char * out = &code[pc];
+	int jump = pc;			// address of the jmp
+
+	/* Conditional branches flush what follows them when taken, jmp runs the word after it first (a nop here, or for bra the word the short bra ran) */
+	if (opcode == opcodes::bge) {			// bge is taken on Z or N = V, blt on N != V: no single branch is its inverse
+
+		out[0] = opcodes::beq << 3;				// Z: to the jmp
+		out[1] = 2;
+		out[2] = opcodes::blt << 3;				// N != V without Z: over it
+		out[3] = 6;
+		jump = pc + 4;
+	}
+	else if (opcode == opcodes::blt) {
+
+		out[0] = opcodes::blt << 3;				// to the jmp
+		out[1] = 6;
+		out[2] = opcodes::bra << 3;				// over it; the word behind bra is masked, the next one runs
+		out[3] = 10;
+		out[4] = out[5] = out[6] = out[7] = 0;
+		jump = pc + 8;
+	}
+	else if (opcode != opcodes::bra) {
+
+		int inverse = opcode == opcodes::beq ? opcodes::bne : opcode == opcodes::bne ? opcodes::beq
+			: opcode == opcodes::bhs ? opcodes::blo : opcode == opcodes::blo ? opcodes::bhs
+			: opcode == opcodes::bvs ? opcodes::bvc : opcodes::bvs;
+
+		out[0] = inverse << 3;					// over the jmp and its nop
+		out[1] = 6;
+		jump = pc + 2;
+	}
+
+	code[jump] = opcodes::jmp << 3;
+	code[jump + 1] = code[jump + 2] = code[jump + 3] = 0;
+	code[jump + 4] = code[jump + 5] = 0;			// nop, run before jmp jumps
+
+	int label_address = get_label_address(label);
+
+	if (relocatable || label_address == -1 || label_address > jump || opcode == opcodes::bra) {			// a bra waits for the code behind it, see move_delay_word
+
+		pending.push_back({jump, line_num, label, nullptr, opcode == opcodes::bra});
+		return SUCCESS;
+	}
+
+	return patch_label(jump, label_address, line_num);
+}
+
+
+int assembly::move_delay_word(int pc, int line_num) {
+
+	/* Behind the short bra came the masked word, then the one it ran: here they follow the jmp and its slot */
+	int masked = pc + LONG_BRA;
+	int word = masked + 2;
+	int end = region_ends.at(region_of(pc));
+
+	if (word >= end || (!code[word] && !code[word + 1]))			// a nop, as the slot already holds
+		return SUCCESS;
+
+	int masked_type = get_instruction_type(code[masked] >> 3);
+	int type = get_instruction_type(code[word] >> 3);
+	auto next = lower_bound(line_addresses.begin(), line_addresses.end(), masked);
+	bool masked_grown = masked_type == BRANCH && !(next != line_addresses.end() && *next == masked && next + 1 != line_addresses.end() && *(next + 1) == word);
+
+	/* Only a whole 2 byte instruction that does not branch runs the same anywhere */
+	if (instruction_size(masked_type) != 2 || masked_grown || instruction_size(type) != 2 || type == BRANCH) {
+
+		*diagnostics << "\nLine " << line_num << ": Error... bra cannot reach its label, and the word it runs behind it cannot move behind a jmp" << endl;
+		return FAIL;
+	}
+
+	code[pc + 4] = code[word];
+	code[pc + 5] = code[word + 1];
+
+	return SUCCESS;
+}
+
+
+bool reaches(int pc, int label_address) {
+
+	int offset = (label_address - (pc + 2)) / WORD_SIZE_BYTES;
+
+	return offset <= 127 && offset >= -128;
+}
+
+
+int assembly::patch_label(int pc, int label_address, int line_num) {
+
+	if (get_instruction_type(code.at(pc) >> 3) != BRANCH) {
+
+		code.at(pc + 2) = label_address >> 8;		// high byte of address
+		code.at(pc + 3) = label_address;			// low byte of address
+
+		return SUCCESS;
+	}
+
+	int offset = (label_address - (pc + 2)) / WORD_SIZE_BYTES;		// relative to the next instruction, divided by # of individually accessible bytes
+
+	if (offset > 127 || offset < -128) {
+
+		*diagnostics << "\nLine " << line_num << ": Error... Offset out of range" << endl;
+		return FAIL;
+	}
+
+	code.at(pc + 1) = offset;			// relative displacement byte
+
+	return SUCCESS;
+}
+
+
+int assembly::resolve_fixups() {
+
+	/* Branches that cannot reach grow all at once; the linker has to reach the labels it may still move */
+	bool grown = false;
+
+	for (const label_fixup& fixup : fixups) {
+
+		auto found = label_index.find(fixup.label);
+
+		if (!fixup.branch || found == label_index.end() || (relocatable && label_regions.at(found->second) != region_of(fixup.pc)))
+			continue;
+
+		if (!reaches(fixup.pc, label_addresses.at(found->second))) {
+
+			long_branches.insert(fixup.branch);
+			grown = true;
+		}
+	}
+
+	if (grown) {
+
+		fixups.clear();
+		return GROWN;
+	}
+
+	for (const label_fixup& fixup : fixups)
+		if (fixup.delay_word && move_delay_word(fixup.pc, fixup.line) == FAIL)
+			return FAIL;
+
+	if (relocatable) {			// the linker patches them, every address may move
+
+		relocations.swap(fixups);
+		fixups.clear();
+
+		return SUCCESS;
+	}
+
+	for (const label_fixup& fixup : fixups) {
+
+		int label_address = get_label_address(fixup.label);
+
+		if (label_address == -1) {
+
+			*diagnostics << "\nLine " << fixup.line << ": Error... Label not found [" << fixup.label << "]" << endl;
+			return FAIL;
+		}
+
+		if (patch_label(fixup.pc, label_address, fixup.line) == FAIL)
+			return FAIL;
+	}
+
+	fixups.clear();
+
+	return SUCCESS;
+}
+
+
+int assembly::assemble_tokens() {
+
+	string_view operands[3];
+	size_t line = 0;			// next entry of the line table
+
+	code.clear();
+
+	for (auto token = tokens.begin(); token != tokens.end(); ) {
+
+		int n = token_count(get_instruction_type(string_to_opcode(*token)));
+		int line_num = 0;
+
+		for (int i = 0; i < n; i++)
+			operands[i] = *(token++);
+
+		if (line < line_addresses.size() && line_addresses.at(line) == (int) code.size())
+			line_num = line_numbers.at(line++);
+
+		if (emit_instruction(operands, line_num, code.size(), fixups) == FAIL)
+			return FAIL;
+	}
+
+	return resolve_fixups();
+}
+
+
+int assembly::write_code_file(ostream &bin) {
+
+	bin.write((const char *) code.data(), code.size());
+
+	return bin.good() ? SUCCESS : FAIL;
+}
+
+
+int assembly::write_object_file(ostream &obj) {
+
+	if (region_ends.back() > 0x10000) {
+
+		*diagnostics << "\nError... Code does not fit in program memory" << endl;
+		return FAIL;
+	}
+
+	/* Labels used but not defined here are numbered after the defined ones, in order of first use */
+	unordered_map <string_view, int, label_hash, label_equal> undefined_index;
+	vector <string> undefined;
+	vector <int> relocation_symbols;
+
+	for (const label_fixup& relocation : relocations) {
+
+		auto defined = label_index.find(relocation.label);
+
+		if (defined != label_index.end()) {
+
+			relocation_symbols.push_back(defined->second);
+			continue;
+		}
+
+		auto added = undefined_index.emplace(relocation.label, label_names.size() + undefined.size());
+
+		if (added.second) {
+
+			undefined.emplace_back(relocation.label);
+			transform(undefined.back().begin(), undefined.back().end(), undefined.back().begin(), ::tolower);
+		}
+
+		relocation_symbols.push_back(added.first->second);
+	}
+
+	int sections = region_addresses.size();
+	int symbol_count = label_names.size() + undefined.size();
+
+	if (symbol_count >= OBJECT_UNDEFINED) {
+
+		*diagnostics << "\nError... Too many labels for an object file" << endl;
+		return FAIL;
+	}
+
+	unsigned int string_size = 0;
+	unsigned int code_size = 0;
+
+	for (size_t i = 0; i != label_names.size(); i++)
+		string_size += label_names.at(i).size() + 1;
+
+	for (size_t i = 0; i != undefined.size(); i++)
+		string_size += undefined.at(i).size() + 1;
+
+	for (size_t i = 0; i != line_sources.size(); i++)
+		string_size += line_sources.at(i).size() + 1;
+
+	for (int i = 0; i != sections; i++)
+		code_size += region_ends.at(i) - region_addresses.at(i);
+
+	int section_offset = 56;			// sizeof(object_header)
+	int symbol_offset = section_offset + 16 * sections;
+	int relocation_offset = symbol_offset + 8 * symbol_count;
+	int line_offset = relocation_offset + 12 * relocations.size();
+	int code_offset = line_offset + 12 * line_addresses.size();
+	int string_offset = code_offset + code_size;
+
+	string tables;			// everything before the code, written at once like the symbol file
+	unsigned int next_string = 0;
+	unsigned int next_code = 0;
+
+	tables.reserve(code_offset);
+
+	write_little_endian(tables, OBJECT_MAGIC, 4);
+	write_little_endian(tables, OBJECT_VERSION, 4);
+	write_little_endian(tables, sections, 4);
+	write_little_endian(tables, symbol_count, 4);
+	write_little_endian(tables, relocations.size(), 4);
+	write_little_endian(tables, line_addresses.size(), 4);
+	write_little_endian(tables, section_offset, 4);
+	write_little_endian(tables, symbol_offset, 4);
+	write_little_endian(tables, relocation_offset, 4);
+	write_little_endian(tables, line_offset, 4);
+	write_little_endian(tables, code_offset, 4);
+	write_little_endian(tables, code_size, 4);
+	write_little_endian(tables, string_offset, 4);
+	write_little_endian(tables, string_size, 4);
+
+	for (int i = 0; i != sections; i++) {			// the code before the first #org is the relocatable one
+
+		write_little_endian(tables, i > 0 ? region_addresses.at(i) : 0, 2);
+		write_little_endian(tables, i > 0 ? OBJECT_ABSOLUTE : 0, 2);
+		write_little_endian(tables, region_ends.at(i) - region_addresses.at(i), 4);
+		write_little_endian(tables, next_code, 4);
+		write_little_endian(tables, region_lines.at(i), 4);
+		next_code += region_ends.at(i) - region_addresses.at(i);
+	}
+
+	for (size_t i = 0; i != label_names.size(); i++) {
+
+		write_little_endian(tables, label_regions.at(i), 2);
+		write_little_endian(tables, label_addresses.at(i) - region_addresses.at(label_regions.at(i)), 2);
+		write_little_endian(tables, next_string, 4);
+		next_string += label_names.at(i).size() + 1;
+	}
+
+	for (size_t i = 0; i != undefined.size(); i++) {
+
+		write_little_endian(tables, OBJECT_UNDEFINED, 2);
+		write_little_endian(tables, 0, 2);
+		write_little_endian(tables, next_string, 4);
+		next_string += undefined.at(i).size() + 1;
+	}
+
+	for (size_t i = 0; i != relocations.size(); i++) {
+
+		int pc = relocations.at(i).pc;
+		int region = region_of(pc);
+
+		write_little_endian(tables, region, 2);
+		write_little_endian(tables, pc - region_addresses.at(region), 2);
+		write_little_endian(tables, relocation_symbols.at(i), 2);
+		write_little_endian(tables, get_instruction_type(code.at(pc) >> 3) == BRANCH ? OBJECT_RELATIVE8 : OBJECT_ABSOLUTE16, 2);
+		write_little_endian(tables, relocations.at(i).line, 4);
+	}
+
+	for (size_t i = 0; i != line_addresses.size(); i++) {
+
+		int region = region_of(line_addresses.at(i));
+
+		write_little_endian(tables, region, 2);
+		write_little_endian(tables, line_addresses.at(i) - region_addresses.at(region), 2);
+		write_little_endian(tables, line_numbers.at(i), 4);
+		write_little_endian(tables, next_string, 4);
+		next_string += line_sources.at(i).size() + 1;
+	}
+
+	obj.write(tables.data(), tables.size());
+
+	for (int i = 0; i != sections; i++)
+		obj.write((const char *) code.data() + region_addresses.at(i), region_ends.at(i) - region_addresses.at(i));
+
+	for (size_t i = 0; i != label_names.size(); i++)
+		obj.write(label_names.at(i).c_str(), label_names.at(i).size() + 1);
+
+	for (size_t i = 0; i != undefined.size(); i++)
+		obj.write(undefined.at(i).c_str(), undefined.at(i).size() + 1);
+
+	for (size_t i = 0; i != line_sources.size(); i++) {
+
+		obj.write(line_sources.at(i).data(), line_sources.at(i).size());
+		obj.put('\0');
+	}
+
+	return obj.good() ? SUCCESS : FAIL;
+}
+
+
+int assembly::region_of(int address) {
+
+	return upper_bound(region_addresses.begin(), region_addresses.end(), address) - region_addresses.begin() - 1;
+}
+
+
+string output_file_for(const char * file_name, const char * extension) {
+
+	string name = file_name;
+	size_t dot = name.rfind('.');
+
+	if (dot != string::npos && name.find('/', dot) == string::npos)
+		name.erase(dot);
+
+	return name + extension;
+}
+
+
+int instruction_size(int instruction_type) {
+
+	if (instruction_type == RAM || instruction_type == CALL || instruction_type == JUMP)
+		return 4;			// opcode word and a 16 bit address
+
+	return 2;
+}
+
+
+int assembly::encoded_size(int opcode, const char * mnemonic) {
+
+	int instruction_type = get_instruction_type(opcode);
+
+	if (instruction_type != BRANCH || !long_branches.count(mnemonic))
+		return instruction_size(instruction_type);
+
+	if (opcode == opcodes::bra)
+		return LONG_BRA;
+	if (opcode == opcodes::bge)
+		return LONG_BGE;
+	if (opcode == opcodes::blt)
+		return LONG_BLT;
+
+	return LONG_BRANCH;
+}
+
+
+int token_count(int instruction_type) {
+
+	if (instruction_type == NOP || instruction_type == RET)
+		return 1;
+	if (instruction_type == BRANCH || instruction_type == STACK || instruction_type == CALL || instruction_type == JUMP)
+		return 2;
+
+	return 3;			// IMMEDIATE, REGISTER, RAM
+}
+
+
+instruction_effects assembly::get_effects(const vector <string_view>& operands) {
+
+	instruction_effects e = {};
+
+	int opcode = string_to_opcode(operands.at(0));
+	int instruction_type = get_instruction_type(opcode);
+	unsigned long dx = op_ctrl[opcode & 31][0];
+	unsigned long wb = op_ctrl[opcode & 31][1];
+
+	if (instruction_type == IMMEDIATE || instruction_type == REGISTER || instruction_type == RAM || instruction_type == STACK)
+		e.rd = string_to_register(operands.at(1));
+
+	if (instruction_type == REGISTER)
+		e.rs = string_to_register(operands.at(2));
+	else if (instruction_type == IMMEDIATE)
+		e.rs = string_to_imm(operands.at(2)) & 7;			// the low byte selects a register even when it is an immediate
+
+	e.port_a = e.port_b = -1;
+	e.size = encoded_size(opcode, operands.at(0).data());
+	e.control = instruction_type == BRANCH || instruction_type == CALL || instruction_type == RET || instruction_type == JUMP;
+	e.delay_slot = (dx & STALL) && (wb & J) && !(wb & FLUSH) && e.size == instruction_size(instruction_type);			// the long form of bra fills its own
+	e.store_ports = (wb & RW) && !(dx & STALL);
+
+	if (opcode >= opcodes::bne && opcode <= opcodes::bvc)
+		e.flags_read = (opcode == opcodes::beq || opcode == opcodes::bne ? FLAGS_NZ : opcode == opcodes::bge || opcode == opcodes::blt ? FLAGS_NZ | FLAGS_CV : FLAGS_CV);
+
+	if ((dx & ALUI) && !(dx & PCS)) {			// branches use the ALU for their target only
+
+		int os = dx & OS_MASK;
+
+		if (os != B_ID && os != NOT)
+			e.port_a = e.rd;
+		if (!(dx & IMS))
+			e.port_b = e.rs;
+
+		e.flags = FLAGS_NZ | (os == ADD || os == SUB ? FLAGS_CV : 0);
+	}
+
+	if (e.port_a >= 0)
+		e.reads |= 1 << e.port_a;
+	if (e.port_b >= 0)
+		e.reads |= 1 << e.port_b;
+	if ((wb & RW) && !(wb & CALL_C))			// stored data comes from rd
+		e.reads |= 1 << e.rd;
+	if (wb & WEN)
+		e.writes |= 1 << e.rd;
+
+	e.load = (wb & RR) != 0;
+	e.store = (wb & RW) != 0;
+	e.stack = (wb & SPS) != 0;
+
+	if (e.stack) {
+
+		e.first = 0;
+		e.last = STACK_TOP;
+	} else if (instruction_type == RAM) {
+
+		int address = string_to_imm(operands.at(2));
+
+		e.first = (wb & RBYTE) ? address : address & ~1;
+		e.last = (wb & RBYTE) ? address + 1 : e.first + 2;
+	}
+
+	return e;
+}
+
+
+int instruction_cycles(int opcode) {
+
+	unsigned long dx = op_ctrl[opcode & 31][0];
+	unsigned long wb = op_ctrl[opcode & 31][1];
+
+	int cycles = 1;
+
+	if (dx & STALL)
+		cycles++;
+	if (wb & FLUSH)
+		cycles += (dx & STALL) ? 1 : 2;			// FLUSH empties decode (already a bubble behind a STALL) and masks the fetch
+
+	return cycles;
+}
+
+
+bool depends(const instruction_effects& a, const instruction_effects& b) {
+
+	if ((a.writes & (b.reads | b.writes)) || (a.reads & b.writes))
+		return true;
+
+	if (a.stack && b.stack)			// both move the stack pointer
+		return true;
+
+	if ((a.store && (b.load || b.store)) || (a.load && b.store))
+		return a.first < b.last && b.first < a.last;
+
+	return false;
+}
+
+
+bool misreads(const instruction_effects& behind, const instruction_effects& e) {
+
+	return behind.store_ports && ((e.port_a >= 0 && e.port_a != behind.rd) || (e.port_b >= 0 && e.port_b != behind.rs));
+}
+
+
+int assembly::schedule_block(const vector <scheduled_instruction>& block, const vector <scheduled_instruction>& guarded, bool self_loop, bool behind_push, bool in_order, vector <scheduled_instruction>& out) {
+
+	const scheduled_instruction filler = {{"nop"}, -1};
+
+	int count = block.size();
+	vector <instruction_effects> e;
+
+	for (const scheduled_instruction& ins : block)
+		e.push_back(get_effects(ins.operands));
+
+	bool terminated = count > 0 && e.back().control;
+	int body = terminated ? count - 1 : count;
+
+	/* Dependencies inside the body; the flags have to leave the block as they did, so the last writer of NZ and of CV stays behind the other writers */
+	vector <vector <int>> preds(body);
+	int last_nz = -1, last_cv = -1;
+
+	for (int i = 0; i < body; i++) {
+
+		if (e[i].flags & FLAGS_NZ)
+			last_nz = i;
+		if (e[i].flags & FLAGS_CV)
+			last_cv = i;
+	}
+
+	for (int j = 0; j < body; j++)
+		for (int i = 0; i < j; i++)
+			if (depends(e[i], e[j]) || (j == last_nz && (e[i].flags & FLAGS_NZ)) || (j == last_cv && (e[i].flags & FLAGS_CV)))
+				preds[j].push_back(i);
+
+	/* bra and jmp run the word after the one their STALL masks before jumping; when the source has nothing there, move the latest instruction nothing waits for there */
+	int delay = -1;
+
+	if (!in_order && terminated && e.back().delay_slot && !self_loop && guarded.empty()) {
+
+		for (int i = body - 1; i >= 0 && delay < 0; i--) {
+
+			bool sink = true;
+
+			for (int j = i + 1; j < body; j++)
+				sink = sink && find(preds[j].begin(), preds[j].end(), i) == preds[j].end();
+
+			if (sink && e[i].size == 2 && !e[i].store_ports && !(i > 0 ? e[i - 1].store_ports : behind_push))
+				delay = i;
+		}
+	}
+
+	/* Behind a push the decode ports are addressed by its rd and r0: the instruction the source has there stays there, moving with the push
+	   as one run; a push ending the body stays last, in front of the branch or the next block, and a block the one before falls into
+	   behind a push keeps its first instruction first */
+	int cycles = 0;
+	vector <bool> placed(body, false);
+
+	for (int left = delay >= 0 ? body - 1 : body; left > 0; ) {
+
+		int pick = -1, end = -1;
+
+		for (int i = 0; i < body && pick < 0; i++) {
+
+			if (placed[i] || i == delay || (i > 0 && e[i - 1].store_ports))
+				continue;
+			if (behind_push && !placed[0] && i != 0)
+				break;
+
+			int last = i;
+
+			while (e[last].store_ports && last + 1 < body)
+				last++;
+
+			bool ready = !e[last].store_ports || left == last - i + 1;
+
+			for (int k = i; k <= last; k++)
+				for (int p : preds[k])
+					ready = ready && (placed[p] || p >= i);
+
+			if (ready) {
+
+				pick = i;
+				end = last;
+			} else if (in_order)
+				break;
+		}
+
+		for (int k = pick; k <= end; k++) {
+
+			out.push_back(block[k]);
+			cycles += instruction_cycles(string_to_opcode(block[k].operands.at(0)));
+			placed[k] = true;
+			left--;
+		}
+	}
+
+	if (!terminated)
+		return cycles;
+
+	out.push_back(block.back());
+	cycles += instruction_cycles(string_to_opcode(block.back().operands.at(0)));
+
+	if (e.back().delay_slot) {
+
+		int window = e.back().size == 2 ? 4 : 2;			// the word the STALL masks behind a 2 byte bra, then the word that runs
+
+		/* What the source has in those words stays there, it is what the program runs */
+		for (const scheduled_instruction& ins : guarded) {
+
+			out.push_back(ins);
+
+			if (window <= 2)
+				cycles += instruction_cycles(string_to_opcode(ins.operands.at(0)));
+
+			window -= get_effects(ins.operands).size;
+		}
+
+		if (window > 2) {
+
+			out.push_back(filler);			// masked by the STALL, never runs
+			window -= 2;
+		}
+
+		if (window > 0) {
+
+			out.push_back(delay >= 0 ? block[delay] : filler);
+			cycles += instruction_cycles(delay >= 0 ? string_to_opcode(block[delay].operands.at(0)) : opcodes::nop);
+		}
+	}
+
+	return cycles;
+}
+
+
+int assembly::schedule_program() {
+
+	/* Split the tokens back into instructions; the nops #org padded with are not source lines and are written again below */
+	vector <scheduled_instruction> program;
+	int pc = 0;
+
+	for (auto token = tokens.begin(); token != tokens.end(); ) {
+
+		int n = token_count(get_instruction_type(string_to_opcode(*token)));
+		scheduled_instruction ins = {vector <string_view> (token, token + n), -1};
+
+		token += n;
+
+		if (program.size() < line_addresses.size() && line_addresses.at(program.size()) == pc) {
+
+			ins.source = program.size();
+			program.push_back(ins);
+		}
+
+		pc += get_effects(ins.operands).size;
+	}
+
+	/* Labels stay in front of their instruction, or at the end of their region when nothing follows them there */
+	vector <int> label_instruction(label_names.size(), -1);
+	vector <int> label_region(label_names.size(), 0);
+	vector <bool> leader(program.size(), false);
+
+	for (size_t i = 0; i != label_names.size(); i++) {
+
+		int k = label_positions.at(i);
+
+		if (k < (int) program.size() && line_addresses.at(k) == label_addresses.at(i)) {
+
+			label_instruction[i] = k;
+			leader[k] = true;
+		}
+
+		for (size_t r = 0; r != region_addresses.size(); r++)
+			if (region_addresses.at(r) <= label_addresses.at(i))
+				label_region[i] = r;
+	}
+
+	vector <scheduled_instruction> out;
+	vector <int> out_addresses;
+	vector <int> leader_address(program.size(), 0);
+	vector <int> new_ends(region_addresses.size());
+
+	int source_cycles = 0, scheduled_cycles = 0, blocks = 0;
+	int k = 0;
+
+	for (size_t r = 0; r != region_addresses.size(); r++) {
+
+		pc = region_addresses.at(r);
+
+		if (r > 0 && pc < new_ends.at(r - 1)) {
+
+			*diagnostics << "\nLine " << region_lines.at(r) << ": Error... Scheduled code runs into #org" << endl;
+			return FAIL;
+		}
+
+		while (k < (int) program.size() && line_addresses.at(k) < region_ends.at(r)) {
+
+			/* Basic block: up to the next label or control flow instruction */
+			vector <scheduled_instruction> block;
+			int first = k;
+
+			do
+				block.push_back(program.at(k++));
+			while (k < (int) program.size() && line_addresses.at(k) < region_ends.at(r) && !leader[k] && !get_effects(block.back().operands).control);
+
+			/* The words behind a bra or jmp stay with it in source order, labelled or not */
+			vector <scheduled_instruction> guarded;
+			instruction_effects last = get_effects(block.back().operands);
+
+			for (int window = last.delay_slot ? (last.size == 2 ? 4 : 2) : 0; window > 0 && k < (int) program.size() && line_addresses.at(k) < region_ends.at(r); ) {
+
+				guarded.push_back(program.at(k++));
+				window -= get_effects(guarded.back().operands).size;
+			}
+
+			bool self_loop = false;
+			int opcode = string_to_opcode(block.back().operands.at(0));
+			bool behind_push = first > 0 && get_effects(program.at(first - 1).operands).store_ports && line_addresses.at(first - 1) + 2 == line_addresses.at(first);
+
+			if (opcode == opcodes::bra || opcode == opcodes::jmp)
+				self_loop = label_instruction[label_index.at(block.back().operands.at(1))] == first;
+
+			vector <scheduled_instruction> in_order;
+			size_t start = out.size();
+
+			int before = schedule_block(block, guarded, self_loop, behind_push, true, in_order);
+			int after = schedule_block(block, guarded, self_loop, behind_push, false, out);
+
+			if (after < before)
+				*diagnostics << "line " << line_numbers.at(first) << ": " << before << " -> " << after << " cycles" << endl;
+
+			source_cycles += before;
+			scheduled_cycles += after;
+			blocks++;
+
+			leader_address[first] = pc;
+
+			for (size_t i = start; i < out.size(); i++) {
+
+				out_addresses.push_back(pc);
+				pc += get_effects(out[i].operands).size;
+			}
+
+			for (const scheduled_instruction& ins : guarded)			// labels on them stay with them
+				for (size_t i = start; i < out.size(); i++)
+					if (out[i].source == ins.source)
+						leader_address[ins.source] = out_addresses[i];
+		}
+
+		if (pc > 0x10000) {
+
+			*diagnostics << "\nError... Scheduled code does not fit in program memory" << endl;
+			return FAIL;
+		}
+
+		new_ends[r] = pc;
+	}
+
+	/* Write everything back in address order, padding the #org gaps with nop as parse_directive does */
+	vector <int> numbers;
+	vector <string_view> sources;
+	int next = 0;
+
+	tokens.clear();
+	line_addresses.clear();
+
+	for (size_t r = 0, i = 0; r != region_addresses.size(); r++) {
+
+		for (int gap = (region_addresses.at(r) - next) / 2; gap > 0; gap--)
+			tokens.push_back("nop");
+
+		for (; i < out.size() && out_addresses[i] < new_ends[r]; i++) {
+
+			tokens.insert(tokens.end(), out[i].operands.begin(), out[i].operands.end());
+
+			if (out[i].source >= 0) {
+
+				line_addresses.push_back(out_addresses[i]);
+				numbers.push_back(line_numbers.at(out[i].source));
+				sources.push_back(line_sources.at(out[i].source));
+			}
+		}
+
+		next = new_ends[r];
+		region_ends.at(r) = new_ends[r];
+	}
+
+	line_numbers = numbers;
+	line_sources = sources;
+
+	for (size_t i = 0; i != label_names.size(); i++)
+		label_addresses.at(i) = label_instruction[i] >= 0 ? leader_address[label_instruction[i]] : new_ends[label_region[i]];
+
+	*diagnostics << blocks << " blocks scheduled: " << source_cycles << " cycles in source order, " << scheduled_cycles << " scheduled, "
+		<< source_cycles - scheduled_cycles << " saved (one pass through every block, branches not taken)" << endl;
+
+	return SUCCESS;
+}
+
+
+/* Label or #org region end a label resolves to once the instructions in front of it are gone: first surviving instruction of its region at or after it */
+int assembly::peephole_label(const peephole_program& p, int label) {
+
+	int k = p.label_instruction.at(label);
+
+	while (k >= 0 && k < (int) p.code.size() && p.removed[k] && p.region[k] == label_regions.at(label))
+		k++;
+
+	return k >= 0 && k < (int) p.code.size() && p.region[k] == label_regions.at(label) ? k : -1;
+}
+
+
+int peephole_next(const peephole_program& p, int k) {
+
+	do
+		k++;
+	while (k < (int) p.code.size() && p.removed[k]);
+
+	return k < (int) p.code.size() ? k : -1;
+}
+
+
+int peephole_previous(const peephole_program& p, int k) {
+
+	do
+		k--;
+	while (k >= 0 && p.removed[k]);
+
+	return k;
+}
+
+
+int assembly::peephole_target(const peephole_program& p, string_view label) {
+
+	auto found = label_index.find(label);
+
+	if (found == label_index.end())
+		return -1;
+
+	int k = peephole_label(p, found->second);
+
+	if (k >= 0)
+		return k;
+
+	/* At the end of its region: the #org padding runs into the next region */
+	for (k = 0; k < (int) p.code.size(); k++)
+		if (!p.removed[k] && p.region[k] > label_regions.at(found->second))
+			return k;
+
+	return -1;
+}
+
+
+void assembly::peephole_analyze(peephole_program& p) {
+
+	int count = p.code.size();
+
+	/* Labels follow the instructions removed from under them */
+	p.leader.assign(count, false);
+
+	for (size_t i = 0; i != label_names.size(); i++) {
+
+		int k = peephole_label(p, i);
+
+		if (k >= 0)
+			p.leader[k] = true;
+	}
+
+	/* The word bra masks and the one it runs before jumping, the one jmp runs; a long branch fills its own */
+	p.guarded.assign(count, false);
+
+	for (int k = 0; k < count; k++) {
+
+		if (p.removed[k] || !p.effects[k].delay_slot)
+			continue;
+
+		int words = (p.effects[k].size == 2 ? 4 : 2);
+
+		for (int n = peephole_next(p, k); n >= 0 && words > 0; n = peephole_next(p, n)) {
+
+			p.guarded[n] = true;
+			words -= p.effects[n].size;
+		}
+	}
+
+	/* Flags live after each instruction, backwards to a fixed point; whatever cannot be followed (ret, a label of another module, the end of the program) reads them all */
+	const int all = FLAGS_NZ | FLAGS_CV;
+	vector <int> live_in(count, 0);
+
+	p.live.assign(count, 0);
+
+	for (bool changed = true; changed; ) {
+
+		changed = false;
+
+		for (int k = count - 1; k >= 0; k--) {
+
+			if (p.removed[k])
+				continue;
+
+			const instruction_effects& e = p.effects[k];
+			int opcode = string_to_opcode(p.code[k].operands.at(0));
+			int next = peephole_next(p, k);
+			int out = next >= 0 ? live_in[next] : all;
+
+			if (opcode == opcodes::ret)
+				out = all;
+			else if (e.control) {
+
+				int target = peephole_target(p, p.code[k].operands.at(1));
+
+				out |= target >= 0 ? live_in[target] : all;
+
+				if (e.delay_slot && next >= 0) {			// the delay slot runs the instruction after the masked word
+
+					int slot = peephole_next(p, next);
+
+					if (e.size == 2 && p.effects[next].size == 4)
+						out = all;			// the address word of an instruction would run as one
+					else if (e.size == 2)
+						out |= slot >= 0 ? live_in[slot] : all;
+				}
+			}
+
+			int in = e.flags_read | (out & ~e.flags);
+
+			if (out != p.live[k] || in != live_in[k]) {
+
+				p.live[k] = out;
+				live_in[k] = in;
+				changed = true;
+			}
+		}
+	}
+}
+
+
+bool peephole_removable(const peephole_program& p, int k) {
+
+	int previous = peephole_previous(p, k);
+	int next = peephole_next(p, k);
+
+	if (p.guarded[k] || (previous >= 0 && p.effects[previous].store_ports))			// behind a push sits a nop or an instruction reading through its ports
+		return false;
+
+	return next < 0 || previous < 0 || !misreads(p.effects[previous], p.effects[next]);
+}
+
+
+int peephole_follower(const peephole_program& p, int k) {
+
+	int next = peephole_next(p, k);
+
+	if (next < 0 || p.removed[k] || p.guarded[k] || p.guarded[next] || p.leader[next] || p.effects[k].control || p.region[next] != p.region[k])
+		return -1;
+
+	return next;
+}
+
+
+string_view assembly::peephole_constant(int value) {
+
+	peephole_constants.push_back(to_string(value));
+
+	return peephole_constants.back();
+}
+
+
+void peephole_remove(peephole_program& p, int k) {
+
+	int next = peephole_next(p, k);
+
+	p.removed[k] = true;
+
+	if (p.leader[k] && next >= 0 && p.region[next] == p.region[k])
+		p.leader[next] = true;
+}
+
+
+bool assembly::remove_nop(peephole_program& p, int k) {
+
+	if (string_to_opcode(p.code[k].operands.at(0)) != opcodes::nop || !peephole_removable(p, k))
+		return false;
+
+	/* A label on it would move onto a branch back to itself, which halts instead of looping */
+	int next = peephole_next(p, k);
+
+	if (p.leader[k] && next >= 0 && p.effects[next].control)
+		return false;
+
+	peephole_remove(p, k);
+
+	return true;
+}
+
+
+bool assembly::fold_immediate(peephole_program& p, int k) {
+
+	int next = peephole_follower(p, k);
+
+	if (next < 0 || string_to_opcode(p.code[k].operands.at(0)) != opcodes::mvi || !peephole_removable(p, next))
+		return false;
+
+	const instruction_effects& e = p.effects[next];
+	int opcode = string_to_opcode(p.code[next].operands.at(0));
+
+	if (get_instruction_type(opcode) != IMMEDIATE || e.rd != p.effects[k].rd)
+		return false;
+
+	int a = string_to_imm(p.code[k].operands.at(2)) & 0xff;			// mvi zero extends
+	int b = (signed char) string_to_imm(p.code[next].operands.at(2));			// the others sign extend
+	int value;
+
+	switch (opcode) {
+
+		case opcodes::mvi:
+			value = b & 0xff;
+			break;
+		case opcodes::addi:
+			value = a + b;
+			break;
+		case opcodes::subi:
+			value = a - b;
+			break;
+		case opcodes::andi:
+			value = a & b;
+			break;
+		case opcodes::ori:
+			value = a | b;
+			break;
+		default:
+			return false;
+	}
+
+	/* mvi only makes 0-255 and sets NZ alone, so the carry and overflow of addi and subi must not be read */
+	if (value < 0 || value > 0xff || (e.flags & FLAGS_CV & p.live[next]))
+		return false;
+
+	p.code[k].operands.at(2) = peephole_constant(value);
+	peephole_remove(p, next);
+
+	return true;
+}
+
+
+bool assembly::remove_byte_move(peephole_program& p, int k) {
+
+	int next = peephole_follower(p, k);
+
+	if (next < 0 || string_to_opcode(p.code[next].operands.at(0)) != opcodes::mvr || p.effects[next].rd != p.effects[next].rs
+		|| p.effects[k].rd != p.effects[next].rd || !(p.effects[k].writes & (1 << p.effects[k].rd)) || !peephole_removable(p, next))
+		return false;
+
+	/* mvr keeps the low byte and sets NZ; it is a no-op only on a register already holding a byte, whose NZ are already set from it */
+	switch (string_to_opcode(p.code[k].operands.at(0))) {
+
+		case opcodes::mvi:
+		case opcodes::mvr:
+			break;
+		case opcodes::andi:
+			if ((string_to_imm(p.code[k].operands.at(2)) & 0xff) > 0x7f)
+				return false;
+			break;
+		case opcodes::ldrb:
+			if (p.live[next] & FLAGS_NZ)
+				return false;
+			break;
+		default:
+			return false;
+	}
+
+	peephole_remove(p, next);
+
+	return true;
+}
+
+
+bool assembly::remove_compare(peephole_program& p, int k) {
+
+	int next = peephole_follower(p, k);
+
+	if (next < 0 || string_to_opcode(p.code[next].operands.at(0)) != opcodes::cmpi || string_to_imm(p.code[next].operands.at(2)) & 0xff
+		|| !peephole_removable(p, next))
+		return false;
+
+	/* NZ are already those of the register; cmpi would also set C and clear V */
+	if (!(p.effects[k].flags & FLAGS_NZ) || !(p.effects[k].writes & (1 << p.effects[next].rd)) || (p.live[next] & FLAGS_CV))
+		return false;
+
+	peephole_remove(p, next);
+
+	return true;
+}
+
+
+bool assembly::thread_jump(peephole_program& p, int k) {
+
+	const instruction_effects& e = p.effects[k];
+	int opcode = string_to_opcode(p.code[k].operands.at(0));
+
+	if (!e.control || opcode == opcodes::ret || p.guarded[k])
+		return false;
+
+	string_view label = p.code[k].operands.at(1);
+
+	/* Follow the branches whose delay slot runs a nop, up to one jumping to itself; a chain running in a circle stays as it is */
+	vector <int> visited;
+
+	for (int hops = 0; hops < PEEPHOLE_HOPS; hops++) {
+
+		int target = peephole_target(p, label);
+
+		if (target < 0 || target == k)
+			break;
+		if (find(visited.begin(), visited.end(), target) != visited.end())
+			return false;
+
+		const instruction_effects& t = p.effects[target];
+		int to = string_to_opcode(p.code[target].operands.at(0));
+		int slot = peephole_next(p, target);
+
+		if (t.delay_slot && t.size == 2 && slot >= 0 && p.effects[slot].size == 2)
+			slot = peephole_next(p, slot);
+
+		bool unconditional = t.delay_slot && slot >= 0 && string_to_opcode(p.code[slot].operands.at(0)) == opcodes::nop;
+		bool same = to == opcode && opcode >= opcodes::bne && opcode <= opcodes::bvc;			// taken again, the flags did not change
+
+		if ((!unconditional && !same) || label_equal()(p.code[target].operands.at(1), label))
+			break;
+
+		visited.push_back(target);
+		label = p.code[target].operands.at(1);
+	}
+
+	if (label_equal()(label, p.code[k].operands.at(1)))
+		return false;
+
+	p.code[k].operands.at(1) = label;
+
+	return true;
+}
+
+
+bool assembly::remove_push_pop(peephole_program& p, int k) {
+
+	int next = peephole_follower(p, k);
+
+	if (next < 0 || string_to_opcode(p.code[k].operands.at(0)) != opcodes::push || string_to_opcode(p.code[next].operands.at(0)) != opcodes::pop
+		|| p.effects[k].rd != p.effects[next].rd || p.guarded[k])
+		return false;
+
+	/* The pop reads nothing through the push's ports; what follows the pop must not end up behind another push */
+	int previous = peephole_previous(p, k);
+	int after = peephole_next(p, next);
+
+	if (previous >= 0 && after >= 0 && misreads(p.effects[previous], p.effects[after]))
+		return false;
+
+	peephole_remove(p, k);
+	peephole_remove(p, next);
+
+	return true;
+}
+
+
+int assembly::optimize_program() {
+
+	/* Split the tokens back into instructions as schedule_program does, the #org padding left out */
+	peephole_program p;
+	int pc = 0;
+
+	for (auto token = tokens.begin(); token != tokens.end(); ) {
+
+		int n = token_count(get_instruction_type(string_to_opcode(*token)));
+		scheduled_instruction ins = {vector <string_view> (token, token + n), -1};
+		instruction_effects e = get_effects(ins.operands);
+
+		token += n;
+
+		if (p.code.size() < line_addresses.size() && line_addresses.at(p.code.size()) == pc) {
+
+			ins.source = p.code.size();
+			p.code.push_back(ins);
+			p.effects.push_back(e);
+			p.region.push_back(region_of(pc));
+		}
+
+		pc += e.size;
+	}
+
+	int count = p.code.size();
+
+	p.removed.assign(count, false);
+	p.label_instruction.assign(label_names.size(), -1);
+
+	for (size_t i = 0; i != label_names.size(); i++) {
+
+		int k = label_positions.at(i);
+
+		if (k < count && line_addresses.at(k) == label_addresses.at(i))
+			p.label_instruction[i] = k;
+	}
+
+	/* Every rule over the whole program, again until none applies; the analysis is redone in between, a rule only ever makes it more conservative */
+	vector <int> hits(size(peephole_rules), 0);
+
+	for (bool changed = true; changed; ) {
+
+		changed = false;
+		peephole_analyze(p);
+
+		for (size_t r = 0; r != hits.size(); r++) {
+
+			for (int k = 0; k < count; k++) {
+
+				if (!p.removed[k] && (this->*peephole_rules[r].apply)(p, k)) {
+
+					hits[r]++;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	/* Write the rest back, every region from its #org, padding the gaps with nop as parse_directive does */
+	vector <int> new_addresses(count, 0), new_lines(count, 0);
+	vector <int> new_ends(region_addresses.size()), end_lines(region_addresses.size());
+	vector <int> numbers;
+	vector <string_view> sources;
+	int next = 0, saved = 0, removed = 0;
+
+	tokens.clear();
+	line_addresses.clear();
+
+	for (int r = 0, k = 0; r != (int) region_addresses.size(); r++) {
+
+		for (int gap = (region_addresses.at(r) - next) / 2; gap > 0; gap--)
+			tokens.push_back("nop");
+
+		pc = region_addresses.at(r);
+
+		for (; k < count && p.region[k] == r; k++) {
+
+			if (p.removed[k]) {
+
+				saved += p.effects[k].size;
+				removed++;
+				continue;
+			}
+
+			new_addresses[k] = pc;
+			new_lines[k] = line_addresses.size();
+
+			tokens.insert(tokens.end(), p.code[k].operands.begin(), p.code[k].operands.end());
+			line_addresses.push_back(pc);
+			numbers.push_back(line_numbers.at(k));
+			sources.push_back(line_sources.at(k));
+
+			pc += p.effects[k].size;
+		}
+
+		next = new_ends[r] = region_ends.at(r) = pc;
+		end_lines[r] = line_addresses.size();
+	}
+
+	for (size_t i = 0; i != label_names.size(); i++) {
+
+		int k = peephole_label(p, i);
+
+		label_addresses.at(i) = k >= 0 ? new_addresses[k] : new_ends[label_regions.at(i)];
+		label_positions.at(i) = k >= 0 ? new_lines[k] : end_lines[label_regions.at(i)];
+	}
+
+	line_numbers = numbers;
+	line_sources = sources;
+
+	for (size_t r = 0; r != hits.size(); r++)
+		*diagnostics << hits[r] << " " << peephole_rules[r].name << endl;
+
+	*diagnostics << "peephole: " << removed << " instructions removed, " << saved << " bytes saved" << endl;
+
+	return SUCCESS;
+}
+
+
+int assembly::read_branch_profile(string_view profile) {
+
+	istringstream rows{string(profile)};
+	string row;
+
+	branch_counts_by_line.clear();
+	branch_counts_by_address.clear();
+	branch_counts.clear();
+
+	while (getline(rows, row)) {
+
+		istringstream fields(row);
+		string address;
+		int line;
+		unsigned long long taken, not_taken;
+
+		if (row.empty() || row[0] == '#')
+			continue;
+
+		if (!(fields >> address >> line >> taken >> not_taken) || !is_valid_immediate(address, 16)) {
+
+			*diagnostics << "\nError... Not a branch profile: " << row << endl;
+			return FAIL;
+		}
+
+		if (line > 0)
+			branch_counts_by_line[line] = {taken, not_taken};
+		else
+			branch_counts_by_address[string_to_imm(address)] = {taken, not_taken};
+	}
+
+	return SUCCESS;
+}
+
+
+int inverse_branch(int opcode) {
+
+	switch (opcode) {
+
+		case opcodes::beq: return opcodes::bne;
+		case opcodes::bne: return opcodes::beq;
+		case opcodes::bhs: return opcodes::blo;
+		case opcodes::blo: return opcodes::bhs;
+		case opcodes::bvs: return opcodes::bvc;
+		case opcodes::bvc: return opcodes::bvs;
+	}
+
+	return -1;			// bge and blt are both taken on Z with N != V (a sum wrapping to 0), neither is the other's inverse
+}
+
+
+string_view assembly::layout_label(vector <int>& label_instruction, vector <int>& label_region, vector <string_view>& label_keys, int instruction, int region) {
+
+	for (size_t i = 0; i != label_instruction.size(); i++)
+		if (label_instruction[i] == instruction && (instruction >= 0 || label_region[i] == region))
+			return label_keys[i];
+
+	/* None there yet: one named after the source line, the space keeps it apart from source labels */
+	layout_labels.push_back(LAYOUT_LABEL + (instruction >= 0 ? to_string(line_numbers.at(instruction)) : "end " + to_string(region)));
+
+	label_index.emplace(layout_labels.back(), label_names.size());
+	label_names.push_back(layout_labels.back());
+	label_addresses.push_back(0);
+	label_positions.push_back(0);
+	label_regions.push_back(region);
+	label_instruction.push_back(instruction);
+	label_region.push_back(region);
+	label_keys.push_back(layout_labels.back());
+
+	return layout_labels.back();
+}
+
+
+int assembly::layout_program() {
+
+	/* Split the tokens back into instructions as schedule_program does, the #org padding left out */
+	vector <scheduled_instruction> program;
+	vector <instruction_effects> effects;
+	int pc = 0;
+
+	for (auto token = tokens.begin(); token != tokens.end(); ) {
+
+		int n = token_count(get_instruction_type(string_to_opcode(*token)));
+		scheduled_instruction ins = {vector <string_view> (token, token + n), -1};
+		instruction_effects e = get_effects(ins.operands);
+
+		token += n;
+
+		if (program.size() < line_addresses.size() && line_addresses.at(program.size()) == pc) {
+
+			ins.source = program.size();
+			program.push_back(ins);
+			effects.push_back(e);
+		}
+
+		pc += e.size;
+	}
+
+	/* Labels stay in front of their instruction, or at the end of their region when nothing follows them there */
+	vector <int> label_instruction(label_names.size(), -1);
+	vector <int> label_region(label_regions);
+	vector <string_view> label_keys(label_names.size());
+	vector <bool> leader(program.size(), false);
+
+	for (size_t i = 0; i != label_names.size(); i++) {
+
+		int k = label_positions.at(i);
+
+		if (k < (int) program.size() && line_addresses.at(k) == label_addresses.at(i)) {
+
+			label_instruction[i] = k;
+			leader[k] = true;
+		}
+	}
+
+	for (const auto& label : label_index)			// the names as written, which stay mapped
+		label_keys[label.second] = label.first;
+
+	vector <scheduled_instruction> out;
+	vector <int> out_addresses;
+	vector <int> new_addresses(program.size(), 0);
+	vector <int> new_ends(region_addresses.size());
+	vector <int> block_of(program.size(), -1);
+
+	unsigned long long flushes_before = 0, flushes_after = 0, jumps_run = 0;
+	int inverted = 0, jumps = 0, profiled = 0;
+	int k = 0;
+
+	for (int r = 0; r != (int) region_addresses.size(); r++) {
+
+		/* Basic blocks: split before a label and after a control flow instruction, the words a bra or jmp runs or masks behind it included */
+		vector <layout_block> blocks;
+		bool split = true;
+		int window = 0;			// bytes still in the delay slot of the last bra or jmp
+
+		for (; k < (int) program.size() && line_addresses.at(k) < region_ends.at(r); k++) {
+
+			if (window <= 0 && (split || leader[k]))
+				blocks.push_back({k, k, -1, -1, -1, 0, 0, -1, -1});
+
+			blocks.back().end = k + 1;
+			block_of[k] = blocks.size() - 1;
+			split = false;
+
+			if (window > 0) {
+
+				window -= effects[k].size;
+				split = window <= 0;
+			} else if (effects[k].delay_slot)
+				window = effects[k].size == 2 ? 4 : 2;
+			else
+				split = effects[k].control;
+		}
+
+		/* Where each block goes next: a conditional branch both ways, call and plain code fall through, bra, jmp and ret never do */
+		for (int b = 0; b != (int) blocks.size(); b++) {
+
+			layout_block& block = blocks[b];
+			int last = block.first;
+
+			while (last + 1 < block.end && !effects[last].control)			// a bra or jmp ends its block with its delay slot
+				last++;
+
+			int opcode = string_to_opcode(program[last].operands.at(0));
+			int fall = b + 1 < (int) blocks.size() ? b + 1 : LAYOUT_END;
+
+			if (!effects[last].control || opcode == opcodes::call)
+				block.fall = fall;
+			else if (opcode >= opcodes::bne && opcode <= opcodes::bvc) {
+
+				auto label = label_index.find(program[last].operands.at(1));
+				int target = label != label_index.end() ? label_instruction[label->second] : -1;
+
+				block.branch = last;
+				block.fall = fall;
+
+				if (target >= 0 && region_of(line_addresses.at(target)) == r && blocks[block_of[target]].first == target)
+					block.taken = block_of[target];
+
+				/*
+				 * Taken and not taken counts, by source line or by address, found the first time round while the addresses are
+				 * still those of the profiled program; a branch grown since keeps them. One that could not reach its label then
+				 * ran in its long form, whose branch at that address is the inverse, so it goes without
+				 */
+				auto found = branch_counts.find(program[last].operands.at(0).data());
+
+				if (found == branch_counts.end()) {
+
+					auto by_line = branch_counts_by_line.find(line_numbers.at(last));
+					auto by_address = branch_counts_by_address.find(line_addresses.at(last));
+					const pair <unsigned long long, unsigned long long> * counts = by_line != branch_counts_by_line.end() ? &by_line->second
+						: by_address != branch_counts_by_address.end() ? &by_address->second : nullptr;
+
+					if (label != label_index.end() && label_regions.at(label->second) == r && !reaches(line_addresses.at(last), label_addresses.at(label->second)))
+						counts = nullptr;
+
+					found = branch_counts.emplace(program[last].operands.at(0).data(), counts).first;
+				}
+
+				if (const pair <unsigned long long, unsigned long long> * counts = found->second) {
+
+					block.taken_count = counts->first;
+					block.fall_count = counts->second;
+					profiled++;
+				}
 			}
+		}
+
+		/* Chains, greedily from the most followed edge: code that has to fall through first, then the heavier side of each branch */
+		struct layout_edge { unsigned long long weight; bool fall; int from, to; };
+		vector <layout_edge> edges;
+
+		for (int b = 0; b != (int) blocks.size(); b++) {
+
+			const layout_block& block = blocks[b];
+
+			if (block.fall >= 0)
+				edges.push_back({block.branch < 0 ? ~0ULL : block.fall_count, true, b, block.fall});
+
+			if (block.taken >= 0 && block.taken_count > 0 && inverse_branch(string_to_opcode(program[block.branch].operands.at(0))) >= 0)
+				edges.push_back({block.taken_count, false, b, block.taken});
+		}
+
+		stable_sort(edges.begin(), edges.end(), [](const layout_edge& a, const layout_edge& b) {
+			return a.weight != b.weight ? a.weight > b.weight : a.fall > b.fall;
+		});
+
+		for (const layout_edge& edge : edges) {
+
+			int head = edge.from;
 
-			bin << (__int8) offset;			// write relative displacement byte to file
+			while (blocks[head].previous >= 0)
+				head = blocks[head].previous;
 
+			/* The first block of the region stays first, it is where the code comes in */
+			if (blocks[edge.from].next >= 0 || blocks[edge.to].previous >= 0 || edge.to == 0 || head == edge.to)
+				continue;
+
+			blocks[edge.from].next = edge.to;
+			blocks[edge.to].previous = edge.from;
 		}
-		else if (instruction_type == REGISTER) {
 
-			pc += 2;
+		/* The chain holding the first block first, the others in the order their first block had */
+		vector <int> order;
+
+		for (int b = 0; b != (int) blocks.size(); b++)
+			if (blocks[b].previous < 0)
+				for (int c = b; c >= 0; c = blocks[c].next)
+					order.push_back(c);
 
-			__int8 r_dest = string_to_register(*(token_num++));			// first register
-			__int8 r_src = string_to_register(*(token_num++));				// second register
+		/* Place them, inverting a branch whose taken side now follows it and adding a jmp where the side that falls through does not */
+		pc = region_addresses.at(r);
 
-			bin << (__int8) (high_byte | r_dest);			// write first byte of opcode to file
-			bin << r_src;			// write source operand to next byte in memory
+		if (r > 0 && pc < new_ends.at(r - 1)) {
+
+			*diagnostics << "\nLine " << region_lines.at(r) << ": Error... Laid out code runs into #org" << endl;
+			return FAIL;
 		}
-		else if (instruction_type == RAM) {
 
-			pc += 4;
+		for (int i = 0; i != (int) order.size(); i++) {
 
-			__int8 r_ds = string_to_register(*(token_num++));			// register to load memory into
+			const layout_block& block = blocks[order[i]];
+			int next = i + 1 < (int) order.size() ? order[i + 1] : LAYOUT_END;
+			bool jump = block.fall != -1 && block.fall != next;
 
-			bin << (__int8) (high_byte | r_ds);
-			bin << (__int8) 0;
+			for (int j = block.first; j < block.end; j++) {
 
-			string addr = *(token_num++);
+				scheduled_instruction ins = program[j];
+				bool flipped = j == block.branch && jump && block.taken == next && inverse_branch(string_to_opcode(ins.operands.at(0))) >= 0;
 
-			if (is_valid_immediate(addr, 16)) {			// if immediate address...
+				if (flipped) {
 
-				int immediate = string_to_imm(addr);		// get immediate from file
+					const char * mnemonic = ins.operands.at(0).data();
+					auto inverse = inverted_branches.emplace(mnemonic, opcode_names[inverse_branch(string_to_opcode(ins.operands.at(0)))]).first;
 
-				if (opcode == opcodes::str || opcode == opcodes::ldr) {
+					ins.operands.at(0) = inverse->second;			// the same string each time, a branch grown after the layout stays grown
+					ins.operands.at(1) = layout_label(label_instruction, label_region, label_keys, block.fall >= 0 ? blocks[block.fall].first : -1, r);
+					jump = false;
+					inverted++;
+				}
 
-					if (immediate % 2 == 1)	{		// don't allow misaligned writes or reads when using str and ldr
+				if (j == block.branch) {
 
-						cout << "\nError... Misaligned writes and reads not allowed" << endl;
-						return FAIL;
-					}
+					flushes_before += block.taken_count;
+					flushes_after += flipped ? block.fall_count : block.taken_count;
 				}
-				
 
-				bin << (__int8) (immediate >> 8);			// high byte of address
-				bin << (__int8) immediate;				// low byte of address
-			} 
-			
+				new_addresses[j] = pc;
+				out.push_back(ins);
+				out_addresses.push_back(pc);
+				pc += flipped ? encoded_size(string_to_opcode(ins.operands.at(0)), ins.operands.at(0).data()) : effects[j].size;			// the inverse may be the one grown
+			}
+
+			if (jump) {
+
+				string_view label = layout_label(label_instruction, label_region, label_keys, block.fall >= 0 ? blocks[block.fall].first : -1, r);
+
+				out.push_back({{"jmp", label}, -1});
+				out_addresses.push_back(pc);
+				out.push_back({{"nop"}, -1});			// delay slot
+				out_addresses.push_back(pc + 4);
+				pc += 6;
+
+				jumps++;
+				jumps_run += block.fall_count;
+			}
+		}
+
+		if (pc > 0x10000) {
+
+			*diagnostics << "\nError... Laid out code does not fit in program memory" << endl;
+			return FAIL;
 		}
-		else if (instruction_type == STACK) {
 
+		new_ends[r] = pc;
+	}
+
+	/* Write everything back in address order, padding the #org gaps with nop as parse_directive does */
+	vector <int> numbers;
+	vector <string_view> sources;
+	vector <int> new_lines(program.size(), 0), end_lines(region_addresses.size());
+	int next = 0;
 
-			pc += 2;
+	tokens.clear();
+	line_addresses.clear();
 
-			__int8 r_ds = string_to_register(*(token_num++));		// register to push/pop memory into/out
+	for (size_t r = 0, i = 0; r != region_addresses.size(); r++) {
 
-			bin << (__int8) (high_byte | r_ds);
-			bin << (__int8) 0;
+		for (int gap = (region_addresses.at(r) - next) / 2; gap > 0; gap--)
+			tokens.push_back("nop");
+
+		for (; i < out.size() && out_addresses[i] < new_ends[r]; i++) {
+
+			tokens.insert(tokens.end(), out[i].operands.begin(), out[i].operands.end());
+
+			if (out[i].source >= 0) {
+
+				new_lines[out[i].source] = line_addresses.size();
+				line_addresses.push_back(out_addresses[i]);
+				numbers.push_back(line_numbers.at(out[i].source));
+				sources.push_back(line_sources.at(out[i].source));
+			}
 		}
-		else if (instruction_type == CALL) {
 
-			pc += 4;
+		next = new_ends[r];
+		region_ends.at(r) = new_ends[r];
+		end_lines[r] = line_addresses.size();
+	}
 
-			bin << (__int8) high_byte;
-			bin << (__int8) 0;
+	line_numbers = numbers;
+	line_sources = sources;
 
-			int label_address = get_label_address(*(token_num++));		// get address of label
+	for (size_t i = 0; i != label_names.size(); i++) {
 
-			if (label_address == -1) {
+		int k = label_instruction[i];
 
-				cout << "\nLine []: Error... Invalid reference to label [" << line << "]" << endl;
-				return FAIL;
+		label_addresses.at(i) = k >= 0 ? new_addresses[k] : new_ends[label_region[i]];
+		label_positions.at(i) = k >= 0 ? new_lines[k] : end_lines[label_region[i]];
+	}
+
+	*diagnostics << profiled << " branches profiled: " << inverted << " inverted, " << jumps << " jumps added; taken branches (a flush each) "
+		<< flushes_before << " -> " << flushes_after << ", " << jumps_run << " added jumps run" << endl;
+
+	return SUCCESS;
+}
+
+
+int assembly::inline_program() {
+
+	/* Split the tokens back into instructions as schedule_program does, the #org padding left out */
+	vector <scheduled_instruction> program;
+	vector <instruction_effects> effects;
+	int pc = 0;
+
+	for (auto token = tokens.begin(); token != tokens.end(); ) {
+
+		int n = token_count(get_instruction_type(string_to_opcode(*token)));
+		scheduled_instruction ins = {vector <string_view> (token, token + n), -1};
+		instruction_effects e = get_effects(ins.operands);
+
+		token += n;
+
+		if (program.size() < line_addresses.size() && line_addresses.at(program.size()) == pc) {
+
+			ins.source = program.size();
+			program.push_back(ins);
+			effects.push_back(e);
+		}
+
+		pc += e.size;
+	}
+
+	/* Labels stay in front of their instruction, or at the end of their region when nothing follows them there */
+	vector <int> label_instruction(label_names.size(), -1);
+	vector <vector <int>> labels_of(program.size());
+	vector <string_view> label_keys(label_names.size());
+
+	for (size_t i = 0; i != label_names.size(); i++) {
+
+		int k = label_positions.at(i);
+
+		if (k < (int) program.size() && line_addresses.at(k) == label_addresses.at(i)) {
+
+			label_instruction[i] = k;
+			labels_of[k].push_back(i);
+		}
+	}
+
+	for (const auto& label : label_index)			// the names as written, which stay mapped
+		label_keys[label.second] = label.first;
+
+	/* The words a bra or jmp masks and runs behind it are taken by position, nothing there grows */
+	vector <bool> guarded(program.size(), false);
+	int window = 0;
+
+	for (int k = 0; k != (int) program.size(); k++) {
+
+		if (k > 0 && region_of(line_addresses.at(k)) != region_of(line_addresses.at(k - 1)))
+			window = 0;
+
+		if (window > 0) {
+
+			guarded[k] = true;
+			window -= effects[k].size;
+		} else if (effects[k].delay_slot)
+			window = effects[k].size == 2 ? 4 : 2;
+	}
+
+	/*
+	 * Leaf functions: a called label, then straight to its only ret without a call, branches that stay inside, pushes and pops
+	 * that never reach below the return address and balance out, no ldr or str into the stack, and a body within the budget
+	 */
+	vector <int> function_end(program.size(), -2);			// per entry, its ret; -1 if it cannot be inlined, -2 not looked at yet
+	vector <int> function_bytes(program.size(), 0);			// its body, ret left out
+
+	for (int k = 0; k != (int) program.size(); k++) {
+
+		if (string_to_opcode(program[k].operands.at(0)) != opcodes::call)
+			continue;
+
+		auto label = label_index.find(program[k].operands.at(1));
+		int f = label != label_index.end() ? label_instruction[label->second] : -1;
+
+		if (f < 0 || function_end[f] != -2)
+			continue;
+
+		int depth = 0, size = 0, end = -1;
+		bool leaf = true;
+
+		for (int t = f; t < (int) program.size() && leaf && end < 0; t++) {
+
+			int opcode = string_to_opcode(program[t].operands.at(0));
+
+			if (t > f && region_of(line_addresses.at(t)) != region_of(line_addresses.at(f)))
+				leaf = false;
+			else if (opcode == opcodes::ret && guarded[t])			// masked or run by position, the body has no ret of its own
+				leaf = false;
+			else if (opcode == opcodes::ret)
+				end = t;
+			else if (opcode == opcodes::call || ((effects[t].load || effects[t].store) && !effects[t].stack && effects[t].first < STACK_TOP))
+				leaf = false;
+			else {
+
+				depth += opcode == opcodes::push ? 1 : opcode == opcodes::pop ? -1 : 0;
+				size += effects[t].size;
+				leaf = depth >= 0 && size <= INLINE_BYTES;
 			}
+		}
 
-			bin << (__int8) (label_address >> 8);		// write high byte of address
-			bin << (__int8) (label_address);		// write low byte of address
+		for (int t = f; t < end && leaf; t++) {
 
+			int type = get_instruction_type(string_to_opcode(program[t].operands.at(0)));
+
+			if (type != BRANCH && type != JUMP)
+				continue;
+
+			auto target = label_index.find(program[t].operands.at(1));
+			int to = target != label_index.end() ? label_instruction[target->second] : -1;
+
+			leaf = to >= f && to <= end;
 		}
-		else if (instruction_type == RET) {
 
-			bin << (__int8) high_byte;
-			bin << (__int8) 0;
+		function_end[f] = leaf && end >= 0 && depth == 0 ? end : -1;
+		function_bytes[f] = size;
+	}
+
+	/* Copy each body in place of the calls to it, its labels renamed for every copy */
+	vector <scheduled_instruction> out;
+	vector <int> out_addresses;
+	vector <int> label_out(label_names.size(), -1);			// instruction of out a label stands in front of
+	vector <int> label_region(label_regions);
+	vector <int> region_out_ends(region_addresses.size()), new_ends(region_addresses.size());
+	vector <int> calls_inlined(program.size(), 0);
+	vector <pair <int, string_view>> renamed;
+	int copies = 0, bytes_added = 0;
+	int k = 0;
+
+	for (int r = 0; r != (int) region_addresses.size(); r++) {
+
+		pc = region_addresses.at(r);
+
+		if (r > 0 && pc < new_ends.at(r - 1)) {
+
+			*diagnostics << "\nLine " << region_lines.at(r) << ": Error... Inlined code runs into #org" << endl;
+			return FAIL;
 		}
-		else if (instruction_type == JUMP) {
 
-			pc += 4;
+		for (; k < (int) program.size() && line_addresses.at(k) < region_ends.at(r); k++) {
 
-			bin << high_byte;		// write jump instruction
-			bin << (__int8) 0;			// write empty byte
+			for (int i : labels_of[k])
+				label_out[i] = out.size();
 
-			int label_address = get_label_address(*(token_num++));		// get absolute address of label
+			auto label = string_to_opcode(program[k].operands.at(0)) == opcodes::call ? label_index.find(program[k].operands.at(1)) : label_index.end();
+			int f = label != label_index.end() ? label_instruction[label->second] : -1;
 
-			if (label_address == -1) {			// if label not found...
+			/* Behind a push the first instruction of the body would read the push's registers, call does not */
+			bool inline_call = f >= 0 && function_end[f] >= 0 && !guarded[k] && !(k > 0 && effects[k - 1].store_ports && misreads(effects[k - 1], effects[f]));
 
-				cout << "\nLine []: Error... Invalid reference to label [" << line << "]" << endl;
-				return FAIL;
+			if (!inline_call) {
+
+				out.push_back(program[k]);
+				out_addresses.push_back(pc);
+				pc += effects[k].size;
+				continue;
 			}
 
-			bin << (__int8) (label_address >> 8);			// get upper byte of memory address
-			bin << (__int8) (label_address);		// get low byte of memory address
-			
+			renamed.clear();
+
+			for (int t = f; t <= function_end[f]; t++) {
+
+				for (int i : labels_of[t]) {
+
+					inline_labels.push_back(INLINE_LABEL + to_string(copies) + " " + label_names.at(i));
+
+					label_index.emplace(inline_labels.back(), label_names.size());
+					label_names.push_back(inline_labels.back());
+					label_addresses.push_back(0);
+					label_positions.push_back(0);
+					label_regions.push_back(r);
+					label_out.push_back(out.size() + t - f);			// the ret's labels end up behind the copy
+					label_region.push_back(r);
+					renamed.push_back({i, inline_labels.back()});
+				}
+			}
+
+			for (int t = f; t < function_end[f]; t++) {
+
+				scheduled_instruction ins = program[t];
+
+				if (effects[t].control) {
+
+					int i = label_index.find(ins.operands.at(1))->second;
+
+					for (const auto& name : renamed)
+						if (name.first == i)
+							ins.operands.at(1) = name.second;
+				}
+
+				out.push_back(ins);
+				out_addresses.push_back(pc);
+				pc += effects[t].size;
+				bytes_added += effects[t].size;
+			}
+
+			bytes_added -= effects[k].size;
+			calls_inlined[f]++;
+			copies++;
 		}
-		else {
 
-			cout << "\nHow did you even get here?" << endl;
+		if (pc > 0x10000) {
+
+			*diagnostics << "\nError... Inlined code does not fit in program memory" << endl;
 			return FAIL;
 		}
 
+		region_out_ends[r] = out.size();
+		new_ends[r] = pc;
 	}
-		
+
+	if (copies == 0) {
+
+		*diagnostics << "0 calls inlined" << endl;
+		return SUCCESS;
+	}
+
+	/* Write everything back in address order, padding the #org gaps with nop as parse_directive does */
+	vector <int> numbers;
+	vector <int> addresses;
+	vector <string_view> sources;
+	vector <int> new_lines(out.size() + 1, 0);
+	int next = 0;
+
+	tokens.clear();
+
+	for (int r = 0, i = 0; r != (int) region_addresses.size(); r++) {
+
+		for (int gap = (region_addresses.at(r) - next) / 2; gap > 0; gap--)
+			tokens.push_back("nop");
+
+		for (; i < region_out_ends[r]; i++) {
+
+			tokens.insert(tokens.end(), out[i].operands.begin(), out[i].operands.end());
+
+			new_lines[i] = addresses.size();			// every copy keeps the line of the instruction it was copied from
+			addresses.push_back(out_addresses[i]);
+			numbers.push_back(line_numbers.at(out[i].source));
+			sources.push_back(line_sources.at(out[i].source));
+		}
+
+		next = new_ends[r];
+		region_ends.at(r) = new_ends[r];
+	}
+
+	new_lines[out.size()] = addresses.size();
+
+	line_addresses = addresses;
+	line_numbers = numbers;
+	line_sources = sources;
+
+	for (size_t i = 0; i != label_names.size(); i++) {
+
+		int o = label_out[i];
+		int r = label_region[i];
+		bool at_end = o < 0 || o >= region_out_ends[r];			// nothing behind it in its region
+
+		label_addresses.at(i) = at_end ? new_ends[r] : out_addresses[o];
+		label_positions.at(i) = at_end ? new_lines[region_out_ends[r]] : new_lines[o];
+	}
+
+	for (int f = 0; f != (int) program.size(); f++)
+		if (calls_inlined[f])
+			*diagnostics << label_keys[labels_of[f].front()] << ": " << calls_inlined[f] << " calls inlined, " << function_bytes[f] << " bytes each" << endl;
+
+	*diagnostics << copies << " calls inlined, " << bytes_added << " bytes added; each one that runs saves " << instruction_cycles(opcodes::call) + instruction_cycles(opcodes::ret)
+		<< " cycles (call and ret) and the 2 bytes of stack its return address took" << endl;
 
 	return SUCCESS;
 }
+
+
+int assembly::write_symbol_file(ostream &sym) {
+
+	/* Instructions and regions are recorded in address order, so are labels in source order; the block layout and the inliner move them, so they are sorted here */
+	vector <int> labels;
+	vector <int> regions;			// regions holding at least one byte
+	unsigned int string_size = 0;
+
+	for (size_t i = 0; i != label_names.size(); i++)
+		if (label_names.at(i).find(' ') == string::npos)			// the labels the block layout and the inliner add have a space, they stay out
+			labels.push_back(i);
+
+	stable_sort(labels.begin(), labels.end(), [this](int a, int b) { return label_addresses.at(a) < label_addresses.at(b); });
+
+	for (int i : labels)
+		string_size += label_names.at(i).size() + 1;
+
+	for (size_t i = 0; i != line_sources.size(); i++)
+		string_size += line_sources.at(i).size() + 1;
+
+	for (size_t i = 0; i != region_addresses.size(); i++)
+		if (region_ends.at(i) > region_addresses.at(i))
+			regions.push_back(i);
+
+	int symbol_offset = 40;			// sizeof(symbols_header)
+	int line_offset = symbol_offset + 8 * labels.size();
+	int region_offset = line_offset + 12 * line_addresses.size();
+	int string_offset = region_offset + 12 * regions.size();
+
+	string tables;			// everything before the strings, written at once; the strings follow straight from the label names and the program file
+	unsigned int next_string = 0;
+
+	tables.reserve(string_offset);
+
+	write_little_endian(tables, SYMBOLS_MAGIC, 4);
+	write_little_endian(tables, SYMBOLS_VERSION, 4);
+	write_little_endian(tables, labels.size(), 4);
+	write_little_endian(tables, line_addresses.size(), 4);
+	write_little_endian(tables, regions.size(), 4);
+	write_little_endian(tables, symbol_offset, 4);
+	write_little_endian(tables, line_offset, 4);
+	write_little_endian(tables, region_offset, 4);
+	write_little_endian(tables, string_offset, 4);
+	write_little_endian(tables, string_size, 4);
+
+	for (int i : labels) {
+
+		write_little_endian(tables, label_addresses.at(i), 2);
+		write_little_endian(tables, 0, 2);
+		write_little_endian(tables, next_string, 4);
+		next_string += label_names.at(i).size() + 1;
+	}
+
+	for (size_t i = 0; i != line_addresses.size(); i++) {
+
+		write_little_endian(tables, line_addresses.at(i), 2);
+		write_little_endian(tables, 0, 2);
+		write_little_endian(tables, line_numbers.at(i), 4);
+		write_little_endian(tables, next_string, 4);
+		next_string += line_sources.at(i).size() + 1;
+	}
+
+	for (int i : regions) {
+
+		write_little_endian(tables, region_addresses.at(i), 2);
+		write_little_endian(tables, 0, 2);
+		write_little_endian(tables, region_ends.at(i) - region_addresses.at(i), 4);
+		write_little_endian(tables, region_lines.at(i), 4);
+	}
+
+	sym.write(tables.data(), tables.size());
+
+	for (int i : labels)
+		sym.write(label_names.at(i).c_str(), label_names.at(i).size() + 1);
+
+	for (size_t i = 0; i != line_sources.size(); i++) {
+
+		sym.write(line_sources.at(i).data(), line_sources.at(i).size());
+		sym.put('\0');
+	}
+
+	return sym.good() ? SUCCESS : FAIL;
+}
+
+
+void write_little_endian(string &buffer, unsigned int value, int bytes) {
+
+	for (int i = 0; i < bytes; i++)
+		buffer += (char) (value >> (8 * i));
+}
@@ -0,0 +1,48 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+#ifndef SUCCESS
+	#define SUCCESS				1
+	#define FAIL				-1
+#endif
+
+
+/*
+ * The assembler as a library. assemble() takes the program text and gives back the binary, its symbol file and what the
+ * command line tool would print, without touching a file. Everything one assembly works on is in its assembly (assembly.h),
+ * so assemblies on separate threads share nothing; the command line tool, the linker and the benchmark are built on it.
+ */
+
+
+/* Flags of the command line tool */
+struct assembler_options {
+
+	bool schedule;						// -s: reorder around pipeline hazards
+	bool inline_calls;					// -i: leaf functions copied in place of the calls
+	bool optimize;						// -O: peephole rules
+	bool verify;						// -v: also give back the binary the peephole rules and the inliner start from
+	bool layout;						// -p: lay the blocks out for branch_profile
+	std::string_view branch_profile;	// the rows simulator -e wrote
+	bool relocatable;					// -c: an object file for the linker instead of a program
+	int threads;						// -j: parse threads, 0 for every core
+};
+
+/* What assemble() gives back: the files the command line tool writes and what it prints */
+struct assembler_output {
+
+	int result;							// SUCCESS or FAIL
+	std::vector <unsigned char> code;	// machine_code.bin, or the object file of a relocatable module
+	std::string symbols;				// machine_code.sym, empty for a relocatable module
+	std::vector <unsigned char> unoptimized;		// machine_code_unoptimized.bin, with verify and optimize or inline_calls
+	std::string diagnostics;			// errors and the reports of the passes
+};
+
+/* Assembles the program text with options; source only has to outlive the call */
+assembler_output assemble(std::string_view source, const assembler_options& options);
+
+#endif
@@ -0,0 +1,224 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <iterator>
+
+#include "assembler.h"
+#include "assembly.h"
+
+using namespace std;
+
+
+/*
+ * Times the assembler on generated source files of 100k to 1M lines, to show that it scales linearly with the number of lines,
+ * then the parallel parse on every core, whose code has to match the serial one byte for byte, and last as many separate
+ * assemblies at once through assemble(), in memory, one per core.
+ * Build with the assembler itself:
+ *	g++ -O2 -DHBCP_NO_MAIN -o assembler_benchmark assembler_benchmark.cpp assembler.cpp -pthread
+ */
+
+
+#define SOURCE_FILE			"assembler_benchmark.txt"
+#define CODE_FILE			"assembler_benchmark.bin"
+#define BLOCK_LINES			8			// lines per label in the generated source
+#define CODE_LINES			20000		// lines of code at most, 50000 bytes: longer sources are padded with comment and blank lines
+#define REPEATS				3			// best of
+#define CONCURRENT_LINES	25000		// lines of each of the assemblies run at once
+
+
+/* Writes lines of source: up to CODE_LINES of code with a label every BLOCK_LINES lines, backward and forward branches, calls and jumps, comments, RAM accesses, and comment and blank lines spread between them for the rest */
+bool write_source(int lines, const char * file_name);
+/* Assembles file_name REPEATS times, with the parallel parse on threads or the serial one if threads is 0, and returns the best time in seconds, or a negative value if it does not assemble */
+double time_assembly(const char * file_name, int threads);
+/* Runs count assemblies of source at once, one thread each, and returns the time in seconds, or a negative value if one assembles other code than expected */
+double time_concurrent(string_view source, int count, const vector <unsigned char>& expected);
+
+
+static assembly program;
+
+
+int main() {
+
+	int sizes[] = {100000, 200000, 500000, 1000000};
+	int threads = max(1, (int) thread::hardware_concurrency());
+	double previous = 0;
+	int previous_lines = 0;
+
+	cout << "     lines     labels   code bytes        ms   ns/line   x time / x lines   ms on " << setw(3) << threads << " threads   speedup" << endl;
+
+	for (int lines : sizes) {
+
+		if (!write_source(lines, SOURCE_FILE)) {
+
+			cout << "Unable to write [" << SOURCE_FILE << "]" << endl;
+			return -1;
+		}
+
+		double seconds = time_assembly(SOURCE_FILE, 0);
+		vector <unsigned char> serial = program.code;
+		double parallel = time_assembly(SOURCE_FILE, threads);
+
+		if (seconds < 0 || parallel < 0) {
+
+			cout << "Generated source did not assemble" << endl;
+			return -1;
+		}
+
+		if (program.code != serial) {
+
+			cout << "Parallel parse assembled different code" << endl;
+			return -1;
+		}
+
+		cout << setw(10) << lines << " " << setw(10) << program.label_names.size() << " " << setw(12) << program.code.size() << " "
+			<< fixed << setprecision(1) << setw(9) << seconds * 1e3 << " " << setw(9) << seconds * 1e9 / lines << " ";
+
+		if (previous > 0)			// 1 when the time grows as the lines do
+			cout << setw(18) << setprecision(2) << seconds / previous * previous_lines / lines;
+		else
+			cout << setw(18) << "";
+
+		cout << " " << setw(21) << setprecision(1) << parallel * 1e3 << " " << setw(9) << setprecision(2) << seconds / parallel << endl;
+		previous = seconds;
+		previous_lines = lines;
+	}
+
+	/* Separate assemblies share nothing, so they scale with the cores as long as memory keeps up */
+	if (!write_source(CONCURRENT_LINES, SOURCE_FILE) || time_assembly(SOURCE_FILE, 0) < 0) {
+
+		cout << "Generated source did not assemble" << endl;
+		return -1;
+	}
+
+	ifstream file(SOURCE_FILE, ios::in | ios::binary);
+	string source((istreambuf_iterator <char> (file)), istreambuf_iterator <char> ());
+	double one = time_concurrent(source, 1, program.code);
+	double all = time_concurrent(source, threads, program.code);
+
+	if (one < 0 || all < 0) {
+
+		cout << "assemble() on separate threads assembled different code" << endl;
+		return -1;
+	}
+
+	cout << endl << threads << " assemblies of " << CONCURRENT_LINES << " lines at once through assemble(): " << fixed << setprecision(1) << all * 1e3
+		<< " ms, one alone " << one * 1e3 << " ms, throughput x" << setprecision(2) << one * threads / all << endl;
+
+	remove(SOURCE_FILE);
+	remove(CODE_FILE);
+
+	return 0;
+}
+
+
+bool write_source(int lines, const char * file_name) {
+
+	ofstream source(file_name, ios::out | ios::trunc);
+
+	if (!source.is_open())
+		return false;
+
+	/* 20 bytes of code every BLOCK_LINES lines, so CODE_LINES fill most of the 64 KB of program memory; after code line i the padding brings the total to lines * (i + 1) / code */
+	int code = min(lines, CODE_LINES);
+	long long written = 0;
+
+	for (int line = 0, block = 0; line < code; block++) {
+
+		const string body[BLOCK_LINES] = {
+			".l" + to_string(block),
+			"\tmvi r1, " + to_string(block & 0xff) + "\t\t; comment",
+			"\taddr r1, r2",
+			"\tldr r3, 0x0040",
+			block > 0 ? "\tbne l" + to_string(block - 1) : "\tnop",			// backward, resolved on the spot
+			"\tbeq l" + to_string(block + 1),							// forward, backpatched
+			block % 2 ? "\tcall l" + to_string(block + 2) : "\tjmp l" + to_string(block + 2),
+			"\tstrb r3, 0x0043"
+		};
+
+		for (int i = 0; i < BLOCK_LINES && line < code; i++, line++) {
+
+			source << body[i] << '\n';
+
+			for (written++; written < (long long) lines * (line + 1) / code; written++)
+				source << (written % 2 ? "\t\t; padding comment, the parser skips it\n" : "\n");
+		}
+	}
+
+	/* Targets of the last forward references */
+	int last = (code - 1) / BLOCK_LINES;
+
+	source << ".l" << last + 1 << "\n.l" << last + 2 << "\n\tnop\n";
+
+	return source.good();
+}
+
+
+double time_assembly(const char * file_name, int threads) {
+
+	double best = -1;
+
+	for (int i = 0; i < REPEATS; i++) {
+
+		source_file prog;
+		ofstream bin(CODE_FILE, ios::out | ios::trunc | ios::binary);
+
+		auto start = chrono::steady_clock::now();
+
+		if (open_source_file(prog, file_name) == -1)
+			return -1;
+
+		int parsed = threads > 0 ? program.parse_file_parallel(prog, threads) : program.parse_file(prog);
+		bool assembled = parsed != -1 && program.write_code_file(bin) != -1;
+
+		close_source_file(prog);
+		bin.close();
+
+		if (!assembled)
+			return -1;
+
+		double seconds = chrono::duration <double> (chrono::steady_clock::now() - start).count();
+
+		if (best < 0 || seconds < best)
+			best = seconds;
+	}
+
+	return best;
+}
+
+
+double time_concurrent(string_view source, int count, const vector <unsigned char>& expected) {
+
+	vector <thread> pool;
+	vector <char> matches(count, false);			// one byte each, the threads write them at once
+	assembler_options options = {};
+
+	options.threads = 1;
+
+	auto start = chrono::steady_clock::now();
+
+	for (int i = 0; i < count; i++) {
+
+		pool.emplace_back([&, i]() {
+
+			assembler_output output = assemble(source, options);
+
+			matches[i] = output.result == SUCCESS && output.code == expected;
+		});
+	}
+
+	for (thread& t : pool)
+		t.join();
+
+	double seconds = chrono::duration <double> (chrono::steady_clock::now() - start).count();
+
+	for (int i = 0; i < count; i++)
+		if (!matches[i])
+			return -1;
+
+	return seconds;
+}
@@ -0,0 +1,250 @@
+#ifndef ASSEMBLY_H
+#define ASSEMBLY_H
+
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+
+#ifndef SUCCESS
+	#define SUCCESS				1
+	#define FAIL				-1
+#endif
+
+
+/*
+ * Inside the assembler: the tables of one program and the passes over them. Only what is built with assembler.cpp and
+ * needs more than assemble() includes it, the linker for the code and symbol file writers and assembler_benchmark to time
+ * the parse alone.
+ */
+
+
+/* Program file, mapped read only where the host has mmap */
+struct source_file {
+
+	const char * data;
+	size_t size;
+	bool mapped;
+};
+
+/* Hash and equality for label names as written, ignoring case */
+struct label_hash {
+
+	size_t operator()(std::string_view name) const;
+};
+
+struct label_equal {
+
+	bool operator()(std::string_view a, std::string_view b) const;
+};
+
+/* Instruction referring to a label defined further down, patched once the whole file is parsed */
+struct label_fixup {
+
+	int pc;						// address of the instruction
+	int line;
+	std::string_view label;
+	const char * branch;		// mnemonic of a short branch, which grows if it cannot reach the label; nullptr otherwise
+	bool delay_word = false;	// the jmp of a grown bra, whose delay slot gets the word the short bra ran
+};
+
+/* Label or #org found while measuring a chunk */
+struct chunk_event {
+
+	bool label;					// label (text without the '.') or directive (the whole line)
+	std::string_view text;
+	int line;					// lines into the chunk
+	int pc;						// bytes of code in the chunk before it, or its address once an #org came before it
+	bool absolute;
+	int instructions;			// instructions in the chunk before it
+};
+
+/* Whole lines of the program file one thread of the parallel parse works on */
+struct source_chunk {
+
+	size_t begin, end;
+
+	/* Measured */
+	int lines;
+	int instructions;			// up to the first line measuring could not size
+	int pc;						// like chunk_event, after the last line measured
+	bool absolute;
+	std::vector <chunk_event> events;
+
+	/* Merged */
+	int first_line;				// lines before the chunk, -1 until merged
+	int first_instruction;
+	int base;					// address the chunk starts at
+
+	/* Encoded */
+	int error_line;				// first error, 0 if none
+	std::ostringstream errors;
+	std::vector <label_fixup> fixups;
+};
+
+/* What an instruction reads and writes, taken from its control words in op_ctrl */
+struct instruction_effects {
+
+	int rd, rs;					// registers the high and low byte select
+	int reads, writes;			// register masks
+	int port_a, port_b;			// registers the ALU operands are read from in decode, -1 if unused
+	int flags;					// FLAGS_NZ | FLAGS_CV written
+	int flags_read;				// FLAGS_NZ | FLAGS_CV a conditional branch tests
+	bool load, store, stack;	// RAM accesses, stack ones through the stack pointer
+	int first, last;			// RAM bytes touched, last excluded
+	bool control;				// ends a basic block
+	bool delay_slot;			// the word after the one STALL masks still runs before the jump (bra, jmp)
+	bool store_ports;			// RW without STALL: the next instruction reads the registers this one selects (push)
+	int size;					// bytes
+};
+
+/* Instruction as the scheduler moves it */
+struct scheduled_instruction {
+
+	std::vector <std::string_view> operands;	// opcode token first
+	int source;					// index into the line table, -1 for a nop the scheduler adds
+};
+
+/* Program the peephole rules rewrite: the instructions in address order and what is known about each */
+struct peephole_program {
+
+	std::vector <scheduled_instruction> code;
+	std::vector <instruction_effects> effects;
+	std::vector <int> region;				// #org region of each instruction
+	std::vector <bool> removed;
+	std::vector <bool> leader;				// a label resolves to it
+	std::vector <bool> guarded;				// in the words after a bra or jmp, which are masked or run by position
+	std::vector <int> live;					// FLAGS_NZ | FLAGS_CV read after it before being written again
+	std::vector <int> label_instruction;		// per label, -1 at the end of its region
+};
+
+
+/* One program as it is assembled: its tables and the passes that fill and rewrite them */
+struct assembly {
+
+	std::vector <std::string> label_names;			// names of labels, lowercase
+	std::vector <int> label_addresses;			// addresses of labels
+	std::vector <std::string_view> tokens;			// tokenizer
+	std::vector <int> line_addresses;			// address of each instruction
+	std::vector <int> line_numbers;				// source line of each instruction
+	std::vector <std::string_view> line_sources;		// source text of each instruction, comment removed
+	std::vector <int> region_addresses;			// first address of each #org region
+	std::vector <int> region_ends;				// address after the last byte of each #org region
+	std::vector <int> region_lines;				// line of the #org starting each region, 0 for the code from address 0
+	std::vector <int> label_positions;			// index of the instruction each label was defined in front of
+	std::vector <int> label_regions;				// #org region each label was defined in
+	std::unordered_map <std::string_view, int, label_hash, label_equal> label_index;	// label name as written -> index into label_names
+	std::vector <unsigned char> code;			// machine code, emitted as each line is parsed
+	bool keep_tokens = false;				// tokens are only kept for the passes that rewrite them
+	bool relocatable = false;				// assembler -c: every label reference is left to the linker
+	std::unordered_set <const char *> long_branches;			// mnemonics of the branches grown to their long form, the program file stays mapped
+	std::deque <std::string> peephole_constants;		// immediates the peephole optimizer folded, tokens view them
+	std::deque <std::string> layout_labels;			// names of the labels the block layout added, label_index views them
+	std::deque <std::string> inline_labels;			// names of the labels of the inlined copies, label_index views them
+	std::unordered_map <const char *, std::string> inverted_branches;			// mnemonic of a branch the block layout inverted -> the inverse put in its place
+	std::unordered_map <int, std::pair <unsigned long long, unsigned long long>> branch_counts_by_line;			// branch profile: source line -> taken, not taken
+	std::unordered_map <int, std::pair <unsigned long long, unsigned long long>> branch_counts_by_address;		// rows of the branch profile without a line
+	std::unordered_map <const char *, const std::pair <unsigned long long, unsigned long long> *> branch_counts;		// mnemonic -> its row, looked up before any layout; nullptr if none
+	std::vector <label_fixup> fixups;			// references to labels further down, each chunk of the parallel parse collects its own first
+	std::vector <label_fixup> relocations;			// every label reference of a relocatable module, in address order
+	std::vector <source_chunk> chunks;			// parallel parse
+	const source_file * chunk_source = nullptr;
+	int chunk_stop_line = 0;				// encoding stops here, where merging failed
+
+	/* Takes in a label (valid or invalid) and returns its absolute address or -1 if it is not defined (yet) */
+	int get_label_address(std::string_view label);
+	/* Reads each line of the program file, checking for syntax and valid label names, registers, instructions, and immediate values; branches that cannot reach their label are relaxed */
+	int parse_file(const source_file& source);
+	/* parse_file on threads threads: chunks are measured in parallel, merged in order (prefix sum of their sizes, labels and #org), then encoded in parallel into their own part of code */
+	int parse_file_parallel(const source_file& source, int threads);
+	/* Reads the file again, the branches that could not reach their label grown, until none has to grow (threads 0 for the serial parse); keeps the branches grown so far */
+	int parse_file_relaxed(const source_file& source, int threads);
+	/* One pass of parse_file, GROWN if a branch had to grow */
+	int parse_pass(const source_file& source);
+	/* One pass of parse_file_parallel, GROWN if a branch had to grow */
+	int parse_pass_parallel(const source_file& source, int threads);
+	/* Runs work(item) for every item below count on threads threads */
+	void parallel(int threads, unsigned long long count, void (assembly::*work)(unsigned long long item));
+	/* Sizes the instructions of a chunk and notes its labels and #org lines, stopping at a line it cannot size */
+	void measure_chunk(unsigned long long item);
+	/* Places the chunks one after another, defines the labels and opens the #org regions; returns the line of the first error, 0 if none */
+	int merge_chunks();
+	/* Parses and encodes the instructions of a chunk at the addresses merge_chunks gave it */
+	void encode_chunk(unsigned long long item);
+	/* Empties every table parse_file fills */
+	void clear_program();
+	/* Receives one line from program line and checks for syntax, updating the program counter for every line; adds each token to a vector */
+	int parse_instruction(std::string_view line, int line_num, int& pc, std::vector <label_fixup>& pending);
+	/* Checks to see if label has a valid name and notes its name and location in memory using the program counter */
+	int parse_label(std::string_view label, int line_num, int& pc);
+	/* Checks to see if org or dcx directive, otherwise, exit */
+	int parse_directive(std::string_view dir, int line_num, int& pc);
+	/* Encode one instruction at pc, growing code if needed; references to labels further down go to pending, for resolve_fixups */
+	int emit_instruction(const std::string_view operands[], int line_num, int pc, std::vector <label_fixup>& pending);
+	/* Encode the long form of a branch at pc: the jmp to the label behind the branches over it */
+	int emit_long_branch(int opcode, std::string_view label, int line_num, int pc, std::vector <label_fixup>& pending);
+	/* Write a label address into the instruction at pc: displacement for branches, absolute address for call and jmp */
+	int patch_label(int pc, int label_address, int line_num);
+	/* Copy the word a short bra at pc would have run (two words behind it) into the delay slot of the jmp it grew into; FAIL if that word cannot move */
+	int move_delay_word(int pc, int line_num);
+	/* Patch every forward label reference once all labels are known; a relocatable module keeps them all as relocations; GROWN if a branch cannot reach its label */
+	int resolve_fixups();
+	/* Encode the token vector again from address 0, after the scheduler rewrote it */
+	int assemble_tokens();
+	/* Write the machine code to the bin file */
+	int write_code_file(std::ostream &bin);
+	/* Write the sections, labels, relocations and line table of a relocatable module to its object file (object.h) */
+	int write_object_file(std::ostream &obj);
+	/* #org region holding the byte at address */
+	int region_of(int address);
+	/* Add token to token vector */
+	void add_token(std::string_view tok);
+	/* Reorder the instructions of each basic block around the pipeline hazards and report the cycles saved; rewrites tokens, labels and the line table */
+	int schedule_program();
+	/* Schedule one basic block, append it and the words guarded behind its bra/jmp to out and return its cycles for one pass; behind_push pins its first instruction, in_order keeps the source order */
+	int schedule_block(const std::vector <scheduled_instruction>& block, const std::vector <scheduled_instruction>& guarded, bool self_loop, bool behind_push, bool in_order, std::vector <scheduled_instruction>& out);
+	/* Reads, writes and pipeline behaviour of one instruction */
+	instruction_effects get_effects(const std::vector <std::string_view>& operands);
+	/* Remove, fold and thread what the peephole rules find redundant and report the hits of each rule; rewrites tokens, labels and the line table */
+	int optimize_program();
+	/* Leader flags, delay slot guards and live flags of the instructions left */
+	void peephole_analyze(peephole_program& p);
+	/* Instruction a label now stands in front of, -1 if it is at the end of its region */
+	int peephole_label(const peephole_program& p, int label);
+	/* Instruction a branch to label runs next, -1 if it cannot be followed (a label of another module) */
+	int peephole_target(const peephole_program& p, std::string_view label);
+	/* Token for a folded immediate */
+	std::string_view peephole_constant(int value);
+	/* Reads the rows of a branch profile (simulator -e): taken and not taken counts by source line, by address for the rows without one */
+	int read_branch_profile(std::string_view profile);
+	/* Reorder the basic blocks of each #org region so the side of every profiled branch taken more often falls through, inverting branches and adding jumps where needed; rewrites tokens, labels and the line table */
+	int layout_program();
+	/* Name of a label in front of instruction (at the end of region if -1), adding one if there is none */
+	std::string_view layout_label(std::vector <int>& label_instruction, std::vector <int>& label_region, std::vector <std::string_view>& label_keys, int instruction, int region);
+	/* Copy the leaf functions within INLINE_BYTES in place of the calls to them and report what that saves; rewrites tokens, labels and the line table */
+	int inline_program();
+	/* Peephole rules */
+	bool remove_nop(peephole_program& p, int k);
+	bool fold_immediate(peephole_program& p, int k);
+	bool remove_byte_move(peephole_program& p, int k);
+	bool remove_compare(peephole_program& p, int k);
+	bool thread_jump(peephole_program& p, int k);
+	bool remove_push_pop(peephole_program& p, int k);
+	/* Bytes of the instruction whose mnemonic is at mnemonic, the long form of a grown branch included */
+	int encoded_size(int opcode, const char * mnemonic);
+	/* Write labels, the line of every instruction and the #org regions to the symbol file (symbols.h) */
+	int write_symbol_file(std::ostream &sym);
+};
+
+
+/* Maps the program file, or reads it where it cannot be mapped */
+int open_source_file(source_file& source, const char * file_name);
+/* Unmaps or frees the program file; the tokens and line table point into it */
+void close_source_file(source_file& source);
+
+#endif
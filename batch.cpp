@@ -0,0 +1,418 @@
+#include <cstring>
+
+#include "simulator.h"
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define VEC_LANES		16
+	typedef __m256i vec;
+#elif defined(__SSE2__) || defined(_M_X64)
+	#include <emmintrin.h>
+	#define VEC_LANES		8
+	typedef __m128i vec;
+#else
+	#define VEC_LANES		1			// no SIMD, one lane at a time
+	typedef unsigned short vec;
+#endif
+
+
+#define CODE_ENTRIES		(MEM_SIZE / 2)
+#define COUNT_FLUSH			0x7fff			// steps before the 16 bit lane counters could overflow
+
+
+/*
+ * 16 bit lane operations. Masks have every bit of a lane set or clear, so select and the flag masks
+ * are plain bitwise operations.
+ */
+#if VEC_LANES == 16
+static inline vec vload(const unsigned short * p) { return _mm256_loadu_si256((const vec *) p); }
+static inline void vstore(unsigned short * p, vec a) { _mm256_storeu_si256((vec *) p, a); }
+static inline vec vset(int x) { return _mm256_set1_epi16((short) x); }
+static inline vec vadd(vec a, vec b) { return _mm256_add_epi16(a, b); }
+static inline vec vsub(vec a, vec b) { return _mm256_sub_epi16(a, b); }
+static inline vec vand(vec a, vec b) { return _mm256_and_si256(a, b); }
+static inline vec vandnot(vec a, vec b) { return _mm256_andnot_si256(a, b); }			// ~a & b
+static inline vec vor(vec a, vec b) { return _mm256_or_si256(a, b); }
+static inline vec vxor(vec a, vec b) { return _mm256_xor_si256(a, b); }
+static inline vec veq(vec a, vec b) { return _mm256_cmpeq_epi16(a, b); }
+static inline vec vsign(vec a) { return _mm256_srai_epi16(a, 15); }
+static inline vec vadds(vec a, vec b) { return _mm256_adds_epu16(a, b); }
+static inline vec vsubs(vec a, vec b) { return _mm256_subs_epu16(a, b); }
+static inline vec vshr8(vec a) { return _mm256_srli_epi16(a, 8); }
+static inline vec vshl8(vec a) { return _mm256_slli_epi16(a, 8); }
+static inline bool vany(vec a) { return _mm256_movemask_epi8(a) != 0; }
+#elif VEC_LANES == 8
+static inline vec vload(const unsigned short * p) { return _mm_loadu_si128((const vec *) p); }
+static inline void vstore(unsigned short * p, vec a) { _mm_storeu_si128((vec *) p, a); }
+static inline vec vset(int x) { return _mm_set1_epi16((short) x); }
+static inline vec vadd(vec a, vec b) { return _mm_add_epi16(a, b); }
+static inline vec vsub(vec a, vec b) { return _mm_sub_epi16(a, b); }
+static inline vec vand(vec a, vec b) { return _mm_and_si128(a, b); }
+static inline vec vandnot(vec a, vec b) { return _mm_andnot_si128(a, b); }
+static inline vec vor(vec a, vec b) { return _mm_or_si128(a, b); }
+static inline vec vxor(vec a, vec b) { return _mm_xor_si128(a, b); }
+static inline vec veq(vec a, vec b) { return _mm_cmpeq_epi16(a, b); }
+static inline vec vsign(vec a) { return _mm_srai_epi16(a, 15); }
+static inline vec vadds(vec a, vec b) { return _mm_adds_epu16(a, b); }
+static inline vec vsubs(vec a, vec b) { return _mm_subs_epu16(a, b); }
+static inline vec vshr8(vec a) { return _mm_srli_epi16(a, 8); }
+static inline vec vshl8(vec a) { return _mm_slli_epi16(a, 8); }
+static inline bool vany(vec a) { return _mm_movemask_epi8(a) != 0; }
+#else
+static inline vec vload(const unsigned short * p) { return *p; }
+static inline void vstore(unsigned short * p, vec a) { *p = a; }
+static inline vec vset(int x) { return (vec) x; }
+static inline vec vadd(vec a, vec b) { return a + b; }
+static inline vec vsub(vec a, vec b) { return a - b; }
+static inline vec vand(vec a, vec b) { return a & b; }
+static inline vec vandnot(vec a, vec b) { return ~a & b; }
+static inline vec vor(vec a, vec b) { return a | b; }
+static inline vec vxor(vec a, vec b) { return a ^ b; }
+static inline vec veq(vec a, vec b) { return a == b ? 0xffff : 0; }
+static inline vec vsign(vec a) { return a & 0x8000 ? 0xffff : 0; }
+static inline vec vadds(vec a, vec b) { return a + b > 0xffff ? 0xffff : a + b; }
+static inline vec vsubs(vec a, vec b) { return a > b ? a - b : 0; }
+static inline vec vshr8(vec a) { return a >> 8; }
+static inline vec vshl8(vec a) { return a << 8; }
+static inline bool vany(vec a) { return a != 0; }
+#endif
+
+/* Lanes of m take a, the others keep b */
+static inline vec vselect(vec m, vec a, vec b) { return vor(vand(m, a), vandnot(m, b)); }
+
+
+/* Instruction decoded once for every ROM word, shared by all lanes */
+struct batch_decoded {
+
+	unsigned char op, rd, rs;
+	unsigned short imm;				// extended immediate or RAM address
+	unsigned short next;			// fall through address
+	unsigned short target;			// branch, jmp and call destination
+};
+
+static batch_decoded code[CODE_ENTRIES];
+
+
+void batch_predecode(const machine& m) {
+
+	for (int i = 0; i < CODE_ENTRIES; i++) {
+
+		unsigned short pc = i << 1;
+		unsigned short word = rom_read_word(m, pc);
+		unsigned short address = rom_read_word(m, pc + 2);
+		batch_decoded& d = code[i];
+
+		d.op = word >> 11;
+		d.rd = (word >> 8) & 7;
+		d.rs = word & 7;
+		d.imm = d.op == opcodes::mvi ? word & 0xff : sext8(word);
+		d.next = pc + 2;
+		d.target = pc + 2 + sext8(word);
+
+		if ((d.op >= opcodes::ldr && d.op <= opcodes::strb) || d.op == opcodes::call || d.op == opcodes::jmp) {
+
+			d.next = pc + 4;
+			d.imm = address;
+			d.target = address;
+		}
+	}
+}
+
+
+void batch_set_lane(batch& b, int lane, const machine& m) {
+
+	for (int r = 0; r < NUM_REGS; r++)
+		b.regs[r][lane] = m.regs[r];
+
+	b.n[lane] = m.n ? 0xffff : 0;
+	b.z[lane] = m.z ? 0xffff : 0;
+	b.c[lane] = m.c ? 0xffff : 0;
+	b.v[lane] = m.v ? 0xffff : 0;
+	b.pc[lane] = m.pc;
+	b.sp[lane] = m.sp;
+	b.active[lane] = 0xffff;
+	b.retired[lane] = m.retired;
+
+	for (int w = 0; w < MEM_SIZE / 2; w++)
+		b.ram[w][lane] = ram_read_word(m, w << 1);
+}
+
+
+void batch_get_lane(const batch& b, int lane, machine& m) {
+
+	for (int r = 0; r < NUM_REGS; r++)
+		m.regs[r] = b.regs[r][lane];
+
+	m.n = b.n[lane] != 0;
+	m.z = b.z[lane] != 0;
+	m.c = b.c[lane] != 0;
+	m.v = b.v[lane] != 0;
+	m.pc = b.pc[lane];
+	m.sp = b.sp[lane];
+	m.retired = b.retired[lane];
+
+	for (int w = 0; w < MEM_SIZE / 2; w++)
+		ram_write_word(m, w << 1, b.ram[w][lane]);
+}
+
+
+/*
+ * Runs every active lane of b through the program in lockstep, one instruction per step.
+ * Each step executes the instruction at the lowest pc among the active lanes, for the lanes that are at that pc;
+ * lanes that took the other side of a branch wait with their pc until the lowest pc catches up with them.
+ * A lane stops when it branches or jumps to itself. Returns RUN_HALT once every lane has stopped,
+ * RUN_LIMIT after max_steps steps.
+ */
+int batch_run(batch& b, unsigned long long max_steps) {
+
+	alignas(32) unsigned short exec[BATCH_LANES];			// lanes executing this step
+	alignas(32) unsigned short counts[BATCH_LANES];			// instructions per lane since the last flush
+
+	memset(counts, 0, sizeof(counts));
+
+	bool uniform = false;			// every active lane is at pc, b.pc is stale for them
+	unsigned short pc = 0;
+	unsigned long long steps = 0;
+	int result = RUN_LIMIT;
+
+	while (steps < max_steps) {
+
+		/* Pick the instruction and the lanes that execute it */
+		if (!uniform) {
+
+			int lowest = -1;
+
+			for (int l = 0; l < BATCH_LANES; l++)
+				if (b.active[l] && (lowest < 0 || b.pc[l] < lowest))
+					lowest = b.pc[l];
+
+			if (lowest < 0) {
+
+				result = RUN_HALT;
+				break;
+			}
+
+			pc = (unsigned short) lowest;
+			uniform = true;
+
+			for (int k = 0; k < BATCH_LANES; k += VEC_LANES) {
+
+				vec active = vload(&b.active[k]);
+				vec e = vand(active, veq(vload(&b.pc[k]), vset(pc)));
+
+				vstore(&exec[k], e);
+				uniform = uniform && !vany(vxor(e, active));
+			}
+		} else
+			memcpy(exec, b.active, sizeof(exec));
+
+		const batch_decoded& d = code[(pc >> 1) & (CODE_ENTRIES - 1)];
+		unsigned short next = d.next;
+		bool branch = false;			// next differs per lane, b.pc has been written for the executing lanes
+
+		steps++;
+
+		for (int k = 0; k < BATCH_LANES; k += VEC_LANES) {
+
+			vec e = vload(&exec[k]);
+			vec rd = vload(&b.regs[d.rd][k]);
+			vec rs = vload(&b.regs[d.rs][k]);
+			vec imm = vset(d.imm);
+			vec zero = vset(0);
+			vec ones = vset(0xffff);
+			vec result_value = zero, cout = zero, vout = zero;
+			vec taken;
+			bool write = true, arith = false, logic = true;
+
+			vstore(&counts[k], vsub(vload(&counts[k]), e));			// exec lanes are -1
+
+			switch (d.op) {
+
+				case opcodes::nop:
+					write = logic = false;
+					break;
+				case opcodes::mvi:
+					result_value = imm;
+					break;
+				case opcodes::addi:
+				case opcodes::addr: {
+
+					vec bv = d.op == opcodes::addi ? imm : rs;
+
+					result_value = vadd(rd, bv);
+					cout = vxor(veq(vadds(rd, bv), result_value), ones);			// saturation differs from wrap on carry
+					vout = vsign(vandnot(vxor(rd, bv), vxor(rd, result_value)));
+					arith = true;
+					break;
+				}
+				case opcodes::subi:
+				case opcodes::subr:
+				case opcodes::cmpi:
+				case opcodes::cmp: {
+
+					vec bv = (d.op == opcodes::subi || d.op == opcodes::cmpi) ? imm : rs;
+
+					result_value = vsub(rd, bv);
+					cout = veq(vsubs(bv, rd), zero);			// no borrow
+					vout = vsign(vand(vxor(rd, bv), vxor(rd, result_value)));
+					arith = true;
+					write = d.op == opcodes::subi || d.op == opcodes::subr;
+					break;
+				}
+				case opcodes::andi: result_value = vand(rd, imm); break;
+				case opcodes::ori: result_value = vor(rd, imm); break;
+				case opcodes::mvr: result_value = vand(rs, vset(0xff)); break;			// B_ID zero extends
+				case opcodes::andr: result_value = vand(rd, rs); break;
+				case opcodes::orr: result_value = vor(rd, rs); break;
+				case opcodes::notr: result_value = vxor(rs, ones); break;
+				case opcodes::ldr:
+					result_value = vload(b.ram[d.imm >> 1] + k);
+					logic = false;
+					break;
+				case opcodes::ldrb:
+					result_value = vload(b.ram[d.imm >> 1] + k);
+					result_value = (d.imm & 1) ? vand(result_value, vset(0xff)) : vshr8(result_value);
+					logic = false;
+					break;
+				case opcodes::str:
+				case opcodes::strb: {
+
+					unsigned short * word = b.ram[d.imm >> 1] + k;
+					vec data = rd;
+
+					if (d.op == opcodes::strb)
+						data = (d.imm & 1) ? vor(vand(vload(word), vset(0xff00)), vand(rd, vset(0xff)))
+										   : vor(vand(vload(word), vset(0x00ff)), vshl8(rd));
+
+					vstore(word, vselect(e, data, vload(word)));
+					write = logic = false;
+					break;
+				}
+				default:
+					write = logic = false;
+					break;
+			}
+
+			if (write)
+				vstore(&b.regs[d.rd][k], vselect(e, result_value, rd));
+
+			if (logic) {
+
+				vstore(&b.n[k], vselect(e, vsign(result_value), vload(&b.n[k])));
+				vstore(&b.z[k], vselect(e, veq(result_value, zero), vload(&b.z[k])));
+			}
+
+			if (arith) {
+
+				vstore(&b.c[k], vselect(e, cout, vload(&b.c[k])));
+				vstore(&b.v[k], vselect(e, vout, vload(&b.v[k])));
+			}
+
+			if (d.op < opcodes::bra || d.op > opcodes::bvc)
+				continue;
+
+			/* Conditional branches, read the flags after any update above */
+			vec n = vload(&b.n[k]), z = vload(&b.z[k]), c = vload(&b.c[k]), v = vload(&b.v[k]);
+
+			switch (d.op) {
+
+				case opcodes::bra: taken = ones; break;
+				case opcodes::bne: taken = vxor(z, ones); break;
+				case opcodes::beq: taken = z; break;
+				case opcodes::bhs: taken = c; break;
+				case opcodes::blo: taken = vxor(c, ones); break;
+				case opcodes::bge: taken = vor(z, vxor(vxor(n, v), ones)); break;			// the urom takes bge on Z as well
+				case opcodes::blt: taken = vxor(n, v); break;
+				case opcodes::bvs: taken = v; break;
+				default: taken = vxor(v, ones); break;
+			}
+
+			taken = vand(taken, e);
+
+			if (d.target == pc)			// lanes branching to themselves are done
+				vstore(&b.active[k], vandnot(taken, vload(&b.active[k])));
+
+			vstore(&b.pc[k], vselect(e, vselect(taken, vset(d.target), vset(d.next)), vload(&b.pc[k])));
+			branch = true;
+		}
+
+		/* Stack instructions address RAM through each lane's own stack pointer */
+		if (d.op >= opcodes::push && d.op <= opcodes::ret) {
+
+			for (int l = 0; l < BATCH_LANES; l++) {
+
+				if (!exec[l])
+					continue;
+
+				unsigned char& sp = b.sp[l];
+
+				switch (d.op) {
+
+					case opcodes::push:
+						b.ram[sp >> 1][l] = b.regs[d.rd][l];
+						sp += 2;
+						break;
+					case opcodes::pop:
+						sp -= 2;
+						b.regs[d.rd][l] = b.ram[sp >> 1][l];
+						break;
+					case opcodes::call:
+						b.ram[sp >> 1][l] = d.next;
+						sp += 2;
+						break;
+					case opcodes::ret:
+						sp -= 2;
+						b.pc[l] = b.ram[sp >> 1][l] & ~1;
+						break;
+				}
+			}
+
+			if (d.op == opcodes::ret)
+				uniform = false;			// return addresses may differ
+		}
+
+		if (d.op == opcodes::call || d.op == opcodes::jmp) {
+
+			next = d.target;
+
+			if (d.op == opcodes::jmp && d.target == pc) {
+
+				for (int l = 0; l < BATCH_LANES; l++)
+					if (exec[l])
+						b.active[l] = 0;
+
+				uniform = false;			// the search finds the lanes still running, if any
+			}
+		}
+
+		if (branch) {
+
+			uniform = false;			// settled by the next lowest pc search
+		} else if (d.op != opcodes::ret) {
+
+			if (uniform)
+				pc = next;
+			else
+				for (int k = 0; k < BATCH_LANES; k += VEC_LANES)
+					vstore(&b.pc[k], vselect(vload(&exec[k]), vset(next), vload(&b.pc[k])));
+		}
+
+		if (!(steps & COUNT_FLUSH)) {
+
+			for (int l = 0; l < BATCH_LANES; l++)
+				b.retired[l] += counts[l];
+
+			memset(counts, 0, sizeof(counts));
+		}
+	}
+
+	if (uniform)
+		for (int l = 0; l < BATCH_LANES; l++)
+			if (b.active[l])
+				b.pc[l] = pc;
+
+	for (int l = 0; l < BATCH_LANES; l++)
+		b.retired[l] += counts[l];
+
+	return result;
+}
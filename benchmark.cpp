@@ -0,0 +1,485 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <chrono>
+
+#include "simulator.h"
+
+using namespace std;
+
+
+#define BENCH_INSTRUCTIONS		100000000ULL			// instructions timed per program
+#define CHECK_CYCLES			2000000000ULL			// pipeline cycle limit for the reference run
+
+
+/* Program image built in memory, encoded the way assemble_file writes it */
+struct program {
+
+	const char * name;
+	vector <unsigned char> bin;
+
+	int here() { return (int) bin.size(); }
+
+	void word(int w) {
+
+		bin.push_back((unsigned char) (w >> 8));
+		bin.push_back((unsigned char) w);
+	}
+
+	/* Immediate, register, stack, nop and ret instructions */
+	void op(int opcode, int rd = 0, int low = 0) { word((opcode << 11) | (rd << 8) | (low & 0xff)); }
+	/* ldr, ldrb, str, strb, call, jmp */
+	void op4(int opcode, int rd, int address) { op(opcode, rd); word(address); }
+	/* Relative branch to an address already emitted */
+	void branch(int opcode, int target) { op(opcode, 0, target - (here() + 2)); }
+	/* Branch to itself, stops both engines */
+	void halt() { branch(opcodes::bra, here()); }
+};
+
+
+/* Functional execution engine under test */
+struct engine {
+
+	const char * name;
+	int (*init)(const machine& m);			// called after the ROM changes
+	int (*run)(machine& m, unsigned long long max_instructions);
+};
+
+
+/* Loads a binary written by the assembler, returns false if there is none */
+bool load_file(program& p, const char * file_name);
+/* Writes p as <file>.bin for the other tools, returns false if the file cannot be written */
+bool write_file(const program& p, const char * file_name);
+/* Nested counted loops over the register ALU instructions */
+program synthetic_alu();
+/* Loads, stores, push/pop and call/ret in a counted loop */
+program synthetic_memory();
+/* One long unrolled loop body, far larger than a relative branch can span */
+program synthetic_large();
+/* Adds and subtracts whose flags are mostly overwritten unread, and forward branches on carry, overflow and less than */
+program synthetic_flags();
+/* Every conditional branch after adds and subtracts on the corner cases of the flags, one result bit per branch in RAM */
+program synthetic_branches();
+/* Fibonacci of the input word at RAM[0x0000] modulo 32 for sweep, the loop count differs per instance */
+program synthetic_sweep();
+
+/* Runs p on the pipeline and on e from reset and compares registers, flags, stack pointer and RAM */
+bool check_program(const program& p, const engine& e);
+/* Times e on p, rerunning from reset until BENCH_INSTRUCTIONS have executed */
+void bench_program(const program& p, const engine& e);
+/* interp_predecode with the engine init signature */
+int interp_init(const machine& m);
+
+
+static machine reference, cpu;
+
+
+int main(int argc, char * argv[]) {
+
+	vector <program> programs;
+	program fib;
+	const char * file_name = "machine_code.bin";
+	bool write = false;
+
+	for (int i = 1; i < argc; i++) {
+
+		if (!strcmp(argv[i], "-w"))
+			write = true;			// only write the synthetic programs out
+		else
+			file_name = argv[i];
+	}
+
+	if (write) {
+
+		bool written = write_file(synthetic_alu(), "synthetic_alu.bin");
+
+		written = write_file(synthetic_memory(), "synthetic_memory.bin") && written;
+		written = write_file(synthetic_large(), "synthetic_large.bin") && written;
+		written = write_file(synthetic_flags(), "synthetic_flags.bin") && written;
+		written = write_file(synthetic_branches(), "synthetic_branches.bin") && written;
+		written = write_file(synthetic_sweep(), "synthetic_sweep.bin") && written;
+
+		return written ? 0 : FAIL;
+	}
+
+	fib.name = "fibonacci";
+
+	if (load_file(fib, file_name))
+		programs.push_back(fib);
+
+	programs.push_back(synthetic_alu());
+	programs.push_back(synthetic_memory());
+	programs.push_back(synthetic_large());
+	programs.push_back(synthetic_flags());
+	programs.push_back(synthetic_branches());
+
+	engine engines[] = {{"interpreter", interp_init, interp_run},
+						{"jit", jit_init, jit_run}};
+
+	int failed = 0;
+
+	for (const program& p : programs) {
+
+		for (const engine& e : engines) {
+
+			if (!check_program(p, e)) {
+
+				failed++;
+				continue;
+			}
+
+			bench_program(p, e);
+		}
+	}
+
+	return failed ? FAIL : 0;
+}
+
+
+bool load_file(program& p, const char * file_name) {
+
+	ifstream bin;
+
+	bin.open(file_name, ios::in | ios::binary);
+
+	if (!bin.is_open()) {
+
+		cout << "Unable to open program file [" << file_name << "], skipping" << endl;
+		return false;
+	}
+
+	p.bin.assign(istreambuf_iterator<char>(bin), istreambuf_iterator<char>());
+	bin.close();
+
+	return true;
+}
+
+
+bool write_file(const program& p, const char * file_name) {
+
+	ofstream bin;
+
+	bin.open(file_name, ios::out | ios::trunc | ios::binary);
+
+	if (!bin.is_open()) {
+
+		cout << "Unable to open write file [" << file_name << "]" << endl;
+		return false;
+	}
+
+	bin.write((const char *) p.bin.data(), p.bin.size());
+	bin.close();
+
+	return true;
+}
+
+
+program synthetic_alu() {
+
+	program p;
+
+	p.name = "synthetic alu";
+
+	p.op(opcodes::mvi, 0, 1);
+	p.op(opcodes::mvi, 1, 0x35);
+	p.op(opcodes::mvi, 6, 200);			// outer count
+
+	int outer = p.here();
+
+	p.op(opcodes::mvi, 7, 250);			// inner count
+
+	int inner = p.here();
+
+	p.op(opcodes::addr, 0, 1);
+	p.op(opcodes::mvr, 2, 0);
+	p.op(opcodes::andi, 2, 0x3c);
+	p.op(opcodes::orr, 1, 2);
+	p.op(opcodes::notr, 3, 1);
+	p.op(opcodes::subr, 0, 3);
+	p.op(opcodes::addi, 1, 7);
+	p.op(opcodes::cmp, 0, 1);
+	p.op(opcodes::subi, 7, 1);
+	p.branch(opcodes::bne, inner);
+	p.op(opcodes::subi, 6, 1);
+	p.branch(opcodes::bne, outer);
+	p.op4(opcodes::str, 0, 0x0010);
+	p.halt();
+
+	return p;
+}
+
+
+program synthetic_memory() {
+
+	program p;
+
+	p.name = "synthetic memory";
+
+	int function = 0x0200;
+
+	p.op(opcodes::mvi, 7, 250);
+	p.op(opcodes::mvi, 5, 0);
+
+	int loop = p.here();
+
+	p.op4(opcodes::ldr, 0, 0x0400);
+	p.op(opcodes::addr, 0, 7);
+	p.op4(opcodes::str, 0, 0x0400);
+	p.op4(opcodes::ldrb, 1, 0x0401);
+	p.op(opcodes::push, 1);
+	p.op(opcodes::nop);			// the register read ports belong to the push for one cycle
+	p.op4(opcodes::call, 0, function);
+	p.op(opcodes::pop, 2);
+	p.op(opcodes::addr, 5, 2);
+	p.op4(opcodes::strb, 5, 0x0403);
+	p.op(opcodes::subi, 7, 1);
+	p.branch(opcodes::bne, loop);
+	p.halt();
+
+	p.bin.resize(function, 0);
+
+	p.op4(opcodes::ldr, 3, 0x0402);			// leaf function: RAM[0x0402] += ~r1
+	p.op(opcodes::notr, 4, 1);
+	p.op(opcodes::addr, 3, 4);
+	p.op4(opcodes::str, 3, 0x0402);
+	p.op(opcodes::ret);
+
+	return p;
+}
+
+
+program synthetic_large() {
+
+	program p;
+
+	p.name = "synthetic large";
+
+	p.op(opcodes::mvi, 7, 100);
+
+	int top = p.here();
+
+	for (int i = 0; i < 4000; i++) {
+
+		int rd = i % 6;
+		int rs = (i * 5 + 1) % 6;
+
+		switch (i % 5) {
+
+			case 0: p.op(opcodes::addr, rd, rs); break;
+			case 1: p.op(opcodes::subi, rd, i & 0x7f); break;
+			case 2: p.op(opcodes::orr, rd, rs); break;
+			case 3: p.op(opcodes::andi, rd, 0xf0 | i); break;
+			case 4: p.op(opcodes::subr, rd, rs); break;
+		}
+	}
+
+	p.op(opcodes::subi, 7, 1);
+	p.op(opcodes::beq, 0, 6);			// over the jmp and its delay slot
+	p.op4(opcodes::jmp, 0, top);
+	p.op(opcodes::nop);			// the word after jmp still enters decode
+	p.halt();
+
+	return p;
+}
+
+
+program synthetic_flags() {
+
+	program p;
+
+	p.name = "synthetic flags";
+
+	p.op(opcodes::mvi, 0, 0x71);
+	p.op(opcodes::mvi, 1, 0xc3);
+	p.op(opcodes::mvi, 7, 250);
+	p.op(opcodes::mvi, 6, 200);
+
+	int loop = p.here();
+
+	p.op(opcodes::addr, 0, 1);			// flags written and never read
+	p.op(opcodes::subr, 2, 0);
+	p.op(opcodes::addi, 3, 0x5b);
+	p.op(opcodes::subr, 1, 3);
+	p.op(opcodes::addr, 4, 2);
+	p.op(opcodes::addr, 1, 4);
+	p.op(opcodes::cmp, 0, 2);
+	p.op(opcodes::bhs, 0, 2);			// over one word
+	p.op(opcodes::addi, 5, 1);
+	p.op(opcodes::addr, 0, 3);
+	p.op(opcodes::bvs, 0, 2);
+	p.op(opcodes::subi, 5, 3);
+	p.op(opcodes::cmp, 4, 1);
+	p.op(opcodes::blt, 0, 2);
+	p.op(opcodes::addr, 5, 0);
+	p.op(opcodes::subi, 7, 1);
+	p.branch(opcodes::bne, loop);
+	p.op(opcodes::mvi, 7, 250);
+	p.op(opcodes::subi, 6, 1);
+	p.branch(opcodes::bne, loop);
+	p.op4(opcodes::str, 5, 0x0010);
+	p.halt();
+
+	return p;
+}
+
+
+program synthetic_branches() {
+
+	program p;
+
+	p.name = "synthetic branches";
+
+	/* a, b, and whether a + b or a - b sets the flags */
+	static const struct { int a, b; bool add; } cases[] = {
+		{0x8000, 0x8000, true},			// Z and V with N clear: bge is taken on Z
+		{0x7fff, 0x0001, true},			// N and V
+		{0xffff, 0x0001, true},			// Z and C
+		{0x4000, 0x4000, true},
+		{0x0000, 0x0000, false},
+		{0x8000, 0x0001, false},		// V
+		{0x0001, 0x0002, false},		// N, borrow
+		{0x1234, 0x1234, false}
+	};
+
+	static const int conditions[] = {opcodes::bne, opcodes::beq, opcodes::bhs, opcodes::blo,
+									 opcodes::bge, opcodes::blt, opcodes::bvs, opcodes::bvc};
+
+	/* rd = value: the high byte shifted up by eight doublings, then the low byte ored in */
+	auto load = [&p](int rd, int value) {
+
+		p.op(opcodes::mvi, rd, value >> 8);
+
+		for (int i = 0; i < 8; i++)
+			p.op(opcodes::addr, rd, rd);
+
+		p.op(opcodes::mvi, 7, value & 0xff);
+		p.op(opcodes::orr, rd, 7);
+	};
+
+	int address = 0x0020;
+
+	for (const auto& c : cases) {
+
+		load(0, c.a);
+		load(1, c.b);
+		p.op(opcodes::mvi, 5, 0);
+
+		for (int condition : conditions) {
+
+			p.op(opcodes::addr, 5, 5);
+
+			if (c.add) {
+
+				p.op(opcodes::mvi, 2, 0);			// mvr only copies the low byte
+				p.op(opcodes::orr, 2, 0);
+				p.op(opcodes::addr, 2, 1);
+			} else
+				p.op(opcodes::cmp, 0, 1);
+
+			p.op(condition, 0, 2);			// over the ori when taken
+			p.op(opcodes::ori, 5, 1);
+		}
+
+		p.op4(opcodes::str, 5, address);
+		address += 2;
+	}
+
+	p.halt();
+
+	return p;
+}
+
+
+program synthetic_sweep() {
+
+	program p;
+
+	p.name = "synthetic sweep";
+
+	p.op4(opcodes::ldr, 2, 0x0000);
+	p.op(opcodes::andi, 2, 0x1f);
+	p.op(opcodes::mvi, 0, 0);
+	p.op(opcodes::mvi, 1, 1);
+	p.op(opcodes::cmpi, 2, 0);
+
+	int skip = p.here();
+
+	p.op(opcodes::beq, 0, 0);			// patched below
+
+	int loop = p.here();
+
+	p.op(opcodes::mvi, 3, 0);			// r0, r1 = r1, r0 + r1
+	p.op(opcodes::orr, 3, 1);
+	p.op(opcodes::addr, 1, 0);
+	p.op(opcodes::mvi, 0, 0);
+	p.op(opcodes::orr, 0, 3);
+	p.op(opcodes::subi, 2, 1);
+	p.branch(opcodes::bne, loop);
+
+	p.bin[skip + 1] = (unsigned char) (p.here() - (skip + 2));
+
+	p.op4(opcodes::str, 0, 0x0000);
+	p.halt();
+
+	return p;
+}
+
+
+int interp_init(const machine& m) {
+
+	interp_predecode(m);
+
+	return SUCCESS;
+}
+
+
+bool check_program(const program& p, const engine& e) {
+
+	memset(reference.rom, 0, MEM_SIZE);
+	memcpy(reference.rom, p.bin.data(), p.bin.size());
+	memcpy(cpu.rom, reference.rom, MEM_SIZE);
+
+	machine_reset(reference);
+	machine_reset(cpu);
+
+	pipeline_init();
+	e.init(cpu);
+
+	bool halted = pipeline_run(reference, CHECK_CYCLES) == RUN_HALT;
+	bool match = halted && e.run(cpu, ~0ULL) == RUN_HALT;
+
+	match = match && !memcmp(reference.regs, cpu.regs, sizeof(cpu.regs)) && reference.sp == cpu.sp;
+	match = match && reference.n == cpu.n && reference.z == cpu.z && reference.c == cpu.c && reference.v == cpu.v;
+	match = match && !memcmp(reference.ram, cpu.ram, MEM_SIZE);
+
+	if (!match)
+		cout << p.name << ": " << e.name << " does not match the pipeline" << (halted ? "" : " (pipeline did not halt)") << endl;
+
+	return match;
+}
+
+
+void bench_program(const program& p, const engine& e) {
+
+	unsigned long long per_run = cpu.retired;			// left behind by check_program
+	unsigned long long total = 0;
+	double seconds = 0;
+
+	while (total < BENCH_INSTRUCTIONS) {
+
+		machine_reset(cpu);
+
+		auto start = chrono::steady_clock::now();
+
+		e.run(cpu, BENCH_INSTRUCTIONS - total);
+
+		seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		total += cpu.retired;
+	}
+
+	cout << left << setw(20) << p.name << setw(12) << e.name << right << setw(8) << p.bin.size() << " bytes  "
+		<< setw(12) << reference.cycles << " cycles  " << setw(12) << per_run << " instructions/run  "
+		<< fixed << setprecision(1) << setw(8) << total / seconds / 1e6 << " MIPS" << endl;
+}
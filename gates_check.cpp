@@ -0,0 +1,255 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <chrono>
+
+#include "simulator.h"
+
+using namespace std;
+
+
+/*
+ * Runs the evaluator generated by gatesim.cpp against the pipeline model in lockstep, comparing every register
+ * the two share after each clock cycle, and reports both in simulated cycles per second. Build with the generated file:
+ *	g++ -O2 -DHBCP_NO_MAIN -o gates_check gates_check.cpp hbcp_gates.cpp pipeline.cpp machine.cpp
+ */
+
+
+#define BENCH_CYCLES			20000000ULL
+#define CHECK_CYCLES			100000000ULL			// give up if the pipeline has not halted by then
+#define RAM_PATH				"/RAM(400,850)"
+#define PROGRAM_PATH			"/ROM(920,440)"
+
+
+/* Interface written by gatesim.cpp, the state layout stays in the generated file */
+struct gates_state;
+
+gates_state * gates_new();
+void gates_reset(gates_state& s);
+int gates_load(gates_state& s, const char * path, const char * file_name);
+void gates_cycle(gates_state& s);
+int gates_register(const char * path);
+unsigned gates_read(const gates_state& s, int slot);
+unsigned char * gates_memory(gates_state& s, const char * path, unsigned& size);
+
+
+/* Register of the circuit and the machine field modelling it */
+struct binding {
+
+	const char * path;
+	const char * name;
+	unsigned (*get)(const machine& m);
+};
+
+/* Control ROM images urom.cpp writes, loaded over the contents saved in the circuit with -r */
+static const char * const rom_files[][2] = {{"/control(1500,910)/ROM(320,520)", "dx_rom.bin"},
+											{"/control(1500,910)/ROM(310,790)", "dx_rom2.bin"},
+											{"/control(1500,910)/ROM(1070,510)", "wb_rom.bin"},
+											{"/control(1500,910)/ROM(1070,780)", "wb_rom2.bin"}};
+
+static const binding bindings[] = {
+	{"/Register(680,420)", "pc", [](const machine& m) -> unsigned { return m.pc; }},
+	{"/Register(1490,460)", "dx", [](const machine& m) -> unsigned { return m.dx; }},
+	{"/Register(1720,460)", "wb", [](const machine& m) -> unsigned { return m.wb; }},
+	{"/Register(1300,600)", "imm", [](const machine& m) -> unsigned { return m.imm; }},
+	{"/Register(1640,1160)", "sp", [](const machine& m) -> unsigned { return m.sp; }},
+	{"/registerfile(550,1300)/Register(1060,100)", "r0", [](const machine& m) -> unsigned { return m.regs[0]; }},
+	{"/registerfile(550,1300)/Register(1060,230)", "r1", [](const machine& m) -> unsigned { return m.regs[1]; }},
+	{"/registerfile(550,1300)/Register(1060,360)", "r2", [](const machine& m) -> unsigned { return m.regs[2]; }},
+	{"/registerfile(550,1300)/Register(1060,490)", "r3", [](const machine& m) -> unsigned { return m.regs[3]; }},
+	{"/registerfile(550,1300)/Register(1060,620)", "r4", [](const machine& m) -> unsigned { return m.regs[4]; }},
+	{"/registerfile(550,1300)/Register(1060,750)", "r5", [](const machine& m) -> unsigned { return m.regs[5]; }},
+	{"/registerfile(550,1300)/Register(1060,880)", "r6", [](const machine& m) -> unsigned { return m.regs[6]; }},
+	{"/registerfile(550,1300)/Register(1060,1010)", "r7", [](const machine& m) -> unsigned { return m.regs[7]; }},
+	{"/alu(1050,1430)/Register(540,170)", "alu a", [](const machine& m) -> unsigned { return m.alu_a; }},
+	{"/alu(1050,1430)/Register(540,300)", "alu b", [](const machine& m) -> unsigned { return m.alu_b; }},
+	{"/alu(1050,1430)/Register(330,30)", "alu os", [](const machine& m) -> unsigned { return m.alu_os; }},
+	{"/alu(1050,1430)/Register(290,780)", "alu uf", [](const machine& m) -> unsigned { return m.alu_uf; }},
+	{"/alu(1050,1430)/Register(1400,540)", "n", [](const machine& m) -> unsigned { return m.n; }},
+	{"/alu(1050,1430)/Register(1600,540)", "z", [](const machine& m) -> unsigned { return m.z; }},
+	{"/alu(1050,1430)/Register(1410,870)", "c", [](const machine& m) -> unsigned { return m.c; }},
+	{"/alu(1050,1430)/Register(1650,870)", "v", [](const machine& m) -> unsigned { return m.v; }},
+};
+
+
+#define BINDINGS		((int) (sizeof(bindings) / sizeof(bindings[0])))
+
+static int slots[BINDINGS];			// register slot of each binding in the generated state
+
+
+/* Returns the first binding that differs between m and s, -1 if all agree */
+int compare(const machine& m, const gates_state& s);
+/* Returns true if the circuit RAM holds the same words as m */
+bool same_ram(const machine& m, gates_state& s);
+/* Resets the circuit and loads the program and, with -r, the control ROM images; returns FAIL if a file is missing */
+int prepare(gates_state& s);
+/* Simulated cycles per second of the pipeline and the circuit, rerunning from reset every run_cycles */
+double bench_pipeline(unsigned long long run_cycles);
+double bench_gates(unsigned long long run_cycles);
+
+
+static machine cpu;
+static gates_state * circuit;
+static const char * program_name = "machine_code.bin";
+static bool urom_images = false;
+
+
+int main(int argc, char * argv[]) {
+
+	for (int i = 1; i < argc; i++) {
+
+		if (!strcmp(argv[i], "-r"))
+			urom_images = true;			// control ROMs from the urom.cpp output files
+		else if (argv[i][0] != '-')
+			program_name = argv[i];
+		else {
+
+			cout << "\nUsage: gates_check [-r] [program.bin]" << endl;
+			return FAIL;
+		}
+	}
+
+	for (int i = 0; i < BINDINGS; i++) {
+
+		if ((slots[i] = gates_register(bindings[i].path)) < 0) {
+
+			cout << "circuit has no register at " << bindings[i].path << endl;
+			return FAIL;
+		}
+	}
+
+	circuit = gates_new();
+
+	if (load_program(cpu, program_name) == FAIL)
+		return FAIL;
+
+	if (prepare(*circuit) == FAIL)
+		return FAIL;
+
+	pipeline_init();
+	machine_reset(cpu);
+
+	bool halted = false;
+
+	while (!halted && cpu.cycles < CHECK_CYCLES) {
+
+		halted = pipeline_cycle(cpu);
+		gates_cycle(*circuit);
+
+		int b = compare(cpu, *circuit);
+
+		if (b >= 0) {
+
+			cout << "cycle " << cpu.cycles << ": " << bindings[b].name << " is 0x" << hex << gates_read(*circuit, slots[b])
+				<< " in the circuit, 0x" << bindings[b].get(cpu) << " in the pipeline" << dec << endl;
+			return FAIL;
+		}
+	}
+
+	if (!same_ram(cpu, *circuit)) {
+
+		cout << "RAM differs after " << cpu.cycles << " cycles" << endl;
+		return FAIL;
+	}
+
+	cout << "circuit matches the pipeline for " << cpu.cycles << " cycles" << (halted ? "" : " (pipeline did not halt)") << endl;
+
+	double pipeline = bench_pipeline(cpu.cycles);
+	double gates = bench_gates(cpu.cycles);
+
+	cout << fixed << setprecision(1);
+	cout << "pipeline    " << setw(10) << pipeline / 1e6 << " M cycles/s" << endl;
+	cout << "gates       " << setw(10) << gates / 1e6 << " M cycles/s  " << setprecision(2) << gates / pipeline << "x" << endl;
+
+	return 0;
+}
+
+
+int compare(const machine& m, const gates_state& s) {
+
+	for (int i = 0; i < BINDINGS; i++)
+		if (gates_read(s, slots[i]) != bindings[i].get(m))
+			return i;
+
+	return -1;
+}
+
+
+bool same_ram(const machine& m, gates_state& s) {
+
+	unsigned size;
+	unsigned char * ram = gates_memory(s, RAM_PATH, size);
+
+	/* The circuit stores line 0, the low byte, at the even address; the machine keeps words big endian */
+	for (unsigned a = 0; ram && a < size && a < MEM_SIZE; a++)
+		if (ram[a] != m.ram[a ^ 1])
+			return false;
+
+	return ram != nullptr;
+}
+
+
+int prepare(gates_state& s) {
+
+	gates_reset(s);
+
+	if (gates_load(s, PROGRAM_PATH, program_name) == FAIL) {
+
+		cout << "Unable to open program file [" << program_name << "]" << endl;
+		return FAIL;
+	}
+
+	for (const auto& r : rom_files) {
+
+		if (urom_images && gates_load(s, r[0], r[1]) == FAIL) {
+
+			cout << "Unable to load ROM image [" << r[1] << "] into " << r[0] << endl;
+			return FAIL;
+		}
+	}
+
+	return SUCCESS;
+}
+
+
+double bench_pipeline(unsigned long long run_cycles) {
+
+	unsigned long long total = 0;
+	double seconds = 0;
+
+	while (total < BENCH_CYCLES) {
+
+		machine_reset(cpu);
+
+		auto start = chrono::steady_clock::now();
+
+		pipeline_run(cpu, run_cycles);
+
+		seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		total += cpu.cycles;
+	}
+
+	return total / seconds;
+}
+
+
+double bench_gates(unsigned long long run_cycles) {
+
+	unsigned long long total = 0;
+	double seconds = 0;
+
+	while (total < BENCH_CYCLES) {
+
+		prepare(*circuit);
+
+		auto start = chrono::steady_clock::now();
+
+		for (unsigned long long i = 0; i < run_cycles; i++)
+			gates_cycle(*circuit);
+
+		seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		total += run_cycles;
+	}
+
+	return total / seconds;
+}
@@ -0,0 +1,610 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "netlist.h"
+
+using namespace std;
+
+
+/*
+ * Compiles hbcp.circ into straight-line C++. Every component of the flattened circuit becomes a few
+ * statements in gates_cycle, written in the order the netlist was levelized, so one call settles the
+ * combinational logic and then applies one rising clock edge to the registers and RAM, bit for bit what
+ * Logisim computes for one clock tick.
+ */
+
+
+#define TOP_CIRCUIT			"main"
+
+
+/* Writes the evaluator for n, returns FAIL if the circuit cannot be compiled or the file cannot be written */
+int write_evaluator(const netlist& n, const char * circ_name, const char * file_name);
+/* Returns the C++ expression for the value of bits, floating bits read as fill */
+string bits_value(const netlist& n, const vector <int>& bits, bool fill);
+/* Writes the settle statements of one cell */
+void write_cell(ostream& out, const netlist& n, int i);
+/* Writes the statements loading the registers of one clock edge */
+void write_edge(ostream& out, const netlist& n, bool falling);
+
+
+static vector <int> state_slot;			// register or flip-flop slot of each cell, -1 otherwise
+static vector <int> memory_slot;			// ROM or RAM array of each cell, -1 otherwise
+static vector <bool> falling;			// clocked through an inverter, loads on the falling edge
+static vector <bool> in_pass;			// cells settled by the pass being written whose outputs are read
+static bool pass_falling;				// the pass ends in the falling edge
+
+
+int main(int argc, char * argv[]) {
+
+	const char * circ_name = argc > 1 ? argv[1] : "hbcp.circ";
+	const char * out_name = argc > 2 ? argv[2] : "hbcp_gates.cpp";
+	netlist n;
+
+	if (netlist_load(n, circ_name, TOP_CIRCUIT) == FAIL) {
+
+		cout << circ_name << ": " << n.error << endl;
+		return FAIL;
+	}
+
+	if (write_evaluator(n, circ_name, out_name) == FAIL)
+		return FAIL;
+
+	cout << n.cells.size() << " components, " << n.bits << " signal bits written to " << out_name << endl;
+
+	return 0;
+}
+
+
+static string var(int cell, int port) {
+
+	return "c" + to_string(cell) + "_" + to_string(port);
+}
+
+static string hex_word(unsigned x) {
+
+	stringstream s;
+
+	s << "0x" << hex << x;
+
+	return s.str();
+}
+
+static string mask(int width) {
+
+	return hex_word(width >= 32 ? ~0u : (1u << width) - 1) + "u";
+}
+
+
+string bits_value(const netlist& n, const vector <int>& bits, bool fill) {
+
+	string expr;
+	unsigned constant = 0;
+	size_t i = 0;
+
+	while (i < bits.size()) {
+
+		int b = bits[i];
+		int d = n.driver[b];
+
+		if (d < 0) {
+
+			constant |= (unsigned) fill << i;
+			i++;
+			continue;
+		}
+
+		/* Longest run of consecutive bits of the same driver port */
+		int port = n.driver_port[b];
+		int first = n.driver_bit[b];
+		size_t run = 1;
+
+		while (i + run < bits.size() && n.driver[bits[i + run]] == d && n.driver_port[bits[i + run]] == port &&
+			   n.driver_bit[bits[i + run]] == first + (int) run)
+			run++;
+
+		string term = var(d, port);
+		int width = (int) n.cells[d].ports[port].size();
+
+		if (first)
+			term = "(" + term + " >> " + to_string(first) + ")";
+
+		if (first + (int) run < width)
+			term = "(" + term + " & " + mask((int) run) + ")";
+
+		if (i)
+			term = "(" + term + " << " + to_string(i) + ")";
+
+		expr += (expr.empty() ? "" : " | ") + term;
+		i += run;
+	}
+
+	if (constant || expr.empty())
+		expr += (expr.empty() ? "" : " | ") + hex_word(constant) + "u";
+
+	return expr;
+}
+
+
+/* Returns true if port p of cell i is read by the logic of the current pass or by the clock edge ending it */
+static bool port_read(const netlist& n, int i, int p) {
+
+	for (size_t r = 0; r < n.cells.size(); r++) {
+
+		const cell& c = n.cells[r];
+		int clk = c.kind == CELL_REGISTER || c.kind == CELL_FLIPFLOP ? 3 : c.kind == CELL_RAM ? 2 : -1;
+		bool edge = clk >= 0 && falling[r] == pass_falling;
+
+		for (size_t q = 0; q < c.ports.size(); q++) {
+
+			if (cell_output(c, (int) q) || (int) q == clk)
+				continue;
+
+			if (!(in_pass[r] && cell_combinational_input(c, (int) q)) && !edge)
+				continue;
+
+			for (int b : c.ports[q])
+				if (n.driver[b] == i && n.driver_port[b] == p)
+					return true;
+		}
+	}
+
+	return false;
+}
+
+
+/* Picks the cells of scope the pass has to settle, dropping logic nothing reads like unused splitter constants */
+static void start_pass(const netlist& n, const vector <bool>& scope, bool fall) {
+
+	in_pass.assign(n.cells.size(), false);
+	pass_falling = fall;
+
+	for (auto it = n.order.rbegin(); it != n.order.rend(); ++it) {			// readers come later in the order
+
+		int i = *it;
+		const cell& c = n.cells[i];
+		bool live = c.kind == CELL_REGISTER || c.kind == CELL_FLIPFLOP || (c.kind == CELL_RAM && !fall);
+
+		for (size_t p = 0; p < c.ports.size() && scope[i] && !live; p++)
+			live = cell_output(c, (int) p) && port_read(n, i, (int) p);
+
+		in_pass[i] = scope[i] && live;
+	}
+}
+
+
+void write_cell(ostream& out, const netlist& n, int i) {
+
+	const cell& c = n.cells[i];
+	const vector <vector <int>>& ports = c.ports;
+	auto in = [&](int p, bool fill = false) { return bits_value(n, ports[p], fill); };
+	auto read = [&](int p) { return port_read(n, i, p); };
+	string o = var(i, 0);
+	string m = mask((int) ports[0].size());
+
+	if (!in_pass[i])
+		return;
+
+	out << "\n\t// " << c.path << "\n";
+
+	switch (c.kind) {
+
+		case CELL_CONSTANT:
+			out << "\tunsigned " << o << " = " << hex_word(c.value & ((1ull << ports[0].size()) - 1)) << "u;\n";
+			break;
+		case CELL_CLOCK:
+		case CELL_BUTTON:
+		case CELL_INPUT:
+			out << "\tunsigned " << o << " = 0;\n";			// the clock settles low, reset is not pressed
+			break;
+		case CELL_OUTPUT:
+			break;
+		case CELL_AND: case CELL_OR: case CELL_XOR: case CELL_NAND: case CELL_NOR: case CELL_XNOR: {
+
+			int base = c.kind >= CELL_NAND ? c.kind - 3 : c.kind;
+			bool invert = c.kind >= CELL_NAND;
+			vector <string> terms;
+
+			for (int k = 0; k < c.inputs; k++) {
+
+				string t = in(1 + k, base == CELL_AND);			// floating inputs do not change the result
+
+				terms.push_back(c.negate >> k & 1 ? "~(" + t + ")" : "(" + t + ")");
+			}
+
+			string e;
+
+			if (base == CELL_XOR && !c.value) {			// exactly one input high
+
+				out << "\tunsigned " << o << "_one = 0, " << o << "_many = 0;\n";
+
+				for (const string& t : terms)
+					out << "\t" << o << "_many |= " << o << "_one & " << t << ";\n\t" << o << "_one |= " << t << ";\n";
+
+				e = o + "_one & ~" + o + "_many";
+			} else {
+
+				const char * op = base == CELL_AND ? " & " : base == CELL_OR ? " | " : " ^ ";
+
+				for (size_t k = 0; k < terms.size(); k++)
+					e += (k ? op : "") + terms[k];
+			}
+
+			out << "\tunsigned " << o << " = " << (invert ? "~(" + e + ")" : "(" + e + ")") << " & " << m << ";\n";
+			break;
+		}
+		case CELL_NOT:
+			out << "\tunsigned " << o << " = ~(" << in(1) << ") & " << m << ";\n";
+			break;
+		case CELL_MUX:
+			out << "\tconst unsigned " << o << "_in[] = {";
+
+			for (int k = 0; k < c.inputs; k++)
+				out << (k ? ", " : "") << in(2 + k);
+
+			out << "};\n\tunsigned " << o << " = " << o << "_in[" << in(1) << "];\n";
+			break;
+		case CELL_DEMUX:
+			out << "\tunsigned " << o << " = " << in(0) << ";\n\tunsigned " << var(i, 1) << " = " << in(1) << ";\n";
+
+			for (int k = 0; k < c.inputs; k++)
+				if (read(2 + k))
+					out << "\tunsigned " << var(i, 2 + k) << " = " << var(i, 1) << " == " << k << " ? " << o << " : 0;\n";
+			break;
+		case CELL_ADDER:
+		case CELL_SUBTRACTOR: {
+
+			int w = (int) ports[0].size();
+			const char * op = c.kind == CELL_ADDER ? " + " : " - ";
+
+			out << "\tunsigned long long " << o << "_full = (unsigned long long) (" << in(1) << ")" << op << "(" << in(2) << ")"
+				<< op << "(" << in(3) << ");\n";
+			out << "\tunsigned " << o << " = (unsigned) " << o << "_full & " << m << ";\n";
+			if (read(4))
+				out << "\tunsigned " << var(i, 4) << " = (unsigned) (" << o << "_full >> " << w << ") & 1;\n";
+			break;
+		}
+		case CELL_EXTENDER: {
+
+			int w = (int) ports[1].size();
+			int extra = (int) ports[0].size() - w;
+			string high = extra > 0 ? mask(extra) + " << " + to_string(w) : "0";
+
+			out << "\tunsigned " << o << "_in = " << in(1) << ";\n";
+
+			if (extra <= 0 || c.extend == EXT_ZERO)
+				out << "\tunsigned " << o << " = " << o << "_in & " << m << ";\n";
+			else if (c.extend == EXT_ONE)
+				out << "\tunsigned " << o << " = " << o << "_in | (" << high << ");\n";
+			else {
+
+				string fill = c.extend == EXT_SIGN ? "(" + o + "_in >> " + to_string(w - 1) + ") & 1" : in(2);
+
+				out << "\tunsigned " << o << " = " << o << "_in | (" << fill << " ? " << high << " : 0);\n";
+			}
+			break;
+		}
+		case CELL_REGISTER: {
+
+			int slot = state_slot[i];
+
+			if (n.driver[ports[4][0]] >= 0)
+				out << "\tif (" << in(4) << ")\n\t\ts.q[" << slot << "] = 0;\n";			// clear does not wait for the clock
+
+			if (read(0))
+				out << "\tunsigned " << o << " = s.q[" << slot << "];\n";
+			break;
+		}
+		case CELL_FLIPFLOP: {
+
+			int slot = state_slot[i];
+
+			out << "\tif (" << in(4) << ")\n\t\ts.q[" << slot << "] = 1;\n\telse if (" << in(5) << ")\n\t\ts.q[" << slot << "] = 0;\n";
+			out << "\tunsigned " << o << " = s.q[" << slot << "];\n";
+
+			if (read(1))
+				out << "\tunsigned " << var(i, 1) << " = " << o << " ^ 1;\n";
+			break;
+		}
+		case CELL_ROM:
+		case CELL_RAM: {
+
+			int slot = memory_slot[i];
+			int first = c.kind == CELL_ROM ? 1 : 3 + 2 * c.lines;
+
+			out << "\tunsigned " << var(i, 0) << "_base = (" << in(0) << ") & ~" << c.lines - 1 << "u;\n";
+
+			for (int k = 0; k < c.lines; k++)
+				if (read(first + k))
+					out << "\tunsigned " << var(i, first + k) << " = s.mem" << slot << "[" << var(i, 0) << "_base + " << k << "];\n";
+			break;
+		}
+	}
+}
+
+
+void write_edge(ostream& out, const netlist& n, bool fall) {
+
+	for (int i : n.order) {
+
+		const cell& c = n.cells[i];
+		auto in = [&](int p, bool fill = false) { return bits_value(n, c.ports[p], fill); };
+
+		if (falling[i] != fall)
+			continue;
+
+		if (c.kind == CELL_REGISTER)			// a floating enable leaves the register enabled
+			out << "\tif ((" << in(2, true) << ") && !(" << in(4) << "))\n\t\ts.q[" << state_slot[i] << "] = " << in(1) << ";\n";
+		else if (c.kind == CELL_FLIPFLOP)
+			out << "\tif (!(" << in(4) << ") && !(" << in(5) << "))\n\t\ts.q[" << state_slot[i] << "] = " << in(2) << ";\n";
+		else if (c.kind == CELL_RAM) {
+
+			out << "\n\tif (" << in(1) << ") {\n\n";
+
+			for (int k = 0; k < c.lines; k++)
+				out << "\t\tif (" << in(3 + k, true) << ")\n\t\t\ts.mem" << memory_slot[i] << "[" << var(i, 0) << "_base + " << k
+					<< "] = " << in(3 + c.lines + k) << ";\n";
+
+			out << "\t}\n";
+		}
+	}
+}
+
+
+int write_evaluator(const netlist& n, const char * circ_name, const char * file_name) {
+
+	vector <int> registers, memories;
+	int clock = -1, program = -1;
+
+	state_slot.assign(n.cells.size(), -1);
+	memory_slot.assign(n.cells.size(), -1);
+
+	for (size_t i = 0; i < n.cells.size(); i++) {
+
+		const cell& c = n.cells[i];
+
+		if (c.kind == CELL_CLOCK) {
+
+			if (clock >= 0) {
+
+				cout << "more than one clock: " << n.cells[clock].path << " and " << c.path << endl;
+				return FAIL;
+			}
+
+			clock = (int) i;
+		}
+
+		for (const auto& port : c.ports) {
+
+			if (port.size() > 32) {
+
+				cout << c.path << ": signals wider than 32 bits are not supported" << endl;
+				return FAIL;
+			}
+		}
+
+		if (c.kind == CELL_REGISTER || c.kind == CELL_FLIPFLOP) {
+
+			state_slot[i] = (int) registers.size();
+			registers.push_back((int) i);
+		} else if (c.kind == CELL_ROM || c.kind == CELL_RAM) {
+
+			if (c.width > 8) {
+
+				cout << c.path << ": only byte wide memories are supported" << endl;
+				return FAIL;
+			}
+
+			if (program < 0 && c.kind == CELL_ROM && c.path.find('/', 1) == string::npos)
+				program = (int) memories.size();			// first ROM of the top circuit holds the program
+
+			memory_slot[i] = (int) memories.size();
+			memories.push_back((int) i);
+		}
+	}
+
+	/*
+	 * Everything clocked hangs off the one clock, directly or through a single NOT gate (the ALU flags load
+	 * on the falling edge). Gated or derived clocks and logic reading the clock as data are not supported.
+	 */
+	falling.assign(n.cells.size(), false);
+
+	for (size_t i = 0; i < n.cells.size(); i++) {
+
+		const cell& c = n.cells[i];
+		int clk = c.kind == CELL_REGISTER || c.kind == CELL_FLIPFLOP ? 3 : c.kind == CELL_RAM ? 2 : -1;
+
+		for (size_t p = 0; clock >= 0 && p < c.ports.size(); p++) {
+
+			bool inverter = c.kind == CELL_NOT && p == 1;
+
+			for (int b : c.ports[p]) {
+
+				if (cell_combinational_input(c, (int) p) && n.driver[b] == clock && !inverter) {
+
+					cout << c.path << " reads the clock as data" << endl;
+					return FAIL;
+				}
+			}
+		}
+
+		if (clk < 0)
+			continue;
+
+		int d = n.driver[c.ports[clk][0]];
+
+		if (d >= 0 && d != clock && n.cells[d].kind == CELL_NOT && c.kind != CELL_RAM && n.driver[n.cells[d].ports[1][0]] == clock)
+			falling[i] = true;
+		else if (clock < 0 || d != clock) {
+
+			cout << c.path << " is not clocked by the circuit clock" << endl;
+			return FAIL;
+		}
+	}
+
+	/* Logic settled before the falling edge: everything the falling edge registers load from */
+	vector <bool> cone(n.cells.size(), false);
+	vector <int> work;
+
+	for (size_t i = 0; i < n.cells.size(); i++)
+		if (falling[i])
+			work.push_back((int) i);
+
+	while (!work.empty()) {
+
+		int i = work.back();
+		const cell& c = n.cells[i];
+
+		work.pop_back();
+
+		for (size_t p = 0; p < c.ports.size(); p++) {
+
+			if (cell_output(c, (int) p) || (falling[i] ? p == 3 : !cell_combinational_input(c, (int) p)))
+				continue;			// a falling edge register loads from everything but its clock
+
+			for (int b : c.ports[p]) {
+
+				int d = n.driver[b];
+
+				if (d >= 0 && !cone[d]) {
+
+					cone[d] = true;
+					work.push_back(d);
+				}
+			}
+		}
+	}
+
+	ofstream out(file_name, ios::out | ios::trunc);
+
+	if (!out.is_open()) {
+
+		cout << "Unable to open output file [" << file_name << "]" << endl;
+		return FAIL;
+	}
+
+	out << "// Generated by gatesim from " << circ_name << ", one statement group per component in evaluation order\n\n";
+	out << "#include <iostream>\n#include <fstream>\n#include <cstring>\n#include <cstdlib>\n#include <chrono>\n\nusing namespace std;\n\n\n";
+	out << "#define GATES_REGISTERS\t\t" << registers.size() << "\n#define GATES_MEMORIES\t\t" << memories.size() << "\n\n\n";
+
+	/* State: register contents and memory arrays */
+	out << "struct gates_state {\n\n\tunsigned q[GATES_REGISTERS];\t\t\t// registers and flip-flops\n";
+
+	for (size_t k = 0; k < memories.size(); k++)
+		out << "\tunsigned char mem" << k << "[" << (1u << n.cells[memories[k]].ports[0].size()) << "];\t\t\t// " << n.cells[memories[k]].path << "\n";
+
+	out << "\tunsigned long long cycles;\n};\n\n";
+
+	out << "const char * const gates_register_names[GATES_REGISTERS] = {\n";
+
+	for (int i : registers)
+		out << "\t\"" << n.cells[i].path << "\",\n";
+
+	out << "};\n\nconst char * const gates_memory_names[GATES_MEMORIES] = {\n";
+
+	for (int i : memories)
+		out << "\t\"" << n.cells[i].path << "\",\n";
+
+	out << "};\n\n";
+
+	if (program >= 0)
+		out << "#define GATES_PROGRAM_ROM\t\tgates_memory_names[" << program << "]\n\n";
+
+	/* Contents saved in the circuit, loaded by gates_reset */
+	for (size_t k = 0; k < memories.size(); k++) {
+
+		const cell& c = n.cells[memories[k]];
+
+		if (c.contents.empty())
+			continue;
+
+		out << "static const unsigned char mem" << k << "_contents[" << c.contents.size() << "] = {";
+
+		for (size_t w = 0; w < c.contents.size(); w++)
+			out << (w % 16 ? " " : "\n\t") << hex_word(c.contents[w]) << (w + 1 < c.contents.size() ? "," : "");
+
+		out << "\n};\n\n";
+	}
+
+	/* Lookup and loading helpers */
+	out << "\n/* Returns the slot of the register at path, -1 if there is none */\n";
+	out << "int gates_register(const char * path) {\n\n\tfor (int i = 0; i < GATES_REGISTERS; i++)\n\t\tif (!strcmp(gates_register_names[i], path))\n\t\t\treturn i;\n\n\treturn -1;\n}\n\n\n";
+
+	/* Accessors for code built against this file without the struct layout */
+	out << "/* Returns the contents of register slot */\n";
+	out << "unsigned gates_read(const gates_state& s, int slot) {\n\n\treturn s.q[slot];\n}\n\n\n";
+
+	out << "/* Returns the array of the ROM or RAM at path and its size, nullptr if there is none */\n";
+	out << "unsigned char * gates_memory(gates_state& s, const char * path, unsigned& size) {\n\n";
+
+	for (size_t k = 0; k < memories.size(); k++)
+		out << "\tif (!strcmp(path, gates_memory_names[" << k << "])) {\n\n\t\tsize = sizeof(s.mem" << k << ");\n\t\treturn s.mem" << k << ";\n\t}\n\n";
+
+	out << "\treturn nullptr;\n}\n\n\n";
+
+	out << "/* Clears registers and RAM, ROMs get the contents saved in the circuit */\n";
+	out << "void gates_reset(gates_state& s) {\n\n\tmemset(&s, 0, sizeof(s));\n";
+
+	for (size_t k = 0; k < memories.size(); k++)
+		if (!n.cells[memories[k]].contents.empty())
+			out << "\tmemcpy(s.mem" << k << ", mem" << k << "_contents, sizeof(mem" << k << "_contents));\n";
+
+	out << "}\n\n\n";
+
+	out << "/* Allocates a state, reset */\n";
+	out << "gates_state * gates_new() {\n\n\tgates_state * s = new gates_state;\n\n\tgates_reset(*s);\n\n\treturn s;\n}\n\n\n";
+
+	out << "/* Replaces the contents of memory path with a binary file, returns 1 on success, -1 if either is missing */\n";
+	out << "int gates_load(gates_state& s, const char * path, const char * file_name) {\n\n";
+	out << "\tunsigned size;\n\tunsigned char * mem = gates_memory(s, path, size);\n\tifstream bin(file_name, ios::in | ios::binary);\n\n";
+	out << "\tif (!mem || !bin.is_open())\n\t\treturn -1;\n\n\tmemset(mem, 0, size);\n\tbin.read((char *) mem, size);\n\n\treturn 1;\n}\n\n\n";
+
+	/* A clock period starts high, so the falling edge comes first and the rising edge ends it */
+	out << "/* One clock period: the falling edge with the clock high, then the rising edge with the clock low */\n";
+	out << "void gates_cycle(gates_state& s) {\n";
+
+	if (find(falling.begin(), falling.end(), true) != falling.end()) {
+
+		out << "\n\t{\n";
+		start_pass(n, cone, true);
+
+		for (int i : n.order)
+			if (cone[i])
+				write_cell(out, n, i);
+
+		out << "\n\t// falling edge\n";
+		write_edge(out, n, true);
+		out << "\t}\n";
+	}
+
+	start_pass(n, vector <bool> (n.cells.size(), true), false);
+
+	for (int i : n.order)
+		write_cell(out, n, i);
+
+	out << "\n\t// rising edge, everything below samples values settled above\n";
+	write_edge(out, n, false);
+	out << "\n\ts.cycles++;\n}\n\n\n";
+
+	/* Standalone runner */
+	out << "#ifndef HBCP_NO_MAIN\n\n";
+	out << "static gates_state state;\n\n\n";
+	out << "int main(int argc, char * argv[]) {\n\n";
+	out << "\tunsigned long long cycles = argc > 2 ? strtoull(argv[2], nullptr, 0) : 1000000;\n\n";
+	out << "\tgates_reset(state);\n\n";
+	out << "\tif (argc > 1 && gates_load(state, GATES_PROGRAM_ROM, argv[1]) < 0) {\n\n";
+	out << "\t\tcout << \"Unable to open program file [\" << argv[1] << \"]\" << endl;\n\t\treturn -1;\n\t}\n\n";
+	out << "\tauto start = chrono::steady_clock::now();\n\n";
+	out << "\twhile (state.cycles < cycles)\n\t\tgates_cycle(state);\n\n";
+	out << "\tdouble seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();\n\n";
+	out << "\tfor (int i = 0; i < GATES_REGISTERS; i++)\n\t\tcout << gates_register_names[i] << \" = 0x\" << hex << state.q[i] << dec << endl;\n\n";
+	out << "\tcout << state.cycles << \" cycles, \" << state.cycles / seconds / 1e6 << \" MHz\" << endl;\n\n";
+	out << "\treturn 0;\n}\n\n#endif\n";
+
+	out.close();
+
+	return SUCCESS;
+}
@@ -0,0 +1,481 @@
+#include "simulator.h"
+
+
+#if defined(__GNUC__)
+	#define THREADED_DISPATCH		1			// labels as values: every handler jumps straight to the next one
+#endif
+
+#define CODE_ENTRIES		(MEM_SIZE / 2)			// one entry for every word of program ROM
+
+/* Define EAGER_FLAGS to work out NZCV after every ALU instruction instead, for benchmark to compare against */
+
+/*
+ * Pairs of instructions interp_predecode fuses into one superinstruction, the ones that run back to back most in
+ * fibonacci, gcd and the benchmark programs: a compare or a countdown with the conditional branch after it, and the
+ * ALU pairs at the ends of their loops. X(first, second) for each.
+ */
+#define SUPERINSTRUCTIONS(X) \
+	X(cmpi, bne) X(cmpi, beq) X(cmpi, bhs) X(cmpi, blo) X(cmpi, bge) X(cmpi, blt) \
+	X(cmp, bne) X(cmp, beq) X(cmp, bhs) X(cmp, blo) X(cmp, bge) X(cmp, blt) \
+	X(subi, bne) X(subi, beq) X(subi, bhs) X(subi, blo) X(subi, bge) X(subi, blt) \
+	X(addr, subi) X(addr, bra) X(subr, bra) X(mvi, mvi)
+
+#define SUPER_ENUM(first, second)		first##_##second,
+#define SUPER_NAME(first, second)		#first "+" #second,
+
+/* Dispatch numbers of the superinstructions, after the 32 opcodes */
+enum superinstructions {
+
+	super_before = 31,
+	SUPERINSTRUCTIONS(SUPER_ENUM)
+	super_end
+};
+
+#define SUPER_FIRST			32
+#define SUPER_COUNT			(super_end - SUPER_FIRST)
+
+
+/*
+ * Instruction decoded once by interp_predecode, so executing it needs no shifting or masking.
+ * An entry is built for every ROM word, not only for words the assembler started an instruction on,
+ * so jumping or returning into the middle of a 4 byte instruction still runs whatever the hardware would fetch.
+ */
+struct decoded {
+
+	const void * handler;			// threaded code address, filled in by interp_run
+	const decoded * next;			// fall through instruction
+	const decoded * target;			// branch, jmp and call destination
+	unsigned short imm;				// ALU operand, RAM address or return address
+	unsigned char op;
+	unsigned char kind;				// op, or the superinstruction of op and the instruction at next
+	unsigned char rd, rs;
+};
+
+
+static decoded code[CODE_ENTRIES];
+static bool threaded = false;			// handlers are only known inside interp_run
+
+static const char * const super_names[SUPER_COUNT] = {SUPERINSTRUCTIONS(SUPER_NAME)};
+static unsigned int super_sites[SUPER_COUNT];				// ROM words fused into each superinstruction
+static unsigned long long super_fired[SUPER_COUNT];			// times each ran since interp_predecode
+
+
+/* Returns the ROM word index of an address, wrapping at the end of program memory */
+static inline int code_index(int address) {
+
+	return (address >> 1) & (CODE_ENTRIES - 1);
+}
+
+
+void interp_predecode(const machine& m) {
+
+	for (int i = 0; i < CODE_ENTRIES; i++) {
+
+		unsigned short pc = i << 1;
+		unsigned short word = rom_read_word(m, pc);
+		unsigned short address = rom_read_word(m, pc + 2);			// second word of 4 byte instructions
+		decoded& d = code[i];
+
+		d.op = word >> 11;
+		d.rd = (word >> 8) & 7;
+		d.rs = word & 7;
+		d.imm = sext8(word);
+		d.next = &code[code_index(pc + 2)];
+		d.target = nullptr;
+
+		switch (d.op) {
+
+			case opcodes::mvi:
+				d.imm = word & 0xff;			// B_ID zero extends the low byte
+				break;
+			case opcodes::bra: case opcodes::bne: case opcodes::beq: case opcodes::bhs:
+			case opcodes::blo: case opcodes::bge: case opcodes::blt: case opcodes::bvs: case opcodes::bvc:
+				d.target = &code[code_index(pc + 2 + sext8(word))];			// relative to the following instruction
+				break;
+			case opcodes::ldr: case opcodes::ldrb: case opcodes::str: case opcodes::strb:
+				d.imm = address;
+				d.next = &code[code_index(pc + 4)];
+				break;
+			case opcodes::call:
+				d.imm = pc + 4;			// return address pushed on the stack
+				d.target = &code[code_index(address)];
+				d.next = &code[code_index(pc + 4)];
+				break;
+			case opcodes::jmp:
+				d.target = &code[code_index(address)];
+				d.next = &code[code_index(pc + 4)];
+				break;
+		}
+	}
+
+	/*
+	 * An entry runs its own instruction and the one at next with a single dispatch. The entry at next is left as it is,
+	 * so a branch to the second instruction runs only that one. Both are one word long, so the second is the entry after
+	 * the first and whatever follows it the one after that; the branch target is copied into the first, which has none of
+	 * its own. A branch to itself is left alone so interp_run still sees it halt, and so is the end of ROM where entries wrap.
+	 */
+	unsigned char fuse[32][32] = {};
+
+	#define SUPER_TABLE(first, second)		fuse[opcodes::first][opcodes::second] = first##_##second;
+	SUPERINSTRUCTIONS(SUPER_TABLE)
+	#undef SUPER_TABLE
+
+	for (int i = 0; i < SUPER_COUNT; i++)
+		super_sites[i] = 0, super_fired[i] = 0;
+
+	for (int i = 0; i < CODE_ENTRIES; i++) {
+
+		decoded& d = code[i];
+
+		d.kind = d.op;
+
+		if (i + 2 >= CODE_ENTRIES || !fuse[d.op][d.next->op] || d.next->target == d.next)
+			continue;
+
+		d.kind = fuse[d.op][d.next->op];
+		d.target = d.next->target;
+		super_sites[d.kind - SUPER_FIRST]++;
+	}
+
+	threaded = false;
+}
+
+
+int interp_superinstruction(int i, const char *& name, unsigned int& sites, unsigned long long& fired) {
+
+	if (i < 0 || i >= SUPER_COUNT)
+		return FAIL;
+
+	name = super_names[i];
+	sites = super_sites[i];
+	fired = super_fired[i];
+
+	return SUCCESS;
+}
+
+
+/*
+ * Executes the predecoded program from m.pc, one ISA instruction or superinstruction per dispatch.
+ * A superinstruction counts as the two instructions it runs; with one instruction of the budget left it runs only the first.
+ *
+ * Flags are kept in the lazy_flags form: an ALU instruction only saves its result (and its operands if it adds or
+ * subtracts), the flag a branch tests is worked out when the branch runs, and NZCV are written back to m on return.
+ *
+ * This is the architectural model, not the pipeline: ALU results and flags follow alu_eval exactly,
+ * but the pipeline hazards of the circuit are not reproduced (the word after bra/jmp entering decode,
+ * and the register read ports following the writeback instruction during a push). Programs that step
+ * on those hazards only agree with pipeline_run when the affected slot holds a nop.
+ */
+int interp_run(machine& m, unsigned long long max_instructions) {
+
+#ifdef THREADED_DISPATCH
+	#define SUPER_LABEL(first, second)		&&op_##first##_##second,
+
+	static const void * const handlers[SUPER_FIRST + SUPER_COUNT] = {
+		&&op_nop, &&op_mvi, &&op_addi, &&op_subi, &&op_andi, &&op_ori, &&op_cmpi, &&op_bra,
+		&&op_bne, &&op_beq, &&op_bhs, &&op_blo, &&op_bge, &&op_blt, &&op_bvs, &&op_bvc,
+		&&op_mvr, &&op_addr, &&op_subr, &&op_andr, &&op_orr, &&op_notr, &&op_cmp, &&op_ldr,
+		&&op_ldrb, &&op_str, &&op_strb, &&op_push, &&op_pop, &&op_call, &&op_ret, &&op_jmp,
+		SUPERINSTRUCTIONS(SUPER_LABEL)
+	};
+
+	#undef SUPER_LABEL
+
+	if (!threaded) {
+
+		for (int i = 0; i < CODE_ENTRIES; i++)
+			code[i].handler = handlers[code[i].kind];
+
+		threaded = true;
+	}
+
+	#define OP(name)		op_##name
+	#define SUPER(name)		op_##name
+	#define NEXT()			do { if (!--budget) goto limit; goto *d->handler; } while (0)
+	#define SINGLE()		goto *handlers[d->op]
+#else
+	#define OP(name)		case opcodes::name
+	#define SUPER(name)		case superinstructions::name
+	#define NEXT()			do { if (!--budget) goto limit; goto dispatch; } while (0)
+	#define SINGLE()		do { kind = d->op; goto select; } while (0)
+
+	int kind;
+#endif
+
+	/* Working copies, so stores into RAM cannot alias the registers */
+	unsigned short r[NUM_REGS];
+	unsigned char sp = m.sp;
+#ifdef EAGER_FLAGS
+	bool n = m.n, z = m.z, c = m.c, v = m.v;
+#else
+	lazy_flags f;
+
+	lazy_from_machine(f, m);
+#endif
+
+	for (int i = 0; i < NUM_REGS; i++)
+		r[i] = m.regs[i];
+
+	const decoded * d = &code[code_index(m.pc)];
+	unsigned long long budget = max_instructions;
+	unsigned short e;
+	bool cout, vout;
+	int result;
+
+	/* ALU operations, flags are updated the same way alu_set_flags does */
+#ifdef EAGER_FLAGS
+	#define ARITH(os, a, b)		do { e = alu_eval(a, b, os, cout, vout); n = e >> 15; z = e == 0; c = cout; v = vout; } while (0)
+	#define LOGIC(os, a, b)		do { e = alu_eval(a, b, os, cout, vout); n = e >> 15; z = e == 0; } while (0)
+	#define FLAG_N				n
+	#define FLAG_Z				z
+	#define FLAG_C				c
+	#define FLAG_V				v
+#else
+	#define ARITH(os, a, b)		do { f.cv_a = a; f.cv_b = (os) == SUB ? (unsigned short) ~(b) : (b); f.cv_cin = (os) == SUB; e = f.res = f.cv_a + f.cv_b + f.cv_cin; } while (0)
+	#define LOGIC(os, a, b)		do { e = f.res = alu_eval(a, b, os, cout, vout); } while (0)
+	#define FLAG_N				(f.res >> 15)
+	#define FLAG_Z				(f.res == 0)
+	#define FLAG_C				lazy_c(f)
+	#define FLAG_V				lazy_v(f)
+#endif
+	#define BRANCH(taken)		do { if (taken) { if (d->target == d) goto halt; d = d->target; } else d = d->next; NEXT(); } while (0)
+
+	/* Halves of the superinstructions: FIRST_ runs the instruction at d, THEN_ the one at d + 1 and dispatches the next */
+	#define FIRST_cmpi			ARITH(SUB, r[d->rd], d->imm)
+	#define FIRST_cmp			ARITH(SUB, r[d->rd], r[d->rs])
+	#define FIRST_subi			do { ARITH(SUB, r[d->rd], d->imm); r[d->rd] = e; } while (0)
+	#define FIRST_addr			do { ARITH(ADD, r[d->rd], r[d->rs]); r[d->rd] = e; } while (0)
+	#define FIRST_subr			do { ARITH(SUB, r[d->rd], r[d->rs]); r[d->rd] = e; } while (0)
+	#define FIRST_mvi			do { LOGIC(B_ID, 0, d->imm); r[d->rd] = e; } while (0)
+	#define FUSED_BRANCH(taken)	do { d = (taken) ? d->target : d + 2; NEXT(); } while (0)
+	#define THEN_bra			FUSED_BRANCH(true)
+	#define THEN_bne			FUSED_BRANCH(!FLAG_Z)
+	#define THEN_beq			FUSED_BRANCH(FLAG_Z)
+	#define THEN_bhs			FUSED_BRANCH(FLAG_C)
+	#define THEN_blo			FUSED_BRANCH(!FLAG_C)
+	#define THEN_bge			FUSED_BRANCH(FLAG_Z || FLAG_N == FLAG_V)
+	#define THEN_blt			FUSED_BRANCH(FLAG_N != FLAG_V)
+	#define THEN_subi			do { d++; FIRST_subi; d++; NEXT(); } while (0)
+	#define THEN_mvi			do { d++; FIRST_mvi; d++; NEXT(); } while (0)
+	#define FUSED(first, second) \
+		SUPER(first##_##second): \
+			if (budget == 1) \
+				SINGLE(); \
+			FIRST_##first; \
+			super_fired[superinstructions::first##_##second - SUPER_FIRST]++; \
+			budget--; \
+			THEN_##second;
+
+	if (!budget)
+		goto limit;
+
+#ifdef THREADED_DISPATCH
+	goto *d->handler;
+#else
+dispatch:
+	kind = d->kind;
+select:
+	switch (kind) {
+#endif
+
+	OP(nop):
+		d = d->next;
+		NEXT();
+
+	OP(mvi):
+		LOGIC(B_ID, 0, d->imm);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(addi):
+		ARITH(ADD, r[d->rd], d->imm);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(subi):
+		ARITH(SUB, r[d->rd], d->imm);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(andi):
+		LOGIC(AND, r[d->rd], d->imm);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(ori):
+		LOGIC(OR, r[d->rd], d->imm);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(cmpi):
+		ARITH(SUB, r[d->rd], d->imm);
+		d = d->next;
+		NEXT();
+
+	OP(bra):	BRANCH(true);
+	OP(bne):	BRANCH(!FLAG_Z);
+	OP(beq):	BRANCH(FLAG_Z);
+	OP(bhs):	BRANCH(FLAG_C);
+	OP(blo):	BRANCH(!FLAG_C);
+	OP(bge):	BRANCH(FLAG_Z || FLAG_N == FLAG_V);
+	OP(blt):	BRANCH(FLAG_N != FLAG_V);
+	OP(bvs):	BRANCH(FLAG_V);
+	OP(bvc):	BRANCH(!FLAG_V);
+
+	OP(mvr):
+		LOGIC(B_ID, 0, r[d->rs]);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(addr):
+		ARITH(ADD, r[d->rd], r[d->rs]);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(subr):
+		ARITH(SUB, r[d->rd], r[d->rs]);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(andr):
+		LOGIC(AND, r[d->rd], r[d->rs]);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(orr):
+		LOGIC(OR, r[d->rd], r[d->rs]);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(notr):
+		LOGIC(NOT, 0, r[d->rs]);
+		r[d->rd] = e;
+		d = d->next;
+		NEXT();
+
+	OP(cmp):
+		ARITH(SUB, r[d->rd], r[d->rs]);
+		d = d->next;
+		NEXT();
+
+	OP(ldr):
+		r[d->rd] = ram_read_word(m, d->imm);
+		d = d->next;
+		NEXT();
+
+	OP(ldrb):
+		r[d->rd] = m.ram[d->imm];
+		d = d->next;
+		NEXT();
+
+	OP(str):
+		ram_write_word(m, d->imm, r[d->rd]);
+		d = d->next;
+		NEXT();
+
+	OP(strb):
+		m.ram[d->imm] = (unsigned char) r[d->rd];
+		d = d->next;
+		NEXT();
+
+	OP(push):
+		ram_write_word(m, sp, r[d->rd]);
+		sp += 2;
+		d = d->next;
+		NEXT();
+
+	OP(pop):
+		sp -= 2;
+		r[d->rd] = ram_read_word(m, sp);
+		d = d->next;
+		NEXT();
+
+	OP(call):
+		ram_write_word(m, sp, d->imm);
+		sp += 2;
+		d = d->target;
+		NEXT();
+
+	OP(ret):
+		sp -= 2;
+		d = &code[code_index(ram_read_word(m, sp))];
+		NEXT();
+
+	OP(jmp):
+		if (d->target == d)
+			goto halt;
+		d = d->target;
+		NEXT();
+
+	SUPERINSTRUCTIONS(FUSED)
+
+#ifndef THREADED_DISPATCH
+	}
+#endif
+
+halt:
+	m.halt_pc = (d - code) << 1;
+	budget--;			// the jump to itself counts as executed
+	result = RUN_HALT;
+	goto done;
+
+limit:
+	result = RUN_LIMIT;
+
+done:
+	for (int i = 0; i < NUM_REGS; i++)
+		m.regs[i] = r[i];
+
+#ifdef EAGER_FLAGS
+	m.n = n;
+	m.z = z;
+	m.c = c;
+	m.v = v;
+#else
+	lazy_to_machine(m, f);
+#endif
+	m.sp = sp;
+	m.pc = (d - code) << 1;
+	m.retired += max_instructions - budget;
+
+	return result;
+
+	#undef OP
+	#undef SUPER
+	#undef NEXT
+	#undef SINGLE
+	#undef ARITH
+	#undef LOGIC
+	#undef FLAG_N
+	#undef FLAG_Z
+	#undef FLAG_C
+	#undef FLAG_V
+	#undef BRANCH
+	#undef FIRST_cmpi
+	#undef FIRST_cmp
+	#undef FIRST_subi
+	#undef FIRST_addr
+	#undef FIRST_subr
+	#undef FIRST_mvi
+	#undef FUSED_BRANCH
+	#undef THEN_bra
+	#undef THEN_bne
+	#undef THEN_beq
+	#undef THEN_bhs
+	#undef THEN_blo
+	#undef THEN_bge
+	#undef THEN_blt
+	#undef THEN_subi
+	#undef THEN_mvi
+	#undef FUSED
+}
@@ -0,0 +1,643 @@
+#include <vector>
+#include <cstddef>
+
+#include "simulator.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+	#include <sys/mman.h>
+	#define JIT_X86_64			1			// System V calling convention, mmap for executable memory
+#endif
+
+using namespace std;
+
+
+#define CODE_ENTRIES		(MEM_SIZE / 2)
+#define JIT_BUFFER_SIZE		(8 << 20)			// translation cache, flushed whole when full
+#define MAX_BLOCK			64					// instructions per basic block
+#define MAX_BLOCK_BYTES		(MAX_BLOCK * 48 + 256)			// host code for the longest block and its exits
+
+/* Why translated code returned to jit_run */
+#define EXIT_NONE			0			// pc is not translated yet, or ret went somewhere new
+#define EXIT_HALT			1			// branch or jump to itself
+#define EXIT_BUDGET			2			// next block is longer than the instructions left
+
+
+/* Lives in rbx while translated code runs, the flags in the lazy form the interpreter uses too */
+struct jit_context {
+
+	unsigned long long budget;			// instructions left
+	unsigned short pc;					// guest pc on exit
+	unsigned char status;				// EXIT_*
+	lazy_flags flags;
+};
+
+
+static jit_context ctx;
+
+
+#ifdef JIT_X86_64
+
+/* Host registers, guest rN lives in r(8 + N) */
+#define RAX			0
+#define RCX			1
+#define RDX			2
+#define RBX			3			// jit_context
+#define RBP			5			// machine
+#define RSI			6
+#define RDI			7
+#define GUEST(r)	(8 + (r))
+
+/* Condition codes for jcc/setcc */
+#define CC_O		0x0
+#define CC_NO		0x1
+#define CC_B		0x2
+#define CC_AE		0x3
+#define CC_E		0x4
+#define CC_NE		0x5
+#define CC_L		0xc
+#define CC_GE		0xd
+
+#define CTX(field)		((int) offsetof(jit_context, field))
+#define MACHINE(field)	((int) offsetof(machine, field))
+
+
+static unsigned char * buffer = nullptr;			// executable memory
+static unsigned char * emit_ptr;					// next free byte
+static unsigned char * enter_stub;					// void enter(jit_context *, machine *, const void * block)
+static unsigned char * exit_stub;					// stores guest registers and returns to jit_run
+
+static unsigned char * blocks[CODE_ENTRIES];		// translated block for each ROM word, or null
+static vector <unsigned char *> pending[CODE_ENTRIES];			// exits waiting for a block to be translated
+
+
+/* Instruction encoding */
+static void emit8(int b) { *emit_ptr++ = (unsigned char) b; }
+static void emit16(int v) { emit8(v); emit8(v >> 8); }
+static void emit32(int v) { emit16(v); emit16(v >> 16); }
+static void emit64(unsigned long long v) { emit32((int) v); emit32((int) (v >> 32)); }
+
+static void prefix(int size, int reg, int index, int base) {
+
+	if (size == 16)
+		emit8(0x66);
+
+	int rex = 0x40 | ((size == 64) << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+
+	if (rex != 0x40 || (size == 8 && (reg >= 4 || base >= 4)))			// spl..dil need an empty REX
+		emit8(rex);
+}
+
+static void opcode(int op) {
+
+	if (op > 0xff)
+		emit8(op >> 8);
+	emit8(op);
+}
+
+/* op reg, rm with both operands registers */
+static void rr(int size, int op, int reg, int rm) {
+
+	prefix(size, reg, 0, rm);
+	opcode(op);
+	emit8(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op reg, [base + index << scale + disp32] */
+static void rm(int size, int op, int reg, int base, int disp, int index = -1, int scale = 0) {
+
+	prefix(size, reg, index < 0 ? 0 : index, base);
+	opcode(op);
+
+	if (index < 0) {
+
+		emit8(0x80 | ((reg & 7) << 3) | (base & 7));
+	} else {
+
+		emit8(0x84 | ((reg & 7) << 3));
+		emit8((scale << 6) | ((index & 7) << 3) | (base & 7));
+	}
+
+	emit32(disp);
+}
+
+static void emit_jmp(const unsigned char * target) {
+
+	emit8(0xe9);
+	emit32((int) (target - (emit_ptr + 4)));
+}
+
+/* Emits jcc rel32 and returns the address of its displacement for later patching */
+static unsigned char * emit_jcc(int cc) {
+
+	emit8(0x0f);
+	emit8(0x80 | cc);
+	emit32(0);
+
+	return emit_ptr - 4;
+}
+
+static void patch_rel32(unsigned char * displacement, const unsigned char * target) {
+
+	int rel = (int) (target - (displacement + 4));
+
+	for (int i = 0; i < 4; i++)
+		displacement[i] = (unsigned char) (rel >> (8 * i));
+}
+
+
+/* Builds the stubs that move guest registers between the machine and host registers */
+static void emit_stubs() {
+
+	emit_ptr = buffer;
+	enter_stub = emit_ptr;
+
+	emit8(0x53);										// push rbx
+	emit8(0x55);										// push rbp
+	emit8(0x41); emit8(0x54);							// push r12
+	emit8(0x41); emit8(0x55);							// push r13
+	emit8(0x41); emit8(0x56);							// push r14
+	emit8(0x41); emit8(0x57);							// push r15
+	rr(64, 0x89, RDI, RBX);							// mov rbx, rdi
+	rr(64, 0x89, RSI, RBP);							// mov rbp, rsi
+
+	for (int i = 0; i < NUM_REGS; i++)
+		rm(32, 0x0fb7, GUEST(i), RBP, MACHINE(regs) + 2 * i);			// movzx guest, word [regs]
+
+	rr(32, 0xff, 4, RDX);							// jmp rdx
+
+	exit_stub = emit_ptr;
+
+	for (int i = 0; i < NUM_REGS; i++)
+		rm(16, 0x89, GUEST(i), RBP, MACHINE(regs) + 2 * i);
+
+	emit8(0x41); emit8(0x5f);							// pop r15
+	emit8(0x41); emit8(0x5e);
+	emit8(0x41); emit8(0x5d);
+	emit8(0x41); emit8(0x5c);
+	emit8(0x5d);										// pop rbp
+	emit8(0x5b);										// pop rbx
+	emit8(0xc3);										// ret
+}
+
+
+/* Drops every translation */
+static void flush_cache() {
+
+	for (int i = 0; i < CODE_ENTRIES; i++) {
+
+		blocks[i] = nullptr;
+		pending[i].clear();
+	}
+
+	emit_stubs();
+}
+
+
+/*
+ * Leaves the block for a guest address known at translation time, halting if it is the address of the jump itself (from).
+ * The exit starts with a 5 byte store of the pc, which is overwritten by a direct jmp once the target block exists,
+ * chaining the two blocks.
+ */
+static void emit_exit(unsigned short target, int from) {
+
+	if (target == from) {			// branch or jump to itself
+
+		rm(16, 0xc7, 0, RBX, CTX(pc)); emit16(target);
+		rm(8, 0xc6, 0, RBX, CTX(status)); emit8(EXIT_HALT);
+		emit_jmp(exit_stub);
+		return;
+	}
+
+	unsigned char * site = emit_ptr;
+	unsigned char * block = (target & 1) ? nullptr : blocks[target >> 1];
+
+	if (block) {
+
+		emit_jmp(block);
+		return;
+	}
+
+	rm(16, 0xc7, 0, RBX, CTX(pc)); emit16(target);
+	emit_jmp(exit_stub);
+
+	if (!(target & 1))
+		pending[target >> 1].push_back(site);
+}
+
+
+/* Writes the condition a branch tests into the host flags from the lazy form, returns the jcc condition (N == V only for bge, its Z is tested apart) */
+static int emit_lazy_condition(int op) {
+
+	if (op == opcodes::bne || op == opcodes::beq) {
+
+		rm(16, 0x83, 7, RBX, CTX(flags.res)); emit8(0);			// cmp word [res], 0
+		return op == opcodes::beq ? CC_E : CC_NE;
+	}
+
+	rm(8, 0x8a, RCX, RBX, CTX(flags.cv_cin));				// mov cl, [cv_cin]
+	rr(8, 0x80, 0, RCX); emit8(0xff);				// add cl, 0xff: CF = carry in
+	rm(16, 0x8b, RAX, RBX, CTX(flags.cv_a));				// mov ax, [cv_a]
+	rm(16, 0x13, RAX, RBX, CTX(flags.cv_b));				// adc ax, [cv_b]: CF = C, OF = V
+
+	switch (op) {
+
+		case opcodes::bhs: return CC_B;
+		case opcodes::blo: return CC_AE;
+		case opcodes::bvs: return CC_O;
+		case opcodes::bvc: return CC_NO;
+	}
+
+	rr(8, 0x0f90, 0, RCX);							// seto cl
+	rm(16, 0x8b, RAX, RBX, CTX(flags.res));				// mov ax, [res]
+	rr(16, 0xc1, 5, RAX); emit8(15);					// shr ax, 15: N
+	rr(8, 0x38, RCX, RAX);							// cmp al, cl
+
+	return op == opcodes::bge ? CC_E : CC_NE;
+}
+
+
+static bool is_branch(int op) { return op >= opcodes::bra && op <= opcodes::bvc; }
+static bool sets_nz(int op) { return (op >= opcodes::mvi && op <= opcodes::cmpi) || (op >= opcodes::mvr && op <= opcodes::cmp); }
+static bool sets_cv(int op) { return (op >= opcodes::addi && op <= opcodes::subi) || op == opcodes::cmpi || (op >= opcodes::addr && op <= opcodes::subr) || op == opcodes::cmp; }
+static bool is_subtract(int op) { return op == opcodes::subi || op == opcodes::cmpi || op == opcodes::subr || op == opcodes::cmp; }
+static bool ends_block(int op) { return is_branch(op) || op >= opcodes::call; }
+
+
+/*
+ * Condition of a conditional branch taken straight from the host flags of the instruction in front of it (N == V only
+ * for bge, its Z is tested apart). Returns -1 when that instruction does not produce every flag the branch reads.
+ */
+static int fused_condition(int producer, int op) {
+
+	if (!sets_nz(producer))
+		return -1;
+
+	if (op == opcodes::beq)
+		return CC_E;
+	if (op == opcodes::bne)
+		return CC_NE;
+
+	if (!sets_cv(producer))
+		return -1;
+
+	bool sub = is_subtract(producer);			// x86 borrow is the inverse of the hbcp carry
+
+	switch (op) {
+
+		case opcodes::bhs: return sub ? CC_AE : CC_B;
+		case opcodes::blo: return sub ? CC_B : CC_AE;
+		case opcodes::bge: return CC_GE;
+		case opcodes::blt: return CC_L;
+		case opcodes::bvs: return CC_O;
+		case opcodes::bvc: return CC_NO;
+	}
+
+	return -1;
+}
+
+
+/* Emits one flag setting or data movement instruction, saving the lazy flag operands when asked to */
+static void emit_instruction(int op, int rd, int rs, unsigned short word, unsigned short address, bool save_nz, bool save_cv, bool host_flags) {
+
+	int d = GUEST(rd), s = GUEST(rs);
+	unsigned short imm = sext8(word);
+	bool sub = is_subtract(op);
+	bool immediate = op <= opcodes::cmpi;
+
+	if (save_cv) {
+
+		rm(16, 0x89, d, RBX, CTX(flags.cv_a));
+
+		if (immediate) {
+
+			rm(16, 0xc7, 0, RBX, CTX(flags.cv_b)); emit16(sub ? (unsigned short) ~imm : imm);
+		} else {
+
+			rr(32, 0x89, s, RCX);					// mov ecx, rs
+			if (sub)
+				rr(16, 0xf7, 2, RCX);				// not cx
+			rm(16, 0x89, RCX, RBX, CTX(flags.cv_b));
+		}
+
+		rm(8, 0xc6, 0, RBX, CTX(flags.cv_cin)); emit8(sub);
+	}
+
+	int result = d;			// register holding the result for N and Z
+
+	switch (op) {
+
+		case opcodes::nop:
+			break;
+		case opcodes::mvi:
+			prefix(16, 0, 0, d); emit8(0xb8 | (d & 7)); emit16(word & 0xff);			// B_ID zero extends
+			break;
+		case opcodes::addi: rr(16, 0x81, 0, d); emit16(imm); break;
+		case opcodes::subi: rr(16, 0x81, 5, d); emit16(imm); break;
+		case opcodes::andi: rr(16, 0x81, 4, d); emit16(imm); break;
+		case opcodes::ori: rr(16, 0x81, 1, d); emit16(imm); break;
+		case opcodes::cmpi:
+			rr(32, 0x89, d, RAX);
+			rr(16, 0x81, 5, RAX); emit16(imm);
+			result = RAX;
+			break;
+		case opcodes::mvr:
+			rr(32, 0x0fb6, d, s);					// movzx rd, rs low byte
+			break;
+		case opcodes::addr: rr(16, 0x01, s, d); break;
+		case opcodes::subr: rr(16, 0x29, s, d); break;
+		case opcodes::andr: rr(16, 0x21, s, d); break;
+		case opcodes::orr: rr(16, 0x09, s, d); break;
+		case opcodes::notr:
+			if (d != s)
+				rr(16, 0x89, s, d);
+			rr(16, 0xf7, 2, d);
+			break;
+		case opcodes::cmp:
+			rr(32, 0x89, d, RAX);
+			rr(16, 0x29, s, RAX);
+			result = RAX;
+			break;
+		case opcodes::ldr:
+			rm(16, 0x8b, d, RBP, MACHINE(ram) + (address & ~1));
+			rr(16, 0xc1, 0, d); emit8(8);			// rol: RAM is big endian
+			break;
+		case opcodes::ldrb:
+			rm(32, 0x0fb6, d, RBP, MACHINE(ram) + address);
+			break;
+		case opcodes::str:
+			rr(32, 0x89, d, RCX);
+			rr(16, 0xc1, 0, RCX); emit8(8);
+			rm(16, 0x89, RCX, RBP, MACHINE(ram) + (address & ~1));
+			break;
+		case opcodes::strb:
+			rm(8, 0x88, d, RBP, MACHINE(ram) + address);
+			break;
+		case opcodes::push:
+			rm(32, 0x0fb6, RAX, RBP, MACHINE(sp));
+			rr(32, 0x81, 4, RAX); emit32(0xfe);			// words are aligned
+			rr(32, 0x89, d, RCX);
+			rr(16, 0xc1, 0, RCX); emit8(8);
+			rm(16, 0x89, RCX, RBP, MACHINE(ram), RAX);
+			rm(8, 0x80, 0, RBP, MACHINE(sp)); emit8(2);
+			break;
+		case opcodes::pop:
+			rm(8, 0x80, 5, RBP, MACHINE(sp)); emit8(2);
+			rm(32, 0x0fb6, RAX, RBP, MACHINE(sp));
+			rr(32, 0x81, 4, RAX); emit32(0xfe);
+			rm(16, 0x8b, d, RBP, MACHINE(ram), RAX);
+			rr(16, 0xc1, 0, d); emit8(8);
+			break;
+	}
+
+	if (save_nz)
+		rm(16, 0x89, result, RBX, CTX(flags.res));
+
+	if (host_flags && (op == opcodes::mvi || op == opcodes::mvr || op == opcodes::notr))
+		rr(16, 0x85, result, result);				// mov and not leave the host flags alone
+}
+
+
+/* Translates the basic block starting at pc, returns its entry point or null if it cannot be translated */
+static unsigned char * translate(const machine& m, unsigned short pc) {
+
+	if (pc & 1)
+		return nullptr;
+
+	if (emit_ptr + MAX_BLOCK_BYTES > buffer + JIT_BUFFER_SIZE)
+		flush_cache();
+
+	/* Find the block and the last instruction setting each group of flags */
+	unsigned short addresses[MAX_BLOCK];
+	int count = 0, last_nz = -1, last_cv = -1;
+	unsigned short next = pc;
+
+	while (count < MAX_BLOCK) {
+
+		int op = rom_read_word(m, next) >> 11;
+
+		if (sets_nz(op))
+			last_nz = count;
+		if (sets_cv(op))
+			last_cv = count;
+
+		addresses[count++] = next;
+
+		unsigned short size = (op >= opcodes::ldr && op <= opcodes::strb) || op == opcodes::call || op == opcodes::jmp ? 4 : 2;
+		unsigned short following = next + size;
+		bool wrapped = following < next;
+
+		next = following;
+
+		if (ends_block(op) || wrapped)			// stop at control flow or the end of ROM
+			break;
+	}
+
+	unsigned char * entry = emit_ptr;
+
+	blocks[pc >> 1] = entry;
+
+	for (unsigned char * site : pending[pc >> 1]) {
+
+		unsigned char * saved = emit_ptr;
+
+		emit_ptr = site;
+		emit_jmp(entry);
+		emit_ptr = saved;
+	}
+
+	pending[pc >> 1].clear();
+
+	/* Charge the whole block up front, or leave it to the interpreter if the budget would run out inside it */
+	rm(64, 0x81, 7, RBX, CTX(budget)); emit32(count);
+	unsigned char * no_budget = emit_jcc(CC_B);
+	rm(64, 0x81, 5, RBX, CTX(budget)); emit32(count);
+
+	int last_op = rom_read_word(m, addresses[count - 1]) >> 11;
+	int fused = -1;
+
+	if (last_op >= opcodes::bne && last_op <= opcodes::bvc && count > 1 && last_nz == count - 2)
+		fused = fused_condition(rom_read_word(m, addresses[count - 2]) >> 11, last_op);
+
+	for (int i = 0; i < count; i++) {
+
+		unsigned short at = addresses[i];
+		unsigned short word = rom_read_word(m, at);
+		unsigned short address = rom_read_word(m, at + 2);
+		int op = word >> 11;
+
+		if (!ends_block(op)) {
+
+			emit_instruction(op, (word >> 8) & 7, word & 7, word, address, i == last_nz, i == last_cv, fused >= 0 && i == count - 2);
+			continue;
+		}
+
+		unsigned short fall = at + ((op == opcodes::call || op == opcodes::jmp) ? 4 : 2);
+
+		if (op == opcodes::bra) {
+
+			emit_exit(fall + sext8(word), at);
+		} else if (is_branch(op)) {
+
+			unsigned char * zero = nullptr;
+
+			/* The urom takes bge on Z or N == V, no single host condition is both */
+			if (op == opcodes::bge) {
+
+				if (fused < 0) {
+
+					rm(16, 0x83, 7, RBX, CTX(flags.res)); emit8(0);			// cmp word [res], 0
+				}
+
+				zero = emit_jcc(CC_E);
+			}
+
+			int cc = fused >= 0 ? fused : emit_lazy_condition(op);
+			unsigned char * taken = emit_jcc(cc);
+
+			emit_exit(fall, at);
+			patch_rel32(taken, emit_ptr);
+
+			if (zero)
+				patch_rel32(zero, emit_ptr);
+			emit_exit(fall + sext8(word), at);
+		} else if (op == opcodes::call) {
+
+			rm(32, 0x0fb6, RAX, RBP, MACHINE(sp));
+			rr(32, 0x81, 4, RAX); emit32(0xfe);
+			rm(16, 0xc7, 0, RBP, MACHINE(ram), RAX); emit16((fall >> 8) | (fall << 8));			// return address, big endian
+			rm(8, 0x80, 0, RBP, MACHINE(sp)); emit8(2);
+			emit_exit(address, -1);			// calling itself pushes forever rather than halting
+		} else if (op == opcodes::ret) {
+
+			rm(8, 0x80, 5, RBP, MACHINE(sp)); emit8(2);
+			rm(32, 0x0fb6, RAX, RBP, MACHINE(sp));
+			rr(32, 0x81, 4, RAX); emit32(0xfe);
+			rm(32, 0x0fb7, RAX, RBP, MACHINE(ram), RAX);
+			rr(16, 0xc1, 0, RAX); emit8(8);
+			rr(32, 0x81, 4, RAX); emit32(0xfffe);			// instructions are fetched a word at a time, like interp_run
+			rm(16, 0x89, RAX, RBX, CTX(pc));			// in case the return address is not translated
+			rr(32, 0xd1, 5, RAX);						// shr eax, 1
+			emit8(0x48); emit8(0xb9); emit64((unsigned long long) blocks);			// mov rcx, blocks
+			rm(64, 0x8b, RCX, RCX, 0, RAX, 3);			// mov rcx, [rcx + rax * 8]
+			rr(64, 0x85, RCX, RCX);
+			patch_rel32(emit_jcc(CC_E), exit_stub);
+			rr(32, 0xff, 4, RCX);						// jmp rcx
+		} else {
+
+			emit_exit(address, at);			// jmp
+		}
+	}
+
+	if (!ends_block(last_op))
+		emit_exit(next, -1);			// block cut short, fall through
+
+	patch_rel32(no_budget, emit_ptr);
+	rm(16, 0xc7, 0, RBX, CTX(pc)); emit16(pc);
+	rm(8, 0xc6, 0, RBX, CTX(status)); emit8(EXIT_BUDGET);
+	emit_jmp(exit_stub);
+
+	return entry;
+}
+
+#endif
+
+
+static bool available = false;
+
+
+int jit_init(const machine& m) {
+
+	interp_predecode(m);			// for whatever cannot be translated
+
+#ifdef JIT_X86_64
+	if (!buffer) {
+
+		void * memory = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (memory != MAP_FAILED)
+			buffer = (unsigned char *) memory;
+	}
+
+	if (buffer) {
+
+		flush_cache();
+		available = true;
+		return SUCCESS;
+	}
+#endif
+
+	available = false;
+	return FAIL;
+}
+
+
+/* Runs one instruction in the interpreter with the flags moved out of and back into the lazy form */
+static int interp_step(machine& m, unsigned long long max_instructions) {
+
+	unsigned long long before = m.retired;
+
+	lazy_to_machine(m, ctx.flags);
+
+	int result = interp_run(m, max_instructions);
+
+	lazy_from_machine(ctx.flags, m);
+	ctx.budget -= m.retired - before;
+
+	return result;
+}
+
+
+int jit_run(machine& m, unsigned long long max_instructions) {
+
+	if (!available)
+		return interp_run(m, max_instructions);
+
+	unsigned long long start = m.retired;
+	int result = RUN_LIMIT;
+
+	ctx.budget = max_instructions;
+	lazy_from_machine(ctx.flags, m);
+
+	while (ctx.budget) {
+
+#ifdef JIT_X86_64
+		unsigned char * block = (m.pc & 1) ? nullptr : blocks[m.pc >> 1];
+
+		if (!block)
+			block = translate(m, m.pc);
+
+		if (!block) {
+
+			if (interp_step(m, 1) == RUN_HALT) {
+
+				result = RUN_HALT;
+				break;
+			}
+
+			continue;
+		}
+
+		ctx.status = EXIT_NONE;
+		((void (*)(jit_context *, machine *, const void *)) enter_stub)(&ctx, &m, block);
+		m.pc = ctx.pc;
+
+		if (ctx.status == EXIT_HALT) {
+
+			m.halt_pc = m.pc;
+			result = RUN_HALT;
+			break;
+		}
+
+		if (ctx.status == EXIT_BUDGET) {
+
+			result = interp_step(m, ctx.budget);
+			break;
+		}
+#endif
+	}
+
+	lazy_to_machine(m, ctx.flags);
+	m.retired = start + max_instructions - ctx.budget;
+
+	return result;
+}
@@ -0,0 +1,340 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+#include "assembly.h"
+#include "object.h"
+#include "symbols.h"
+
+using namespace std;
+
+
+/*
+ * Links the object files of assembler -c into one program and its symbol file. Absolute sections (#org) go to their
+ * address, the relocatable ones follow each other from address 0 in command line order, moved past any absolute section
+ * they would overlap; then every label reference is patched. Built with the assembler, whose writers it reuses:
+ *	g++ -O2 -DHBCP_NO_MAIN -o linker linker.cpp object.cpp symbols.cpp assembler.cpp -pthread
+ */
+
+
+#define PROGRAM_SIZE		0x10000
+
+
+/* Section as the linker placed it */
+struct placed_section {
+
+	int module, section;
+	int address, size;
+};
+
+
+/* Gives every section its address, FAIL if absolute ones overlap or the code does not fit */
+int place_sections();
+/* Addresses of the labels every module defines, FAIL if one is defined twice */
+int define_symbols();
+/* Copies the code of every section to its address and patches the label references, FAIL if a label is missing or a branch cannot reach it */
+int relocate();
+/* Fills the tables of the symbol file writer, each sorted by address */
+void collect_symbols();
+
+
+static vector <object> modules;
+static vector <const char *> module_names;
+static vector <vector <int>> section_addresses;			// per module and section
+static vector <vector <int>> symbol_addresses;			// per module and symbol, -1 if no module defines it
+static vector <placed_section> placed;					// non-empty sections in address order
+static assembly linked;									// code and tables of the program, for the assembler's writers
+
+
+int main(int argc, char * argv[]) {
+
+	const char * out_name = "machine_code.bin";
+	bool usage = argc < 2;
+
+	for (int i = 1; i < argc && !usage; i++) {
+
+		if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			out_name = argv[++i];
+		else if (argv[i][0] != '-')
+			module_names.push_back(argv[i]);
+		else
+			usage = true;
+	}
+
+	if (usage || module_names.empty()) {
+
+		cout << "\nUsage: linker [-o program.bin] module.o ..." << endl;
+		return FAIL;
+	}
+
+	modules.resize(module_names.size());
+
+	for (size_t m = 0; m != modules.size(); m++) {
+
+		if (object_open(modules[m], module_names[m]) == FAIL) {
+
+			cout << "\nUnable to open object file [" << module_names[m] << "]" << endl;
+			return FAIL;
+		}
+	}
+
+	int result = FAIL;
+
+	if (place_sections() == SUCCESS && define_symbols() == SUCCESS && relocate() == SUCCESS) {
+
+		ofstream bin(out_name, ios::out | ios::trunc | ios::binary);
+		ofstream sym(symbols_file_for(out_name), ios::out | ios::trunc | ios::binary);
+
+		collect_symbols();
+
+		if (!bin.is_open())
+			cout << "\nUnable to open write file";
+		else if (!sym.is_open())
+			cout << "\nUnable to open symbol file";
+		else if (linked.write_code_file(bin) == SUCCESS && linked.write_symbol_file(sym) == SUCCESS) {
+
+			cout << "success";
+			result = SUCCESS;
+		}
+	}
+
+	for (object& o : modules)
+		object_close(o);
+
+	return result == SUCCESS ? 0 : FAIL;
+}
+
+
+int place_sections() {
+
+	section_addresses.resize(modules.size());
+
+	/* Absolute sections first, they cannot move */
+	for (int m = 0; m != (int) modules.size(); m++) {
+
+		const object& o = modules[m];
+
+		section_addresses[m].assign(o.header->section_count, 0);
+
+		for (int s = 0; s != (int) o.header->section_count; s++) {
+
+			section_addresses[m][s] = o.section[s].address;
+
+			if ((o.section[s].flags & OBJECT_ABSOLUTE) && o.section[s].size > 0)
+				placed.push_back({m, s, o.section[s].address, (int) o.section[s].size});
+		}
+	}
+
+	sort(placed.begin(), placed.end(), [](const placed_section& a, const placed_section& b) { return a.address < b.address; });
+
+	for (int i = 1; i < (int) placed.size(); i++) {
+
+		if (placed[i].address < placed[i - 1].address + placed[i - 1].size) {
+
+			cout << "\nError... #org at line " << modules[placed[i].module].section[placed[i].section].line << " of [" << module_names[placed[i].module]
+				<< "] overlaps the one at line " << modules[placed[i - 1].module].section[placed[i - 1].section].line << " of [" << module_names[placed[i - 1].module] << "]" << endl;
+			return FAIL;
+		}
+	}
+
+	/* Then the relocatable ones in the gaps, in order */
+	vector <placed_section> absolute = placed;
+	int next = 0;
+
+	for (int m = 0; m != (int) modules.size(); m++) {
+
+		const object& o = modules[m];
+
+		for (int s = 0; s != (int) o.header->section_count; s++) {
+
+			if (o.section[s].flags & OBJECT_ABSOLUTE)
+				continue;
+
+			int size = o.section[s].size;
+			int address = (next + 1) & ~1;			// instructions start on a word
+
+			for (const placed_section& a : absolute)			// sorted and apart, so moving past one never runs into an earlier one
+				if (size > 0 && address < a.address + a.size && a.address < address + size)
+					address = (a.address + a.size + 1) & ~1;
+
+			if (address + size > PROGRAM_SIZE) {
+
+				cout << "\nError... [" << module_names[m] << "] does not fit in program memory" << endl;
+				return FAIL;
+			}
+
+			section_addresses[m][s] = address;
+			next = address + size;
+
+			if (size > 0)
+				placed.push_back({m, s, address, size});
+		}
+	}
+
+	sort(placed.begin(), placed.end(), [](const placed_section& a, const placed_section& b) { return a.address < b.address; });
+
+	return SUCCESS;
+}
+
+
+int define_symbols() {
+
+	unordered_map <string_view, pair <int, int>> defined;			// name -> module, address
+	symbol_addresses.resize(modules.size());
+
+	for (size_t m = 0; m != modules.size(); m++) {
+
+		const object& o = modules[m];
+
+		symbol_addresses[m].assign(o.header->symbol_count, -1);
+
+		for (size_t i = 0; i != o.header->symbol_count; i++) {
+
+			if (o.symbol[i].section == OBJECT_UNDEFINED)
+				continue;
+
+			string_view name = object_string(o, o.symbol[i].name);
+			int address = section_addresses[m][o.symbol[i].section] + o.symbol[i].offset;
+			auto added = defined.emplace(name, make_pair(m, address));
+
+			if (!added.second) {
+
+				cout << "\nError... Label [" << name << "] defined in [" << module_names[added.first->second.first] << "] and [" << module_names[m] << "]" << endl;
+				return FAIL;
+			}
+
+			symbol_addresses[m][i] = address;
+		}
+	}
+
+	for (size_t m = 0; m != modules.size(); m++) {
+
+		const object& o = modules[m];
+
+		for (size_t i = 0; i != o.header->symbol_count; i++) {
+
+			auto found = defined.find(object_string(o, o.symbol[i].name));
+
+			if (o.symbol[i].section == OBJECT_UNDEFINED && found != defined.end())
+				symbol_addresses[m][i] = found->second.second;
+		}
+	}
+
+	return SUCCESS;
+}
+
+
+int relocate() {
+
+	int size = 0;
+
+	for (size_t m = 0; m != modules.size(); m++)			// an #org with nothing behind it still lengthens the program, as in the assembler
+		for (size_t s = 0; s != modules[m].header->section_count; s++)
+			size = max(size, section_addresses[m][s] + (int) modules[m].section[s].size);
+
+	linked.code.assign(size, 0);			// gaps are nop, as #org pads them
+
+	for (const placed_section& p : placed) {
+
+		const object& o = modules[p.module];
+
+		memcpy(linked.code.data() + p.address, o.code + o.section[p.section].code, p.size);
+	}
+
+	for (size_t m = 0; m != modules.size(); m++) {
+
+		const object& o = modules[m];
+
+		for (size_t i = 0; i != o.header->relocation_count; i++) {
+
+			const object_relocation& r = o.relocation[i];
+			int pc = section_addresses[m][r.section] + r.offset;
+			int label_address = symbol_addresses[m][r.symbol];
+
+			if (label_address == -1) {
+
+				cout << "\n[" << module_names[m] << "] Line " << r.line << ": Error... Label not found [" << object_string(o, o.symbol[r.symbol].name) << "]" << endl;
+				return FAIL;
+			}
+
+			if (r.kind == OBJECT_ABSOLUTE16) {
+
+				linked.code[pc + 2] = label_address >> 8;		// high byte of address
+				linked.code[pc + 3] = label_address;			// low byte of address
+				continue;
+			}
+
+			int offset = label_address - (pc + 2);			// relative to the next instruction
+
+			if (offset > 127 || offset < -128) {
+
+				cout << "\n[" << module_names[m] << "] Line " << r.line << ": Error... Offset out of range (the linker cannot grow a branch, use jmp or call)" << endl;
+				return FAIL;
+			}
+
+			linked.code[pc + 1] = offset;
+		}
+	}
+
+	return SUCCESS;
+}
+
+
+void collect_symbols() {
+
+	struct label { int address; string_view name; };
+	struct line { int address, number; string_view source; };
+
+	vector <label> labels;
+	vector <line> lines;
+
+	for (size_t m = 0; m != modules.size(); m++) {
+
+		const object& o = modules[m];
+
+		for (size_t i = 0; i != o.header->symbol_count; i++)
+			if (o.symbol[i].section != OBJECT_UNDEFINED)
+				labels.push_back({symbol_addresses[m][i], object_string(o, o.symbol[i].name)});
+
+		for (size_t i = 0; i != o.header->line_count; i++)
+			lines.push_back({section_addresses[m][o.line[i].section] + o.line[i].offset, (int) o.line[i].line, object_string(o, o.line[i].source)});
+	}
+
+	/* Modules keep their own order among labels at the same address, so the one found first stays first */
+	stable_sort(labels.begin(), labels.end(), [](const label& a, const label& b) { return a.address < b.address; });
+	stable_sort(lines.begin(), lines.end(), [](const line& a, const line& b) { return a.address < b.address; });
+
+	linked.label_names.clear();
+	linked.label_addresses.clear();
+	linked.line_addresses.clear();
+	linked.line_numbers.clear();
+	linked.line_sources.clear();
+	linked.region_addresses.clear();
+	linked.region_ends.clear();
+	linked.region_lines.clear();
+
+	for (const label& l : labels) {
+
+		linked.label_names.emplace_back(l.name);
+		linked.label_addresses.push_back(l.address);
+	}
+
+	for (const line& l : lines) {
+
+		linked.line_addresses.push_back(l.address);
+		linked.line_numbers.push_back(l.number);
+		linked.line_sources.push_back(l.source);
+	}
+
+	for (const placed_section& p : placed) {
+
+		linked.region_addresses.push_back(p.address);
+		linked.region_ends.push_back(p.address + p.size);
+		linked.region_lines.push_back(modules[p.module].section[p.section].line);
+	}
+}
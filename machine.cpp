@@ -0,0 +1,40 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+
+#include "simulator.h"
+
+using namespace std;
+
+
+void machine_reset(machine& m) {
+
+	unsigned char rom[MEM_SIZE];
+
+	memcpy(rom, m.rom, MEM_SIZE);			// program ROM survives reset
+	memset(&m, 0, sizeof(machine));
+	memcpy(m.rom, rom, MEM_SIZE);
+}
+
+
+int load_program(machine& m, const char * file_name) {
+
+	ifstream bin;
+
+	bin.open(file_name, ios::in | ios::binary);
+
+	if (!bin.is_open()) {
+
+		cout << "\nUnable to open program file [" << file_name << "]" << endl;
+		return FAIL;
+	}
+
+	memset(m.rom, 0, MEM_SIZE);
+	bin.read((char *) m.rom, MEM_SIZE);			// anything past 64 KiB does not fit in program ROM
+
+	int size = (int) bin.gcount();
+
+	bin.close();
+
+	return size;
+}
@@ -0,0 +1,1098 @@
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <deque>
+#include <cstring>
+#include <cstdlib>
+
+#include "netlist.h"
+
+using namespace std;
+
+
+/*
+ * Reads the netlist out of a Logisim-evolution 3.8 project. Logisim stores no connectivity, only component
+ * locations and wire segments, so every port position is recomputed here from the component's attributes
+ * the way Logisim lays it out; a port connects to whatever wire end, wire or other port sits on that point.
+ */
+
+
+#define MAX_DEPTH			16			// subcircuit nesting before giving up on recursion
+
+
+/* Element of the .circ XML */
+struct xml_node {
+
+	string name;
+	string text;			// character data, only memory contents use it
+	vector <pair <string, string>> attrs;
+	vector <xml_node> children;
+
+	const char * attr(const char * key) const {
+
+		for (const auto& a : attrs)
+			if (a.first == key)
+				return a.second.c_str();
+
+		return nullptr;
+	}
+};
+
+/* Component as saved: library name, location and <a name val> attributes */
+struct component {
+
+	string name;
+	int x, y;
+	map <string, string> a;
+
+	string get(const char * key, const char * fallback) const {
+
+		auto it = a.find(key);
+
+		return it == a.end() ? fallback : it->second;
+	}
+
+	int number(const char * key, int fallback) const {
+
+		auto it = a.find(key);
+
+		return it == a.end() ? fallback : (int) strtol(it->second.c_str(), nullptr, 0);
+	}
+};
+
+struct circuit_port {
+
+	int pin_x, pin_y;			// pin inside the circuit
+	int x, y;					// where the port is drawn in the appearance
+};
+
+struct circuit {
+
+	string name;
+	vector <component> comps;
+	vector <int> wires;			// x0, y0, x1, y1 per wire
+	bool custom;				// has an <appear> with an anchor
+	int anchor_x, anchor_y;
+	string anchor_facing;
+	vector <circuit_port> ports;
+};
+
+/* Port of a component relative to nothing, filled in by geometry */
+struct port_place {
+
+	int x, y;
+	int width;
+	bool output;
+};
+
+
+static map <string, circuit> circuits;
+static vector <int> parent;				// bit union find while flattening
+
+
+static int find_bit(int b) {
+
+	while (parent[b] != b)
+		b = parent[b] = parent[parent[b]];
+
+	return b;
+}
+
+static void join_bits(int a, int b) {
+
+	a = find_bit(a);
+	b = find_bit(b);
+
+	if (a != b)
+		parent[a] = b;
+}
+
+static int new_bits(int count) {
+
+	int first = (int) parent.size();
+
+	for (int i = 0; i < count; i++)
+		parent.push_back(first + i);
+
+	return first;
+}
+
+
+/* XML subset written by Logisim: elements, attributes, text, comments and the declaration */
+static bool parse_element(const string& s, size_t& i, xml_node& node, string& error) {
+
+	size_t end = s.find_first_of(" \t\r\n/>", i + 1);
+
+	node.name = s.substr(i + 1, end - i - 1);
+	i = end;
+
+	while (true) {
+
+		while (i < s.size() && isspace((unsigned char) s[i]))
+			i++;
+
+		if (i >= s.size()) {
+
+			error = "unterminated <" + node.name + ">";
+			return false;
+		}
+
+		if (s[i] == '/') {			// <name ... />
+
+			i += 2;
+			return true;
+		}
+
+		if (s[i] == '>') {
+
+			i++;
+			break;
+		}
+
+		size_t eq = s.find('=', i);
+		size_t open = s.find('"', eq);
+		size_t close = s.find('"', open + 1);
+
+		if (eq == string::npos || open == string::npos || close == string::npos) {
+
+			error = "bad attribute in <" + node.name + ">";
+			return false;
+		}
+
+		string value = s.substr(open + 1, close - open - 1);
+		static const char * const entities[][2] = {{"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}, {"&amp;", "&"}};
+
+		for (const auto& e : entities)
+			for (size_t at = value.find(e[0]); at != string::npos; at = value.find(e[0], at + 1))
+				value.replace(at, strlen(e[0]), e[1]);
+
+		node.attrs.push_back(make_pair(s.substr(i, eq - i), value));
+		i = close + 1;
+	}
+
+	while (true) {			// children until </name>
+
+		size_t open = s.find('<', i);
+
+		if (open == string::npos) {
+
+			error = "missing </" + node.name + ">";
+			return false;
+		}
+
+		node.text += s.substr(i, open - i);
+		i = open;
+
+		if (!s.compare(i, 4, "<!--")) {
+
+			i = s.find("-->", i);
+			i = i == string::npos ? s.size() : i + 3;
+		} else if (s[i + 1] == '/') {
+
+			i = s.find('>', i) + 1;
+			return true;
+		} else {
+
+			node.children.emplace_back();
+
+			if (!parse_element(s, i, node.children.back(), error))
+				return false;
+		}
+	}
+}
+
+
+static bool parse_xml(const string& s, xml_node& root, string& error) {
+
+	size_t i = 0;
+
+	while ((i = s.find('<', i)) != string::npos) {
+
+		if (s[i + 1] == '?' || s[i + 1] == '!') {			// declaration or comment
+
+			i = s.find('>', i);
+			continue;
+		}
+
+		return parse_element(s, i, root, error);
+	}
+
+	error = "no root element";
+	return false;
+}
+
+
+static void read_circuits(const xml_node& project) {
+
+	for (const xml_node& c : project.children) {
+
+		if (c.name != "circuit" || !c.attr("name"))
+			continue;
+
+		circuit& def = circuits[c.attr("name")];
+
+		def.name = c.attr("name");
+		def.custom = false;
+
+		for (const xml_node& e : c.children) {
+
+			if (e.name == "comp" && e.attr("loc") && e.attr("name")) {
+
+				component comp;
+
+				comp.name = e.attr("name");
+				sscanf(e.attr("loc"), "(%d,%d)", &comp.x, &comp.y);
+
+				for (const xml_node& a : e.children)
+					if (a.name == "a" && a.attr("name"))
+						comp.a[a.attr("name")] = a.attr("val") ? a.attr("val") : a.text;
+
+				def.comps.push_back(comp);
+			} else if (e.name == "wire" && e.attr("from") && e.attr("to")) {
+
+				int x0, y0, x1, y1;
+
+				sscanf(e.attr("from"), "(%d,%d)", &x0, &y0);
+				sscanf(e.attr("to"), "(%d,%d)", &x1, &y1);
+				def.wires.insert(def.wires.end(), {x0, y0, x1, y1});
+			} else if (e.name == "appear") {
+
+				for (const xml_node& shape : e.children) {
+
+					if (shape.name == "circ-anchor") {
+
+						def.custom = true;
+						def.anchor_x = atoi(shape.attr("x"));
+						def.anchor_y = atoi(shape.attr("y"));
+						def.anchor_facing = shape.attr("facing") ? shape.attr("facing") : "east";
+					} else if (shape.name == "circ-port") {
+
+						circuit_port p;
+
+						sscanf(shape.attr("pin"), "%d,%d", &p.pin_x, &p.pin_y);
+						p.x = atoi(shape.attr("x"));
+						p.y = atoi(shape.attr("y"));
+						def.ports.push_back(p);
+					}
+				}
+			}
+		}
+	}
+}
+
+
+/* Rotates an offset drawn facing east to facing */
+static void rotate(int& dx, int& dy, const string& facing) {
+
+	int x = dx, y = dy;
+
+	if (facing == "west") {
+
+		dx = -x;
+		dy = -y;
+	} else if (facing == "north") {
+
+		dx = y;
+		dy = -x;
+	} else if (facing == "south") {
+
+		dx = -y;
+		dy = x;
+	}
+}
+
+static int facing_angle(const string& facing) {
+
+	return facing == "north" ? 1 : facing == "west" ? 2 : facing == "south" ? 3 : 0;
+}
+
+
+/* Bits of each splitter end, in order; end -1 is "none" */
+static vector <vector <int>> splitter_ends(const component& c) {
+
+	int fanout = c.number("fanout", 2);
+	int incoming = c.number("incoming", 2);
+	vector <vector <int>> ends(fanout);
+
+	for (int b = 0; b < incoming; b++) {
+
+		string key = "bit" + to_string(b);
+		string v = c.get(key.c_str(), "");
+		int end = v.empty() ? b : v == "none" ? -1 : atoi(v.c_str());			// Logisim saves bitN only when it is not end N
+
+		if (end >= 0 && end < fanout)
+			ends[end].push_back(b);
+	}
+
+	return ends;
+}
+
+
+/* Port positions of c relative to its location, in the cell port order of netlist.h */
+static bool geometry(const component& c, int& kind, vector <port_place>& ports, string& error) {
+
+	string facing = c.get("facing", "east");
+	int width = c.number("width", 1);
+
+	ports.clear();
+
+	auto add = [&](int dx, int dy, int w, bool output) {
+
+		rotate(dx, dy, facing);
+		ports.push_back({dx, dy, w, output});
+	};
+
+	auto place = [&](int dx, int dy, int w, bool output) {			// already in screen coordinates
+		ports.push_back({dx, dy, w, output});
+	};
+
+	const string& name = c.name;
+
+	if (name == "Constant") {
+
+		kind = CELL_CONSTANT;
+		add(0, 0, width, true);
+	} else if (name == "Clock" || name == "Button") {
+
+		kind = name == "Clock" ? CELL_CLOCK : CELL_BUTTON;
+		add(0, 0, 1, true);
+	} else if (name == "Pin") {
+
+		kind = c.get("output", "false") == "true" ? CELL_OUTPUT : CELL_INPUT;
+		add(0, 0, width, kind == CELL_INPUT);
+	} else if (name == "AND Gate" || name == "OR Gate" || name == "XOR Gate" || name == "NAND Gate" || name == "NOR Gate" || name == "XNOR Gate") {
+
+		static const char * const gates[] = {"AND Gate", "OR Gate", "XOR Gate", "NAND Gate", "NOR Gate", "XNOR Gate"};
+		int inputs = c.number("inputs", 2);
+		int size = c.number("size", 50);
+		bool negated_output = name[0] == 'N' || name[1] == 'N';
+		int axis = size + (name[0] == 'X' ? 10 : 0) + (negated_output ? 10 : 0);
+		int start, step, lower;
+
+		for (int g = 0; g < 6; g++)
+			if (name == gates[g])
+				kind = CELL_AND + g;
+
+		if (inputs <= 3) {
+
+			if (size < 40)
+				start = -5, step = 10, lower = 10;
+			else if (size < 60 || inputs <= 2)
+				start = -10, step = 20, lower = 20;
+			else
+				start = -15, step = 30, lower = 30;
+		} else if (inputs == 4 && size >= 60)
+			start = -5, step = 20, lower = 0;
+		else
+			start = -5, step = 10, lower = 10;
+
+		add(0, 0, width, true);
+
+		for (int i = 0; i < inputs; i++) {
+
+			int dy = (inputs & 1) ? start * (inputs - 1) + step * i : start * inputs + step * i + (i >= inputs / 2 ? lower : 0);
+			string key = "negate" + to_string(i);
+			int dx = axis + (c.get(key.c_str(), "false") == "true" ? 10 : 0);			// the bubble sits in front of the input
+
+			add(-dx, dy, width, false);
+		}
+	} else if (name == "NOT Gate") {
+
+		kind = CELL_NOT;
+		add(0, 0, width, true);
+		add(c.number("size", 30) == 20 ? -20 : -30, 0, width, false);
+	} else if (name == "Multiplexer" || name == "Demultiplexer") {
+
+		bool mux = name == "Multiplexer";
+		int select = c.number("select", 1);
+		int inputs = 1 << select;
+		int size = c.number("size", 30);
+		bool bottom = c.get("selloc", "bl") != "tr";
+		int side = mux ? -1 : 1;			// data inputs of a multiplexer are behind it, demultiplexer outputs in front
+
+		kind = mux ? CELL_MUX : CELL_DEMUX;
+		add(0, 0, width, mux);
+
+		/* Select input. Narrow plexers put it beside the body in screen coordinates, 10 further out on the top or left */
+		if (size == 20) {
+
+			int reach = inputs == 2 ? 20 : inputs / 2 * 10;
+			int sign = (facing == "east" ? 1 : -1) * (bottom ? 1 : -1);
+			int across = sign > 0 ? reach : -reach - 10;
+			int along = 10 * side;
+
+			if (facing == "east" || facing == "west")
+				place(facing == "east" ? along : -along, across, select, false);
+			else
+				place(across, facing == "south" ? along : -along, select, false);
+		} else
+			add(20 * side, (inputs == 2 ? 20 : inputs / 2 * 10) * (bottom ? 1 : -1), select, false);
+
+		for (int i = 0; i < inputs; i++) {
+
+			int dx = side * (inputs == 2 ? size : size == 20 ? 20 : 40);
+			int dy = inputs == 2 ? -10 + 20 * i : -(inputs / 2) * 10 + 10 * i;
+
+			if (inputs == 2 && (facing == "north" || facing == "south"))			// first input on the left either way
+				place(i ? 10 : -10, facing == "north" ? -dx : dx, width, !mux);
+			else
+				add(dx, dy, width, !mux);
+		}
+	} else if (name == "Adder" || name == "Subtractor") {
+
+		width = c.number("width", 8);
+		kind = name == "Adder" ? CELL_ADDER : CELL_SUBTRACTOR;
+		add(0, 0, width, true);
+		add(-40, -10, width, false);
+		add(-40, 10, width, false);
+		add(-20, -20, 1, false);
+		add(-20, 20, 1, true);
+	} else if (name == "Bit Extender") {
+
+		string type = c.get("type", "sign");
+
+		kind = CELL_EXTENDER;
+		add(0, 0, c.number("out_width", 16), true);
+		add(-40, 0, c.number("in_width", 8), false);
+		add(-20, 20, 1, false);
+	} else if (name == "Register") {
+
+		if (c.get("appearance", "classic") != "logisim_evolution") {
+
+			error = "register at (" + to_string(c.x) + "," + to_string(c.y) + ") uses the classic appearance";
+			return false;
+		}
+
+		width = c.number("width", 8);
+		kind = CELL_REGISTER;
+		place(60, 30, width, true);
+		place(0, 30, width, false);
+		place(0, 50, 1, false);
+		place(0, 70, 1, false);
+		place(30, 90, 1, false);
+	} else if (name == "D Flip-Flop") {
+
+		kind = CELL_FLIPFLOP;
+		place(50, 10, 1, true);
+		place(50, 50, 1, true);
+		place(-10, 10, 1, false);
+		place(-10, 50, 1, false);
+		place(20, 0, 1, false);
+		place(20, 60, 1, false);
+	} else if (name == "ROM" || name == "RAM") {
+
+		string line = c.get("line", "single");
+		int lines = line == "dual" ? 2 : line == "quad" ? 4 : line == "octo" ? 8 : 1;
+		int data = c.number("dataWidth", 8);
+
+		place(0, 10, c.number("addrWidth", 8), false);
+
+		if (name == "ROM") {
+
+			kind = CELL_ROM;
+
+			for (int i = 0; i < lines; i++)
+				place(240, 60 + 10 * i, data, true);
+		} else {
+
+			if (lines != 2 || c.get("enables", "byte") != "line") {
+
+				error = "only dual line RAM with line enables is supported";
+				return false;
+			}
+
+			kind = CELL_RAM;
+			place(0, 50, 1, false);			// write enable
+			place(0, 90, 1, false);			// clock
+			place(0, 70, 1, false);			// line enable 0
+			place(0, 80, 1, false);			// line enable 1
+
+			for (int i = 0; i < lines; i++)
+				place(0, 110 + 10 * i, data, false);
+
+			for (int i = 0; i < lines; i++)
+				place(240, 110 + 10 * i, data, true);
+		}
+	} else {
+
+		error = "unsupported component " + name;
+		return false;
+	}
+
+	return true;
+}
+
+
+/* Splitter ends relative to the combined end, spacing and appearance as Logisim-evolution draws them */
+static void splitter_places(const component& c, vector <port_place>& places) {
+
+	string facing = c.get("facing", "east");
+	string appear = c.get("appear", "left");
+	int fanout = c.number("fanout", 2);
+	int spacing = c.number("spacing", 1);
+	int justify = appear == "center" || appear == "legacy" ? 0 : appear == "right" ? 1 : -1;
+	int x, y, dx, dy;
+
+	if (facing == "north" || facing == "south") {
+
+		int m = facing == "north" ? 1 : -1;
+
+		x = justify == 0 ? 10 * spacing * ((fanout + 1) / 2 - 1) : m * justify < 0 ? -10 : 10 * spacing * (fanout - 1) + 10;
+		y = -m * 20;
+		dx = -10 * spacing;
+		dy = 0;
+	} else {
+
+		int m = facing == "west" ? -1 : 1;
+
+		x = m * 20;
+		y = justify == 0 ? -10 * spacing * (fanout / 2) : m * justify > 0 ? 10 : -10 * spacing * (fanout - 1) - 10;
+		dx = 0;
+		dy = 10 * spacing;
+	}
+
+	places.clear();
+
+	for (int i = 0; i < fanout; i++)
+		places.push_back({x + dx * i, y + dy * i, 0, false});
+}
+
+
+/* Logisim memory image: "addr/data: <address bits> <data bits>" header, then hex words, count*word for runs */
+static bool read_contents(const string& text, vector <unsigned>& words) {
+
+	stringstream in(text);
+	string header, token;
+	int address_bits, data_bits;
+
+	words.clear();
+
+	if (text.empty())
+		return true;
+
+	if (!(in >> header >> address_bits >> data_bits) || header != "addr/data:")
+		return false;
+
+	while (in >> token) {
+
+		size_t star = token.find('*');
+		unsigned long count = star == string::npos ? 1 : strtoul(token.c_str(), nullptr, 10);
+		unsigned word = (unsigned) strtoul(token.c_str() + (star == string::npos ? 0 : star + 1), nullptr, 16);
+
+		if (words.size() + count > (1ul << address_bits))
+			return false;
+
+		words.insert(words.end(), count, word);
+	}
+
+	while (!words.empty() && !words.back())
+		words.pop_back();
+
+	return true;
+}
+
+
+/* Point to net union find of one circuit instance */
+struct point_nets {
+
+	map <pair <int, int>, int> ids;
+	vector <int> up;
+
+	int id(int x, int y) {
+
+		auto key = make_pair(x, y);
+		auto it = ids.find(key);
+
+		if (it != ids.end())
+			return it->second;
+
+		up.push_back((int) up.size());
+		ids[key] = (int) up.size() - 1;
+
+		return (int) up.size() - 1;
+	}
+
+	int root(int i) {
+
+		while (up[i] != i)
+			i = up[i] = up[up[i]];
+
+		return i;
+	}
+
+	void join(int a, int b) {
+
+		a = root(a);
+		b = root(b);
+
+		if (a != b)
+			up[a] = b;
+	}
+};
+
+
+/* A port of some component attached to a point, resolved to bits once net widths are known */
+struct attachment {
+
+	int x, y, width;
+	vector <int> * bits;
+};
+
+
+static bool instantiate(netlist& n, const circuit& def, const string& path, map <pair <int, int>, vector <int>> * outer, int depth) {
+
+	if (depth > MAX_DEPTH) {
+
+		n.error = "subcircuits nested too deep at " + path;
+		return false;
+	}
+
+	point_nets points;
+	vector <attachment> attached;
+	map <string, vector <int>> tunnels;			// label to points
+	vector <pair <const component *, vector <vector <int>>>> splitters;
+	vector <pair <const component *, map <pair <int, int>, vector <int>>>> instances;
+	map <pair <int, int>, vector <int>> pins;			// pin location to bits, for the enclosing instance
+
+	for (size_t w = 0; w < def.wires.size(); w += 4)
+		points.join(points.id(def.wires[w], def.wires[w + 1]), points.id(def.wires[w + 2], def.wires[w + 3]));
+
+	/* Collect every port as an attachment; bits are allocated when the nets are complete */
+	deque <vector <int>> storage;			// bit vectors of splitters, tunnels and pins, never moved
+
+	auto attach = [&](int x, int y, int width, vector <int> * bits) {
+
+		points.id(x, y);
+		attached.push_back({x, y, width, bits});
+	};
+
+	n.cells.reserve(n.cells.size() + def.comps.size());
+
+	for (const component& c : def.comps) {
+
+		string where = path + "/" + c.name + "(" + to_string(c.x) + "," + to_string(c.y) + ")";
+
+		if (c.name == "Text" || c.name == "Probe")
+			continue;
+
+		if (c.name == "Tunnel") {
+
+			storage.emplace_back();
+			attach(c.x, c.y, c.number("width", 1), &storage.back());
+			tunnels[c.get("label", "")].push_back(points.id(c.x, c.y));
+			continue;
+		}
+
+		if (c.name == "Splitter") {
+
+			vector <port_place> places;
+			vector <vector <int>> ends = splitter_ends(c);
+
+			splitter_places(c, places);
+			storage.emplace_back();
+			attach(c.x, c.y, c.number("incoming", 2), &storage.back());
+
+			size_t first = storage.size() - 1;
+
+			for (size_t e = 0; e < ends.size(); e++) {
+
+				storage.emplace_back();
+
+				if (!ends[e].empty())
+					attach(c.x + places[e].x, c.y + places[e].y, (int) ends[e].size(), &storage.back());
+			}
+
+			vector <vector <int>> map_bits;			// first entry: storage index of the combined end, then bit lists
+
+			map_bits.push_back({(int) first});
+
+			for (const auto& e : ends)
+				map_bits.push_back(e);
+
+			splitters.push_back(make_pair(&c, map_bits));
+			continue;
+		}
+
+		if (c.name == "Pin" && outer) {			// joins the enclosing instance's port
+
+			storage.emplace_back();
+			attach(c.x, c.y, c.number("width", 1), &storage.back());
+			pins[make_pair(c.x, c.y)] = {(int) storage.size() - 1};
+			continue;
+		}
+
+		auto sub = circuits.find(c.name);
+
+		if (sub != circuits.end()) {
+
+			const circuit& inner = sub->second;
+
+			if (!inner.custom) {
+
+				n.error = "circuit " + inner.name + " has no custom appearance";
+				return false;
+			}
+
+			map <pair <int, int>, vector <int>> ports;
+
+			for (const circuit_port& p : inner.ports) {
+
+				int dx = p.x - inner.anchor_x, dy = p.y - inner.anchor_y;
+				int turn = (facing_angle(c.get("facing", "east")) - facing_angle(inner.anchor_facing) + 4) % 4;
+				static const char * const turns[] = {"east", "north", "west", "south"};
+				int width = 1;
+
+				for (const component& pin : inner.comps)
+					if (pin.name == "Pin" && pin.x == p.pin_x && pin.y == p.pin_y)
+						width = pin.number("width", 1);
+
+				rotate(dx, dy, turns[turn]);
+				storage.emplace_back();
+				attach(c.x + dx, c.y + dy, width, &storage.back());
+				ports[make_pair(p.pin_x, p.pin_y)] = {(int) storage.size() - 1};
+			}
+
+			instances.push_back(make_pair(&c, ports));
+			continue;
+		}
+
+		cell cl;
+		vector <port_place> places;
+
+		if (!geometry(c, cl.kind, places, n.error)) {
+
+			n.error += " in " + path;
+			return false;
+		}
+
+		cl.path = where;
+		cl.label = c.get("label", "");
+		cl.width = c.number("width", cl.kind == CELL_REGISTER || cl.kind == CELL_ADDER || cl.kind == CELL_SUBTRACTOR ? 8 : 1);
+		cl.inputs = cl.kind == CELL_MUX || cl.kind == CELL_DEMUX ? 1 << c.number("select", 1) : c.number("inputs", 2);
+		cl.negate = 0;
+		cl.value = (unsigned) strtoul(c.get("value", "0x1").c_str(), nullptr, 0);
+		cl.lines = c.get("line", "single") == "dual" ? 2 : 1;
+		cl.extend = EXT_SIGN;
+
+		if (cl.kind == CELL_XOR || cl.kind == CELL_XNOR)
+			cl.value = c.get("xor", "1") == "odd" || cl.inputs <= 2;			// otherwise exactly one input high
+		else if (cl.kind == CELL_ROM && !read_contents(c.get("contents", ""), cl.contents)) {
+
+			n.error = "bad contents in " + where;
+			return false;
+		}
+
+		if (cl.kind == CELL_EXTENDER) {
+
+			string type = c.get("type", "sign");
+
+			cl.extend = type == "zero" ? EXT_ZERO : type == "one" ? EXT_ONE : type == "input" ? EXT_INPUT : EXT_SIGN;
+			cl.width = c.number("out_width", 16);
+		} else if (cl.kind == CELL_ROM || cl.kind == CELL_RAM)
+			cl.width = c.number("dataWidth", 8);
+
+		for (int i = 0; i < cl.inputs && i < 32; i++) {
+
+			string key = "negate" + to_string(i);
+
+			if (c.get(key.c_str(), "false") == "true")
+				cl.negate |= 1u << i;
+		}
+
+		if (!outer && (cl.kind == CELL_INPUT || cl.kind == CELL_OUTPUT) && cl.label.empty())
+			cl.label = where;
+
+		cl.ports.resize(places.size());
+		n.cells.push_back(cl);
+
+		for (size_t p = 0; p < places.size(); p++)
+			attach(c.x + places[p].x, c.y + places[p].y, places[p].width, &n.cells.back().ports[p]);
+	}
+
+	/* A point on the inside of a wire joins it */
+	for (const auto& pt : points.ids) {
+
+		int x = pt.first.first, y = pt.first.second;
+
+		for (size_t w = 0; w < def.wires.size(); w += 4) {
+
+			int x0 = def.wires[w], y0 = def.wires[w + 1], x1 = def.wires[w + 2], y1 = def.wires[w + 3];
+			bool inside = (x0 == x1 && x == x0 && y > min(y0, y1) && y < max(y0, y1)) ||
+						  (y0 == y1 && y == y0 && x > min(x0, x1) && x < max(x0, x1));
+
+			if (inside)
+				points.join(pt.second, points.id(x0, y0));
+		}
+	}
+
+	for (const auto& t : tunnels)
+		for (size_t i = 1; i < t.second.size(); i++)
+			points.join(t.second[0], t.second[i]);
+
+	/* Allocate the bits of every net at its widest port */
+	map <int, int> net_width;
+	map <int, int> net_first;
+
+	for (const attachment& a : attached) {
+
+		int net = points.root(points.id(a.x, a.y));
+
+		net_width[net] = max(net_width[net], a.width);
+	}
+
+	for (const auto& w : net_width)
+		net_first[w.first] = new_bits(w.second);
+
+	for (const attachment& a : attached) {
+
+		int net = points.root(points.id(a.x, a.y));
+		int first = net_first[net];
+
+		a.bits->clear();
+
+		for (int b = 0; b < a.width; b++)
+			a.bits->push_back(first + b);
+	}
+
+	/* Splitters only rename bits */
+	for (const auto& s : splitters) {
+
+		const vector <int>& combined = storage[s.second[0][0]];
+		size_t end_storage = s.second[0][0] + 1;
+
+		for (size_t e = 1; e < s.second.size(); e++) {
+
+			const vector <int>& end_bits = storage[end_storage + e - 1];
+			const vector <int>& taken = s.second[e];
+
+			for (size_t j = 0; j < taken.size() && j < end_bits.size(); j++)
+				if (taken[j] < (int) combined.size())
+					join_bits(combined[taken[j]], end_bits[j]);
+		}
+	}
+
+	for (auto& inst : instances) {
+
+		const circuit& inner = circuits[inst.first->name];
+		string where = path + "/" + inner.name + "(" + to_string(inst.first->x) + "," + to_string(inst.first->y) + ")";
+		map <pair <int, int>, vector <int>> bits;
+
+		for (const auto& p : inst.second)
+			bits[p.first] = storage[p.second[0]];
+
+		if (!instantiate(n, inner, where, &bits, depth + 1))
+			return false;
+	}
+
+	/* Pins of a subcircuit become the bits of the enclosing port */
+	if (outer) {
+
+		for (const auto& p : pins) {
+
+			auto it = outer->find(p.first);
+
+			if (it == outer->end())
+				continue;			// pin without a port on the appearance
+
+			const vector <int>& inside = storage[p.second[0]];
+
+			for (size_t b = 0; b < inside.size() && b < it->second.size(); b++)
+				join_bits(inside[b], it->second[b]);
+		}
+	}
+
+	return true;
+}
+
+
+bool cell_output(const cell& c, int p) {
+
+	switch (c.kind) {
+
+		case CELL_CONSTANT: case CELL_CLOCK: case CELL_BUTTON: case CELL_INPUT:
+			return true;
+		case CELL_OUTPUT:
+			return false;
+		case CELL_DEMUX:
+			return p >= 2;
+		case CELL_ADDER: case CELL_SUBTRACTOR:
+			return p == 0 || p == 4;
+		case CELL_FLIPFLOP:
+			return p <= 1;
+		case CELL_ROM:
+			return p >= 1;
+		case CELL_RAM:
+			return p >= 3 + 2 * c.lines;
+		default:
+			return p == 0;
+	}
+}
+
+
+bool cell_combinational_input(const cell& c, int p) {
+
+	if (cell_output(c, p))
+		return false;
+
+	switch (c.kind) {
+
+		case CELL_REGISTER:
+			return p == 4;			// clear is asynchronous
+		case CELL_FLIPFLOP:
+			return p >= 4;			// set and reset
+		case CELL_RAM:
+			return p == 0;			// read address
+		default:
+			return true;
+	}
+}
+
+
+static bool levelize(netlist& n) {
+
+	size_t count = n.cells.size();
+	vector <vector <int>> users(count);
+	vector <int> waiting(count, 0);
+
+	for (size_t i = 0; i < count; i++) {
+
+		const cell& c = n.cells[i];
+
+		for (size_t p = 0; p < c.ports.size(); p++) {
+
+			if (!cell_combinational_input(c, (int) p))
+				continue;
+
+			for (int b : c.ports[p]) {
+
+				int d = n.driver[b];
+
+				if (d >= 0) {
+
+					users[d].push_back((int) i);
+					waiting[i]++;
+				}
+			}
+		}
+	}
+
+	vector <int> ready;
+
+	for (size_t i = 0; i < count; i++)
+		if (!waiting[i])
+			ready.push_back((int) i);
+
+	n.order.clear();
+
+	while (!ready.empty()) {
+
+		int i = ready.back();
+
+		ready.pop_back();
+		n.order.push_back(i);
+
+		for (int u : users[i])
+			if (!--waiting[u])
+				ready.push_back(u);
+	}
+
+	if (n.order.size() != count) {
+
+		n.error = "combinational loop through";
+
+		for (size_t i = 0; i < count; i++)
+			if (waiting[i])
+				n.error += " " + n.cells[i].path;
+
+		return false;
+	}
+
+	return true;
+}
+
+
+int netlist_load(netlist& n, const char * file_name, const char * top) {
+
+	ifstream file(file_name);
+	xml_node project;
+
+	n.cells.clear();
+	n.error.clear();
+	circuits.clear();
+	parent.clear();
+
+	if (!file.is_open()) {
+
+		n.error = string("unable to open ") + file_name;
+		return FAIL;
+	}
+
+	stringstream text;
+
+	text << file.rdbuf();
+
+	if (!parse_xml(text.str(), project, n.error))
+		return FAIL;
+
+	read_circuits(project);
+
+	auto it = circuits.find(top);
+
+	if (it == circuits.end()) {
+
+		n.error = string("no circuit named ") + top;
+		return FAIL;
+	}
+
+	if (!instantiate(n, it->second, "", nullptr, 0))
+		return FAIL;
+
+	/* Number the merged bits densely */
+	map <int, int> dense;
+
+	for (size_t b = 0; b < parent.size(); b++) {
+
+		int r = find_bit((int) b);
+
+		if (!dense.count(r))
+			dense[r] = (int) dense.size();
+	}
+
+	for (cell& c : n.cells)
+		for (auto& port : c.ports)
+			for (int& b : port)
+				b = dense[find_bit(b)];
+
+	n.bits = (int) dense.size();
+	n.driver.assign(n.bits, -1);
+	n.driver_port.assign(n.bits, -1);
+	n.driver_bit.assign(n.bits, -1);
+
+	for (size_t i = 0; i < n.cells.size(); i++) {
+
+		const cell& c = n.cells[i];
+
+		for (size_t p = 0; p < c.ports.size(); p++) {
+
+			if (!cell_output(c, (int) p))
+				continue;
+
+			for (size_t b = 0; b < c.ports[p].size(); b++) {
+
+				int bit = c.ports[p][b];
+
+				if (n.driver[bit] >= 0) {
+
+					n.error = "bit driven by both " + n.cells[n.driver[bit]].path + " and " + c.path;
+					return FAIL;
+				}
+
+				n.driver[bit] = (int) i;
+				n.driver_port[bit] = (int) p;
+				n.driver_bit[bit] = (int) b;
+			}
+		}
+	}
+
+	return levelize(n) ? SUCCESS : FAIL;
+}
@@ -0,0 +1,131 @@
+#ifndef NETLIST_H
+#define NETLIST_H
+
+#include <string>
+#include <vector>
+
+
+#ifndef SUCCESS
+	#define SUCCESS				1
+	#define FAIL				-1
+#endif
+
+/* Cell kinds of a flattened netlist, one per Logisim component */
+#define CELL_CONSTANT		0
+#define CELL_CLOCK			1
+#define CELL_BUTTON			2
+#define CELL_INPUT			3			// input pin of the top circuit
+#define CELL_OUTPUT			4			// output pin of the top circuit
+#define CELL_AND			5
+#define CELL_OR				6
+#define CELL_XOR			7
+#define CELL_NAND			8
+#define CELL_NOR			9
+#define CELL_XNOR			10
+#define CELL_NOT			11
+#define CELL_MUX			12
+#define CELL_DEMUX			13
+#define CELL_ADDER			14
+#define CELL_SUBTRACTOR		15
+#define CELL_EXTENDER		16
+#define CELL_REGISTER		17
+#define CELL_FLIPFLOP		18
+#define CELL_ROM			19
+#define CELL_RAM			20
+
+/*
+ * Port order of each kind in cell::ports
+ *	gates			out, in0 ... in(inputs - 1)
+ *	NOT				out, in
+ *	MUX				out, sel, in0 ... in(inputs - 1)
+ *	DEMUX			in, sel, out0 ... out(inputs - 1)
+ *	ADDER			out, a, b, carry in, carry out			(SUBTRACTOR: borrow in, borrow out)
+ *	EXTENDER		out, in, extra (fill bit for "input" type)
+ *	REGISTER		q, d, en, clk, clr
+ *	FLIPFLOP		q, nq, d, clk, s, r
+ *	ROM				addr, d0 ... d(lines - 1)
+ *	RAM				addr, we, clk, le0 ... le(lines - 1), din0 ... din(lines - 1), dout0 ... dout(lines - 1)
+ *	others			the single pin
+ */
+#define EXT_ZERO			0
+#define EXT_ONE				1
+#define EXT_SIGN			2
+#define EXT_INPUT			3
+
+
+/* One flattened component */
+struct cell {
+
+	int kind;
+	std::string path;						// Logisim style, /control(1500,910)/ROM(320,520)
+	std::string label;						// pins of the top circuit
+	int width;								// data width
+	int inputs;								// gate inputs or multiplexer data inputs
+	unsigned negate;						// gate inputs drawn with a bubble
+	unsigned value;							// constant value, 1 for XOR and XNOR gates counting odd parity
+	int extend;								// EXT_* for bit extenders
+	int lines;								// memory data lines, each width bits wide
+	std::vector <unsigned> contents;		// ROM words saved in the circuit, trailing zeros dropped
+	std::vector <std::vector <int>> ports;	// signal bit of every port bit, least significant first
+};
+
+struct netlist {
+
+	std::vector <cell> cells;
+	int bits;								// distinct signal bits after splitters, tunnels and pins are merged
+	std::vector <int> driver;				// cell driving each bit, -1 when it floats
+	std::vector <int> driver_port, driver_bit;
+	std::vector <int> order;				// cells in evaluation order, every combinational input driven earlier
+	std::string error;
+};
+
+
+/* Parses a Logisim-evolution .circ file and flattens circuit top into n, returns FAIL with n.error set */
+int netlist_load(netlist& n, const char * file_name, const char * top);
+/* Returns true if port p of c drives its bits */
+bool cell_output(const cell& c, int p);
+/*
+ * Returns true if port p of c is read while the circuit settles. Register data, enable and clock,
+ * and memory write ports are only sampled on the clock edge.
+ */
+bool cell_combinational_input(const cell& c, int p);
+
+
+/* Operations of a bit-sliced netlist, every slot holds one signal bit of 64 independent test vectors */
+#define SLICE_AND			0			// dst = a & b
+#define SLICE_OR			1			// dst = a | b
+#define SLICE_XOR			2			// dst = a ^ b
+#define SLICE_ANDN			3			// dst = a & ~b
+#define SLICE_NOT			4			// dst = ~a
+#define SLICE_MUX			5			// dst = c ? b : a, per lane
+#define SLICE_COPY			6			// dst = a
+#define SLICE_ROM			7			// ROM cell a looked up lane by lane
+
+struct slice_op {
+
+	int op;
+	int dst, a, b, c;
+};
+
+/*
+ * A netlist compiled to lane-parallel operations. Slots 0 .. bits - 1 are the netlist's signal bits, then the
+ * all zero and all one slots and temporaries. Input pins and register outputs are not computed: the caller
+ * stores them before settling, everything else follows from them.
+ */
+struct slice_program {
+
+	const netlist * n;
+	std::vector <slice_op> ops;
+	int slots;
+	int zero, ones;
+	std::string error;
+};
+
+
+/* Compiles n, keeping only operations that reach the bits in observe (all if it is empty); returns FAIL with p.error set */
+int slice_compile(const netlist& n, slice_program& p, const std::vector <int>& observe);
+/* Evaluates the combinational logic of p over v, which holds p.slots values */
+void slice_settle(const slice_program& p, unsigned long long * v);
+
+
+#endif
@@ -0,0 +1,163 @@
+#include <fstream>
+#include <cstring>
+
+#include "object.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define OBJECT_MMAP			1
+#endif
+
+using namespace std;
+
+
+/* Reads the whole file into memory, for hosts without mmap and for files that cannot be mapped */
+static int read_file(object& o, const char * file_name) {
+
+	ifstream file(file_name, ios::in | ios::binary | ios::ate);
+
+	if (!file.is_open())
+		return FAIL;
+
+	size_t size = (size_t) file.tellg();
+	char * data = new char[size ? size : 1];
+
+	file.seekg(0);
+	file.read(data, size);
+
+	if ((size_t) file.gcount() != size) {
+
+		delete[] data;
+		return FAIL;
+	}
+
+	o.data = data;
+	o.size = size;
+	o.mapped = false;
+
+	return SUCCESS;
+}
+
+
+/* True if count records of record_size at offset lie inside the file */
+static bool inside(const object& o, unsigned int offset, unsigned int count, size_t record_size) {
+
+	return offset <= o.size && count <= (o.size - offset) / record_size && offset % 4 == 0;
+}
+
+
+/* True if every record points at a section, symbol and bytes that exist */
+static bool consistent(const object& o) {
+
+	const object_header * h = o.header;
+
+	for (unsigned int i = 0; i < h->section_count; i++)
+		if (o.section[i].code > h->code_size || o.section[i].size > h->code_size - o.section[i].code
+			|| ((o.section[i].flags & OBJECT_ABSOLUTE) && o.section[i].address + o.section[i].size > 0x10000))
+			return false;
+
+	for (unsigned int i = 0; i < h->symbol_count; i++)
+		if (o.symbol[i].section != OBJECT_UNDEFINED && (o.symbol[i].section >= h->section_count || o.symbol[i].offset > o.section[o.symbol[i].section].size))
+			return false;
+
+	for (unsigned int i = 0; i < h->relocation_count; i++) {
+
+		const object_relocation& r = o.relocation[i];
+		unsigned int bytes = r.kind == OBJECT_RELATIVE8 ? 2 : 4;
+
+		if (r.section >= h->section_count || r.symbol >= h->symbol_count || r.kind > OBJECT_ABSOLUTE16 || r.offset + bytes > o.section[r.section].size)
+			return false;
+	}
+
+	for (unsigned int i = 0; i < h->line_count; i++)
+		if (o.line[i].section >= h->section_count || o.line[i].offset >= o.section[o.line[i].section].size)
+			return false;
+
+	return true;
+}
+
+
+int object_open(object& o, const char * file_name) {
+
+	memset(&o, 0, sizeof(object));
+
+	bool opened = false;
+
+#ifdef OBJECT_MMAP
+	int fd = open(file_name, O_RDONLY);
+	struct stat info;
+
+	if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+
+		void * memory = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (memory != MAP_FAILED) {
+
+			o.data = (const char *) memory;
+			o.size = (size_t) info.st_size;
+			o.mapped = opened = true;
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+#endif
+
+	if (!opened && read_file(o, file_name) == FAIL)
+		return FAIL;
+
+	const object_header * h = (const object_header *) o.data;
+
+	bool valid = o.size >= sizeof(object_header) && h->magic == OBJECT_MAGIC && h->version == OBJECT_VERSION
+		&& inside(o, h->section_offset, h->section_count, sizeof(object_section))
+		&& inside(o, h->symbol_offset, h->symbol_count, sizeof(object_symbol))
+		&& inside(o, h->relocation_offset, h->relocation_count, sizeof(object_relocation))
+		&& inside(o, h->line_offset, h->line_count, sizeof(object_line))
+		&& h->code_offset <= o.size && h->code_size <= o.size - h->code_offset
+		&& h->string_offset <= o.size && h->string_size <= o.size - h->string_offset
+		&& (h->string_size == 0 || o.data[h->string_offset + h->string_size - 1] == 0);			// strings cannot run off the end
+
+	if (valid) {
+
+		o.header = h;
+		o.section = (const object_section *) (o.data + h->section_offset);
+		o.symbol = (const object_symbol *) (o.data + h->symbol_offset);
+		o.relocation = (const object_relocation *) (o.data + h->relocation_offset);
+		o.line = (const object_line *) (o.data + h->line_offset);
+		o.code = (const unsigned char *) (o.data + h->code_offset);
+		o.strings = o.data + h->string_offset;
+
+		valid = consistent(o);
+	}
+
+	if (!valid) {
+
+		object_close(o);
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+
+void object_close(object& o) {
+
+#ifdef OBJECT_MMAP
+	if (o.data && o.mapped)
+		munmap((void *) o.data, o.size);
+#endif
+
+	if (o.data && !o.mapped)
+		delete[] o.data;
+
+	memset(&o, 0, sizeof(object));
+}
+
+
+const char * object_string(const object& o, unsigned int offset) {
+
+	return o.header && offset < o.header->string_size ? o.strings + offset : "";
+}
@@ -0,0 +1,104 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <cstddef>
+
+
+#ifndef SUCCESS
+	#define SUCCESS				1
+	#define FAIL				-1
+#endif
+
+#define OBJECT_MAGIC		0x4a424f48			// "HOBJ"
+#define OBJECT_VERSION		1
+
+/* Section flags */
+#define OBJECT_ABSOLUTE		1				// placed at its address (#org), otherwise wherever the linker puts it
+
+/* Symbol section of a label the module uses but does not define */
+#define OBJECT_UNDEFINED	0xffff
+
+/* Relocation kinds */
+#define OBJECT_RELATIVE8	0				// branch: signed byte after the opcode, label - (instruction + 2)
+#define OBJECT_ABSOLUTE16	1				// call, jmp: big endian word after the opcode word
+
+
+/*
+ * Relocatable object the assembler writes for one module (assembler -c). Little endian fixed width records like the
+ * symbol file, so the linker maps it and reads it in place:
+ *	header, sections, symbols, relocations, lines, then the code of every section back to back, then the strings
+ * Code before the first #org is relocatable and addressed from 0, every #org starts an absolute section.
+ * Every label reference is left to the linker, the referring bytes are 0 in the code.
+ */
+struct object_header {
+
+	unsigned int magic;
+	unsigned int version;
+	unsigned int section_count, symbol_count, relocation_count, line_count;
+	unsigned int section_offset, symbol_offset, relocation_offset, line_offset;			// bytes from the start of the file
+	unsigned int code_offset, code_size;
+	unsigned int string_offset, string_size;
+};
+
+/* Code assembled in one go: from the start of the module, or from an #org up to the next one */
+struct object_section {
+
+	unsigned short address;						// of an absolute section, 0 otherwise
+	unsigned short flags;
+	unsigned int size;
+	unsigned int code;							// offset into the code
+	unsigned int line;							// line of the #org, 0 for the relocatable section
+};
+
+/* Label defined (section and offset into it) or used by the module */
+struct object_symbol {
+
+	unsigned short section;						// OBJECT_UNDEFINED if defined in another module
+	unsigned short offset;
+	unsigned int name;							// offset into the strings, lowercase
+};
+
+/* Label reference in the instruction at offset into section */
+struct object_relocation {
+
+	unsigned short section;
+	unsigned short offset;
+	unsigned short symbol;
+	unsigned short kind;
+	unsigned int line;							// source line, for errors
+};
+
+/* Source line of the instruction at offset into section */
+struct object_line {
+
+	unsigned short section;
+	unsigned short offset;
+	unsigned int line;
+	unsigned int source;						// offset into the strings
+};
+
+/* Open object file, mapped read only where the host has mmap */
+struct object {
+
+	const char * data;
+	size_t size;
+	bool mapped;
+
+	const object_header * header;				// nullptr when no file is open
+	const object_section * section;
+	const object_symbol * symbol;
+	const object_relocation * relocation;
+	const object_line * line;
+	const unsigned char * code;
+	const char * strings;
+};
+
+
+/* Opens and checks an object file, every record pointing inside it; returns FAIL if it is missing or malformed (o is then empty) */
+int object_open(object& o, const char * file_name);
+/* Unmaps or frees the file, o is empty afterwards */
+void object_close(object& o);
+/* String at offset of the string table */
+const char * object_string(const object& o, unsigned int offset);
+
+#endif
@@ -0,0 +1,138 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <random>
+
+#include "simulator.h"
+
+using namespace std;
+
+
+/*
+ * Checks what assembler -O did to a program: the binary it started from (assembler -O -v writes it) and the optimized one
+ * run on the pipeline from the same random registers and RAM, several times, and have to halt with the same registers,
+ * stack pointer and RAM. The stack at and above the stack pointer is dead and may differ (a push and pop pair is gone), and
+ * so may the flags (a removed cmpi sets none). Build with the simulator:
+ *	g++ -O2 -o peephole_check peephole_check.cpp pipeline.cpp machine.cpp
+ */
+
+
+#define RUNS				16
+#define MAX_CYCLES			100000000ULL
+#define STACK_TOP			0x100
+
+
+/* Loads file_name and runs it on the pipeline from the registers and RAM of start, returns RUN_HALT or RUN_LIMIT */
+int run_from(machine& m, const machine& start, const char * file_name);
+/* Prints the registers, stack pointer and live RAM where a and b differ, returns true if they match */
+bool compare(const machine& a, const machine& b);
+
+
+static machine start, before, after;
+
+
+int main(int argc, char * argv[]) {
+
+	const char * before_name = argc > 1 ? argv[1] : "machine_code_unoptimized.bin";
+	const char * after_name = argc > 2 ? argv[2] : "machine_code.bin";
+
+	if (argc > 3) {
+
+		cout << "\nUsage: peephole_check [unoptimized.bin] [optimized.bin]" << endl;
+		return FAIL;
+	}
+
+	pipeline_init();
+
+	mt19937 random(1);
+	unsigned long long cycles_before = 0, cycles_after = 0;
+	unsigned long long retired_before = 0, retired_after = 0;
+
+	for (int run = 0; run < RUNS; run++) {
+
+		machine_reset(start);
+
+		if (run > 0) {			// the first run from reset, the others from random registers and RAM
+
+			for (int r = 0; r < NUM_REGS; r++)
+				start.regs[r] = random();
+			for (int i = 0; i < MEM_SIZE; i++)
+				start.ram[i] = random();
+		}
+
+		int result_before = run_from(before, start, before_name);
+		int result_after = run_from(after, start, after_name);
+
+		if (result_before == FAIL || result_after == FAIL)
+			return FAIL;
+
+		if (result_before != RUN_HALT || result_after != RUN_HALT) {
+
+			cout << "run " << run << ": " << (result_before != RUN_HALT ? before_name : after_name) << " does not halt within " << MAX_CYCLES << " cycles" << endl;
+			return FAIL;
+		}
+
+		if (!compare(before, after)) {
+
+			cout << "run " << run << ": optimized program ends in a different state" << endl;
+			return FAIL;
+		}
+
+		cycles_before += before.cycles;
+		cycles_after += after.cycles;
+		retired_before += before.retired;
+		retired_after += after.retired;
+	}
+
+	cout << RUNS << " runs match" << endl;
+	cout << "cycles        " << setw(12) << cycles_before << " -> " << setw(12) << cycles_after << endl;
+	cout << "instructions  " << setw(12) << retired_before << " -> " << setw(12) << retired_after << endl;
+
+	return 0;
+}
+
+
+int run_from(machine& m, const machine& start, const char * file_name) {
+
+	if (load_program(m, file_name) == FAIL)
+		return FAIL;
+
+	machine_reset(m);
+
+	memcpy(m.regs, start.regs, sizeof(m.regs));
+	memcpy(m.ram, start.ram, MEM_SIZE);
+
+	return pipeline_run(m, MAX_CYCLES);
+}
+
+
+bool compare(const machine& a, const machine& b) {
+
+	bool match = true;
+
+	for (int r = 0; r < NUM_REGS; r++) {
+
+		if (a.regs[r] != b.regs[r]) {
+
+			cout << "r" << r << " = " << a.regs[r] << " before, " << b.regs[r] << " after" << endl;
+			match = false;
+		}
+	}
+
+	if (a.sp != b.sp) {
+
+		cout << "sp = " << (int) a.sp << " before, " << (int) b.sp << " after" << endl;
+		return false;
+	}
+
+	for (int i = 0; i < MEM_SIZE; i++) {
+
+		if ((i < a.sp || i >= STACK_TOP) && a.ram[i] != b.ram[i]) {
+
+			cout << "RAM 0x" << hex << setw(4) << setfill('0') << i << dec << setfill(' ') << " = " << (int) a.ram[i] << " before, " << (int) b.ram[i] << " after" << endl;
+			match = false;
+		}
+	}
+
+	return match;
+}
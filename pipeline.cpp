@@ -0,0 +1,165 @@
+#include "simulator.h"
+
+
+/* Control ROM contents, generated from op_ctrl the same way urom.cpp writes dx_rom.bin / wb_rom.bin */
+static unsigned short dx_rom[DX_ROM_SIZE];
+static unsigned short wb_rom[WB_ROM_SIZE];
+
+
+void pipeline_init() {
+
+	for (int i = 0; i < DX_ROM_SIZE; i++)
+		dx_rom[i] = (unsigned short) dx_ctrl(i);
+
+	for (int i = 0; i < WB_ROM_SIZE; i++)
+		wb_rom[i] = (unsigned short) wb_ctrl(i);
+}
+
+
+/*
+ * One clock period of hbcp-main. Everything before the rising edge section is combinational and reads
+ * the latches as they were at the start of the cycle; the rising edge section then updates every latch at once.
+ *
+ * Behaviour that falls out of the circuit rather than the ISA description:
+ *	- bra and jmp raise STALL but not FLUSH, so the word two slots behind them still enters decode
+ *	- during a store (RW) the register file read ports are addressed by the writeback instruction,
+ *	  so an instruction decoding behind a push reads the wrong registers
+ */
+bool pipeline_cycle(machine& m) {
+
+	bool cout, vout;
+	unsigned short e = alu_eval(m.alu_a, m.alu_b, m.alu_os, cout, vout);			// ALUZ
+
+	if (m.alu_uf)			// falling edge: flag registers load from the instruction in writeback
+		alu_set_flags(m, e, m.alu_os, cout, vout);
+
+	unsigned short wbc = wb_rom[(m.n << 11) | (m.z << 10) | (m.c << 9) | (m.v << 8) | (m.wb >> 8)];
+
+	if (wbc & FLUSH) {			// FL resets the decode register asynchronously
+
+		if (m.dx_valid) {			// a bubble already in decode keeps its cause
+
+			m.dx_bubble = BUBBLE_FLUSH;
+			m.dx_blame = m.wb_pc;
+		}
+
+		m.dx = 0;
+		m.dx_valid = false;
+	}
+
+	unsigned short dxc = dx_rom[m.dx >> 8];
+
+
+	/* RAM, addressed by the stack pointer or the latched address word */
+	unsigned short address = (wbc & SPS) ? m.sp : m.imm;
+	unsigned short ro = (wbc & RBYTE) ? m.ram[address] : ram_read_word(m, address);
+	unsigned short wdata = (wbc & RR) ? ro : e;			// register file write data
+
+	/* Register file reads, forwarding from writeback when the destination matches */
+	unsigned short rsel = (wbc & RW) ? m.wb : m.dx;
+	unsigned short qa = m.regs[(rsel >> 8) & 7];
+	unsigned short qb = m.regs[rsel & 7];
+
+	int wb_rd = (m.wb >> 8) & 7;
+	bool fwda = (wbc & WEN) && ((m.dx >> 8) & 7) == wb_rd;
+	bool fwdb = (wbc & WEN) && (m.dx & 7) == wb_rd;
+
+	unsigned short a = (dxc & PCS) ? m.pc : (fwda ? wdata : qa);
+	unsigned short b = (dxc & IMS) ? sext8(m.dx) : (fwdb ? wdata : qb);
+
+
+	/* PC multiplexer, selected by RET_C | J | BRS */
+	unsigned short next_pc;
+
+	switch (((wbc & RET_C) ? 4 : 0) | ((wbc & J) ? 2 : 0) | ((wbc & BRS) ? 1 : 0)) {
+
+		case 2:
+			next_pc = m.imm;			// jmp, call
+			break;
+		case 3:
+			next_pc = e;				// taken branch
+			break;
+		case 6:
+			next_pc = ro;				// ret
+			break;
+		default:
+			next_pc = m.pc + 2;			// no jump, or branch not taken
+	}
+
+	bool halt = m.wb_valid && (wbc & J) && next_pc == m.wb_pc;			// jumping to itself forever
+
+	if (halt)
+		m.halt_pc = m.wb_pc;
+
+	unsigned short fetch = rom_read_word(m, m.pc);
+
+
+	/* Rising edge */
+	if (wbc & WEN)
+		m.regs[wb_rd] = wdata;
+
+	if (wbc & RW) {
+
+		unsigned short data = (wbc & CALL_C) ? m.pc : qa;			// call pushes the return address
+
+		if (wbc & RBYTE)
+			m.ram[address] = (unsigned char) data;
+		else
+			ram_write_word(m, address, data);
+	}
+
+	if ((wbc & INCSP) && !(dxc & DECSP))
+		m.sp += 2;
+	else if ((dxc & DECSP) && !(wbc & INCSP))
+		m.sp -= 2;
+
+	if (dxc & ALUI) {
+
+		m.alu_a = a;
+		m.alu_b = b;
+		m.alu_os = dxc & OS_MASK;
+		m.alu_uf = !(dxc & PCS);			// branches use the ALU for their target without touching the flags
+	}
+
+	if (dxc & LDI)
+		m.imm = fetch;
+
+	if (m.wb_valid)
+		m.retired++;
+
+	unsigned short blame = (wbc & FLUSH) ? m.wb_pc : m.dx_pc;			// instruction a new bubble in decode is charged to
+
+	m.wb = m.dx;
+	m.wb_pc = m.dx_pc;
+	m.wb_valid = m.dx_valid;
+	m.wb_bubble = m.dx_bubble;
+	m.wb_blame = m.dx_blame;
+
+	if ((wbc & FLUSH) || (dxc & STALL)) {			// STL masks the fetched word, FL holds the register cleared
+
+		m.dx = 0;
+		m.dx_valid = false;
+		m.dx_bubble = (wbc & FLUSH) ? BUBBLE_FLUSH : BUBBLE_STALL;
+		m.dx_blame = blame;
+	} else {
+
+		m.dx = fetch;
+		m.dx_valid = true;
+	}
+
+	m.dx_pc = m.pc;
+	m.pc = next_pc;
+	m.cycles++;
+
+	return halt;
+}
+
+
+int pipeline_run(machine& m, unsigned long long max_cycles) {
+
+	while (m.cycles < max_cycles)
+		if (pipeline_cycle(m))
+			return RUN_HALT;
+
+	return RUN_LIMIT;
+}
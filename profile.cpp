@@ -0,0 +1,228 @@
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#include "profile.h"
+
+using namespace std;
+
+
+/*
+ * Cycle profiler for the pipeline model. Every clock cycle has exactly one slot in writeback: it either holds an
+ * instruction, which is charged a retired cycle, or a bubble, which pipeline_cycle tagged with the instruction whose
+ * STALL or FLUSH created it. A shadow call stack follows call and ret so the same cycles can be written as collapsed stacks.
+ */
+
+
+static const char * const charge_names[CHARGE_KINDS] = {"", "[stall]", "[flush]"};
+
+
+void profile_reset(profile& p) {
+
+	p.counts.assign(MEM_SIZE * CHARGE_KINDS, 0);
+	p.reset = 0;
+
+	p.parent.assign(1, -1);
+	p.entry.assign(1, 0);
+	p.children.clear();
+
+	p.context = 0;
+	p.next_context = -1;
+
+	p.samples.clear();
+
+	p.taken.assign(MEM_SIZE, 0);
+	p.not_taken.assign(MEM_SIZE, 0);
+}
+
+
+void profile_cycle(profile& p, const machine& m) {
+
+	unsigned short address;
+	int kind;
+
+	if (m.wb_valid) {
+
+		if (p.next_context >= 0) {			// the first instruction after a call or ret belongs to the new context
+
+			p.context = p.next_context;
+			p.next_context = -1;
+		}
+
+		address = m.wb_pc;
+		kind = CHARGE_RETIRED;
+
+		int opcode = m.wb >> 11;
+
+		if (opcode == opcodes::call) {			// imm still holds the target LDI latched while the call was in decode
+
+			auto key = make_pair(p.context, m.imm);
+			auto found = p.children.find(key);
+
+			if (found == p.children.end()) {
+
+				found = p.children.emplace(key, (int) p.parent.size()).first;
+				p.parent.push_back(p.context);
+				p.entry.push_back(m.imm);
+			}
+
+			p.next_context = found->second;
+		} else if (opcode == opcodes::ret && p.context != 0)
+			p.next_context = p.parent[p.context];
+		else if (opcode >= opcodes::bne && opcode <= opcodes::bvc) {			// a branch leaves the flags alone, they are still those it tests
+
+			unsigned long wbc = wb_ctrl((m.n << 11) | (m.z << 10) | (m.c << 9) | (m.v << 8) | (m.wb >> 8));
+
+			(wbc & J ? p.taken : p.not_taken)[address]++;
+		}
+	} else if (m.wb_bubble == BUBBLE_RESET) {
+
+		p.reset++;
+		return;
+	} else {
+
+		address = m.wb_blame;
+		kind = m.wb_bubble == BUBBLE_STALL ? CHARGE_STALL : CHARGE_FLUSH;
+	}
+
+	p.counts[address * CHARGE_KINDS + kind]++;
+	p.samples[((unsigned long long) p.context << 16 | address) * CHARGE_KINDS + kind]++;
+}
+
+
+int profile_run(profile& p, machine& m, unsigned long long max_cycles) {
+
+	while (m.cycles < max_cycles) {
+
+		profile_cycle(p, m);
+
+		if (pipeline_cycle(m))
+			return RUN_HALT;
+	}
+
+	return RUN_LIMIT;
+}
+
+
+void profile_report(const profile& p, const symbols& s, ostream& out) {
+
+	unsigned long long totals[CHARGE_KINDS] = {};
+	vector <pair <unsigned long long, int>> rows;			// (cycles, address)
+
+	for (int a = 0; a < MEM_SIZE; a++) {
+
+		unsigned long long cycles = 0;
+
+		for (int k = 0; k < CHARGE_KINDS; k++) {
+
+			cycles += p.counts[a * CHARGE_KINDS + k];
+			totals[k] += p.counts[a * CHARGE_KINDS + k];
+		}
+
+		if (cycles)
+			rows.push_back({cycles, a});
+	}
+
+	sort(rows.begin(), rows.end(), [](const pair <unsigned long long, int>& x, const pair <unsigned long long, int>& y) {
+		return x.first != y.first ? x.first > y.first : x.second < y.second;
+	});
+
+	unsigned long long total = totals[CHARGE_RETIRED] + totals[CHARGE_STALL] + totals[CHARGE_FLUSH] + p.reset;
+
+	out << setfill(' ') << total << " cycles: " << totals[CHARGE_RETIRED] << " retired, " << totals[CHARGE_STALL] << " stall, "
+		<< totals[CHARGE_FLUSH] << " flush, " << p.reset << " reset" << endl << endl;
+
+	out << "    cycles      %    retired      stall      flush  address  line  label / source" << endl;
+
+	for (const auto& r : rows) {
+
+		const unsigned long long * c = &p.counts[r.second * CHARGE_KINDS];
+		const symbols_line * line = symbols_find_line(s, (unsigned short) r.second);
+
+		out << setw(10) << r.first << " " << fixed << setprecision(1) << setw(6) << 100.0 * r.first / total << " "
+			<< setw(10) << c[CHARGE_RETIRED] << " " << setw(10) << c[CHARGE_STALL] << " " << setw(10) << c[CHARGE_FLUSH]
+			<< "   0x" << hex << setw(4) << setfill('0') << r.second << dec << setfill(' ') << " ";
+
+		if (line)
+			out << setw(5) << line->line << "  " << symbols_name(s, (unsigned short) r.second) << "  " << symbols_string(s, line->source);
+		else
+			out << setw(5) << "-" << "  " << symbols_name(s, (unsigned short) r.second);
+
+		out << endl;
+	}
+
+	out << defaultfloat;
+}
+
+
+int profile_write_stacks(const profile& p, const symbols& s, const char * file_name) {
+
+	ofstream file(file_name, ios::out | ios::trunc);
+
+	if (!file.is_open())
+		return FAIL;
+
+	/* Frame list of each context, named by the label of the called address */
+	vector <string> frames(p.parent.size());
+
+	frames[0] = symbols_name(s, 0);
+
+	for (size_t i = 1; i < p.parent.size(); i++)			// callers are always created before their callees
+		frames[i] = frames[p.parent[i]] + ";" + symbols_name(s, p.entry[i]);
+
+	map <string, unsigned long long> stacks;			// sorted output, equal leaf names merged
+
+	for (const auto& sample : p.samples) {
+
+		int kind = (int) (sample.first % CHARGE_KINDS);
+		unsigned short address = (unsigned short) (sample.first / CHARGE_KINDS);
+		int context = (int) (sample.first / CHARGE_KINDS >> 16);
+		const symbols_line * line = symbols_find_line(s, address);
+		ostringstream leaf;
+
+		if (line)
+			leaf << "line " << line->line << " " << symbols_string(s, line->source);
+		else
+			leaf << symbols_name(s, address);
+
+		string stack = frames[context] + ";" + leaf.str();
+
+		if (kind != CHARGE_RETIRED)
+			stack += string(";") + charge_names[kind];
+
+		stacks[stack] += sample.second;
+	}
+
+	if (p.reset)
+		stacks[frames[0] + ";[reset]"] += p.reset;
+
+	for (const auto& stack : stacks)
+		file << stack.first << " " << stack.second << endl;
+
+	return file.good() ? SUCCESS : FAIL;
+}
+
+
+int profile_write_branches(const profile& p, const symbols& s, const char * file_name) {
+
+	ofstream file(file_name, ios::out | ios::trunc);
+
+	if (!file.is_open())
+		return FAIL;
+
+	file << "# address line taken not_taken" << endl;
+
+	for (int a = 0; a < MEM_SIZE; a++) {
+
+		if (!p.taken[a] && !p.not_taken[a])
+			continue;
+
+		const symbols_line * line = symbols_find_line(s, (unsigned short) a);
+
+		file << "0x" << hex << setw(4) << setfill('0') << a << dec << setfill(' ') << " " << (line && line->address == a ? line->line : 0)
+			<< " " << p.taken[a] << " " << p.not_taken[a] << endl;
+	}
+
+	return file.good() ? SUCCESS : FAIL;
+}
@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+#include "symbols.h"
+#include "simulator.h"
+
+
+/* Kinds of cycle charged to an instruction */
+#define CHARGE_RETIRED		0			// the instruction itself was in writeback
+#define CHARGE_STALL		1			// a bubble from the STALL it raised was in writeback
+#define CHARGE_FLUSH		2			// a bubble from the FLUSH it raised was in writeback
+#define CHARGE_KINDS		3
+
+
+/* Cycle counts of a pipeline run by instruction address and by call context */
+struct profile {
+
+	std::vector <unsigned long long> counts;				// MEM_SIZE * CHARGE_KINDS, indexed address * CHARGE_KINDS + kind
+	unsigned long long reset;								// bubbles left over from reset
+
+	/* Call contexts, 0 is the code entered from reset; a context is its caller's context plus the callee address */
+	std::vector <int> parent;
+	std::vector <unsigned short> entry;
+	std::map <std::pair <int, unsigned short>, int> children;
+
+	int context;											// context of the instruction in writeback
+	int next_context;										// context after the call or ret that just retired, -1 if none
+
+	std::unordered_map <unsigned long long, unsigned long long> samples;			// (context, address, kind) -> cycles
+
+	std::vector <unsigned long long> taken, not_taken;		// MEM_SIZE, outcomes of the conditional branches by address
+};
+
+
+/* Clears all counts and call contexts */
+void profile_reset(profile& p);
+/* Charges the cycle m is about to run to the instruction in writeback, or to the instruction that caused the bubble there */
+void profile_cycle(profile& p, const machine& m);
+/* pipeline_run with every cycle charged to p */
+int profile_run(profile& p, machine& m, unsigned long long max_cycles);
+
+/* Flat profile, one row per instruction address sorted by cycles */
+void profile_report(const profile& p, const symbols& s, std::ostream& out);
+/* Collapsed stacks for flame graph tools, one "caller;callee;line count" row per context and line; returns FAIL if the file cannot be written */
+int profile_write_stacks(const profile& p, const symbols& s, const char * file_name);
+/* Branch profile for the assembler's block layout, one "address line taken not_taken" row per conditional branch that ran (line 0 without
+   a symbol file); returns FAIL if the file cannot be written */
+int profile_write_branches(const profile& p, const symbols& s, const char * file_name);
+
+#endif
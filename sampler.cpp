@@ -0,0 +1,253 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <random>
+
+#include "simulator.h"
+
+using namespace std;
+
+
+/*
+ * Estimates the pipeline cycles of a program without running all of it on the pipeline: the functional interpreter runs
+ * the whole program, and every period instructions a copy of its state goes to the pipeline model for a short warm-up
+ * (refilling the latches reset leaves empty) and a measured window, at a random place in the period so that the windows
+ * do not fall in step with a loop. The cycles per instruction of the windows (their cycles over their instructions, a ratio
+ * estimate), times the instructions the interpreter ran, give the total with a 95% confidence interval, from 30 windows on.
+ * -v also runs the whole program on the pipeline and reports the error. Build with the engines:
+ *	g++ -O2 -o sampler sampler.cpp pipeline.cpp machine.cpp interpreter.cpp jit.cpp
+ */
+
+
+#define DEFAULT_PERIOD			100000ULL			// instructions from the start of one sample to the next
+#define DEFAULT_WARMUP			16ULL				// instructions run on the pipeline before a window
+#define DEFAULT_WINDOW			1000ULL				// instructions measured per window
+#define MAX_INSTRUCTIONS		10000000000ULL
+#define CYCLES_PER_INSTRUCTION	16					// a window giving up after this many cycles per instruction has diverged
+#define Z_95					1.96				// normal quantile, the windows are random and independent
+#define MIN_SAMPLES				30					// fewer windows than this and the normal quantile understates the interval
+
+
+/* Cycles of one measured window */
+struct sample {
+
+	unsigned long long cycles;
+	unsigned long long instructions;
+};
+
+
+/* Clears the latches, as reset leaves them, keeping the registers, flags, pc, sp and RAM of a functional run */
+void enter_pipeline(machine& m);
+/* Runs m on the pipeline for warmup instructions, then measures the next window; instructions are counted as the interpreter counts them */
+sample measure(machine& m, unsigned long long warmup, unsigned long long window);
+
+
+static machine fast, detail;			// 128 KiB of memory each, keep off the stack
+
+
+int main(int argc, char * argv[]) {
+
+	const char * file_name = "machine_code.bin";
+	unsigned long long period = DEFAULT_PERIOD;
+	unsigned long long warmup = DEFAULT_WARMUP;
+	unsigned long long window = DEFAULT_WINDOW;
+	unsigned long long max_instructions = MAX_INSTRUCTIONS;
+	bool jit = false;
+	bool validate = false;
+
+	for (int i = 1; i < argc; i++) {
+
+		if (!strcmp(argv[i], "-p") && i + 1 < argc)
+			period = strtoull(argv[++i], nullptr, 0);
+		else if (!strcmp(argv[i], "-u") && i + 1 < argc)
+			warmup = strtoull(argv[++i], nullptr, 0);
+		else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+			window = strtoull(argv[++i], nullptr, 0);
+		else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+			max_instructions = strtoull(argv[++i], nullptr, 0);
+		else if (!strcmp(argv[i], "-j"))
+			jit = true;			// fast-forward on the jit instead of the interpreter
+		else if (!strcmp(argv[i], "-v"))
+			validate = true;	// and run the whole program on the pipeline to compare
+		else if (argv[i][0] != '-')
+			file_name = argv[i];
+		else {
+
+			cout << "\nUsage: sampler [-p period] [-u warmup] [-w window] [-c max_instructions] [-j] [-v] [program.bin]" << endl;
+			return FAIL;
+		}
+	}
+
+	if (window == 0 || period < warmup + window) {
+
+		cout << "\nError... The period has to hold the warm-up and a window of at least one instruction" << endl;
+		return FAIL;
+	}
+
+	if (load_program(fast, file_name) == FAIL)
+		return FAIL;
+
+	machine_reset(fast);
+	pipeline_init();
+
+	if (jit && jit_init(fast) == FAIL) {
+
+		cout << "no executable memory, interpreting" << endl;
+		jit = false;
+	}
+
+	if (!jit)
+		interp_predecode(fast);
+
+	int (*run)(machine&, unsigned long long) = jit ? jit_run : interp_run;
+
+	/* Sample, then fast-forward to the next one */
+	auto start = chrono::steady_clock::now();
+	int result = RUN_LIMIT;
+	int samples = 0;
+	double cycles = 0, instructions = 0;
+	double cycles_squared = 0, products = 0, instructions_squared = 0;
+	unsigned long long detailed = 0;
+
+	mt19937 random(1);			// fixed seed, a run gives the same estimate every time
+
+	while (result == RUN_LIMIT && fast.retired < max_instructions) {
+
+		/* The window lies at a random place in each period but the first, so it does not fall in step with a loop of the program */
+		unsigned long long period_end = min(fast.retired + period, max_instructions);
+		unsigned long long offset = fast.retired ? random() % (period - warmup - window + 1) : 0;
+
+		if (offset && (result = run(fast, min(offset, period_end - fast.retired))) != RUN_LIMIT)
+			break;
+
+		detail = fast;
+		enter_pipeline(detail);
+
+		sample s = measure(detail, fast.retired ? warmup : 0, window);			// reset leaves the latches empty, the first window needs no warm-up
+
+		detailed += detail.cycles;
+
+		if (s.instructions) {
+
+			cycles += s.cycles;
+			instructions += s.instructions;
+			cycles_squared += (double) s.cycles * s.cycles;
+			products += (double) s.cycles * s.instructions;
+			instructions_squared += (double) s.instructions * s.instructions;
+			samples++;
+		}
+
+		if (fast.retired < period_end)
+			result = run(fast, period_end - fast.retired);
+	}
+
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	if (samples == 0) {
+
+		cout << "\nError... No window retired an instruction" << endl;
+		return FAIL;
+	}
+
+	/* Standard error of a ratio estimate: the spread of the window cycles around cpi times their instructions */
+	double cpi = cycles / instructions;
+	double residuals = cycles_squared - 2 * cpi * products + cpi * cpi * instructions_squared;
+	double deviation = samples > 1 ? sqrt(max(0.0, residuals / (samples - 1))) / (instructions / samples) : 0;
+	double cpi_margin = Z_95 * deviation / sqrt((double) samples);
+	double estimate = cpi * fast.retired;
+	double margin = cpi_margin * fast.retired;
+
+	cout << (result == RUN_HALT ? "halted" : "instruction limit reached") << " after " << fast.retired << " instructions" << endl;
+	cout << samples << " windows, " << (unsigned long long) instructions << " instructions measured, " << detailed << " cycles on the pipeline ("
+		<< fixed << setprecision(2) << 100 * detailed / estimate << "% of the estimate)" << endl;
+	cout << "CPI      " << setprecision(4) << cpi << " +- " << cpi_margin << endl;
+	cout << "cycles   " << setprecision(0) << estimate << " +- " << margin;
+
+	if (samples < 2)
+		cout << " (one window, no interval)";
+	else if (samples < MIN_SAMPLES)
+		cout << " (" << samples << " windows, too few for the interval to hold; lower -p)";
+
+	cout << endl << "time     " << setprecision(3) << seconds << " s" << endl;
+
+	if (!validate)
+		return 0;
+
+	/* The same program from reset on the pipeline alone */
+	machine_reset(detail);
+	memcpy(detail.rom, fast.rom, MEM_SIZE);
+
+	start = chrono::steady_clock::now();
+	result = pipeline_run(detail, max_instructions * CYCLES_PER_INSTRUCTION);
+
+	double full_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	double error = (estimate - (double) detail.cycles) / detail.cycles;
+
+	cout << endl << "pipeline " << detail.cycles << " cycles" << (result == RUN_HALT ? "" : " (limit reached)") << ", "
+		<< setprecision(3) << full_seconds << " s" << endl;
+	cout << "error    " << setprecision(2) << showpos << 100 * error << "%" << noshowpos
+		<< (samples < MIN_SAMPLES ? ", too few windows for an interval" : fabs(estimate - (double) detail.cycles) <= margin ? ", inside the interval" : ", outside the interval") << ", "
+		<< setprecision(1) << full_seconds / seconds << "x faster" << endl;
+
+	return 0;
+}
+
+
+void enter_pipeline(machine& m) {
+
+	m.dx = m.wb = m.imm = 0;
+	m.alu_a = m.alu_b = 0;
+	m.alu_os = 0;
+	m.alu_uf = false;
+
+	m.dx_pc = m.wb_pc = 0;
+	m.dx_valid = m.wb_valid = false;
+	m.dx_bubble = m.wb_bubble = BUBBLE_RESET;
+	m.dx_blame = m.wb_blame = 0;
+
+	m.cycles = 0;
+	m.retired = 0;
+}
+
+
+sample measure(machine& m, unsigned long long warmup, unsigned long long window) {
+
+	sample s = {0, 0};
+	unsigned long long counted = 0, first_cycle = 0;
+	unsigned long long max_cycles = (warmup + window) * CYCLES_PER_INSTRUCTION;
+	bool delay_word = false;
+
+	while (counted < warmup + window && m.cycles < max_cycles) {
+
+		/* bra and jmp run the word two behind them before jumping, the interpreter jumps at once: that word is not counted */
+		if (m.wb_valid) {
+
+			int opcode = m.wb >> 11;
+
+			if (delay_word)
+				delay_word = false;
+			else {
+
+				counted++;
+				delay_word = opcode == opcodes::bra || opcode == opcodes::jmp;
+
+				if (counted == warmup)
+					first_cycle = m.cycles + 1;			// after the cycle it leaves in, which belongs to the warm-up
+			}
+		}
+
+		if (pipeline_cycle(m))
+			break;
+	}
+
+	if (counted > warmup) {
+
+		s.cycles = m.cycles - first_cycle;
+		s.instructions = counted - warmup;
+	}
+
+	return s;
+}
@@ -0,0 +1,306 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+
+#include "simulator.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "trace.h"
+
+using namespace std;
+
+
+#define DEFAULT_MAX_CYCLES		100000000ULL
+#define BENCH_CYCLES			200000000ULL			// cycles simulated by -b
+#define BENCH_INSTRUCTIONS		1000000000ULL			// instructions executed by -f -b
+
+
+/* Prints registers, flags, stack pointer and cycle counts */
+void print_state(const machine& m);
+/* Prints how often each superinstruction of the interpreter ran and the share of a run of instructions it covered */
+void print_superinstructions(unsigned long long instructions);
+/* Reruns the program from reset until BENCH_CYCLES have been simulated and reports cycles per second (reset time excluded) */
+void bench_pipeline(machine& m, unsigned long long max_cycles);
+/* Same for the functional engines, reports millions of instructions per second */
+void bench_functional(machine& m, unsigned long long max_instructions, int (*run)(machine&, unsigned long long));
+
+
+static machine cpu;			// 128 KiB of memory, keep off the stack
+static profile cycles;
+static symbols program_symbols;
+static snapshot start;
+static trace_recorder recorder;
+
+
+int main(int argc, char * argv[]) {
+
+	const char * file_name = "machine_code.bin";
+	unsigned long long max_cycles = DEFAULT_MAX_CYCLES;
+	bool bench = false;
+	bool functional = false;
+	bool jit = false;
+	bool profiling = false;
+	const char * stacks_name = nullptr;
+	const char * branches_name = nullptr;
+	const char * symbols_file = nullptr;
+	const char * restore_name = nullptr;
+	const char * save_name = nullptr;
+	const char * trace_name = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+
+		if (!strcmp(argv[i], "-c") && i + 1 < argc)
+			max_cycles = strtoull(argv[++i], nullptr, 0);			// stop after this many cycles
+		else if (!strcmp(argv[i], "-b"))
+			bench = true;
+		else if (!strcmp(argv[i], "-f"))
+			functional = true;			// architectural results only, -c then counts instructions
+		else if (!strcmp(argv[i], "-j"))
+			functional = jit = true;			// functional, with hot blocks translated to x86-64
+		else if (!strcmp(argv[i], "-p"))
+			profiling = true;			// flat profile of cycles by instruction address
+		else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+			profiling = true, stacks_name = argv[++i];			// and collapsed stacks for flame graphs
+		else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+			profiling = true, branches_name = argv[++i];		// and the branch outcomes for the assembler's block layout
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			symbols_file = argv[++i];
+		else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			trace_name = argv[++i];				// binary trace of every cycle, for tracediff
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+			restore_name = argv[++i];			// resume from a snapshot instead of reset
+		else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+			save_name = argv[++i];				// snapshot the machine where the run stops
+		else if (argv[i][0] != '-')
+			file_name = argv[i];
+		else {
+
+			cout << "\nUsage: simulator [-c max_cycles] [-b] [-f | -j | -p [-g stacks.txt] [-e branches.txt]] [-s program.sym] [-t trace.trc] [-r in.snp] [-w out.snp] [program.bin]" << endl;
+			return FAIL;
+		}
+	}
+
+	if (profiling && (functional || bench)) {
+
+		cout << "\nProfiling needs the pipeline model, it cannot be combined with -b, -f or -j" << endl;
+		return FAIL;
+	}
+
+	if (trace_name && (functional || bench || profiling)) {
+
+		cout << "\nTracing needs the pipeline model, it cannot be combined with -b, -f, -j or -p" << endl;
+		return FAIL;
+	}
+
+	if (bench && (restore_name || save_name)) {
+
+		cout << "\nBenchmarks run from reset, -b cannot be combined with -r or -w" << endl;
+		return FAIL;
+	}
+
+	int engine = functional ? SNAPSHOT_FUNCTIONAL : SNAPSHOT_PIPELINE;
+
+	if (restore_name) {
+
+		if (snapshot_open(start, restore_name) == FAIL) {
+
+			cout << "\nUnable to open snapshot [" << restore_name << "]" << endl;
+			return FAIL;
+		}
+
+		if (start.header->engine != engine) {
+
+			cout << "\nSnapshot [" << restore_name << "] was taken " << (engine == SNAPSHOT_FUNCTIONAL ? "on the pipeline, it cannot resume with -f or -j" : "with -f or -j, it needs them to resume") << endl;
+			return FAIL;
+		}
+
+		snapshot_restore(cpu, start);			// the program comes with it
+		snapshot_close(start);
+	} else {
+
+		if (load_program(cpu, file_name) == FAIL)
+			return FAIL;
+
+		machine_reset(cpu);
+	}
+
+	int (*run)(machine&, unsigned long long) = jit ? jit_run : interp_run;
+
+	if (functional) {
+
+		if (jit) {
+
+			if (jit_init(cpu) == FAIL)
+				cout << "no executable memory, interpreting" << endl;
+		} else
+			interp_predecode(cpu);
+
+		if (bench) {
+
+			bench_functional(cpu, max_cycles, run);
+			return 0;
+		}
+	} else {
+
+		pipeline_init();
+
+		if (bench) {
+
+			bench_pipeline(cpu, max_cycles);
+			return 0;
+		}
+	}
+
+	string symbols_path = symbols_file ? symbols_file : symbols_file_for(file_name);
+
+	if (symbols_open(program_symbols, symbols_path.c_str()) == FAIL && (symbols_file || profiling))
+		cout << "no symbol file [" << symbols_path << "], addresses are shown bare" << endl;
+
+	if (profiling)
+		profile_reset(cycles);
+
+	if (trace_name && trace_record_open(recorder, trace_name, cpu) == FAIL) {
+
+		cout << "\nUnable to write trace [" << trace_name << "]" << endl;
+		return FAIL;
+	}
+
+	unsigned long long retired = cpu.retired;			// a snapshot brings its count along
+	int result = functional ? run(cpu, max_cycles) : profiling ? profile_run(cycles, cpu, max_cycles)
+		: trace_name ? trace_record_run(recorder, cpu, max_cycles) : pipeline_run(cpu, max_cycles);
+
+	if (trace_name && trace_record_close(recorder, cpu) == FAIL) {
+
+		cout << "\nUnable to write trace [" << trace_name << "]" << endl;
+		return FAIL;
+	}
+
+	if (result == RUN_HALT)
+		cout << "halted at 0x" << hex << setw(4) << setfill('0') << cpu.halt_pc << dec
+			<< (program_symbols.header ? " (" + symbols_name(program_symbols, cpu.halt_pc) + ")" : "") << endl;
+	else
+		cout << (functional ? "instruction" : "cycle") << " limit reached" << endl;
+
+	print_state(cpu);
+
+	if (functional && !jit)
+		print_superinstructions(cpu.retired - retired);
+
+	if (save_name && snapshot_save(cpu, engine, save_name) == FAIL) {
+
+		cout << "\nUnable to write snapshot [" << save_name << "]" << endl;
+		return FAIL;
+	}
+
+	if (profiling) {
+
+		cout << endl;
+		profile_report(cycles, program_symbols, cout);
+
+		if (stacks_name && profile_write_stacks(cycles, program_symbols, stacks_name) == FAIL) {
+
+			cout << "\nUnable to write collapsed stacks [" << stacks_name << "]" << endl;
+			return FAIL;
+		}
+
+		if (branches_name && profile_write_branches(cycles, program_symbols, branches_name) == FAIL) {
+
+			cout << "\nUnable to write branch profile [" << branches_name << "]" << endl;
+			return FAIL;
+		}
+	}
+
+	return 0;
+}
+
+
+void print_state(const machine& m) {
+
+	for (int i = 0; i < NUM_REGS; i++)
+		cout << "r" << i << " = 0x" << hex << setw(4) << setfill('0') << m.regs[i] << dec << " (" << m.regs[i] << ")" << endl;
+
+	cout << "pc = 0x" << hex << setw(4) << setfill('0') << m.pc << "  sp = 0x" << setw(2) << (int) m.sp << dec << endl;
+	cout << "N = " << m.n << "  Z = " << m.z << "  C = " << m.c << "  V = " << m.v << endl;
+
+	cout << "cycles = " << m.cycles << "  instructions = " << m.retired;
+
+	if (m.retired && m.cycles)			// functional runs do not count cycles
+		cout << "  CPI = " << fixed << setprecision(3) << (double) m.cycles / m.retired << defaultfloat;
+
+	cout << endl;
+}
+
+
+void print_superinstructions(unsigned long long instructions) {
+
+	const char * name;
+	unsigned int sites;
+	unsigned long long fired, fused = 0;
+	bool header = false;
+
+	for (int i = 0; interp_superinstruction(i, name, sites, fired) == SUCCESS; i++) {
+
+		if (!fired)
+			continue;
+
+		if (!header)
+			cout << endl << "superinstruction      sites          runs" << endl;
+
+		header = true;
+		fused += 2 * fired;
+		cout << setfill(' ') << left << setw(16) << name << right << setw(11) << sites << setw(14) << fired << endl;
+	}
+
+	if (header && instructions)
+		cout << fixed << setprecision(1) << 100.0 * fused / instructions << defaultfloat << "% of the instructions ran fused" << endl;
+}
+
+
+void bench_pipeline(machine& m, unsigned long long max_cycles) {
+
+	unsigned long long total = 0;
+	int runs = 0;
+	double seconds = 0;
+
+	while (total < BENCH_CYCLES) {
+
+		machine_reset(m);			// clearing 64 KiB of RAM costs more than a short program, keep it out of the timing
+
+		auto start = chrono::steady_clock::now();
+
+		pipeline_run(m, max_cycles < BENCH_CYCLES - total ? max_cycles : BENCH_CYCLES - total);
+
+		seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		total += m.cycles;
+		runs++;
+	}
+
+	cout << runs << " runs, " << total << " cycles in " << fixed << setprecision(3) << seconds << " s = "
+		<< total / seconds / 1e6 << " Mcycles/s" << endl;
+}
+
+
+void bench_functional(machine& m, unsigned long long max_instructions, int (*run)(machine&, unsigned long long)) {
+
+	unsigned long long total = 0;
+	int runs = 0;
+	double seconds = 0;
+
+	while (total < BENCH_INSTRUCTIONS) {
+
+		machine_reset(m);
+
+		auto start = chrono::steady_clock::now();
+
+		run(m, max_instructions < BENCH_INSTRUCTIONS - total ? max_instructions : BENCH_INSTRUCTIONS - total);
+
+		seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		total += m.retired;
+		runs++;
+	}
+
+	cout << runs << " runs, " << total << " instructions in " << fixed << setprecision(3) << seconds << " s = "
+		<< total / seconds / 1e6 << " MIPS" << endl;
+}
@@ -0,0 +1,228 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include "urom.h"
+
+
+#define SUCCESS				1
+#define FAIL				-1
+
+#define NUM_REGS			8
+#define MEM_SIZE			65536			// 16 bit address space for program ROM and data RAM
+#define MEM_PAGE			16384			// ROM and RAM start on a page boundary (pages up to 16 KiB), so a snapshot can be mapped over them
+
+/* Reasons a run stops */
+#define RUN_HALT			0				// jump or branch to itself reached writeback
+#define RUN_LIMIT			1				// cycle or instruction limit reached
+
+/* Why a pipeline stage holds a bubble instead of an instruction */
+#define BUBBLE_RESET		0				// nothing has entered the stage since reset
+#define BUBBLE_STALL		1				// STALL masked the fetched word
+#define BUBBLE_FLUSH		2				// FLUSH cleared the stage
+
+
+/* Architectural state and pipeline latches of hbcp-main */
+struct machine {
+
+	unsigned short regs[NUM_REGS];			// register file
+	unsigned short pc;						// program counter (fetch address)
+	unsigned char sp;						// stack pointer, 8 bits
+	bool n, z, c, v;						// ALU flag registers
+
+	unsigned short dx;						// decode/execute instruction register
+	unsigned short wb;						// writeback instruction register
+	unsigned short imm;						// address word latched by LDI
+
+	unsigned short alu_a, alu_b;			// ALU operand registers
+	unsigned char alu_os;					// ALU operation register
+	bool alu_uf;							// ALU update flags register
+
+	/* Bookkeeping only, not part of the circuit */
+	unsigned short dx_pc, wb_pc;			// address of the instruction in each stage
+	bool dx_valid, wb_valid;				// false when the stage holds a bubble from STALL or FLUSH
+	unsigned char dx_bubble, wb_bubble;		// BUBBLE_* reason while the stage is not valid
+	unsigned short dx_blame, wb_blame;		// address of the instruction that raised STALL or FLUSH for the bubble
+	unsigned short halt_pc;					// address of the jump to itself that ended the run
+
+	unsigned long long cycles;				// rising clock edges since reset
+	unsigned long long retired;				// instructions that left writeback (bubbles not counted)
+
+	alignas(MEM_PAGE) unsigned char rom[MEM_SIZE];			// program ROM
+	alignas(MEM_PAGE) unsigned char ram[MEM_SIZE];			// RAM, stack lives in 0x0000 - 0x0100
+};
+
+
+#define BATCH_LANES			16			// instances run in lockstep by batch_run
+
+/* BATCH_LANES instances of one program, each field indexed by lane so one vector holds the lanes */
+struct batch {
+
+	unsigned short regs[NUM_REGS][BATCH_LANES];
+	unsigned short n[BATCH_LANES], z[BATCH_LANES];			// flags are 0xffff when set
+	unsigned short c[BATCH_LANES], v[BATCH_LANES];
+	unsigned short pc[BATCH_LANES];
+	unsigned short active[BATCH_LANES];						// 0xffff until the lane halts
+	unsigned char sp[BATCH_LANES];
+	unsigned long long retired[BATCH_LANES];
+
+	unsigned short ram[MEM_SIZE / 2][BATCH_LANES];			// RAM words as read big endian
+};
+
+
+/* Sign extends an 8 bit immediate to 16 bits (Bit Extender in front of the IMS multiplexer) */
+static inline unsigned short sext8(unsigned short x) {
+
+	return (unsigned short) (signed char) x;
+}
+
+
+/* Evaluates the ALU for operation os, returns result E and carry/overflow outputs */
+static inline unsigned short alu_eval(unsigned short a, unsigned short b, int os, bool& cout, bool& vout) {
+
+	unsigned short bx = (os & 4) ? (unsigned short) ~b : b;			// B is inverted for NOT and SUB
+	unsigned int sum = (unsigned int) a + bx + (os & 1);			// carry in is set for SUB
+	unsigned short e;
+
+	switch (os) {
+
+		case ADD:
+		case SUB:
+			e = (unsigned short) sum;
+			break;
+		case AND:
+			e = a & b;
+			break;
+		case OR:
+			e = a | b;
+			break;
+		case B_ID:
+			e = b & 0xff;			// B passes through an 8 to 16 bit zero extend
+			break;
+		case NOT:
+			e = bx;
+			break;
+		default:
+			e = 0;					// unconnected multiplexer inputs
+	}
+
+	cout = (sum >> 16) & 1;
+	vout = (~(a ^ bx) & (a ^ e)) >> 15;			// operands agree in sign, result does not
+
+	return e;
+}
+
+
+/* Updates NZ (and CV for ADD/SUB) the way the flag registers in the ALU do */
+static inline void alu_set_flags(machine& m, unsigned short e, int os, bool cout, bool vout) {
+
+	m.n = e >> 15;
+	m.z = e == 0;
+
+	if (os == ADD || os == SUB) {
+
+		m.c = cout;
+		m.v = vout;
+	}
+}
+
+
+/*
+ * NZCV as the functional engines keep them: N and Z come from the last result, C and V are worked out from the
+ * operands of the last add or subtract only when a branch or the machine state needs them.
+ */
+struct lazy_flags {
+
+	unsigned short res;						// result of the last flag setting instruction
+	unsigned short cv_a, cv_b;				// operands of the last add or subtract, B already inverted for SUB
+	unsigned char cv_cin;					// carry in of that instruction, 1 for SUB
+};
+
+/* Carry and overflow of the last add or subtract */
+static inline bool lazy_c(const lazy_flags& f) {
+
+	return ((unsigned int) f.cv_a + f.cv_b + f.cv_cin) >> 16;
+}
+
+static inline bool lazy_v(const lazy_flags& f) {
+
+	unsigned short e = f.cv_a + f.cv_b + f.cv_cin;
+
+	return (~(f.cv_a ^ f.cv_b) & (f.cv_a ^ e)) >> 15;
+}
+
+/* Moves the machine flags into the lazy form: an ADD chosen so its carry and overflow match */
+static inline void lazy_from_machine(lazy_flags& f, const machine& m) {
+
+	static const unsigned short cv_a[4] = {0x0000, 0x7fff, 0xffff, 0x8000};			// indexed by C << 1 | V
+	static const unsigned short cv_b[4] = {0x0000, 0x0001, 0x0001, 0x8000};
+
+	f.res = m.z ? 0 : (m.n ? 0x8000 : 1);
+	f.cv_a = cv_a[(m.c << 1) | m.v];
+	f.cv_b = cv_b[(m.c << 1) | m.v];
+	f.cv_cin = 0;
+}
+
+/* Materializes NZCV from the lazy form */
+static inline void lazy_to_machine(machine& m, const lazy_flags& f) {
+
+	m.n = f.res >> 15;
+	m.z = f.res == 0;
+	m.c = lazy_c(f);
+	m.v = lazy_v(f);
+}
+
+
+/* RAM is dual line: words are read and written big endian at the aligned address, bytes at the address itself */
+static inline unsigned short ram_read_word(const machine& m, unsigned short address) {
+
+	return (m.ram[address & ~1] << 8) | m.ram[address | 1];
+}
+
+static inline void ram_write_word(machine& m, unsigned short address, unsigned short data) {
+
+	m.ram[address & ~1] = data >> 8;
+	m.ram[address | 1] = (unsigned char) data;
+}
+
+/* Program ROM is read one word at a time, big endian */
+static inline unsigned short rom_read_word(const machine& m, unsigned short address) {
+
+	return (m.rom[address & ~1] << 8) | m.rom[address | 1];
+}
+
+
+/* Clears registers, latches and RAM (RST button) */
+void machine_reset(machine& m);
+/* Copies a binary written by the assembler into program ROM, returns FAIL if the file cannot be read */
+int load_program(machine& m, const char * file_name);
+
+/* Builds the dx_rom and wb_rom lookup tables from op_ctrl */
+void pipeline_init();
+/* Advances the pipeline by one clock cycle, returns true if a jump or branch to itself reached writeback */
+bool pipeline_cycle(machine& m);
+/* Runs the pipeline until it halts or max_cycles have elapsed, returns RUN_HALT or RUN_LIMIT */
+int pipeline_run(machine& m, unsigned long long max_cycles);
+
+/* Decodes every word of program ROM once and fuses frequent pairs into superinstructions, call again whenever the ROM changes */
+void interp_predecode(const machine& m);
+/* Executes instructions from m.pc without pipeline timing until it halts or max_instructions have run, returns RUN_HALT or RUN_LIMIT */
+int interp_run(machine& m, unsigned long long max_instructions);
+/* Superinstruction i of the last interp_predecode: its name, the ROM words fused into it and how often it ran since; returns FAIL past the last one */
+int interp_superinstruction(int i, const char *& name, unsigned int& sites, unsigned long long& fired);
+
+/* Clears the translation cache and predecodes ROM for the interpreter fallback, call again whenever the ROM changes; returns FAIL without executable memory */
+int jit_init(const machine& m);
+/* Same contract as interp_run, executing translated x86-64 basic blocks and interpreting whatever cannot be translated */
+int jit_run(machine& m, unsigned long long max_instructions);
+
+
+/* Decodes every word of program ROM once for batch_run, call again whenever the ROM changes */
+void batch_predecode(const machine& m);
+/* Copies registers, flags, pc, sp and RAM of m into lane of b and starts the lane */
+void batch_set_lane(batch& b, int lane, const machine& m);
+/* Copies lane of b back into m */
+void batch_get_lane(const batch& b, int lane, machine& m);
+/* Runs the lanes of b in lockstep until all halt or max_steps instructions have been issued, returns RUN_HALT or RUN_LIMIT */
+int batch_run(batch& b, unsigned long long max_steps);
+
+#endif
@@ -0,0 +1,330 @@
+#include "netlist.h"
+
+using namespace std;
+
+
+/*
+ * Bit-sliced evaluation of a flattened netlist. Each component is broken down into AND/OR/XOR/NOT/MUX
+ * operations on single signal bits, and every operation works on a 64 bit word holding that signal in 64
+ * test vectors at once, so one pass over the list settles the logic for 64 inputs.
+ */
+
+
+/* Operation list under construction */
+struct slice_builder {
+
+	slice_program& p;
+	const netlist& n;
+
+	int temp() { return p.slots++; }
+
+	int emit(int op, int a, int b = 0, int c = 0, int dst = -1) {
+
+		if (dst < 0)
+			dst = temp();
+
+		p.ops.push_back({op, dst, a, b, c});
+
+		return dst;
+	}
+
+	/* Slot read for bit, floating bits read as fill */
+	int bit(int b, bool fill = false) { return n.driver[b] >= 0 ? b : fill ? p.ones : p.zero; }
+};
+
+
+/* Writes the operations of gate kinds, one output bit at a time */
+static void compile_gate(slice_builder& s, const cell& c) {
+
+	int base = c.kind >= CELL_NAND ? c.kind - 3 : c.kind;
+	bool invert = c.kind >= CELL_NAND;
+
+	for (size_t k = 0; k < c.ports[0].size(); k++) {
+
+		vector <int> terms;
+
+		for (int i = 0; i < c.inputs; i++) {
+
+			int t = s.bit(c.ports[1 + i][k], base == CELL_AND);			// floating inputs do not change the result
+
+			terms.push_back(c.negate >> i & 1 ? s.emit(SLICE_NOT, t) : t);
+		}
+
+		int result;
+
+		if (base == CELL_XOR && !c.value) {			// exactly one input high
+
+			int one = terms[0], many = s.p.zero;
+
+			for (size_t i = 1; i < terms.size(); i++) {
+
+				many = s.emit(SLICE_OR, many, s.emit(SLICE_AND, one, terms[i]));
+				one = s.emit(SLICE_OR, one, terms[i]);
+			}
+
+			result = s.emit(SLICE_ANDN, one, many);
+		} else {
+
+			int op = base == CELL_AND ? SLICE_AND : base == CELL_OR ? SLICE_OR : SLICE_XOR;
+
+			result = terms[0];
+
+			for (size_t i = 1; i < terms.size(); i++)
+				result = s.emit(op, result, terms[i]);
+		}
+
+		s.emit(invert ? SLICE_NOT : SLICE_COPY, result, 0, 0, c.ports[0][k]);
+	}
+}
+
+
+/* Ripple carry adder; a subtractor adds the inverted subtrahend with the borrow inverted as carry */
+static void compile_adder(slice_builder& s, const cell& c) {
+
+	bool subtract = c.kind == CELL_SUBTRACTOR;
+	int carry = s.bit(c.ports[3][0]);
+
+	if (subtract)
+		carry = s.emit(SLICE_NOT, carry);
+
+	for (size_t k = 0; k < c.ports[0].size(); k++) {
+
+		int a = s.bit(c.ports[1][k]);
+		int b = s.bit(c.ports[2][k]);
+
+		if (subtract)
+			b = s.emit(SLICE_NOT, b);
+
+		int half = s.emit(SLICE_XOR, a, b);
+
+		s.emit(SLICE_XOR, half, carry, 0, c.ports[0][k]);
+		carry = s.emit(SLICE_OR, s.emit(SLICE_AND, a, b), s.emit(SLICE_AND, half, carry));
+	}
+
+	s.emit(subtract ? SLICE_NOT : SLICE_COPY, carry, 0, 0, c.ports[4][0]);
+}
+
+
+/* Multiplexer as a tree of two input multiplexers, one level per select bit */
+static void compile_mux(slice_builder& s, const cell& c) {
+
+	const vector <int>& select = c.ports[1];
+
+	for (size_t k = 0; k < c.ports[0].size(); k++) {
+
+		vector <int> level;
+
+		for (int i = 0; i < c.inputs; i++)
+			level.push_back(s.bit(c.ports[2 + i][k]));
+
+		for (size_t b = 0; level.size() > 1; b++) {
+
+			vector <int> next;
+
+			for (size_t i = 0; i < level.size(); i += 2)
+				next.push_back(s.emit(SLICE_MUX, level[i], level[i + 1], s.bit(select[b])));
+
+			level = next;
+		}
+
+		s.emit(SLICE_COPY, level[0], 0, 0, c.ports[0][k]);
+	}
+}
+
+
+static void compile_demux(slice_builder& s, const cell& c) {
+
+	const vector <int>& select = c.ports[1];
+
+	for (int i = 0; i < c.inputs; i++) {
+
+		int match = s.p.ones;
+
+		for (size_t b = 0; b < select.size(); b++)
+			match = s.emit(i >> b & 1 ? SLICE_AND : SLICE_ANDN, match, s.bit(select[b]));
+
+		for (size_t k = 0; k < c.ports[2 + i].size(); k++)
+			s.emit(SLICE_AND, s.bit(c.ports[0][k]), match, 0, c.ports[2 + i][k]);
+	}
+}
+
+
+static void compile_extender(slice_builder& s, const cell& c) {
+
+	const vector <int>& in = c.ports[1];
+	int fill = c.extend == EXT_ONE ? s.p.ones : c.extend == EXT_SIGN ? s.bit(in.back()) : c.extend == EXT_INPUT ? s.bit(c.ports[2][0]) : s.p.zero;
+
+	for (size_t k = 0; k < c.ports[0].size(); k++)
+		s.emit(SLICE_COPY, k < in.size() ? s.bit(in[k]) : fill, 0, 0, c.ports[0][k]);
+}
+
+
+int slice_compile(const netlist& n, slice_program& p, const vector <int>& observe) {
+
+	slice_builder s = {p, n};
+
+	p.n = &n;
+	p.ops.clear();
+	p.zero = n.bits;
+	p.ones = n.bits + 1;
+	p.slots = n.bits + 2;
+
+	for (int i : n.order) {
+
+		const cell& c = n.cells[i];
+
+		switch (c.kind) {
+
+			case CELL_CONSTANT:
+				for (size_t k = 0; k < c.ports[0].size(); k++)
+					s.emit(SLICE_COPY, c.value >> k & 1 ? p.ones : p.zero, 0, 0, c.ports[0][k]);
+				break;
+			case CELL_CLOCK:
+			case CELL_BUTTON:
+				s.emit(SLICE_COPY, p.zero, 0, 0, c.ports[0][0]);
+				break;
+			case CELL_INPUT:
+			case CELL_OUTPUT:
+				break;			// set by the caller, read by the caller
+			case CELL_AND: case CELL_OR: case CELL_XOR: case CELL_NAND: case CELL_NOR: case CELL_XNOR:
+				compile_gate(s, c);
+				break;
+			case CELL_NOT:
+				for (size_t k = 0; k < c.ports[0].size(); k++)
+					s.emit(SLICE_NOT, s.bit(c.ports[1][k]), 0, 0, c.ports[0][k]);
+				break;
+			case CELL_MUX:
+				compile_mux(s, c);
+				break;
+			case CELL_DEMUX:
+				compile_demux(s, c);
+				break;
+			case CELL_ADDER:
+			case CELL_SUBTRACTOR:
+				compile_adder(s, c);
+				break;
+			case CELL_EXTENDER:
+				compile_extender(s, c);
+				break;
+			case CELL_REGISTER:			// q is set by the caller, clear still overrides it
+				if (n.driver[c.ports[4][0]] >= 0)
+					for (int q : c.ports[0])
+						s.emit(SLICE_ANDN, q, c.ports[4][0], 0, q);
+				break;
+			case CELL_FLIPFLOP:
+				s.emit(SLICE_OR, s.emit(SLICE_ANDN, c.ports[0][0], s.bit(c.ports[5][0])), s.bit(c.ports[4][0]), 0, c.ports[0][0]);
+				s.emit(SLICE_NOT, c.ports[0][0], 0, 0, c.ports[1][0]);
+				break;
+			case CELL_ROM:
+				s.emit(SLICE_ROM, i, 0, 0, c.ports[1][0]);			// dst only marks the first data bit
+				break;
+			default:
+				p.error = "cannot bit-slice " + c.path;
+				return FAIL;
+		}
+	}
+
+	if (observe.empty())
+		return SUCCESS;
+
+	/* Drop operations whose result never reaches an observed bit */
+	vector <bool> needed(p.slots, false);
+	vector <slice_op> kept;
+
+	for (int b : observe)
+		needed[b] = true;
+
+	for (auto it = p.ops.rbegin(); it != p.ops.rend(); ++it) {
+
+		const slice_op& o = *it;
+
+		if (o.op == SLICE_ROM) {
+
+			const cell& c = n.cells[o.a];
+			bool used = false;
+
+			for (size_t l = 1; l < c.ports.size(); l++)
+				for (int b : c.ports[l])
+					used = used || needed[b];
+
+			if (!used)
+				continue;
+
+			for (int b : c.ports[0])
+				needed[s.bit(b)] = true;
+		} else {
+
+			if (!needed[o.dst])
+				continue;
+
+			needed[o.a] = true;
+
+			if (o.op != SLICE_NOT && o.op != SLICE_COPY)
+				needed[o.b] = true;
+
+			if (o.op == SLICE_MUX)
+				needed[o.c] = true;
+		}
+
+		kept.push_back(o);
+	}
+
+	p.ops.assign(kept.rbegin(), kept.rend());
+
+	return SUCCESS;
+}
+
+
+/* Looks a ROM up once per lane: gathers each lane's address, scatters the data words back into slices */
+static void settle_rom(const slice_program& p, const cell& c, unsigned long long * v) {
+
+	const vector <int>& address = c.ports[0];
+	unsigned base_mask = ~(unsigned) (c.lines - 1);
+
+	for (int k = 1; k <= c.lines; k++)
+		for (int b : c.ports[k])
+			v[b] = 0;
+
+	for (int lane = 0; lane < 64; lane++) {
+
+		unsigned a = 0;
+
+		for (size_t k = 0; k < address.size(); k++) {
+
+			int b = p.n->driver[address[k]] >= 0 ? address[k] : p.zero;
+
+			a |= (unsigned) (v[b] >> lane & 1) << k;
+		}
+
+		for (int line = 0; line < c.lines; line++) {
+
+			unsigned at = (a & base_mask) + line;
+			unsigned word = at < c.contents.size() ? c.contents[at] : 0;
+
+			for (size_t k = 0; k < c.ports[1 + line].size(); k++)
+				v[c.ports[1 + line][k]] |= (unsigned long long) (word >> k & 1) << lane;
+		}
+	}
+}
+
+
+void slice_settle(const slice_program& p, unsigned long long * v) {
+
+	v[p.zero] = 0;
+	v[p.ones] = ~0ULL;
+
+	for (const slice_op& o : p.ops) {
+
+		switch (o.op) {
+
+			case SLICE_AND: v[o.dst] = v[o.a] & v[o.b]; break;
+			case SLICE_OR: v[o.dst] = v[o.a] | v[o.b]; break;
+			case SLICE_XOR: v[o.dst] = v[o.a] ^ v[o.b]; break;
+			case SLICE_ANDN: v[o.dst] = v[o.a] & ~v[o.b]; break;
+			case SLICE_NOT: v[o.dst] = ~v[o.a]; break;
+			case SLICE_MUX: v[o.dst] = (v[o.a] & ~v[o.c]) | (v[o.b] & v[o.c]); break;
+			case SLICE_COPY: v[o.dst] = v[o.a]; break;
+			case SLICE_ROM: settle_rom(p, p.n->cells[o.a], v); break;
+		}
+	}
+}
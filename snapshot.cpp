@@ -0,0 +1,239 @@
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+
+#include "snapshot.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define SNAPSHOT_MMAP		1
+#endif
+
+using namespace std;
+
+
+int snapshot_save(const machine& m, int engine, const char * file_name) {
+
+	static const char zeros[MEM_PAGE] = {};
+	snapshot_header h;
+
+	memset(&h, 0, sizeof(snapshot_header));
+
+	h.magic = SNAPSHOT_MAGIC;
+	h.version = SNAPSHOT_VERSION;
+	h.rom_offset = MEM_PAGE;
+	h.ram_offset = MEM_PAGE + MEM_SIZE;
+	h.engine = engine;
+	h.flags = (m.n ? SNAPSHOT_N : 0) | (m.z ? SNAPSHOT_Z : 0) | (m.c ? SNAPSHOT_C : 0) | (m.v ? SNAPSHOT_V : 0);
+
+	memcpy(h.regs, m.regs, sizeof(h.regs));
+	h.pc = m.pc;
+	h.sp = m.sp;
+	h.dx = m.dx;
+	h.wb = m.wb;
+	h.imm = m.imm;
+	h.alu_a = m.alu_a;
+	h.alu_b = m.alu_b;
+	h.alu_os = m.alu_os;
+	h.alu_uf = m.alu_uf;
+
+	h.dx_pc = m.dx_pc;
+	h.wb_pc = m.wb_pc;
+	h.dx_valid = m.dx_valid;
+	h.wb_valid = m.wb_valid;
+	h.dx_bubble = m.dx_bubble;
+	h.wb_bubble = m.wb_bubble;
+	h.dx_blame = m.dx_blame;
+	h.wb_blame = m.wb_blame;
+	h.halt_pc = m.halt_pc;
+
+	h.cycles = m.cycles;
+	h.retired = m.retired;
+
+	/* Written beside it and renamed over it, runs still mapping the old file keep seeing the old one */
+	string temporary = string(file_name) + ".tmp";
+	ofstream file(temporary, ios::out | ios::trunc | ios::binary);
+
+	if (!file.is_open())
+		return FAIL;
+
+	file.write((const char *) &h, sizeof(snapshot_header));
+	file.write(zeros, MEM_PAGE - sizeof(snapshot_header));
+	file.write((const char *) m.rom, MEM_SIZE);
+	file.write((const char *) m.ram, MEM_SIZE);
+	file.close();
+
+	if (file.fail() || rename(temporary.c_str(), file_name) != 0) {
+
+		remove(temporary.c_str());
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+
+/* Reads the whole file into memory, for hosts without mmap and for files that cannot be mapped */
+static int read_file(snapshot& s, const char * file_name) {
+
+	ifstream file(file_name, ios::in | ios::binary | ios::ate);
+
+	if (!file.is_open())
+		return FAIL;
+
+	size_t size = (size_t) file.tellg();
+	char * data = new char[size ? size : 1];
+
+	file.seekg(0);
+	file.read(data, size);
+
+	if ((size_t) file.gcount() != size) {
+
+		delete[] data;
+		return FAIL;
+	}
+
+	s.data = data;
+	s.size = size;
+	s.mapped = false;
+
+	return SUCCESS;
+}
+
+
+/* True if a MEM_SIZE image at offset lies inside the file on a MEM_PAGE boundary */
+static bool inside(const snapshot& s, unsigned int offset) {
+
+	return offset % MEM_PAGE == 0 && offset >= sizeof(snapshot_header) && offset <= s.size && MEM_SIZE <= s.size - offset;
+}
+
+
+int snapshot_open(snapshot& s, const char * file_name) {
+
+	memset(&s, 0, sizeof(snapshot));
+	s.fd = -1;
+
+	bool opened = false;
+
+#ifdef SNAPSHOT_MMAP
+	int fd = open(file_name, O_RDONLY);
+	struct stat info;
+
+	if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+
+		void * memory = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (memory != MAP_FAILED) {
+
+			s.data = (const char *) memory;
+			s.size = (size_t) info.st_size;
+			s.mapped = opened = true;
+			s.fd = fd;
+		}
+	}
+
+	if (fd >= 0 && !opened)
+		close(fd);
+#endif
+
+	if (!opened && read_file(s, file_name) == FAIL)
+		return FAIL;
+
+	const snapshot_header * h = (const snapshot_header *) s.data;
+
+	bool valid = s.size >= sizeof(snapshot_header) && h->magic == SNAPSHOT_MAGIC && h->version == SNAPSHOT_VERSION
+		&& h->engine <= SNAPSHOT_FUNCTIONAL && h->sp <= 0xff && inside(s, h->rom_offset) && inside(s, h->ram_offset);
+
+	if (!valid) {
+
+		snapshot_close(s);
+		return FAIL;
+	}
+
+	s.header = h;
+	s.rom = (const unsigned char *) (s.data + h->rom_offset);
+	s.ram = (const unsigned char *) (s.data + h->ram_offset);
+
+	return SUCCESS;
+}
+
+
+void snapshot_close(snapshot& s) {
+
+#ifdef SNAPSHOT_MMAP
+	if (s.data && s.mapped)
+		munmap((void *) s.data, s.size);
+
+	if (s.fd >= 0)
+		close(s.fd);
+#endif
+
+	if (s.data && !s.mapped)
+		delete[] s.data;
+
+	memset(&s, 0, sizeof(snapshot));
+	s.fd = -1;
+}
+
+
+#ifdef SNAPSHOT_MMAP
+/* Maps the MEM_SIZE image at offset of s over memory, private so writes copy the page; false if the pages do not line up */
+static bool map_image(unsigned char * memory, const snapshot& s, unsigned int offset) {
+
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (s.fd < 0 || page <= 0 || MEM_PAGE % page != 0 || (uintptr_t) memory % page != 0)
+		return false;
+
+	return mmap(memory, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, s.fd, offset) != MAP_FAILED;
+}
+#endif
+
+
+void snapshot_restore(machine& m, const snapshot& s) {
+
+	const snapshot_header * h = s.header;
+
+	memcpy(m.regs, h->regs, sizeof(m.regs));
+	m.pc = h->pc;
+	m.sp = (unsigned char) h->sp;
+	m.n = h->flags & SNAPSHOT_N;
+	m.z = h->flags & SNAPSHOT_Z;
+	m.c = h->flags & SNAPSHOT_C;
+	m.v = h->flags & SNAPSHOT_V;
+
+	m.dx = h->dx;
+	m.wb = h->wb;
+	m.imm = h->imm;
+	m.alu_a = h->alu_a;
+	m.alu_b = h->alu_b;
+	m.alu_os = h->alu_os;
+	m.alu_uf = h->alu_uf;
+
+	m.dx_pc = h->dx_pc;
+	m.wb_pc = h->wb_pc;
+	m.dx_valid = h->dx_valid;
+	m.wb_valid = h->wb_valid;
+	m.dx_bubble = h->dx_bubble;
+	m.wb_bubble = h->wb_bubble;
+	m.dx_blame = h->dx_blame;
+	m.wb_blame = h->wb_blame;
+	m.halt_pc = h->halt_pc;
+
+	m.cycles = h->cycles;
+	m.retired = h->retired;
+
+	/* Mapped, a run only copies the pages it writes, the rest stay shared with every other run from the same file */
+#ifdef SNAPSHOT_MMAP
+	if (map_image(m.rom, s, h->rom_offset) && map_image(m.ram, s, h->ram_offset))
+		return;
+#endif
+
+	memcpy(m.rom, s.rom, MEM_SIZE);
+	memcpy(m.ram, s.ram, MEM_SIZE);
+}
@@ -0,0 +1,77 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+
+#include "simulator.h"
+
+
+#define SNAPSHOT_MAGIC		0x504e5348			// "HSNP"
+#define SNAPSHOT_VERSION	1
+
+/* Engine that was running when the snapshot was taken, the others read the latches differently */
+#define SNAPSHOT_PIPELINE	0				// pipeline_run: pc is the fetch address, dx and wb hold instructions in flight
+#define SNAPSHOT_FUNCTIONAL	1				// interp_run and jit_run: pc is the next instruction, the latches are unused
+
+/* Flag bits of snapshot_header */
+#define SNAPSHOT_N			8
+#define SNAPSHOT_Z			4
+#define SNAPSHOT_C			2
+#define SNAPSHOT_V			1
+
+
+/*
+ * Machine state the simulator writes with -w and resumes from with -r. Little endian fixed width fields like the symbol
+ * file, the ROM and RAM images start on a MEM_PAGE boundary so they can be mapped straight over those of a machine:
+ *	header, zeros up to MEM_PAGE, program ROM, RAM
+ */
+struct snapshot_header {
+
+	unsigned int magic;
+	unsigned int version;
+	unsigned int rom_offset, ram_offset;			// bytes from the start of the file, multiples of MEM_PAGE
+	unsigned short engine;
+	unsigned short flags;							// SNAPSHOT_N | SNAPSHOT_Z | SNAPSHOT_C | SNAPSHOT_V
+
+	unsigned short regs[NUM_REGS];
+	unsigned short pc;
+	unsigned short sp;
+	unsigned short dx, wb, imm;
+	unsigned short alu_a, alu_b;
+	unsigned char alu_os, alu_uf;
+
+	unsigned short dx_pc, wb_pc;
+	unsigned char dx_valid, wb_valid;
+	unsigned char dx_bubble, wb_bubble;
+	unsigned short dx_blame, wb_blame;
+	unsigned short halt_pc;
+	unsigned short reserved[3];						// 0, keeps the counters 8 byte aligned
+
+	unsigned long long cycles;
+	unsigned long long retired;
+};
+
+/* Open snapshot file, mapped read only where the host has mmap */
+struct snapshot {
+
+	const char * data;
+	size_t size;
+	bool mapped;
+	int fd;										// kept open to map the ROM and RAM pages from, -1 if they are copied
+
+	const snapshot_header * header;				// nullptr when no file is open
+	const unsigned char * rom;
+	const unsigned char * ram;
+};
+
+
+/* Writes the state of m, taken by engine (SNAPSHOT_*), to file_name; returns FAIL if it cannot be written */
+int snapshot_save(const machine& m, int engine, const char * file_name);
+/* Opens and checks a snapshot file, returns FAIL if it is missing or malformed (s is then empty) */
+int snapshot_open(snapshot& s, const char * file_name);
+/* Unmaps or frees the file, s is empty afterwards; machines restored from it keep their state */
+void snapshot_close(snapshot& s);
+/* Sets m to the state in s: ROM and RAM pages are mapped copy on write where the host allows it, copied otherwise. Predecode again afterwards, the ROM changed */
+void snapshot_restore(machine& m, const snapshot& s);
+
+#endif
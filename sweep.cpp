@@ -0,0 +1,151 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+
+#include "simulator.h"
+
+using namespace std;
+
+
+#define DEFAULT_INSTANCES		4096
+#define DEFAULT_MAX_STEPS		100000000ULL
+
+
+/*
+ * Runs one program over many initial RAM images, BATCH_LANES instances at a time with batch_run.
+ * Instance i starts from reset with the word first + i stored at the input address; every instance is
+ * rerun on the interpreter to check its final state and to compare throughput.
+ */
+
+
+/* Resets m and stores the instance input word */
+void prepare(machine& m, unsigned short address, unsigned short input);
+/* Returns true if registers, flags, pc, sp, instruction count and RAM agree */
+bool same_state(const machine& a, const machine& b);
+
+
+static machine cpu, lane;
+static batch instances;			// 1 MiB of lane RAM, keep off the stack
+
+
+int main(int argc, char * argv[]) {
+
+	const char * file_name = "machine_code.bin";
+	unsigned long long max_steps = DEFAULT_MAX_STEPS;
+	int count = DEFAULT_INSTANCES;
+	unsigned short address = 0x0000;
+	unsigned short first = 0;
+	bool verbose = false;
+
+	for (int i = 1; i < argc; i++) {
+
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			count = atoi(argv[++i]);			// number of instances
+		else if (!strcmp(argv[i], "-a") && i + 1 < argc)
+			address = (unsigned short) strtoul(argv[++i], nullptr, 0);			// input word address
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			first = (unsigned short) strtoul(argv[++i], nullptr, 0);			// input of instance 0
+		else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+			max_steps = strtoull(argv[++i], nullptr, 0);			// lockstep steps per batch
+		else if (!strcmp(argv[i], "-v"))
+			verbose = true;			// print the word at the input address of every instance
+		else if (argv[i][0] != '-')
+			file_name = argv[i];
+		else {
+
+			cout << "\nUsage: sweep [-n instances] [-a address] [-s first] [-c max_steps] [-v] [program.bin]" << endl;
+			return FAIL;
+		}
+	}
+
+	if (load_program(cpu, file_name) == FAIL)
+		return FAIL;
+
+	batch_predecode(cpu);
+	interp_predecode(cpu);
+
+	unsigned long long total = 0;
+	double batch_seconds = 0, interp_seconds = 0;
+	int mismatches = 0, unfinished = 0;
+
+	for (int base = 0; base < count; base += BATCH_LANES) {
+
+		int lanes = count - base < BATCH_LANES ? count - base : BATCH_LANES;
+
+		for (int l = 0; l < BATCH_LANES; l++) {
+
+			prepare(cpu, address, first + base + l);
+			batch_set_lane(instances, l, cpu);
+
+			if (l >= lanes)
+				instances.active[l] = 0;			// partial last batch
+		}
+
+		auto start = chrono::steady_clock::now();
+
+		if (batch_run(instances, max_steps) != RUN_HALT)
+			unfinished++;
+
+		batch_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		for (int l = 0; l < lanes; l++) {
+
+			unsigned short input = first + base + l;
+
+			memset(&lane, 0, sizeof(lane));
+			batch_get_lane(instances, l, lane);
+			prepare(cpu, address, input);
+
+			start = chrono::steady_clock::now();
+
+			interp_run(cpu, max_steps);
+
+			interp_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			total += lane.retired;
+
+			if (!same_state(cpu, lane)) {
+
+				if (mismatches++ < 10)
+					cout << "instance " << base + l << " does not match the interpreter" << endl;
+			}
+
+			if (verbose)
+				cout << "0x" << hex << setw(4) << setfill('0') << input << " -> 0x" << setw(4)
+					<< ram_read_word(lane, address) << dec << setfill(' ') << endl;
+		}
+	}
+
+	cout << count << " instances, " << total << " instance-instructions";
+
+	if (unfinished)
+		cout << ", " << unfinished << " batches hit the step limit";
+
+	cout << endl << fixed << setprecision(1);
+	cout << "batch       " << setw(10) << total / batch_seconds / 1e6 << " M instance-instructions/s (" << BATCH_LANES << " lanes)" << endl;
+	cout << "interpreter " << setw(10) << total / interp_seconds / 1e6 << " M instance-instructions/s  "
+		<< setprecision(2) << interp_seconds / batch_seconds << "x" << endl;
+
+	if (mismatches)
+		cout << mismatches << " instances do not match the interpreter" << endl;
+
+	return mismatches ? FAIL : 0;
+}
+
+
+void prepare(machine& m, unsigned short address, unsigned short input) {
+
+	machine_reset(m);
+	ram_write_word(m, address, input);
+}
+
+
+bool same_state(const machine& a, const machine& b) {
+
+	bool match = !memcmp(a.regs, b.regs, sizeof(a.regs)) && a.pc == b.pc && a.sp == b.sp && a.retired == b.retired;
+
+	match = match && a.n == b.n && a.z == b.z && a.c == b.c && a.v == b.v;
+
+	return match && !memcmp(a.ram, b.ram, MEM_SIZE);
+}
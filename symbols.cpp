@@ -0,0 +1,216 @@
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+#include "symbols.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define SYMBOLS_MMAP		1
+#endif
+
+using namespace std;
+
+
+/* Reads the whole file into memory, for hosts without mmap and for files that cannot be mapped */
+static int read_file(symbols& s, const char * file_name) {
+
+	ifstream file(file_name, ios::in | ios::binary | ios::ate);
+
+	if (!file.is_open())
+		return FAIL;
+
+	size_t size = (size_t) file.tellg();
+	char * data = new char[size ? size : 1];
+
+	file.seekg(0);
+	file.read(data, size);
+
+	if ((size_t) file.gcount() != size) {
+
+		delete[] data;
+		return FAIL;
+	}
+
+	s.data = data;
+	s.size = size;
+	s.mapped = false;
+
+	return SUCCESS;
+}
+
+
+/* True if count records of record_size at offset lie inside the file */
+static bool inside(const symbols& s, unsigned int offset, unsigned int count, size_t record_size) {
+
+	return offset <= s.size && count <= (s.size - offset) / record_size && offset % 4 == 0;
+}
+
+
+string symbols_file_for(const char * file_name) {
+
+	string name = file_name;
+	size_t dot = name.rfind('.');
+
+	if (dot != string::npos && name.find('/', dot) == string::npos)
+		name.erase(dot);
+
+	return name + ".sym";
+}
+
+
+int symbols_open(symbols& s, const char * file_name) {
+
+	memset(&s, 0, sizeof(symbols));
+
+	bool opened = false;
+
+#ifdef SYMBOLS_MMAP
+	int fd = open(file_name, O_RDONLY);
+	struct stat info;
+
+	if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+
+		void * memory = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (memory != MAP_FAILED) {
+
+			s.data = (const char *) memory;
+			s.size = (size_t) info.st_size;
+			s.mapped = opened = true;
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+#endif
+
+	if (!opened && read_file(s, file_name) == FAIL)
+		return FAIL;
+
+	const symbols_header * h = (const symbols_header *) s.data;
+
+	bool valid = s.size >= sizeof(symbols_header) && h->magic == SYMBOLS_MAGIC && h->version == SYMBOLS_VERSION
+		&& inside(s, h->symbol_offset, h->symbol_count, sizeof(symbols_symbol))
+		&& inside(s, h->line_offset, h->line_count, sizeof(symbols_line))
+		&& inside(s, h->region_offset, h->region_count, sizeof(symbols_region))
+		&& h->string_offset <= s.size && h->string_size <= s.size - h->string_offset
+		&& (h->string_size == 0 || s.data[h->string_offset + h->string_size - 1] == 0);			// strings cannot run off the end
+
+	if (!valid) {
+
+		symbols_close(s);
+		return FAIL;
+	}
+
+	s.header = h;
+	s.symbol = (const symbols_symbol *) (s.data + h->symbol_offset);
+	s.line = (const symbols_line *) (s.data + h->line_offset);
+	s.region = (const symbols_region *) (s.data + h->region_offset);
+	s.strings = s.data + h->string_offset;
+
+	return SUCCESS;
+}
+
+
+void symbols_close(symbols& s) {
+
+#ifdef SYMBOLS_MMAP
+	if (s.data && s.mapped)
+		munmap((void *) s.data, s.size);
+#endif
+
+	if (s.data && !s.mapped)
+		delete[] s.data;
+
+	memset(&s, 0, sizeof(symbols));
+}
+
+
+/* Index of the first record of a table sorted by address whose address is above address */
+template <typename T>
+static unsigned int upper_bound_address(const T * table, unsigned int count, unsigned short address) {
+
+	unsigned int low = 0, high = count;
+
+	while (low < high) {
+
+		unsigned int middle = low + (high - low) / 2;
+
+		if (table[middle].address <= address)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+
+const symbols_symbol * symbols_find_symbol(const symbols& s, unsigned short address) {
+
+	if (!s.header)
+		return nullptr;
+
+	unsigned int i = upper_bound_address(s.symbol, s.header->symbol_count, address);
+
+	if (i == 0)
+		return nullptr;
+
+	unsigned short found = s.symbol[--i].address;
+
+	while (i > 0 && s.symbol[i - 1].address == found)
+		i--;
+
+	return &s.symbol[i];
+}
+
+
+const symbols_line * symbols_find_line(const symbols& s, unsigned short address) {
+
+	if (!s.header)
+		return nullptr;
+
+	unsigned int i = upper_bound_address(s.line, s.header->line_count, address);
+
+	return i > 0 && s.line[i - 1].address == address ? &s.line[i - 1] : nullptr;
+}
+
+
+const symbols_region * symbols_find_region(const symbols& s, unsigned short address) {
+
+	if (!s.header)
+		return nullptr;
+
+	unsigned int i = upper_bound_address(s.region, s.header->region_count, address);
+
+	return i > 0 && (unsigned int) (address - s.region[i - 1].address) < s.region[i - 1].size ? &s.region[i - 1] : nullptr;
+}
+
+
+const char * symbols_string(const symbols& s, unsigned int offset) {
+
+	return s.header && offset < s.header->string_size ? s.strings + offset : "";
+}
+
+
+string symbols_name(const symbols& s, unsigned short address) {
+
+	ostringstream name;
+	const symbols_symbol * label = symbols_find_symbol(s, address);
+
+	if (label) {
+
+		name << symbols_string(s, label->name);
+
+		if (address != label->address)
+			name << "+" << address - label->address;
+	} else
+		name << "0x" << hex << setw(4) << setfill('0') << address;
+
+	return name.str();
+}
@@ -0,0 +1,90 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <string>
+#include <cstddef>
+
+
+#ifndef SUCCESS
+	#define SUCCESS				1
+	#define FAIL				-1
+#endif
+
+#define SYMBOLS_MAGIC		0x4d595348			// "HSYM"
+#define SYMBOLS_VERSION		1
+
+
+/*
+ * Symbol file the assembler writes next to the binary (machine_code.sym). Every field is little endian and every
+ * table has fixed width records sorted by address, so the file can be mapped and searched in place:
+ *	header, symbols, lines, regions, then the strings (NUL terminated label names and source text)
+ */
+struct symbols_header {
+
+	unsigned int magic;
+	unsigned int version;
+	unsigned int symbol_count, line_count, region_count;
+	unsigned int symbol_offset, line_offset, region_offset;			// bytes from the start of the file
+	unsigned int string_offset, string_size;
+};
+
+/* Label */
+struct symbols_symbol {
+
+	unsigned short address;
+	unsigned short reserved;
+	unsigned int name;							// offset into the strings
+};
+
+/* Source line of the instruction starting at address */
+struct symbols_line {
+
+	unsigned short address;
+	unsigned short reserved;
+	unsigned int line;
+	unsigned int source;						// offset into the strings, comment and surrounding blanks removed
+};
+
+/* Bytes assembled from address on, up to the next #org or the end of the file */
+struct symbols_region {
+
+	unsigned short address;						// first byte
+	unsigned short reserved;
+	unsigned int size;
+	unsigned int line;							// line of the #org, 0 for the code from address 0
+};
+
+/* Open symbol file, mapped read only where the host has mmap */
+struct symbols {
+
+	const char * data;
+	size_t size;
+	bool mapped;
+
+	const symbols_header * header;				// nullptr when no file is open
+	const symbols_symbol * symbol;
+	const symbols_line * line;
+	const symbols_region * region;
+	const char * strings;
+};
+
+
+/* Symbol file the assembler writes for program file_name: the extension replaced by .sym */
+std::string symbols_file_for(const char * file_name);
+/* Opens and checks a symbol file, returns FAIL if it is missing or malformed (s is then empty) */
+int symbols_open(symbols& s, const char * file_name);
+/* Unmaps or frees the file, s is empty afterwards */
+void symbols_close(symbols& s);
+
+/* Last label at or below address (the first one when several share it), nullptr if none */
+const symbols_symbol * symbols_find_symbol(const symbols& s, unsigned short address);
+/* Line of the instruction starting at address, nullptr if none starts there */
+const symbols_line * symbols_find_line(const symbols& s, unsigned short address);
+/* Region holding address, nullptr if nothing was assembled there */
+const symbols_region * symbols_find_region(const symbols& s, unsigned short address);
+/* String at offset of the string table */
+const char * symbols_string(const symbols& s, unsigned int offset);
+/* Nearest label at or below address plus the offset, or the bare address in hex */
+std::string symbols_name(const symbols& s, unsigned short address);
+
+#endif
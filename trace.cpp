@@ -0,0 +1,611 @@
+#include <fstream>
+#include <cstring>
+
+#include "trace.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define TRACE_MMAP			1
+#endif
+
+using namespace std;
+
+
+#define LZ_MIN_MATCH		4
+#define LZ_HASH_BITS		13
+#define LZ_MAX_OFFSET		0xffff
+
+
+/* Compresses the blocks the recorder queues, in order, and appends them to the file */
+static void compress_blocks(trace_recorder * t) {
+
+	vector <unsigned char> compressed;
+
+	while (true) {
+
+		unique_lock <mutex> held(t->lock);
+
+		t->work.wait(held, [t] { return !t->queue.empty() || t->closing; });
+
+		if (t->queue.empty())
+			return;
+
+		trace_block b = t->queue.front().first;
+		vector <unsigned char> raw = move(t->queue.front().second);
+
+		t->queue.pop_front();
+		t->room.notify_one();
+		held.unlock();
+
+		compressed.clear();
+		lz_compress(raw.data(), raw.size(), compressed);
+
+		b.offset = (unsigned long long) t->file.tellp();
+		b.size = compressed.size();
+		t->file.write((const char *) compressed.data(), compressed.size());
+
+		held.lock();
+		t->index.push_back(b);
+	}
+}
+
+
+/* Hands the block being filled to the compression thread and starts the next one from the current state */
+static void queue_block(trace_recorder& t) {
+
+	if (t.used == 0)
+		return;
+
+	t.block.resize(t.used);
+	t.current.raw_size = t.used;
+
+	unique_lock <mutex> held(t.lock);
+
+	t.room.wait(held, [&t] { return t.queue.size() < TRACE_QUEUE; });
+	t.queue.emplace_back(t.current, move(t.block));
+	t.work.notify_one();
+	held.unlock();
+
+	t.block.assign(TRACE_BLOCK_SIZE, 0);
+	t.used = 0;
+	t.current.entries = 0;
+	t.current.start = t.last;
+}
+
+
+static inline unsigned char * put_varint(unsigned char * out, unsigned long long x) {
+
+	while (x >= 0x80) {
+
+		*out++ = (unsigned char) x | 0x80;
+		x >>= 7;
+	}
+
+	*out++ = (unsigned char) x;
+
+	return out;
+}
+
+
+/* Small differences either way become small numbers */
+static inline unsigned int zigzag(unsigned short from, unsigned short to) {
+
+	short delta = (short) (to - from);
+
+	return ((unsigned int) delta << 1) ^ (unsigned int) (delta >> 15);
+}
+
+static inline unsigned short unzigzag(unsigned short from, unsigned int x) {
+
+	return from + (unsigned short) ((x >> 1) ^ -(x & 1));
+}
+
+
+int trace_record_open(trace_recorder& t, const char * file_name, const machine& m) {
+
+	t.file.open(file_name, ios::out | ios::trunc | ios::binary);
+
+	if (!t.file.is_open())
+		return FAIL;
+
+	trace_header h;
+
+	memset(&h, 0, sizeof(trace_header));
+	t.file.write((const char *) &h, sizeof(trace_header));			// the real one once the index is known
+
+	memset(&t.last, 0, sizeof(trace_state));
+	memcpy(t.last.regs, m.regs, sizeof(m.regs));
+	t.last.cycle = m.cycles;
+	t.last.retired = m.retired;
+	t.last.pc = m.wb_pc;
+	t.last.sp = m.sp;
+	t.last.flags = m.n << 3 | m.z << 2 | m.c << 1 | m.v;
+
+	memset(&t.current, 0, sizeof(trace_block));
+	t.current.start = t.last;
+	t.block.assign(TRACE_BLOCK_SIZE, 0);
+	t.used = 0;
+	t.entries = 0;
+
+	t.queue.clear();
+	t.index.clear();
+	t.closing = false;
+	t.worker = thread(compress_blocks, &t);
+
+	return SUCCESS;
+}
+
+
+bool trace_record_cycle(trace_recorder& t, machine& m) {
+
+	/* What the instruction in writeback does at the rising edge; none of it depends on the flags */
+	unsigned long wbc = op_ctrl[m.wb >> 11][1];
+	bool retired = m.wb_valid;
+	unsigned short pc = m.wb_pc;
+	unsigned long long cycle = m.cycles;
+	int reg = (m.wb >> 8) & 7;
+	unsigned short old_value = m.regs[reg];
+	unsigned short address = (wbc & SPS) ? m.sp : m.imm;
+
+	bool halt = pipeline_cycle(m);
+
+	unsigned char flags = m.n << 3 | m.z << 2 | m.c << 1 | m.v;
+	unsigned char what = (retired ? TRACE_RETIRED : 0) | ((wbc & WEN) ? TRACE_REG : 0) | (flags != t.last.flags ? TRACE_FLAGS : 0)
+		| (m.sp != t.last.sp ? TRACE_SP : 0) | ((wbc & RW) ? ((wbc & RBYTE) ? TRACE_BYTE : TRACE_WORD) : 0);
+
+	if (!what)
+		return halt;
+
+	if (t.current.entries == 0)
+		t.current.first_cycle = cycle;
+
+	/* Encoded straight into the block, which always has room for one more entry */
+	unsigned char * out = t.block.data() + t.used;
+
+	out = put_varint(out, cycle - t.last.cycle);
+	*out++ = what;
+	t.last.cycle = cycle;
+
+	if (what & TRACE_RETIRED) {
+
+		out = put_varint(out, zigzag(t.last.pc, pc));
+		t.last.pc = pc;
+		t.last.retired++;
+	}
+
+	if (what & TRACE_REG) {
+
+		*out++ = reg;
+		out = put_varint(out, zigzag(old_value, m.regs[reg]));
+		t.last.regs[reg] = m.regs[reg];
+	}
+
+	if (what & TRACE_FLAGS)
+		*out++ = t.last.flags = flags;
+
+	if (what & TRACE_SP)
+		*out++ = t.last.sp = m.sp;
+
+	if (what & TRACE_BYTE) {
+
+		out = put_varint(out, address);
+		*out++ = m.ram[address];
+	}
+
+	if (what & TRACE_WORD) {
+
+		out = put_varint(out, address & ~1);
+		out = put_varint(out, ram_read_word(m, address));
+	}
+
+	t.used = out - t.block.data();
+	t.current.entries++;
+	t.entries++;
+
+	if (t.used > TRACE_BLOCK_SIZE - TRACE_ENTRY_MAX)
+		queue_block(t);
+
+	return halt;
+}
+
+
+int trace_record_run(trace_recorder& t, machine& m, unsigned long long max_cycles) {
+
+	while (m.cycles < max_cycles)
+		if (trace_record_cycle(t, m))
+			return RUN_HALT;
+
+	return RUN_LIMIT;
+}
+
+
+int trace_record_close(trace_recorder& t, const machine& m) {
+
+	queue_block(t);
+
+	{
+		lock_guard <mutex> held(t.lock);
+
+		t.closing = true;
+		t.work.notify_one();
+	}
+
+	t.worker.join();
+
+	static const char zeros[8] = {};
+	trace_header h;
+
+	t.file.write(zeros, (8 - (unsigned long long) t.file.tellp() % 8) % 8);			// index records are read in place
+
+	memset(&h, 0, sizeof(trace_header));
+	h.magic = TRACE_MAGIC;
+	h.version = TRACE_VERSION;
+	h.block_count = t.index.size();
+	h.index_offset = (unsigned long long) t.file.tellp();
+	h.entries = t.entries;
+	h.cycles = m.cycles;
+
+	t.file.write((const char *) t.index.data(), t.index.size() * sizeof(trace_block));
+	t.file.seekp(0);
+	t.file.write((const char *) &h, sizeof(trace_header));
+	t.file.close();
+
+	bool written = !t.file.fail();
+
+	t.index.clear();
+	t.block.clear();
+
+	return written ? SUCCESS : FAIL;
+}
+
+
+/* Reads the whole file into memory, for hosts without mmap and for files that cannot be mapped */
+static int read_file(trace& t, const char * file_name) {
+
+	ifstream file(file_name, ios::in | ios::binary | ios::ate);
+
+	if (!file.is_open())
+		return FAIL;
+
+	size_t size = (size_t) file.tellg();
+	char * data = new char[size ? size : 1];
+
+	file.seekg(0);
+	file.read(data, size);
+
+	if ((size_t) file.gcount() != size) {
+
+		delete[] data;
+		return FAIL;
+	}
+
+	t.data = data;
+	t.size = size;
+	t.mapped = false;
+
+	return SUCCESS;
+}
+
+
+int trace_open(trace& t, const char * file_name) {
+
+	memset(&t, 0, sizeof(trace));
+
+	bool opened = false;
+
+#ifdef TRACE_MMAP
+	int fd = open(file_name, O_RDONLY);
+	struct stat info;
+
+	if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+
+		void * memory = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (memory != MAP_FAILED) {
+
+			t.data = (const char *) memory;
+			t.size = (size_t) info.st_size;
+			t.mapped = opened = true;
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+#endif
+
+	if (!opened && read_file(t, file_name) == FAIL)
+		return FAIL;
+
+	const trace_header * h = (const trace_header *) t.data;
+
+	bool valid = t.size >= sizeof(trace_header) && h->magic == TRACE_MAGIC && h->version == TRACE_VERSION
+		&& h->index_offset <= t.size && h->index_offset % 8 == 0 && h->block_count <= (t.size - h->index_offset) / sizeof(trace_block);
+
+	if (valid) {
+
+		t.header = h;
+		t.block = (const trace_block *) (t.data + h->index_offset);
+
+		for (unsigned int b = 0; b < h->block_count && valid; b++)			// blocks inside the file and in cycle order
+			valid = t.block[b].offset <= h->index_offset && t.block[b].size <= h->index_offset - t.block[b].offset
+				&& t.block[b].raw_size <= TRACE_BLOCK_SIZE && (b == 0 || t.block[b].first_cycle >= t.block[b - 1].first_cycle);
+	}
+
+	if (!valid) {
+
+		trace_close(t);
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+
+void trace_close(trace& t) {
+
+#ifdef TRACE_MMAP
+	if (t.data && t.mapped)
+		munmap((void *) t.data, t.size);
+#endif
+
+	if (t.data && !t.mapped)
+		delete[] t.data;
+
+	memset(&t, 0, sizeof(trace));
+}
+
+
+int trace_find_block(const trace& t, unsigned long long cycle) {
+
+	int low = 0, high = (int) t.header->block_count - 1;
+
+	if (high < 0)
+		return -1;
+
+	while (low < high) {
+
+		int middle = (low + high + 1) / 2;
+
+		if (t.block[middle].first_cycle <= cycle)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	return low;
+}
+
+
+int trace_read_block(const trace& t, int b, vector <unsigned char>& raw) {
+
+	return lz_decompress((const unsigned char *) t.data + t.block[b].offset, t.block[b].size, raw, t.block[b].raw_size);
+}
+
+
+/* Reads a varint, nullptr if it runs past end */
+static inline const unsigned char * get_varint(const unsigned char * p, const unsigned char * end, unsigned long long& x) {
+
+	x = 0;
+
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+
+		unsigned char byte = *p++;
+
+		x |= (unsigned long long) (byte & 0x7f) << shift;
+
+		if (!(byte & 0x80))
+			return p;
+	}
+
+	return nullptr;
+}
+
+
+const unsigned char * trace_next(const unsigned char * p, const unsigned char * end, trace_state& state, trace_entry& e) {
+
+	unsigned long long x;
+
+	memset(&e, 0, sizeof(trace_entry));
+
+	if (!(p = get_varint(p, end, x)) || p == end)
+		return nullptr;
+
+	e.cycle = state.cycle += x;
+	e.what = *p++;
+
+	if (e.what & TRACE_RETIRED) {
+
+		if (!(p = get_varint(p, end, x)))
+			return nullptr;
+
+		e.pc = state.pc = unzigzag(state.pc, (unsigned int) x);
+		state.retired++;
+	}
+
+	if (e.what & TRACE_REG) {
+
+		if (p == end || (e.reg = *p++) >= NUM_REGS || !(p = get_varint(p, end, x)))
+			return nullptr;
+
+		e.value = state.regs[e.reg] = unzigzag(state.regs[e.reg], (unsigned int) x);
+	}
+
+	if (e.what & TRACE_FLAGS) {
+
+		if (p == end)
+			return nullptr;
+
+		e.flags = state.flags = *p++;
+	}
+
+	if (e.what & TRACE_SP) {
+
+		if (p == end)
+			return nullptr;
+
+		e.sp = state.sp = *p++;
+	}
+
+	if (e.what & (TRACE_BYTE | TRACE_WORD)) {
+
+		if (!(p = get_varint(p, end, x)))
+			return nullptr;
+
+		e.address = (unsigned short) x;
+
+		if (e.what & TRACE_BYTE) {
+
+			if (p == end)
+				return nullptr;
+
+			e.data = *p++;
+		} else {
+
+			if (!(p = get_varint(p, end, x)))
+				return nullptr;
+
+			e.data = (unsigned short) x;
+		}
+	}
+
+	return p;
+}
+
+
+/* Run length in the nibble of a token, extended by bytes of 255 and a last one below it */
+static inline void put_length(vector <unsigned char>& out, size_t length) {
+
+	for (; length >= 255; length -= 255)
+		out.push_back(255);
+
+	out.push_back((unsigned char) length);
+}
+
+static inline const unsigned char * get_length(const unsigned char * p, const unsigned char * end, size_t& length) {
+
+	unsigned char byte = 255;
+
+	while (byte == 255) {
+
+		if (p == end)
+			return nullptr;
+
+		byte = *p++;
+		length += byte;
+	}
+
+	return p;
+}
+
+
+/* Token: literal run length << 4 | match length - LZ_MIN_MATCH, 15 extended; the literals; the match offset, 2 bytes */
+static void put_sequence(vector <unsigned char>& out, const unsigned char * literals, size_t literal_length, size_t offset, size_t match_length) {
+
+	size_t match = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+	out.push_back((unsigned char) ((literal_length < 15 ? literal_length : 15) << 4 | (match < 15 ? match : 15)));
+
+	if (literal_length >= 15)
+		put_length(out, literal_length - 15);
+
+	out.insert(out.end(), literals, literals + literal_length);
+
+	if (!match_length)			// the last sequence only has literals
+		return;
+
+	out.push_back((unsigned char) offset);
+	out.push_back((unsigned char) (offset >> 8));
+
+	if (match >= 15)
+		put_length(out, match - 15);
+}
+
+
+void lz_compress(const unsigned char * in, size_t size, vector <unsigned char>& out) {
+
+	int table[1 << LZ_HASH_BITS];			// last position of each hash of 4 bytes
+	size_t anchor = 0, i = 0;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (i + LZ_MIN_MATCH <= size) {
+
+		unsigned int word;
+
+		memcpy(&word, in + i, 4);
+
+		unsigned int hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+		int candidate = table[hash];
+
+		table[hash] = (int) i;
+
+		if (candidate < 0 || i - candidate > LZ_MAX_OFFSET || memcmp(in + candidate, in + i, LZ_MIN_MATCH)) {
+
+			i++;
+			continue;
+		}
+
+		size_t length = LZ_MIN_MATCH;
+
+		while (i + length < size && in[candidate + length] == in[i + length])
+			length++;
+
+		put_sequence(out, in + anchor, i - anchor, i - candidate, length);
+		i += length;
+		anchor = i;
+	}
+
+	put_sequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+
+int lz_decompress(const unsigned char * in, size_t size, vector <unsigned char>& out, size_t raw_size) {
+
+	const unsigned char * p = in;
+	const unsigned char * end = in + size;
+
+	out.clear();
+	out.reserve(raw_size);
+
+	while (p < end) {
+
+		unsigned char token = *p++;
+		size_t literal_length = token >> 4;
+
+		if (literal_length == 15 && !(p = get_length(p, end, literal_length)))
+			return FAIL;
+
+		if (literal_length > (size_t) (end - p) || out.size() + literal_length > raw_size)
+			return FAIL;
+
+		out.insert(out.end(), p, p + literal_length);
+		p += literal_length;
+
+		if (p == end)			// the last sequence
+			break;
+
+		if (end - p < 2)
+			return FAIL;
+
+		size_t offset = p[0] | p[1] << 8;
+		size_t match_length = token & 15;
+
+		p += 2;
+
+		if (match_length == 15 && !(p = get_length(p, end, match_length)))
+			return FAIL;
+
+		match_length += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > out.size() || out.size() + match_length > raw_size)
+			return FAIL;
+
+		for (size_t from = out.size() - offset; match_length > 0; match_length--)			// may overlap what it writes
+			out.push_back(out[from++]);
+	}
+
+	return out.size() == raw_size ? SUCCESS : FAIL;
+}
@@ -0,0 +1,143 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+#include "simulator.h"
+
+
+#define TRACE_MAGIC			0x43525448			// "HTRC"
+#define TRACE_VERSION		1
+
+#define TRACE_BLOCK_SIZE	65536			// raw bytes of entries per block at most, so matches reach back with 16 bit offsets
+#define TRACE_ENTRY_MAX		32				// longest encoded entry
+#define TRACE_QUEUE			64				// blocks waiting for the compression thread before recording waits for it
+
+/* What an entry holds, in this order after its cycle delta and this byte */
+#define TRACE_RETIRED		1				// an instruction left writeback: its pc, zigzag delta from the previous one
+#define TRACE_REG			2				// it wrote a register: the register, then the zigzag delta from the old value
+#define TRACE_FLAGS			4				// NZCV changed: N << 3 | Z << 2 | C << 1 | V
+#define TRACE_SP			8				// the stack pointer changed: its new value
+#define TRACE_BYTE			16				// a byte of RAM was written: address, then the byte
+#define TRACE_WORD			32				// a word of RAM was written: address, then the word
+
+
+/*
+ * Execution trace the simulator writes with -t, one entry per cycle in which something happened. Entries are varint
+ * (7 bits a byte, low first) and delta encoded, cut into blocks of at most TRACE_BLOCK_SIZE bytes, and every block is
+ * compressed on its own (LZ77, literal runs and 16 bit back references). Fixed width little endian records otherwise:
+ *	header, compressed blocks, then the index, one record per block sorted by cycle
+ * A block starts from the registers, flags and sp in its index record, so any cycle is reached by a binary search of
+ * the index and decoding one block.
+ */
+struct trace_header {
+
+	unsigned int magic;
+	unsigned int version;
+	unsigned int block_count;
+	unsigned int reserved;
+	unsigned long long index_offset;			// bytes from the start of the file
+	unsigned long long entries;
+	unsigned long long cycles;					// cycle count of the machine when recording stopped
+};
+
+/* Architectural state replayed from a trace, after the entry of cycle */
+struct trace_state {
+
+	unsigned long long cycle;
+	unsigned long long retired;
+	unsigned short regs[NUM_REGS];
+	unsigned short pc;							// of the last instruction that retired
+	unsigned char sp;
+	unsigned char flags;						// as TRACE_FLAGS stores them
+	unsigned int reserved;
+};
+
+/* Index record: where a block is and the state before its first entry */
+struct trace_block {
+
+	unsigned long long offset;
+	unsigned long long first_cycle;			// cycle of the first entry
+	unsigned int size;						// compressed
+	unsigned int raw_size;
+	unsigned int entries;
+	unsigned int reserved;
+	trace_state start;
+};
+
+/* One entry, decoded */
+struct trace_entry {
+
+	unsigned long long cycle;
+	unsigned char what;						// TRACE_* bits
+	unsigned short pc;
+	unsigned char reg;
+	unsigned short value;					// of the register
+	unsigned char flags;
+	unsigned char sp;
+	unsigned short address, data;			// of the RAM write
+};
+
+
+/* Trace being written; blocks are compressed and written by a thread of their own */
+struct trace_recorder {
+
+	std::ofstream file;
+	std::vector <unsigned char> block;			// raw entries of the block being filled, TRACE_BLOCK_SIZE long
+	size_t used;								// bytes of it filled
+	trace_block current;						// its index record
+	trace_state last;							// state after the last entry
+	unsigned long long entries;
+
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable work, room;
+	std::deque <std::pair <trace_block, std::vector <unsigned char>>> queue;
+	std::vector <trace_block> index;			// written blocks, filled by the worker
+	bool closing;
+};
+
+/* Open trace file, mapped read only where the host has mmap */
+struct trace {
+
+	const char * data;
+	size_t size;
+	bool mapped;
+
+	const trace_header * header;				// nullptr when no file is open
+	const trace_block * block;
+};
+
+
+/* Creates file_name and starts recording from the state of m; returns FAIL if it cannot be written */
+int trace_record_open(trace_recorder& t, const char * file_name, const machine& m);
+/* pipeline_cycle with whatever the cycle changed recorded in t */
+bool trace_record_cycle(trace_recorder& t, machine& m);
+/* pipeline_run with every cycle recorded in t */
+int trace_record_run(trace_recorder& t, machine& m, unsigned long long max_cycles);
+/* Writes the last block and the index and stops the thread; returns FAIL if anything could not be written */
+int trace_record_close(trace_recorder& t, const machine& m);
+
+/* Opens and checks a trace file, returns FAIL if it is missing or malformed (t is then empty) */
+int trace_open(trace& t, const char * file_name);
+/* Unmaps or frees the file, t is empty afterwards */
+void trace_close(trace& t);
+/* Last block whose first entry is at or before cycle (the first block if none is), -1 if the trace is empty */
+int trace_find_block(const trace& t, unsigned long long cycle);
+/* Decompresses block b, returns FAIL if it is corrupt */
+int trace_read_block(const trace& t, int b, std::vector <unsigned char>& raw);
+/* Decodes the entry at p into e and applies it to state, returns the byte after it; nullptr if the entry runs past end */
+const unsigned char * trace_next(const unsigned char * p, const unsigned char * end, trace_state& state, trace_entry& e);
+
+/* Compresses size bytes of in, appending to out */
+void lz_compress(const unsigned char * in, size_t size, std::vector <unsigned char>& out);
+/* Decompresses size bytes of in into out, which has to come out raw_size bytes long; returns FAIL otherwise */
+int lz_decompress(const unsigned char * in, size_t size, std::vector <unsigned char>& out, size_t raw_size);
+
+#endif
@@ -0,0 +1,320 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+#include "trace.h"
+
+using namespace std;
+
+
+/*
+ * Reads the traces simulator -t writes. With one trace it prints its size, or with -s the state at a cycle and the
+ * entries from there; with two it finds the first entry where they differ and prints both from there. Blocks that
+ * are the same byte for byte in both files are skipped without decompressing them. Build with the trace reader:
+ *	g++ -O2 -o tracediff tracediff.cpp trace.cpp pipeline.cpp -pthread
+ */
+
+
+#define DEFAULT_COUNT		20			// entries printed
+
+
+/* Position in a trace: the block being read and the next entry, decoded ahead */
+struct cursor {
+
+	const trace * t;
+	int block;
+	vector <unsigned char> raw;
+	const unsigned char * p;
+	const unsigned char * end;
+	trace_state state;					// after next
+	trace_state before;					// before next
+	trace_entry next;
+	bool has_next;
+	bool corrupt;
+};
+
+
+/* Starts c at block b */
+void start(cursor& c, const trace& t, int b);
+/* Decodes the entry after next, moving to the following block at the end of one */
+void fill(cursor& c);
+/* Moves c to the first entry at or after cycle */
+void seek(cursor& c, unsigned long long cycle);
+/* First block at which a and b differ in their index record or bytes */
+int first_different_block(const trace& a, const trace& b);
+/* Prints the registers, flags and sp of a state */
+void print_state(const trace_state& s);
+/* Prints one entry on a line */
+void print_entry(const trace_entry& e);
+
+
+static trace traces[2];
+
+
+int main(int argc, char * argv[]) {
+
+	const char * names[2] = {nullptr, nullptr};
+	unsigned long long cycle = 0;
+	bool seeking = false;
+	int count = DEFAULT_COUNT;
+	bool usage = false;
+
+	for (int i = 1; i < argc && !usage; i++) {
+
+		if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			cycle = strtoull(argv[++i], nullptr, 0), seeking = true;
+		else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			count = atoi(argv[++i]);
+		else if (argv[i][0] != '-' && !names[0])
+			names[0] = argv[i];
+		else if (argv[i][0] != '-' && !names[1])
+			names[1] = argv[i];
+		else
+			usage = true;
+	}
+
+	if (usage || !names[0]) {
+
+		cout << "\nUsage: tracediff [-s cycle] [-n count] a.trc [b.trc]" << endl;
+		return FAIL;
+	}
+
+	int files = names[1] ? 2 : 1;
+
+	for (int f = 0; f < files; f++) {
+
+		if (trace_open(traces[f], names[f]) == FAIL) {
+
+			cout << "\nUnable to open trace [" << names[f] << "]" << endl;
+			return FAIL;
+		}
+	}
+
+	const trace& a = traces[0];
+
+	/* One trace: its size, or the state at a cycle and what follows */
+	if (files == 1) {
+
+		unsigned long long raw = 0;
+
+		for (unsigned int b = 0; b < a.header->block_count; b++)
+			raw += a.block[b].raw_size;
+
+		if (!seeking) {
+
+			cout << a.header->entries << " entries, " << a.header->cycles << " cycles, " << a.header->block_count << " blocks" << endl;
+			cout << raw << " bytes encoded, " << a.size << " bytes in the file (" << fixed << setprecision(2)
+				<< (double) a.size / max(1ULL, a.header->entries) << " per entry)" << endl;
+			return 0;
+		}
+
+		cursor c;
+
+		start(c, a, trace_find_block(a, cycle));
+		seek(c, cycle);
+
+		if (c.corrupt) {
+
+			cout << "\nError... Trace [" << names[0] << "] is corrupt" << endl;
+			return FAIL;
+		}
+
+		cout << "before cycle " << cycle << ":" << endl;
+		print_state(c.before);
+		cout << endl;
+
+		for (int i = 0; i < count && c.has_next; i++, fill(c))
+			print_entry(c.next);
+
+		return 0;
+	}
+
+	/* Two traces: the first entry they disagree on */
+	cursor c[2];
+
+	if (seeking) {
+
+		for (int f = 0; f < 2; f++) {
+
+			start(c[f], traces[f], trace_find_block(traces[f], cycle));
+			seek(c[f], cycle);
+		}
+	} else {
+
+		int b = first_different_block(traces[0], traces[1]);
+
+		for (int f = 0; f < 2; f++)
+			start(c[f], traces[f], b);
+	}
+
+	unsigned long long matched = 0;
+
+	while (c[0].has_next && c[1].has_next && !memcmp(&c[0].next, &c[1].next, sizeof(trace_entry))) {
+
+		fill(c[0]);
+		fill(c[1]);
+		matched++;
+	}
+
+	for (int f = 0; f < 2; f++) {
+
+		if (c[f].corrupt) {
+
+			cout << "\nError... Trace [" << names[f] << "] is corrupt" << endl;
+			return FAIL;
+		}
+	}
+
+	if (!c[0].has_next && !c[1].has_next) {
+
+		cout << "traces match" << (seeking || matched == traces[0].header->entries ? "" : " (identical blocks skipped)") << ", "
+			<< traces[0].header->entries << " entries" << endl;
+		return 0;
+	}
+
+	for (int f = 0; f < 2; f++) {
+
+		cout << names[f] << (f == 0 ? ", first difference" : "") << endl;
+
+		if (c[f].has_next) {
+
+			print_state(c[f].before);
+			cout << endl;
+		}
+
+		for (int i = 0; i < count && c[f].has_next; i++, fill(c[f]))
+			print_entry(c[f].next);
+
+		if (!c[f].has_next)
+			cout << "end of trace" << endl;
+
+		cout << endl;
+	}
+
+	return FAIL;
+}
+
+
+void start(cursor& c, const trace& t, int b) {
+
+	memset(&c.state, 0, sizeof(trace_state));
+	memset(&c.before, 0, sizeof(trace_state));
+	c.t = &t;
+	c.block = b;
+	c.has_next = false;
+	c.corrupt = false;
+	c.p = c.end = nullptr;
+
+	if (b < 0 || b >= (int) t.header->block_count)
+		return;
+
+	c.state = t.block[b].start;
+	c.block = b - 1;			// fill moves on to b
+
+	fill(c);
+}
+
+
+void fill(cursor& c) {
+
+	c.before = c.state;
+	c.has_next = false;
+
+	while (c.p == c.end) {
+
+		if (c.block + 1 >= (int) c.t->header->block_count)
+			return;
+
+		c.block++;
+
+		if (trace_read_block(*c.t, c.block, c.raw) == FAIL) {
+
+			c.corrupt = true;
+			return;
+		}
+
+		c.p = c.raw.data();
+		c.end = c.raw.data() + c.raw.size();
+		c.state = c.before = c.t->block[c.block].start;
+	}
+
+	c.p = trace_next(c.p, c.end, c.state, c.next);
+
+	if (!c.p) {
+
+		c.corrupt = true;
+		c.p = c.end = nullptr;
+		return;
+	}
+
+	c.has_next = true;
+}
+
+
+void seek(cursor& c, unsigned long long cycle) {
+
+	while (c.has_next && c.next.cycle < cycle)
+		fill(c);
+}
+
+
+int first_different_block(const trace& a, const trace& b) {
+
+	unsigned int blocks = min(a.header->block_count, b.header->block_count);
+	unsigned int i = 0;
+
+	for (; i < blocks; i++) {
+
+		trace_block x = a.block[i], y = b.block[i];
+
+		x.offset = y.offset = 0;			// where a block lies does not matter
+
+		if (memcmp(&x, &y, sizeof(trace_block)) || memcmp(a.data + a.block[i].offset, b.data + b.block[i].offset, x.size))
+			break;
+	}
+
+	return i < blocks || a.header->block_count != b.header->block_count ? (int) i : -1;
+}
+
+
+void print_state(const trace_state& s) {
+
+	cout << hex << setfill('0');
+
+	for (int r = 0; r < NUM_REGS; r++)
+		cout << "r" << r << " = 0x" << setw(4) << s.regs[r] << (r == NUM_REGS - 1 ? "\n" : "  ");
+
+	cout << "last pc = 0x" << setw(4) << s.pc << "  sp = 0x" << setw(2) << (int) s.sp << dec << setfill(' ')
+		<< "  NZCV = " << (s.flags >> 3 & 1) << (s.flags >> 2 & 1) << (s.flags >> 1 & 1) << (s.flags & 1)
+		<< "  instructions = " << s.retired << endl;
+}
+
+
+void print_entry(const trace_entry& e) {
+
+	cout << setw(12) << e.cycle << "  " << hex << setfill('0');
+
+	if (e.what & TRACE_RETIRED)
+		cout << "0x" << setw(4) << e.pc;
+	else
+		cout << "------";
+
+	if (e.what & TRACE_REG)
+		cout << "  r" << (int) e.reg << " = 0x" << setw(4) << e.value;
+
+	if (e.what & TRACE_FLAGS)
+		cout << dec << "  NZCV = " << (e.flags >> 3 & 1) << (e.flags >> 2 & 1) << (e.flags >> 1 & 1) << (e.flags & 1) << hex;
+
+	if (e.what & TRACE_SP)
+		cout << "  sp = 0x" << setw(2) << (int) e.sp;
+
+	if (e.what & TRACE_BYTE)
+		cout << "  [0x" << setw(4) << e.address << "] = 0x" << setw(2) << e.data;
+
+	if (e.what & TRACE_WORD)
+		cout << "  [0x" << setw(4) << e.address << "] = 0x" << setw(4) << e.data;
+
+	cout << dec << setfill(' ') << endl;
+}
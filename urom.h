@@ -0,0 +1,219 @@
+#ifndef UROM_H
+#define UROM_H
+
+
+/* uROM1 */
+#define OS      0 << 0
+#define IMS     1 << 3
+#define ALUI    1 << 4
+#define STALL   1 << 5
+#define LDI     1 << 6
+#define PCS     1 << 7
+#define DECSP   1 << 8
+
+
+/* uROM2 */
+#define WEN     1 << 0
+#define J       1 << 1
+#define BRS     1 << 2
+#define RW      1 << 3
+#define RR      1 << 4
+#define RBYTE   1 << 5
+#define FLUSH   1 << 6
+#define INCSP   1 << 7
+#define SPS     1 << 8
+#define RET_C   1 << 9
+#define CALL_C  1 << 10
+
+
+/* ALU operations */
+#define ADD     0 << 0
+#define AND     1 << 0
+#define OR      2 << 0
+#define B_ID    3 << 0
+#define NOT     4 << 0
+#define SUB     5 << 0
+
+#define OS_MASK     7           // ALU operation field of uROM1
+
+
+#define N       1 << 11
+#define Z       1 << 10
+#define C       1 << 9
+#define V       1 << 8
+
+
+#define DX_ROM_SIZE     256         // addressed by opcode byte (opcode << 3 | rd)
+#define WB_ROM_SIZE     4096        // addressed by NZCV << 8 | opcode byte
+
+
+enum opcodes {
+
+	nop = 0,
+	mvi,
+	addi,
+	subi,
+	andi,
+	ori,
+	cmpi,
+	bra,
+	bne,
+	beq,
+    bhs,
+	blo,
+	bge,
+	blt,
+	bvs,
+	bvc,
+	mvr,
+	addr,
+	subr,
+	andr,
+	orr,
+	notr,
+	cmp,
+	ldr,
+	ldrb,
+	str,
+	strb,
+	push,
+	pop,
+	call,
+	ret,
+	jmp
+};
+
+
+static const unsigned long op_ctrl[32][2] = {    {0, 0},                                     // nop
+                                    {B_ID | IMS | ALUI, WEN},                   // mvi
+                                    {ADD | IMS | ALUI, WEN},                    // addi
+                                    {SUB | IMS | ALUI, WEN},                    // subi
+                                    {AND | IMS | ALUI, WEN},                    // andi
+                                    {OR | IMS | ALUI, WEN},                     // ori
+                                    {SUB | IMS | ALUI, 0},                      // cmpi
+                                    {ADD | IMS | ALUI | STALL | PCS, J| BRS}, // bra
+                                    {ADD | IMS | ALUI | PCS, BRS},
+                                    {ADD | IMS | ALUI | PCS, BRS},
+                                    {ADD | IMS | ALUI | PCS, BRS},
+                                    {ADD | IMS | ALUI | PCS, BRS},
+                                    {ADD | IMS | ALUI | PCS, BRS},
+                                    {ADD | IMS | ALUI | PCS, BRS},
+                                    {ADD | IMS | ALUI | PCS, BRS},
+                                    {ADD | IMS | ALUI | PCS, BRS},              // bvc
+                                    {B_ID | ALUI, WEN},                         // mvr
+                                    {ADD | ALUI, WEN},                          // addr
+                                    {SUB | ALUI, WEN},                          // subr
+                                    {AND | ALUI, WEN},                          // andr
+                                    {OR | ALUI, WEN},                           // orr
+                                    {NOT | ALUI, WEN},                          // notr
+                                    {SUB | ALUI, 0},                            // cmp
+                                    {LDI | STALL, WEN | RR},                                  // ldr
+                                    {LDI | STALL, WEN | RR | RBYTE},                          // ldrb
+                                    {LDI | STALL, RW},                                  // str
+                                    {LDI | STALL, RW | RBYTE},                          // strb
+                                    {0, RW | INCSP | SPS},             // push
+                                    {DECSP, RR | WEN | SPS},             // pop
+                                    {LDI | STALL, J | RW | INCSP | SPS | CALL_C | FLUSH},             // call
+                                    {DECSP, RR | J | FLUSH | SPS | RET_C},             // ret
+                                    {STALL | LDI, J}                           // jmp
+                                    };
+
+
+/* Returns the dx_rom word for an opcode byte (opcode in upper 5 bits, rd in lower 3) */
+static inline unsigned long dx_ctrl(int i) {
+
+    return op_ctrl[((unsigned char) i) >> 3][0];
+}
+
+
+/* Returns the wb_rom word for a 12 bit address (flags in bits 11-8, opcode byte in bits 7-0); taken branches add J | FLUSH */
+static inline unsigned long wb_ctrl(int i) {
+
+    int opcode = ((unsigned char) i) >> 3;
+
+    int n_flag = !!(i & N);
+    int z_flag = !!(i & Z);
+    int c_flag = !!(i & C);
+    int v_flag = !!(i & V);
+
+    unsigned long new_ctrl = op_ctrl[((unsigned char) i) >> 3][1];
+
+    if (opcode >= opcodes::bra && opcode <= opcodes::bvc) {
+
+
+        if (z_flag) {
+
+            if (opcode == opcodes::beq || opcode == opcodes::bge)
+                new_ctrl |= J| FLUSH;
+
+        } else {
+
+            if (opcode == opcodes::bne)
+                new_ctrl |= J| FLUSH;
+        }
+
+
+        if (c_flag) {
+
+            if (opcode == opcodes::bhs)
+                new_ctrl |= J| FLUSH;
+
+        } else {
+
+            if (opcode == opcodes::blo)
+                new_ctrl |= J| FLUSH;
+        }
+
+        if (v_flag) {
+
+            if (opcode == opcodes::bvs)
+                new_ctrl |= J| FLUSH;
+        } else {
+
+            if (opcode == opcodes::bvc)
+                new_ctrl |= J| FLUSH;
+        }
+
+        if (n_flag == v_flag) {
+
+            if (opcode == opcodes::bge)
+                new_ctrl |= J| FLUSH;
+        } else {
+
+            if (opcode == opcodes::blt)
+                new_ctrl |= J| FLUSH;
+        }
+    }
+
+    return new_ctrl;
+}
+
+
+/* Contents of the four control ROMs, low and high byte of each word, as urom writes them to dx_rom.bin, dx_rom2.bin, wb_rom.bin and wb_rom2.bin */
+struct urom_images {
+
+    unsigned char dx_rom[DX_ROM_SIZE], dx_rom2[DX_ROM_SIZE];
+    unsigned char wb_rom[WB_ROM_SIZE], wb_rom2[WB_ROM_SIZE];
+};
+
+
+/* Fills the ROM images from dx_ctrl and wb_ctrl, in memory */
+static inline void generate_urom(urom_images& roms) {
+
+    for (int i = 0; i < DX_ROM_SIZE; i++) {
+
+        roms.dx_rom[i] = (unsigned char) dx_ctrl(i);
+        roms.dx_rom2[i] = (unsigned char) (dx_ctrl(i) >> 8);
+    }
+
+    for (int i = 0; i < WB_ROM_SIZE; i++) {
+
+        unsigned long new_ctrl = wb_ctrl(i);        // control word, with J | FLUSH added for taken branches
+
+        roms.wb_rom[i] = (unsigned char) new_ctrl;
+        roms.wb_rom2[i] = (unsigned char) (new_ctrl >> 8);
+    }
+}
+
+
+#endif
@@ -0,0 +1,529 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include "simulator.h"
+#include "netlist.h"
+
+using namespace std;
+
+
+/*
+ * Exhaustively checks the alu and control subcircuits of hbcp.circ against the behaviour the simulator and
+ * urom.h encode, 64 test vectors per netlist pass (slice.cpp), with the work split over all host cores.
+ *	alu		every operation, A and B word with flag updates on, and every operation and A with them off;
+ *			the operand registers are set directly and E plus the next value of each flag register are compared
+ *	control	every wb_rom address (NZCV and the writeback opcode byte) and dx_rom address (decode opcode byte)
+ */
+
+
+#define LANES				64
+#define REPORT_LIMIT		20			// mismatches printed per check, all are counted
+
+
+/* One signal of a checked circuit as bits of the netlist */
+struct probe {
+
+	string name;
+	vector <int> bits;
+	bool inverted;			// active low
+};
+
+/* Flag register of the alu: the value it holds after the falling edge is en ? d : q */
+struct flag_probe {
+
+	string name;
+	vector <int> q, d, en;
+	bool machine::* field;
+};
+
+struct difference {
+
+	unsigned long long vector;			// check specific encoding of the test vector
+	string text;
+};
+
+
+/* Bits of the top level pin labelled label, empty if there is none */
+vector <int> pin_bits(const netlist& n, const char * label);
+/* Returns the register whose d input comes from the pin labelled label (or whose q drives it), -1 if there is none */
+int register_at_pin(const netlist& n, const char * label, bool output);
+/* Runs work(item) for every item below count on threads threads */
+void parallel(int threads, unsigned long long count, void (*work)(unsigned long long item, int thread));
+/* Reads the value of bits in lane */
+unsigned lane_value(const unsigned long long * v, const vector <int>& bits, int lane);
+/* Stores value in every lane of bits */
+void broadcast(unsigned long long * v, const vector <int>& bits, unsigned value);
+/* Prints the first REPORT_LIMIT mismatches in vector order and the total */
+void report(const char * check, vector <difference>& found, unsigned long long vectors, double seconds);
+
+/* ALU work item: one operation, one A word and 1024 blocks of 64 B words */
+void alu_item(unsigned long long item, int thread);
+/* Control work item: 64 consecutive wb_rom addresses */
+void control_item(unsigned long long item, int thread);
+
+
+static netlist alu, control;
+static slice_program alu_program, control_program;
+static vector <vector <unsigned long long>> slots;			// per thread
+static vector <machine *> machines;			// per thread, flag updates use alu_set_flags
+static vector <difference> found;
+static mutex found_lock;
+static int stride = 1;
+
+static vector <int> alu_a, alu_b, alu_os, alu_uf, alu_e;
+static vector <flag_probe> flags;
+static vector <probe> wb_probes, dx_probes;			// control outputs with the control word bits they carry
+static vector <unsigned> wb_bits, dx_bits;
+static vector <int> control_dx, control_wb, control_nzcv[4];
+
+
+int main(int argc, char * argv[]) {
+
+	const char * file_name = "hbcp.circ";
+	int threads = (int) thread::hardware_concurrency();
+	bool run_alu = true, run_control = true;
+
+	for (int i = 1; i < argc; i++) {
+
+		if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			threads = atoi(argv[++i]);			// worker threads, default all cores
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			stride = atoi(argv[++i]);			// only every stride-th A word, 1 is exhaustive
+		else if (!strcmp(argv[i], "-a"))
+			run_control = false;
+		else if (!strcmp(argv[i], "-c"))
+			run_alu = false;
+		else if (argv[i][0] != '-')
+			file_name = argv[i];
+		else {
+
+			cout << "\nUsage: verify [-t threads] [-s stride] [-a | -c] [hbcp.circ]" << endl;
+			return FAIL;
+		}
+	}
+
+	threads = max(threads, 1);
+	stride = max(stride, 1);
+	slots.resize(threads);
+	machines.resize(threads);
+
+	for (int t = 0; t < threads; t++)
+		machines[t] = new machine();
+
+	int failed = 0;
+
+	if (run_alu) {
+
+		if (netlist_load(alu, file_name, "alu") == FAIL) {
+
+			cout << file_name << ": " << alu.error << endl;
+			return FAIL;
+		}
+
+		/* The operand registers are preset, their loading logic and the pins in front of them are not checked */
+		int a = register_at_pin(alu, "A", false), b = register_at_pin(alu, "B", false);
+		int os = register_at_pin(alu, "OS", false), uf = register_at_pin(alu, "UFL", false);
+		vector <int> observe;
+
+		alu_e = pin_bits(alu, "E");
+
+		static const char * const flag_names[] = {"N", "Z", "C", "V"};
+		static bool machine::* const fields[] = {&machine::n, &machine::z, &machine::c, &machine::v};
+
+		for (int f = 0; f < 4; f++) {
+
+			int r = register_at_pin(alu, flag_names[f], true);
+
+			if (r < 0) {
+
+				cout << "alu: no flag register drives " << flag_names[f] << endl;
+				return FAIL;
+			}
+
+			const cell& c = alu.cells[r];
+
+			flags.push_back({flag_names[f], c.ports[0], c.ports[1], c.ports[2], fields[f]});
+			observe.insert(observe.end(), c.ports[1].begin(), c.ports[1].end());
+			observe.insert(observe.end(), c.ports[2].begin(), c.ports[2].end());
+		}
+
+		if (a < 0 || b < 0 || os < 0 || uf < 0 || alu_e.size() != 16) {
+
+			cout << "alu: operand, operation or update flags register not found" << endl;
+			return FAIL;
+		}
+
+		alu_a = alu.cells[a].ports[0];
+		alu_b = alu.cells[b].ports[0];
+		alu_os = alu.cells[os].ports[0];
+		alu_uf = alu.cells[uf].ports[0];
+		observe.insert(observe.end(), alu_e.begin(), alu_e.end());
+
+		if (slice_compile(alu, alu_program, observe) == FAIL) {
+
+			cout << "alu: " << alu_program.error << endl;
+			return FAIL;
+		}
+
+		for (auto& v : slots)
+			v.assign(alu_program.slots, 0);
+
+		unsigned long long items = 2 * 8 * ((65536 + stride - 1) / stride);			// flag updates on and off
+		auto start = chrono::steady_clock::now();
+
+		found.clear();
+		parallel(threads, items, alu_item);
+
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		unsigned long long vectors = items / 2 * (65536ULL + LANES);
+
+		cout << "alu: " << alu_program.ops.size() << " operations per pass, " << threads << " threads" << endl;
+		report("alu", found, vectors, seconds);
+		failed += !found.empty();
+	}
+
+	if (run_control) {
+
+		if (netlist_load(control, file_name, "control") == FAIL) {
+
+			cout << file_name << ": " << control.error << endl;
+			return FAIL;
+		}
+
+		/* Outputs and the control word bits urom.h gives them; STALL leaves the control circuit inverted (decode enable) */
+		static const struct { const char * label; unsigned bits; bool wb, inverted; } outputs[] = {
+			{"WEN", WEN, true, false}, {"J", J, true, false}, {"BRS", BRS, true, false}, {"RW", RW, true, false},
+			{"RR", RR, true, false}, {"RBYTE", RBYTE, true, false}, {"FLUSH", FLUSH, true, false}, {"INCSP", INCSP, true, false},
+			{"SPS", SPS, true, false}, {"RET", RET_C, true, false}, {"CALL", CALL_C, true, false},
+			{"OS", OS_MASK, false, false}, {"IMS", IMS, false, false}, {"ALUI", ALUI, false, false}, {"STALL", STALL, false, true},
+			{"LDI", LDI, false, false}, {"PCS", PCS, false, false}, {"DECSP", DECSP, false, false}};
+		vector <int> observe;
+
+		for (const auto& o : outputs) {
+
+			probe p = {o.label, pin_bits(control, o.label), o.inverted};
+
+			if (p.bits.empty()) {
+
+				cout << "control: no output pin " << o.label << endl;
+				return FAIL;
+			}
+
+			observe.insert(observe.end(), p.bits.begin(), p.bits.end());
+			(o.wb ? wb_probes : dx_probes).push_back(p);
+			(o.wb ? wb_bits : dx_bits).push_back(o.bits);
+		}
+
+		static const char * const flag_names[] = {"N", "Z", "C", "V"};
+
+		control_dx = pin_bits(control, "DX");
+		control_wb = pin_bits(control, "WB");
+
+		for (int f = 0; f < 4; f++)
+			control_nzcv[f] = pin_bits(control, flag_names[f]);
+
+		if (control_dx.size() != 16 || control_wb.size() != 16 || control_nzcv[0].empty() || control_nzcv[1].empty() ||
+			control_nzcv[2].empty() || control_nzcv[3].empty()) {
+
+			cout << "control: missing input pins" << endl;
+			return FAIL;
+		}
+
+		if (slice_compile(control, control_program, observe) == FAIL) {
+
+			cout << "control: " << control_program.error << endl;
+			return FAIL;
+		}
+
+		for (auto& v : slots)
+			v.assign(control_program.slots, 0);
+
+		auto start = chrono::steady_clock::now();
+
+		found.clear();
+		parallel(threads, WB_ROM_SIZE / LANES, control_item);
+
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		report("control", found, WB_ROM_SIZE, seconds);
+		failed += !found.empty();
+	}
+
+	return failed ? FAIL : 0;
+}
+
+
+vector <int> pin_bits(const netlist& n, const char * label) {
+
+	for (const cell& c : n.cells)
+		if ((c.kind == CELL_INPUT || c.kind == CELL_OUTPUT) && c.label == label)
+			return c.ports[0];
+
+	return {};
+}
+
+
+int register_at_pin(const netlist& n, const char * label, bool output) {
+
+	vector <int> pin = pin_bits(n, label);
+
+	for (size_t i = 0; i < n.cells.size() && !pin.empty(); i++) {
+
+		const cell& c = n.cells[i];
+
+		if (c.kind == CELL_REGISTER && c.ports[output ? 0 : 1] == pin)
+			return (int) i;
+	}
+
+	return -1;
+}
+
+
+void parallel(int threads, unsigned long long count, void (*work)(unsigned long long item, int thread)) {
+
+	atomic <unsigned long long> next(0);
+	vector <thread> pool;
+
+	for (int t = 0; t < threads; t++) {
+
+		pool.emplace_back([&next, count, work, t]() {
+
+			for (unsigned long long item; (item = next++) < count; )
+				work(item, t);
+		});
+	}
+
+	for (thread& t : pool)
+		t.join();
+}
+
+
+unsigned lane_value(const unsigned long long * v, const vector <int>& bits, int lane) {
+
+	unsigned value = 0;
+
+	for (size_t k = 0; k < bits.size(); k++)
+		value |= (unsigned) (v[bits[k]] >> lane & 1) << k;
+
+	return value;
+}
+
+
+void broadcast(unsigned long long * v, const vector <int>& bits, unsigned value) {
+
+	for (size_t k = 0; k < bits.size(); k++)
+		v[bits[k]] = value >> k & 1 ? ~0ULL : 0;
+}
+
+
+/* Lane masks of a counter running 0 .. 63 across the lanes: bit k of lane l is bit k of l */
+static unsigned long long lane_bit(int k) {
+
+	static const unsigned long long counter[6] = {0xaaaaaaaaaaaaaaaaULL, 0xccccccccccccccccULL, 0xf0f0f0f0f0f0f0f0ULL,
+												   0xff00ff00ff00ff00ULL, 0xffff0000ffff0000ULL, 0xffffffff00000000ULL};
+
+	return counter[k];
+}
+
+
+/* Transposes a 64 x 64 bit matrix: bit j of word i moves to bit i of word j */
+static void transpose(unsigned long long * m) {
+
+	unsigned long long mask = 0x00000000ffffffffULL;
+
+	for (int j = 32; j; j >>= 1, mask ^= mask << j) {
+
+		for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+
+			unsigned long long t = ((m[k] >> j) ^ m[k | j]) & mask;
+
+			m[k] ^= t << j;
+			m[k | j] ^= t;
+		}
+	}
+}
+
+
+void alu_item(unsigned long long item, int thread) {
+
+	bool update = item & 1;
+	int os = (int) (item >> 1) & 7;
+	unsigned a = (unsigned) (item >> 4) * stride;
+	unsigned long long * v = slots[thread].data();
+	machine& m = *machines[thread];
+	unsigned blocks = update ? 65536 / LANES : 1;			// with the flags held one block of B is enough
+
+	if (a > 0xffff)
+		return;
+
+	broadcast(v, alu_a, a);
+	broadcast(v, alu_os, os);
+	broadcast(v, alu_uf, update);
+
+	for (int f = 0; f < 4; f++)			// previous flags follow the lane number, mixed with A
+		v[flags[f].q[0]] = lane_bit(f) ^ (a >> f & 1 ? ~0ULL : 0);
+
+	for (unsigned block = 0; block < blocks; block++) {
+
+		for (int k = 0; k < 16; k++)
+			v[alu_b[k]] = k < 6 ? lane_bit(k) : (block >> (k - 6) & 1 ? ~0ULL : 0);
+
+		slice_settle(alu_program, v);
+
+		/* Expected E and NZCV one lane per word, transposed into slices for one compare over all lanes */
+		unsigned long long expected[LANES];
+
+		for (int lane = 0; lane < LANES; lane++) {
+
+			unsigned short b = (unsigned short) (block * LANES + lane);
+			bool cout, vout;
+			unsigned short e = alu_eval((unsigned short) a, b, os, cout, vout);
+
+			for (int f = 0; f < 4; f++)
+				m.*flags[f].field = (lane ^ a) >> f & 1;
+
+			if (update)
+				alu_set_flags(m, e, os, cout, vout);
+
+			expected[lane] = e;
+
+			for (int f = 0; f < 4; f++)
+				expected[lane] |= (unsigned long long) (m.*flags[f].field) << (16 + f);
+		}
+
+		transpose(expected);
+
+		unsigned long long wrong = 0;
+		unsigned long long * expected_flag = expected + 16;
+
+		for (int k = 0; k < 16; k++)
+			wrong |= v[alu_e[k]] ^ expected[k];
+
+		for (int f = 0; f < 4; f++) {
+
+			unsigned long long en = v[flags[f].en[0]], q = v[flags[f].q[0]];
+
+			wrong |= ((en & v[flags[f].d[0]]) | (~en & q)) ^ expected_flag[f];
+		}
+
+		for (int lane = 0; wrong && lane < LANES; lane++) {
+
+			if (!(wrong >> lane & 1))
+				continue;
+
+			unsigned b = block * LANES + lane;
+			bool cout, vout;
+			stringstream text;
+
+			text << "os " << os << " a 0x" << hex << setfill('0') << setw(4) << a << " b 0x" << setw(4) << b << (update ? " update" : " hold")
+				<< ": E 0x" << setw(4) << lane_value(v, alu_e, lane) << " expected 0x" << setw(4)
+				<< alu_eval((unsigned short) a, (unsigned short) b, os, cout, vout) << ", NZCV ";
+
+			for (int f = 0; f < 4; f++) {
+
+				unsigned long long en = v[flags[f].en[0]], q = v[flags[f].q[0]];
+
+				text << (((en & v[flags[f].d[0]]) | (~en & q)) >> lane & 1);
+			}
+
+			text << " expected ";
+
+			for (int f = 0; f < 4; f++)
+				text << (expected_flag[f] >> lane & 1);
+
+			lock_guard <mutex> hold(found_lock);
+
+			found.push_back({((unsigned long long) os << 34) | ((unsigned long long) a << 18) | (b << 2) | !update, text.str()});
+		}
+	}
+}
+
+
+void control_item(unsigned long long item, int thread) {
+
+	unsigned long long * v = slots[thread].data();
+	unsigned first = (unsigned) item * LANES;			// lanes cover wb_rom addresses first .. first + 63
+
+	/* Opcode byte and NZCV from the address; the operand bytes are filler that must not matter */
+	for (int k = 0; k < 16; k++) {
+
+		unsigned long long wb = 0, dx = 0;
+
+		for (int lane = 0; lane < LANES; lane++) {
+
+			unsigned address = first + lane;
+			unsigned word = ((address & 0xff) << 8) | ((address * 37) & 0xff);
+
+			wb |= (unsigned long long) (word >> k & 1) << lane;
+			dx |= (unsigned long long) ((((address & 0xff) << 8) | ((address * 91) & 0xff)) >> k & 1) << lane;
+		}
+
+		v[control_wb[k]] = wb;
+		v[control_dx[k]] = dx;
+	}
+
+	for (int f = 0; f < 4; f++)
+		v[control_nzcv[f][0]] = first >> (11 - f) & 1 ? ~0ULL : 0;			// N is address bit 11
+
+	slice_settle(control_program, v);
+
+	for (int lane = 0; lane < LANES; lane++) {
+
+		unsigned address = first + lane;
+		stringstream text;
+
+		for (int stage = 0; stage < 2; stage++) {
+
+			const vector <probe>& probes = stage ? dx_probes : wb_probes;
+			const vector <unsigned>& bits = stage ? dx_bits : wb_bits;
+			unsigned long word = stage ? dx_ctrl(address & 0xff) : wb_ctrl(address);
+
+			for (size_t i = 0; i < probes.size(); i++) {
+
+				unsigned got = lane_value(v, probes[i].bits, lane);
+				unsigned field = bits[i] & -bits[i];			// lowest bit of the field
+				unsigned expected = (unsigned) ((probes[i].inverted ? ~word : word) & bits[i]) / field;
+
+				if (got != expected)
+					text << " " << probes[i].name << " " << got << " expected " << expected;
+			}
+		}
+
+		if (text.str().empty())
+			continue;
+
+		stringstream line;
+
+		line << "wb_rom 0x" << hex << setfill('0') << setw(3) << address << " (opcode " << dec << (address >> 3 & 31) << ", NZCV "
+			<< (address >> 11 & 1) << (address >> 10 & 1) << (address >> 9 & 1) << (address >> 8 & 1) << "):" << text.str();
+
+		lock_guard <mutex> hold(found_lock);
+
+		found.push_back({address, line.str()});
+	}
+}
+
+
+void report(const char * check, vector <difference>& found, unsigned long long vectors, double seconds) {
+
+	sort(found.begin(), found.end(), [](const difference& x, const difference& y) { return x.vector < y.vector; });
+
+	for (size_t i = 0; i < found.size() && i < REPORT_LIMIT; i++)
+		cout << "  " << found[i].text << endl;
+
+	if (found.size() > REPORT_LIMIT)
+		cout << "  ... " << found.size() - REPORT_LIMIT << " more" << endl;
+
+	cout << check << ": " << vectors << " vectors, " << found.size() << " mismatches, " << fixed << setprecision(1) << seconds
+		<< " s (" << setprecision(1) << vectors / seconds / 1e6 << " M vectors/s)" << endl;
+}
@@ -0,0 +1,705 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+#include "symbols.h"
+#include "simulator.h"
+
+using namespace std;
+
+
+/*
+ * Bounds the cycles and the stack of a program before it runs: the control flow graph of every function is built from
+ * the binary (relative branches, jmp, call and ret; code is only ever entered from reset or through call), each
+ * instruction costs its cycle plus the bubbles of its STALL and FLUSH in op_ctrl, and loops run as often as a
+ * "; bound N" comment in the source allows. Exits with FAIL when a bound cannot be given or the stack could grow
+ * past 0x0100, so a build script stops there. Built with the symbol reader:
+ *	g++ -O2 -o wcet wcet.cpp machine.cpp symbols.cpp
+ */
+
+
+#define STACK_TOP			0x100			// the stack pointer is 8 bits, the stack grows up from RAM address 0
+#define RESET_CYCLES		2				// bubbles in the pipeline before the first instruction reaches writeback
+
+/* Analysis state of a function */
+#define FUNCTION_NEW		0
+#define FUNCTION_BUSY		1				// its graph is being built, a call to it now is recursion
+#define FUNCTION_DONE		2
+#define FUNCTION_FAILED		3
+
+
+/* Edge of a function's control flow graph */
+struct flow_edge {
+
+	int to;								// node, -1 where the function ends (ret, or a branch to itself that halts the program)
+	unsigned long long cycles;			// the FLUSH bubbles of a taken branch
+};
+
+/* Instruction of a function; a bra or jmp includes the word it runs behind it, a call the function it calls */
+struct flow_node {
+
+	unsigned short address;
+	unsigned long long cycles;
+	int stack;							// bytes it moves the stack pointer by
+	int depth;							// bytes a call takes below the stack pointer, return address included
+	vector <flow_edge> edges;
+};
+
+/* Natural loop: its header and every node that reaches a branch back to it without passing the header */
+struct flow_loop {
+
+	int header;
+	unsigned short address;				// of the header
+	vector <int> body;
+	int line;							// source line of the bound, 0 if none was found
+	unsigned long long bound;			// times the branches back to the header are taken per entry
+	unsigned long long iteration;		// cycles of the longest pass through the body
+};
+
+/* What the analysis found for a function */
+struct function_bound {
+
+	int state;
+	unsigned long long cycles;			// from its first instruction until its ret retires, or until the program halts
+	int stack;							// most bytes below its entry stack pointer, callees included
+	vector <flow_loop> loops;
+};
+
+
+/* Reads "; bound N" comments of the source, by line */
+int read_bounds(const char * file_name);
+/* Builds the graph of the function at entry and bounds it and everything it calls; FAIL if it cannot be bounded */
+int analyze(unsigned short entry);
+/* Cycles an instruction costs in the pipeline: one, plus its STALL bubble, plus its FLUSH bubbles (taken for a conditional branch) */
+unsigned long long instruction_cycles(int op, bool taken);
+/* Longest path from x through the nodes marked with stamp, ending where an edge leaves them or goes back to header */
+unsigned long long longest_path(int x, int header, int stamp);
+/* Source line the instruction at address came from, nullptr if the symbol file has none */
+const symbols_line * source_line(unsigned short address);
+/* Name of address for messages: nearest label and source line when the symbol file has them */
+string where(unsigned short address);
+
+
+static machine cpu;
+static int program_size;
+static symbols program_symbols;
+static unordered_map <int, unsigned long long> bounds;			// source line -> bound
+static map <unsigned short, function_bound> functions;
+
+/* Graph of the function analyze works on; loops already bounded are folded into their header */
+static vector <flow_node> nodes;
+static vector <int> folded;				// node a node was folded into, itself if none
+static vector <int> marks;				// stamp of the node set longest_path walks
+static vector <int> visiting;			// stamp while longest_path is inside a node
+static vector <unsigned long long> longest;
+static vector <int> longest_stamp;
+
+
+int main(int argc, char * argv[]) {
+
+	const char * file_name = "machine_code.bin";
+	const char * source_name = "function.txt";
+	const char * symbols_file = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+
+		if (!strcmp(argv[i], "-l") && i + 1 < argc)
+			source_name = argv[++i];
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			symbols_file = argv[++i];
+		else if (argv[i][0] != '-')
+			file_name = argv[i];
+		else {
+
+			cout << "\nUsage: wcet [-l program.txt] [-s program.sym] [program.bin]" << endl;
+			return FAIL;
+		}
+	}
+
+	if ((program_size = load_program(cpu, file_name)) == FAIL)
+		return FAIL;
+
+	if (symbols_open(program_symbols, symbols_file ? symbols_file : symbols_file_for(file_name).c_str()) == FAIL)
+		cout << "No symbol file, loops cannot be matched with their bounds" << endl;
+
+	if (read_bounds(source_name) == FAIL)
+		cout << "Unable to read [" << source_name << "], loops have no bounds" << endl;
+
+	int result = analyze(0);
+
+	cout << endl << left << setw(24) << "function" << right << setw(8) << "entry" << setw(16) << "cycles" << setw(8) << "stack" << endl;
+
+	for (const auto& f : functions) {
+
+		if (f.second.state != FUNCTION_DONE)
+			continue;
+
+		cout << left << setw(24) << (f.first == 0 ? string("reset") : symbols_name(program_symbols, f.first)) << right
+			<< "  0x" << hex << setw(4) << setfill('0') << f.first << dec << setfill(' ') << setw(16) << f.second.cycles << setw(8) << f.second.stack << endl;
+
+		for (const flow_loop& loop : f.second.loops)
+			cout << "    loop at " << where(loop.address) << ": " << loop.bound + 1 << " passes of at most " << loop.iteration << " cycles" << endl;
+	}
+
+	if (result == FAIL) {
+
+		symbols_close(program_symbols);
+		return FAIL;
+	}
+
+	const function_bound& reset = functions[0];
+
+	cout << endl << "From reset: at most " << reset.cycles + RESET_CYCLES << " cycles until it halts, at most " << reset.stack << " bytes of stack" << endl;
+
+	symbols_close(program_symbols);
+
+	if (reset.stack > STACK_TOP) {
+
+		cout << "\nError... The stack could grow past 0x" << hex << STACK_TOP << dec << " by " << reset.stack - STACK_TOP << " bytes" << endl;
+		return FAIL;
+	}
+
+	return 0;
+}
+
+
+int read_bounds(const char * file_name) {
+
+	ifstream file(file_name);
+	string row;
+
+	if (!file.is_open())
+		return FAIL;
+
+	for (int line = 1; getline(file, row); line++) {
+
+		size_t comment = row.find(';');
+
+		if (comment == string::npos)
+			continue;
+
+		string text = row.substr(comment + 1);
+
+		transform(text.begin(), text.end(), text.begin(), ::tolower);
+
+		istringstream words(text);
+		string word;
+		unsigned long long bound;
+
+		while (words >> word)
+			if (word == "bound" && words >> bound)
+				bounds[line] = bound;
+	}
+
+	return SUCCESS;
+}
+
+
+static int size_of(int op) {
+
+	return (op >= opcodes::ldr && op <= opcodes::strb) || op == opcodes::call || op == opcodes::jmp ? 4 : 2;
+}
+
+
+static bool is_control(int op) {
+
+	return (op >= opcodes::bra && op <= opcodes::bvc) || op >= opcodes::call;
+}
+
+
+unsigned long long instruction_cycles(int op, bool taken) {
+
+	unsigned long dx = op_ctrl[op][0];
+	unsigned long wb = op_ctrl[op][1] | (taken ? J | FLUSH : 0);
+	unsigned long long cycles = 1;
+
+	if (dx & STALL)
+		cycles++;
+	if (wb & FLUSH)
+		cycles += (dx & STALL) ? 1 : 2;			// FLUSH empties decode (already a bubble behind a STALL) and masks the fetch
+
+	return cycles;
+}
+
+
+const symbols_line * source_line(unsigned short address) {
+
+	const symbols_line * line = symbols_find_line(program_symbols, address);
+
+	if (!line)			// the jmp of a grown conditional branch follows the inverted branch of its line
+		line = symbols_find_line(program_symbols, address - 2);
+
+	return line;
+}
+
+
+string where(unsigned short address) {
+
+	ostringstream text;
+	const symbols_line * line = source_line(address);
+
+	text << symbols_name(program_symbols, address);
+
+	if (line)
+		text << " (line " << line->line << ")";
+
+	return text.str();
+}
+
+
+/* Representative of node x once loops are folded */
+static int fold_find(int x) {
+
+	while (folded[x] != x)
+		x = folded[x] = folded[folded[x]];
+
+	return x;
+}
+
+
+unsigned long long longest_path(int x, int header, int stamp) {
+
+	if (longest_stamp[x] == stamp)
+		return longest[x];
+
+	visiting[x] = stamp;
+
+	unsigned long long most = 0;
+
+	for (const flow_edge& e : nodes[x].edges) {
+
+		int to = e.to >= 0 ? fold_find(e.to) : -1;
+		unsigned long long cycles = e.cycles;
+
+		if (to >= 0 && to != header && marks[to] == stamp)
+			cycles += visiting[to] == stamp ? 0 : longest_path(to, header, stamp);			// a cycle here was ruled out by the loop search
+
+		most = max(most, cycles);
+	}
+
+	visiting[x] = 0;
+	longest_stamp[x] = stamp;
+	longest[x] = nodes[x].cycles + most;
+
+	return longest[x];
+}
+
+
+int analyze(unsigned short entry) {
+
+	function_bound& function = functions[entry];			// map entries stay put while callees are added
+
+	if (function.state == FUNCTION_DONE)
+		return SUCCESS;
+
+	if (function.state == FUNCTION_BUSY) {
+
+		cout << "\nError... " << where(entry) << " is called recursively, its stack has no bound" << endl;
+		return FAIL;
+	}
+
+	if (function.state == FUNCTION_FAILED)
+		return FAIL;
+
+	function.state = FUNCTION_BUSY;
+
+	/* Every instruction reachable from the entry without following a call; a callee is bounded first */
+	vector <flow_node> graph;
+	unordered_map <unsigned short, int> index;
+	vector <unsigned short> work = {entry};
+
+	index[entry] = 0;
+	graph.push_back({entry, 0, 0, 0, {}});
+
+	while (!work.empty()) {
+
+		unsigned short pc = work.back();
+		int k = index[pc];
+
+		work.pop_back();
+
+		unsigned short word = rom_read_word(cpu, pc);
+		int op = word >> 11;
+		unsigned short fall = pc + size_of(op);
+		vector <unsigned short> next;
+		flow_node node = {pc, instruction_cycles(op, false), 0, 0, {}};
+
+		if (pc + size_of(op) > program_size) {
+
+			cout << "\nError... " << where(entry) << " runs past the end of the program at 0x" << hex << pc << dec << endl;
+			function.state = FUNCTION_FAILED;
+			return FAIL;
+		}
+
+		if (op >= opcodes::bne && op <= opcodes::bvc) {
+
+			unsigned short target = fall + sext8(word);
+
+			next.push_back(fall);
+			node.edges.push_back({-2, 0});
+
+			if (target != pc) {
+
+				next.push_back(target);
+				node.edges.push_back({-2, instruction_cycles(op, true) - node.cycles});
+			} else
+				node.edges.push_back({-1, 0});			// halts: the branch to itself is the last instruction to retire
+		} else if (op == opcodes::bra || op == opcodes::jmp) {
+
+			unsigned short target = op == opcodes::bra ? fall + sext8(word) : rom_read_word(cpu, pc + 2);
+			int slot = rom_read_word(cpu, pc + 4) >> 11;			// the word bra and jmp run before jumping
+
+			if (target == pc) {
+
+				node.cycles = 1;
+				node.edges.push_back({-1, 0});
+			} else if (is_control(slot)) {
+
+				cout << "\nError... " << where(pc) << " runs a branch, call or ret behind it" << endl;
+				function.state = FUNCTION_FAILED;
+				return FAIL;
+			} else {
+
+				node.cycles += instruction_cycles(slot, false);
+				node.stack = slot == opcodes::push ? 2 : slot == opcodes::pop ? -2 : 0;
+				next.push_back(target);
+				node.edges.push_back({-2, 0});
+			}
+		} else if (op == opcodes::call) {
+
+			unsigned short target = rom_read_word(cpu, pc + 2);
+
+			if (analyze(target) == FAIL) {
+
+				function.state = FUNCTION_FAILED;
+				return FAIL;
+			}
+
+			node.cycles += functions[target].cycles;
+			node.depth = 2 + functions[target].stack;
+			next.push_back(fall);
+			node.edges.push_back({-2, 0});
+		} else if (op == opcodes::ret)
+			node.edges.push_back({-1, 0});
+		else {
+
+			node.stack = op == opcodes::push ? 2 : op == opcodes::pop ? -2 : 0;
+			next.push_back(fall);
+			node.edges.push_back({-2, 0});
+		}
+
+		/* Edges marked -2 go to the addresses in next, in order */
+		for (size_t e = 0, n = 0; e != node.edges.size(); e++) {
+
+			if (node.edges[e].to != -2)
+				continue;
+
+			auto added = index.emplace(next[n], graph.size());
+
+			if (added.second) {
+
+				graph.push_back({next[n], 0, 0, 0, {}});
+				work.push_back(next[n]);
+			}
+
+			node.edges[e].to = added.first->second;
+			n++;
+		}
+
+		graph[k] = node;
+	}
+
+	/* Stack: every path into an instruction has to agree on the stack pointer, and ret finds it where the function started */
+	vector <int> offset(graph.size(), -1);
+	vector <int> order;			// depth first, for the loop search
+	int stack = 0;
+
+	offset[0] = 0;
+	order.push_back(0);
+
+	for (size_t i = 0; i != order.size(); i++) {
+
+		const flow_node& node = graph[order[i]];
+		int after = offset[order[i]] + node.stack;
+
+		if (after < 0) {
+
+			cout << "\nError... " << where(node.address) << " pops below the stack pointer " << where(entry) << " was entered with" << endl;
+			function.state = FUNCTION_FAILED;
+			return FAIL;
+		}
+
+		stack = max(stack, max(after, offset[order[i]] + node.depth));
+
+		if ((rom_read_word(cpu, node.address) >> 11) == opcodes::ret && entry == 0) {
+
+			cout << "\nError... " << where(node.address) << " returns, but the code from reset was not called" << endl;
+			function.state = FUNCTION_FAILED;
+			return FAIL;
+		}
+
+		if ((rom_read_word(cpu, node.address) >> 11) == opcodes::ret && after != 0) {
+
+			cout << "\nError... " << where(node.address) << " returns with " << after << " bytes still pushed" << endl;
+			function.state = FUNCTION_FAILED;
+			return FAIL;
+		}
+
+		for (const flow_edge& e : node.edges) {
+
+			if (e.to < 0)
+				continue;
+
+			if (offset[e.to] == -1) {
+
+				offset[e.to] = after;
+				order.push_back(e.to);
+			} else if (offset[e.to] != after) {
+
+				cout << "\nError... " << where(graph[e.to].address) << " is reached with " << offset[e.to] << " and with " << after
+					<< " bytes pushed, a loop or a join moves the stack pointer" << endl;
+				function.state = FUNCTION_FAILED;
+				return FAIL;
+			}
+		}
+	}
+
+	/* Loops: a branch back to an instruction that every path from the entry passes, found in one depth first pass */
+	int n = graph.size();
+	vector <int> rpo, state(n, 0), idom(n, -1), position(n);
+	vector <pair <int, int>> retreating;
+	vector <pair <int, int>> stack_dfs = {{0, 0}};
+	vector <vector <int>> predecessors(n);
+
+	state[0] = 1;
+
+	while (!stack_dfs.empty()) {
+
+		int x = stack_dfs.back().first;
+		int& e = stack_dfs.back().second;
+
+		if (e == (int) graph[x].edges.size()) {
+
+			state[x] = 2;
+			rpo.push_back(x);
+			stack_dfs.pop_back();
+			continue;
+		}
+
+		int to = graph[x].edges[e++].to;
+
+		if (to < 0)
+			continue;
+
+		predecessors[to].push_back(x);
+
+		if (state[to] == 0) {
+
+			state[to] = 1;
+			stack_dfs.push_back({to, 0});
+		} else if (state[to] == 1)
+			retreating.push_back({x, to});
+	}
+
+	reverse(rpo.begin(), rpo.end());
+
+	for (int i = 0; i != n; i++)
+		position[rpo[i]] = i;
+
+	/* Immediate dominators, iterated over the reverse postorder (Cooper, Harvey and Kennedy) */
+	idom[0] = 0;
+
+	for (bool changed = true; changed; ) {
+
+		changed = false;
+
+		for (int i = 1; i != n; i++) {
+
+			int x = rpo[i];
+			int dominator = -1;
+
+			for (int p : predecessors[x]) {
+
+				if (idom[p] == -1)
+					continue;
+
+				if (dominator == -1) {
+
+					dominator = p;
+					continue;
+				}
+
+				int a = p, b = dominator;
+
+				while (a != b) {
+
+					while (position[a] > position[b])
+						a = idom[a];
+					while (position[b] > position[a])
+						b = idom[b];
+				}
+
+				dominator = a;
+			}
+
+			if (idom[x] != dominator) {
+
+				idom[x] = dominator;
+				changed = true;
+			}
+		}
+	}
+
+	map <int, flow_loop> loops;			// by header
+
+	for (const auto& edge : retreating) {
+
+		int x = edge.first;
+
+		while (x != edge.second && x != 0)
+			x = idom[x];
+
+		if (x != edge.second) {
+
+			cout << "\nError... " << where(graph[edge.second].address) << " is a loop entered in more than one place, it cannot be bounded" << endl;
+			function.state = FUNCTION_FAILED;
+			return FAIL;
+		}
+
+		flow_loop& loop = loops[edge.second];
+		const symbols_line * latch = source_line(graph[edge.first].address);
+		const symbols_line * head = source_line(graph[edge.second].address);
+
+		loop.header = edge.second;
+		loop.address = graph[edge.second].address;
+
+		/* The bound goes on the branch back or on the first instruction of the loop */
+		for (const symbols_line * line : {latch, head}) {
+
+			if (line && bounds.count(line->line) && (!loop.line || bounds[line->line] > loop.bound)) {
+
+				loop.line = line->line;
+				loop.bound = bounds[line->line];
+			}
+		}
+
+		/* Body: everything that reaches the branch back without passing the header, added to what other branches back brought */
+		vector <bool> in_body(n, false);
+		vector <int> work_back;
+
+		for (int b : loop.body)
+			in_body[b] = true;
+
+		in_body[edge.second] = true;
+
+		if (!in_body[edge.first]) {
+
+			in_body[edge.first] = true;
+			work_back.push_back(edge.first);
+		}
+
+		while (!work_back.empty()) {
+
+			int b = work_back.back();
+
+			work_back.pop_back();
+
+			for (int p : predecessors[b]) {
+
+				if (!in_body[p]) {
+
+					in_body[p] = true;
+					work_back.push_back(p);
+				}
+			}
+		}
+
+		loop.body.clear();
+
+		for (int b = 0; b != n; b++)
+			if (in_body[b])
+				loop.body.push_back(b);
+	}
+
+	for (const auto& l : loops) {
+
+		if (!l.second.line) {
+
+			cout << "\nError... The loop at " << where(graph[l.first].address) << " has no bound, add \"; bound N\" to the branch back" << endl;
+			function.state = FUNCTION_FAILED;
+			return FAIL;
+		}
+	}
+
+	/* Cycles: the innermost loops first, each folded into its header as bound + 1 passes of its longest pass */
+	vector <flow_loop> sorted;
+
+	for (const auto& l : loops)
+		sorted.push_back(l.second);
+
+	stable_sort(sorted.begin(), sorted.end(), [](const flow_loop& a, const flow_loop& b) { return a.body.size() < b.body.size(); });
+
+	nodes = graph;
+	folded.resize(n);
+	marks.assign(n, 0);
+	visiting.assign(n, 0);
+	longest.assign(n, 0);
+	longest_stamp.assign(n, 0);
+
+	for (int i = 0; i != n; i++)
+		folded[i] = i;
+
+	int stamp = 0;
+
+	for (flow_loop& loop : sorted) {
+
+		stamp++;
+
+		for (int b : loop.body)
+			marks[fold_find(b)] = stamp;
+
+		loop.iteration = longest_path(loop.header, loop.header, stamp);
+
+		/* The header stands for the whole loop now: its cost, and the edges that leave the loop */
+		vector <flow_edge> exits;
+
+		for (int b : loop.body) {
+
+			int x = fold_find(b);
+
+			if (marks[x] != stamp)
+				continue;
+
+			marks[x] = -stamp;			// each folded node once
+
+			for (const flow_edge& e : nodes[x].edges)
+				if (e.to < 0 || (marks[fold_find(e.to)] != stamp && marks[fold_find(e.to)] != -stamp))
+					exits.push_back({e.to, 0});			// its cycles are in the pass that took it
+		}
+
+		for (int b : loop.body)
+			folded[fold_find(b)] = loop.header;
+
+		nodes[loop.header].cycles = (loop.bound + 1) * loop.iteration;
+		nodes[loop.header].edges = exits;
+	}
+
+	stamp++;
+
+	for (int i = 0; i != n; i++)
+		marks[i] = stamp;
+
+	function.cycles = longest_path(0, -1, stamp);
+	function.stack = stack;
+	function.loops = sorted;
+	function.state = FUNCTION_DONE;
+
+	return SUCCESS;
+}